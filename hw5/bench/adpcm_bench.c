@@ -0,0 +1,61 @@
+/*
+ * Throughput benchmark for the IMA-ADPCM codec used for recordings and voicemail.
+ *
+ * Usage: bin/adpcm_bench [seconds-of-audio]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "adpcm.h"
+#include "media.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 3600;
+    if(seconds <= 0) {
+        fprintf(stderr, "usage: %s [seconds-of-audio]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    int rate = MEDIA_NARROWBAND_RATE;
+    int frame = MEDIA_FRAME_SAMPLES(rate);
+    long frames = (long)seconds * 1000 / MEDIA_FRAME_MSEC;
+    int16_t pcm[MEDIA_MAX_FRAME], out[MEDIA_MAX_FRAME];
+    uint8_t packed[MEDIA_MAX_FRAME / 2];
+    ADPCM_STATE enc, dec;
+    long sink = 0;
+
+    for(int i = 0; i < frame; i++) {
+        pcm[i] = (int16_t)lrint(9000 * sin(2 * M_PI * 300 * i / rate) + 3000 * sin(2 * M_PI * 1700 * i / rate));
+    }
+    printf("Coding %d s of %d Hz audio in %d ms frames\n", seconds, rate, MEDIA_FRAME_MSEC);
+
+    adpcm_init(&enc);
+    double start = now();
+    for(long f = 0; f < frames; f++) {
+        sink += adpcm_encode(&enc, pcm, frame, packed);
+        sink += packed[f % (frame / 2)];
+    }
+    double elapsed = now() - start;
+    double rate_enc = (double)frames * frame / elapsed;
+    printf("encode  %8.2f Msamples/s  %8.0f streams/core  (%.3f s)\n",
+           rate_enc / 1e6, rate_enc / rate, elapsed);
+
+    adpcm_init(&dec);
+    start = now();
+    for(long f = 0; f < frames; f++) {
+        sink += adpcm_decode(&dec, packed, frame, out);
+        sink += out[f % frame];
+    }
+    elapsed = now() - start;
+    double rate_dec = (double)frames * frame / elapsed;
+    printf("decode  %8.2f Msamples/s  %8.0f streams/core  (%.3f s, check %ld)\n",
+           rate_dec / 1e6, rate_dec / rate, elapsed, sink);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1202 @@
+/*
+ * Load generator: starts a PBX server, puts it under one of several kinds of load, and
+ * measures how it copes.  The modes, and the arguments that follow the port for each:
+ *
+ *   chat [message-size] [total-MB]
+ *       Chat relay throughput: one TU of a call sends chats as fast as it can while
+ *       the other receives them.
+ *   proto [commands] [batch]
+ *       Command throughput without rate limits, text protocol against binary
+ *       protocol: one TU sends pickup and hangup in batches, waiting only for the
+ *       answers to the whole batch.
+ *   shm [socket-path] [commands] [batch]
+ *       Round-trip latency and command throughput without rate limits, over TCP, the
+ *       Unix-domain socket and shared memory (see shm.h).
+ *   handoff [handoff-path] [connections]
+ *       Hot restart: the time for a server with the given number of clients, in calls,
+ *       to hand them over to a new one, and for every call to carry chat again.
+ *   overload [limits|-] [flooding-calls] [storm-clients] [seconds]
+ *       Admission control (see admission.h): the latency of hold and resume in a call
+ *       while other calls flood chat and a storm of new clients connects.
+ *   cores [pairs] [seconds] [cores]...
+ *       One shard per core (see shard.h), without rate limits: calls/s set up and torn
+ *       down by the given number of pairs of clients, for each number of cores (0 for
+ *       no shards).
+ *   coro [clients] [seconds] [loops]...
+ *       Coroutines (see coro.h), without rate limits: the threads and memory for the
+ *       given number of idle clients, and the latency of hold and resume among them,
+ *       for each number of event loops (0 for a thread per client).
+ *   executor [chats] [seconds] [workers]...
+ *       The executor (see executor.h), without rate limits: the latency of hold and
+ *       resume on a channel of a trunk while another channel of it is stuck sending
+ *       chat to a slow reader, for each number of workers (0 for no executor).
+ *
+ * Usage: bin/load_bench <mode> [server-binary] [port] [arguments]...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "proto.h"
+#include "shm.h"
+
+#define NO_LIMITS "0-131071:0"
+#define PBX_VIRTUAL_BASE 65536
+#define MAX_ARGS 16
+#define MAX_PROBES 100000
+#define MAX_PAIRS 1024
+
+static char *server;
+static int port;
+static char portstr[16];
+static volatile int running;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Start the server on the port, with the given further arguments, up to a NULL.
+ */
+static pid_t start_server(char *const args[]) {
+    char *argv[MAX_ARGS] = { server, "-p", portstr };
+    for(int i = 0; args[i] && i + 4 < MAX_ARGS; i++) {
+        argv[i + 3] = args[i];
+    }
+    pid_t pid = fork();
+    if(pid == 0) {
+        execv(server, argv);
+        perror(server);
+        _exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+static void stop_server(pid_t pid, int sig) {
+    kill(pid, sig);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * Connect to the server at an address, trying again while it starts up.
+ *
+ * @return the connection, or -1 if it cannot be made.
+ */
+static int try_connect(struct sockaddr *sa, socklen_t len) {
+    for(int i = 0; i < 100; i++) {
+        int fd = socket(sa->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd == -1) {
+            return -1;
+        }
+        if(connect(fd, sa, len) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(50000);
+    }
+    return -1;
+}
+
+static int try_connect_tcp(void) {
+    struct sockaddr_in sin = { 0 };
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return try_connect((struct sockaddr *)&sin, sizeof(sin));
+}
+
+static int connect_tcp(void) {
+    int fd = try_connect_tcp();
+    if(fd == -1) {
+        fprintf(stderr, "Could not connect to server on port %d\n", port);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static int write_fully(int fd, const void *buf, size_t len) {
+    for(size_t off = 0; off < len; ) {
+        ssize_t n = write(fd, (const char *)buf + off, len - off);
+        if(n <= 0) {
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static int read_fully(int fd, void *buf, size_t len) {
+    for(size_t off = 0; off < len; ) {
+        ssize_t n = read(fd, (char *)buf + off, len - off);
+        if(n <= 0) {
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+/*
+ * Read a text line, a byte at a time so that nothing that follows is consumed.
+ *
+ * @return 0 if successful, -1 if the connection ended first.
+ */
+static int read_line(int fd, char *line, size_t size) {
+    size_t n = 0;
+    while(n + 1 < size) {
+        if(read_fully(fd, line + n, 1) == -1) {
+            line[n] = '\0';
+            return -1;
+        }
+        if(line[n++] == '\n') {
+            break;
+        }
+    }
+    line[n] = '\0';
+    return 0;
+}
+
+/*
+ * Read a line, which must start with a given prefix, and return the number after it.
+ */
+static int expect_line(int fd, const char *prefix) {
+    char line[256];
+    if(read_line(fd, line, sizeof(line)) == -1) {
+        fprintf(stderr, "Connection closed while waiting for %s\n", prefix);
+        exit(EXIT_FAILURE);
+    }
+    if(strncmp(line, prefix, strlen(prefix)) != 0) {
+        fprintf(stderr, "Expected '%s', got '%s'\n", prefix, line);
+        exit(EXIT_FAILURE);
+    }
+    return atoi(line + strlen(prefix));
+}
+
+/*
+ * Read lines until one starting with the given prefix is seen, returning its argument.
+ */
+static int expect(FILE *in, const char *prefix) {
+    char line[256];
+    while(fgets(line, sizeof(line), in)) {
+        if(strncmp(line, prefix, strlen(prefix)) == 0) {
+            return atoi(line + strlen(prefix));
+        }
+    }
+    fprintf(stderr, "Connection closed while waiting for %s\n", prefix);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Discard everything the server sends on a connection until it is closed.
+ */
+static void *drain(void *arg) {
+    char buf[65536];
+    while(read(*(int *)arg, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+/*
+ * A client speaking the text protocol, whose connection is read through a stream.
+ */
+typedef struct client {
+    int fd;
+    FILE *in;
+    int ext;
+} CLIENT;
+
+/*
+ * Connect a client and wait for it to be registered.
+ */
+static void client_connect(CLIENT *c) {
+    c->fd = connect_tcp();
+    c->in = fdopen(dup(c->fd), "r");
+    c->ext = expect(c->in, "ON HOOK");
+}
+
+static void client_close(CLIENT *c) {
+    fclose(c->in);
+    close(c->fd);
+}
+
+/*
+ * Set up a call from one client to another, both on hook.
+ */
+static void call(CLIENT *a, CLIENT *b) {
+    dprintf(a->fd, "pickup\r\n");
+    expect(a->in, "DIAL TONE");
+    dprintf(a->fd, "dial %d\r\n", b->ext);
+    expect(a->in, "RING BACK");
+    expect(b->in, "RINGING");
+    dprintf(b->fd, "pickup\r\n");
+    expect(b->in, "CONNECTED");
+    expect(a->in, "CONNECTED");
+}
+
+/*
+ * Tear down a call set up by call(), leaving both clients on hook.
+ */
+static void hang_up(CLIENT *a, CLIENT *b) {
+    dprintf(a->fd, "hangup\r\n");
+    expect(a->in, "ON HOOK");
+    expect(b->in, "DIAL TONE");
+    dprintf(b->fd, "hangup\r\n");
+    expect(b->in, "ON HOOK");
+}
+
+/*
+ * Put the call of a client on hold and resume it over and over, for a given time,
+ * pausing between rounds.
+ *
+ * @return the number of rounds, whose durations are stored in probes.
+ */
+static int probe_hold(CLIENT *a, double seconds, useconds_t pause, double *probes) {
+    int n = 0;
+    double end = now() + seconds;
+    while(now() < end && n < MAX_PROBES) {
+        double start = now();
+        dprintf(a->fd, "hold\r\n");
+        expect(a->in, "ON HOLD");
+        dprintf(a->fd, "resume\r\n");
+        expect(a->in, "CONNECTED");
+        probes[n++] = now() - start;
+        usleep(pause);
+    }
+    return n;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Write out the 50th and 99th percentiles and the maximum of a number of probes.
+ */
+static void print_probes(const char *what, double *probes, int n) {
+    if(n == 0) {
+        printf("%s: no probes\n", what);
+        return;
+    }
+    qsort(probes, n, sizeof(double), compare);
+    printf("%s p50 %.3f ms, p99 %.3f ms, max %.3f ms over %d probes\n", what, probes[n / 2] * 1e3,
+           probes[n * 99 / 100] * 1e3, probes[n - 1] * 1e3, n);
+}
+
+/*
+ * Raise the limit on open files as far as it goes, for many clients.
+ *
+ * @return the limit.
+ */
+static rlim_t raise_file_limit(void) {
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        return 0;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    return rl.rlim_cur;
+}
+
+/*
+ * A connection for counting answers, over a socket or a shared-memory link, with the
+ * receive buffer of the client.
+ */
+typedef struct conn {
+    int fd;
+    SHM_LINK *link;
+    size_t start, end;
+    char buf[1 << 16];
+} CONN;
+
+static void conn_send(CONN *c, const char *buf, size_t len) {
+    struct iovec iov = { (void *)buf, len };
+    if(c->link ? shm_link_writev(c->link, &iov, 1) == -1 : write_fully(c->fd, buf, len) == -1) {
+        fprintf(stderr, "Connection closed unexpectedly\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void conn_fill(CONN *c) {
+    if(c->start > 0) {
+        memmove(c->buf, c->buf + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+    }
+    ssize_t n = c->link ? shm_link_read(c->link, c->buf + c->end, sizeof(c->buf) - c->end) :
+                          read(c->fd, c->buf + c->end, sizeof(c->buf) - c->end);
+    if(n <= 0) {
+        fprintf(stderr, "Connection closed unexpectedly\n");
+        exit(EXIT_FAILURE);
+    }
+    c->end += n;
+}
+
+/*
+ * Wait for a given number of text lines.
+ */
+static void text_answers(CONN *c, long count) {
+    while(count > 0) {
+        char *eol = memchr(c->buf + c->start, '\n', c->end - c->start);
+        if(!eol) {
+            conn_fill(c);
+            continue;
+        }
+        c->start = eol + 1 - c->buf;
+        count--;
+    }
+}
+
+/*
+ * Wait for the responses to the requests with IDs first to last, checking that they
+ * arrive in order.
+ */
+static void binary_answers(CONN *c, uint32_t first, uint32_t last) {
+    while(first <= last) {
+        if(c->end - c->start < sizeof(PROTO_HEADER)) {
+            conn_fill(c);
+            continue;
+        }
+        PROTO_HEADER h;
+        memcpy(&h, c->buf + c->start, sizeof(h));
+        size_t len = sizeof(h) + ntohl(h.len);
+        if(c->end - c->start < len) {
+            conn_fill(c);
+            continue;
+        }
+        c->start += len;
+        if(h.type == PROTO_RESPONSE) {
+            if(ntohl(h.id) != first) {
+                fprintf(stderr, "Response to request %u, expected %u\n", ntohl(h.id), first);
+                exit(EXIT_FAILURE);
+            }
+            first++;
+        }
+    }
+}
+
+/*
+ * Send pickup and hangup in turn over the text protocol, in batches.
+ *
+ * @return the time taken.
+ */
+static double run_text(CONN *c, long commands, long batch) {
+    char *buf = malloc(batch * 16);
+    double start = now();
+    for(long done = 0; done < commands; done += batch) {
+        long n = commands - done < batch ? commands - done : batch;
+        size_t len = 0;
+        for(long i = 0; i < n; i++) {
+            len += sprintf(buf + len, (done + i) % 2 ? "hangup\r\n" : "pickup\r\n");
+        }
+        conn_send(c, buf, len);
+        text_answers(c, n);
+    }
+    double elapsed = now() - start;
+    free(buf);
+    return elapsed;
+}
+
+/*
+ * Send pickup and hangup in turn over the binary protocol, in batches.
+ *
+ * @return the time taken.
+ */
+static double run_binary(CONN *c, long commands, long batch) {
+    PROTO_HEADER *buf = malloc(batch * sizeof(PROTO_HEADER));
+    double start = now();
+    for(long done = 0; done < commands; done += batch) {
+        long n = commands - done < batch ? commands - done : batch;
+        for(long i = 0; i < n; i++) {
+            uint32_t id = done + i + 1;
+            proto_header_pack(&buf[i], PROTO_REQUEST, id % 2 ? PROTO_OP_PICKUP : PROTO_OP_HANGUP,
+                              0, id, 0, 0);
+        }
+        conn_send(c, (char *)buf, n * sizeof(PROTO_HEADER));
+        binary_answers(c, done + 1, done + n);
+    }
+    double elapsed = now() - start;
+    free(buf);
+    return elapsed;
+}
+
+/*
+ * Chats of a given size, sent from one TU as fast as it can.
+ */
+struct sender {
+    int fd;
+    size_t size;
+    long count;          // Number of chats, or 0 to send for as long as the load runs.
+};
+
+static void *send_chats(void *arg) {
+    struct sender *s = arg;
+    size_t len = strlen("chat ") + s->size + 2;
+    char *line = malloc(len);
+    memcpy(line, "chat ", 5);
+    memset(line + 5, 'x', s->size);
+    memcpy(line + 5 + s->size, "\r\n", 2);
+    for(long i = 0; s->count ? i < s->count : running; i++) {
+        if(write_fully(s->fd, line, len) == -1) {
+            break;
+        }
+    }
+    free(line);
+    return NULL;
+}
+
+static int bench_chat(int argc, char *argv[]) {
+    size_t size = argc > 0 ? strtoul(argv[0], NULL, 10) : 65536;
+    long total_mb = argc > 1 ? atol(argv[1]) : 256;
+    if(size == 0 || total_mb <= 0) {
+        return -1;
+    }
+    long count = (total_mb << 20) / size;
+    if(count == 0) {
+        count = 1;
+    }
+    pid_t pid = start_server((char *[]){ NULL });
+    CLIENT a, b;
+    client_connect(&a);
+    client_connect(&b);
+    call(&a, &b);
+
+    // Relay the chats, counting the bytes that arrive at the called TU.
+    size_t expected = (strlen("chat ") + size + 2) * count;
+    size_t received = 0;
+    char *buf = malloc(1 << 20);
+    struct sender s = { a.fd, size, count };
+    pthread_t stid, dtid;
+    double start = now();
+    pthread_create(&dtid, NULL, drain, &a.fd);
+    pthread_create(&stid, NULL, send_chats, &s);
+    while(received < expected) {
+        ssize_t n = read(b.fd, buf, 1 << 20);
+        if(n <= 0) {
+            fprintf(stderr, "Connection closed after %zu of %zu bytes\n", received, expected);
+            break;
+        }
+        received += n;
+    }
+    double elapsed = now() - start;
+    pthread_join(stid, NULL);
+    printf("%ld chats of %zu bytes: %.1f MB in %.3f s = %.1f MB/s\n",
+           count, size, received / 1048576.0, elapsed, received / 1048576.0 / elapsed);
+    shutdown(a.fd, SHUT_RDWR);
+    client_close(&b);
+    stop_server(pid, SIGKILL);
+    free(buf);
+    return received == expected ? 0 : 1;
+}
+
+static int bench_proto(int argc, char *argv[]) {
+    long commands = argc > 0 ? atol(argv[0]) : 1000000;
+    long batch = argc > 1 ? atol(argv[1]) : 64;
+    if(commands <= 0 || batch <= 0) {
+        return -1;
+    }
+    commands += commands % 2;
+    pid_t pid = start_server((char *[]){ "-r", NO_LIMITS, NULL });
+    CONN *c = calloc(1, sizeof(CONN));
+    c->fd = connect_tcp();
+
+    // The text protocol first, then the same connection switched to the binary protocol.
+    text_answers(c, 1);
+    double text = run_text(c, commands, batch);
+    conn_send(c, "proto 2\r\n", strlen("proto 2\r\n"));
+    binary_answers(c, 0, 0);
+    double binary = run_binary(c, commands, batch);
+    printf("%ld commands in batches of %ld:\n", commands, batch);
+    printf("  text:   %.3f s = %.0f commands/s\n", text, commands / text);
+    printf("  binary: %.3f s = %.0f commands/s\n", binary, commands / binary);
+    close(c->fd);
+    free(c);
+    stop_server(pid, SIGKILL);
+    return 0;
+}
+
+/*
+ * Move a connection on the Unix-domain socket to shared memory.
+ */
+static void start_shm(CONN *c) {
+    conn_send(c, "shm\r\n", strlen("shm\r\n"));
+    char line[64];
+    struct iovec iov = { line, sizeof(line) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg;
+    int memfd;
+    if(recvmsg(c->fd, &msg, 0) <= 0 || strncmp(line, "SHM ", 4) ||
+       !(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "Server did not pass shared memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+    if(!(c->link = shm_link_attach(c->fd, memfd))) {
+        fprintf(stderr, "Cannot map shared memory\n");
+        exit(EXIT_FAILURE);
+    }
+    close(memfd);
+    c->start = c->end = 0;
+    text_answers(c, 1);
+}
+
+/*
+ * Measure the round trip and the throughput of commands over a connection.
+ */
+static void report_transport(const char *name, CONN *c, long commands, long batch) {
+    long rounds = commands / 10;
+    double latency = run_text(c, rounds, 1);
+    double elapsed = run_text(c, commands, batch);
+    printf("  %-6s  %8.2f us round trip  %10.0f commands/s\n", name,
+           latency / rounds * 1e6, commands / elapsed);
+}
+
+static int bench_shm(int argc, char *argv[]) {
+    char *path = argc > 0 ? argv[0] : "/tmp/pbx_bench.sock";
+    long commands = argc > 1 ? atol(argv[1]) : 1000000;
+    long batch = argc > 2 ? atol(argv[2]) : 64;
+    if(commands < 20 || batch <= 0) {
+        return -1;
+    }
+    commands -= commands % 20;
+    pid_t pid = start_server((char *[]){ "-u", path, "-r", NO_LIMITS, NULL });
+    struct sockaddr_un sun = { 0 };
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+    printf("%ld commands, in batches of %ld:\n", commands, batch);
+    CONN *c = calloc(1, sizeof(CONN));
+    c->fd = connect_tcp();
+    text_answers(c, 1);
+    report_transport("tcp", c, commands, batch);
+    close(c->fd);
+
+    memset(c, 0, sizeof(CONN));
+    if((c->fd = try_connect((struct sockaddr *)&sun, sizeof(sun))) == -1) {
+        fprintf(stderr, "Could not connect to server at %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    text_answers(c, 1);
+    report_transport("unix", c, commands, batch);
+    close(c->fd);
+
+    // The client must not have read past the line that passes the memory, so the
+    // connection for shared memory reads its first line a byte at a time.
+    memset(c, 0, sizeof(CONN));
+    char line[64];
+    if((c->fd = try_connect((struct sockaddr *)&sun, sizeof(sun))) == -1 ||
+       read_line(c->fd, line, sizeof(line)) == -1) {
+        fprintf(stderr, "Could not connect to server at %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    start_shm(c);
+    report_transport("shm", c, commands, batch);
+    shm_link_close(c->link);
+    close(c->fd);
+    free(c);
+    stop_server(pid, SIGKILL);
+    unlink(path);
+    return 0;
+}
+
+static int bench_handoff(int argc, char *argv[]) {
+    char *path = argc > 0 ? argv[0] : "/tmp/pbx_bench.handoff";
+    int count = (argc > 1 ? atoi(argv[1]) : 50000) & ~1;
+    if(count <= 0) {
+        return -1;
+    }
+    // Both this process and the servers need a file descriptor for every connection.
+    rlim_t limit = raise_file_limit();
+    if(limit < (rlim_t)count + 64) {
+        fprintf(stderr, "Too few file descriptors (%lu) for %d connections\n", (unsigned long)limit, count);
+        return 1;
+    }
+    unlink(path);
+    char *args[] = { "-H", path, NULL };
+    pid_t old_pid = start_server(args);
+
+    // Clients are read a line at a time, without a stream each, as there are so many.
+    int *fds = malloc(sizeof(int) * count);
+    int *exts = malloc(sizeof(int) * count);
+    double start = now();
+    for(int i = 0; i < count; i++) {
+        fds[i] = connect_tcp();
+        exts[i] = expect_line(fds[i], "ON HOOK ");
+    }
+    for(int i = 0; i < count; i += 2) {
+        dprintf(fds[i], "pickup\r\ndial %d\r\n", exts[i + 1]);
+        expect_line(fds[i], "DIAL TONE");
+        expect_line(fds[i], "RING BACK");
+        expect_line(fds[i + 1], "RINGING");
+        dprintf(fds[i + 1], "pickup\r\n");
+        expect_line(fds[i + 1], "CONNECTED ");
+        expect_line(fds[i], "CONNECTED ");
+    }
+    printf("%d connections in %d calls set up in %.3f s\n", count, count / 2, now() - start);
+
+    // Take over, and wait for the old server to go.
+    start = now();
+    pid_t new_pid = start_server(args);
+    int status;
+    if(waitpid(old_pid, &status, 0) != old_pid || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "Old server did not exit cleanly\n");
+        stop_server(new_pid, SIGKILL);
+        return 1;
+    }
+    double handoff = now() - start;
+
+    // Every call still works, first to last.
+    for(int i = 0; i < count; i += 2) {
+        dprintf(fds[i], "chat ping\r\n");
+    }
+    for(int i = 0; i < count; i += 2) {
+        expect_line(fds[i], "CONNECTED ");
+        expect_line(fds[i + 1], "chat ping");
+    }
+    double served = now() - start;
+    for(int i = 0; i < count; i += 2) {
+        dprintf(fds[i], "hangup\r\n");
+        expect_line(fds[i], "ON HOOK ");
+        expect_line(fds[i + 1], "DIAL TONE");
+    }
+    printf("Handoff of %d connections: %.3f s until the old server exited, %.3f s until every call had carried chat\n",
+           count, handoff, served);
+    for(int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+    stop_server(new_pid, SIGKILL);
+    unlink(path);
+    free(fds);
+    free(exts);
+    return 0;
+}
+
+/*
+ * Connect new clients as fast as possible, keeping those that are registered.
+ */
+struct storm {
+    int clients;
+    int accepted, rejected;
+    long retry_ms;
+};
+
+static void *storm(void *arg) {
+    struct storm *s = arg;
+    for(int i = 0; i < s->clients && running; i++) {
+        int fd = try_connect_tcp();
+        char line[64] = "";
+        if(fd == -1) {
+            break;
+        }
+        FILE *in = fdopen(fd, "r");
+        if(!fgets(line, sizeof(line), in) || strncmp(line, "ON HOOK", 7)) {
+            s->rejected++;
+            s->retry_ms += atoi(line + strlen("OVERLOAD "));
+            fclose(in);
+        }
+        else {
+            s->accepted++;
+        }
+    }
+    return NULL;
+}
+
+static int bench_overload(int argc, char *argv[]) {
+    char *limits = argc > 0 ? argv[0] : "200:64:20";
+    int flooders = argc > 1 ? atoi(argv[1]) : 8;
+    struct storm s = { argc > 2 ? atoi(argv[2]) : 500 };
+    double seconds = argc > 3 ? atof(argv[3]) : 3;
+    if(flooders < 0 || s.clients < 0 || seconds <= 0) {
+        return -1;
+    }
+    pid_t pid = start_server((char *[]){ strcmp(limits, "-") ? "-O" : NULL, limits, NULL });
+
+    // The probe call, then the flooding calls, then the storm.
+    CLIENT a, b;
+    client_connect(&a);
+    client_connect(&b);
+    call(&a, &b);
+    pthread_t tid;
+    pthread_create(&tid, NULL, drain, &b.fd);
+    CLIENT *calls = malloc(2 * flooders * sizeof(CLIENT));
+    struct sender *senders = malloc(flooders * sizeof(struct sender));
+    running = 1;
+    for(int i = 0; i < flooders; i++) {
+        client_connect(&calls[2 * i]);
+        client_connect(&calls[2 * i + 1]);
+        call(&calls[2 * i], &calls[2 * i + 1]);
+        senders[i] = (struct sender){ calls[2 * i].fd, 4096, 0 };
+        pthread_create(&tid, NULL, drain, &calls[2 * i].fd);
+        pthread_create(&tid, NULL, drain, &calls[2 * i + 1].fd);
+        pthread_create(&tid, NULL, send_chats, &senders[i]);
+    }
+    pthread_t storm_tid;
+    pthread_create(&storm_tid, NULL, storm, &s);
+
+    // Stay under the rate limit of control commands.
+    double *probes = malloc(MAX_PROBES * sizeof(double));
+    int n = probe_hold(&a, seconds, 25000, probes);
+    running = 0;
+    pthread_join(storm_tid, NULL);
+
+    char what[64];
+    snprintf(what, sizeof(what), "limits %s, %d flooding calls: hold/resume", limits, flooders);
+    print_probes(what, probes, n);
+    printf("storm of %d clients: %d registered, %d turned away (mean retry %ld ms)\n",
+           s.clients, s.accepted, s.rejected, s.rejected ? s.retry_ms / s.rejected : 0);
+    fflush(stdout);
+
+    // The server writes its counters to its standard error.
+    kill(pid, SIGUSR1);
+    usleep(100000);
+    stop_server(pid, SIGKILL);
+    free(probes);
+    free(calls);
+    free(senders);
+    return 0;
+}
+
+/*
+ * Set up and tear down calls from one client of a pair to the other for as long as
+ * the load runs.
+ */
+struct pair {
+    CLIENT a, b;
+    long calls;
+};
+
+static void *call_repeatedly(void *arg) {
+    struct pair *p = arg;
+    while(running) {
+        call(&(p->a), &(p->b));
+        hang_up(&(p->a), &(p->b));
+        p->calls++;
+    }
+    return NULL;
+}
+
+static void run_cores(int cores, int npairs, double seconds) {
+    char corestr[16];
+    snprintf(corestr, sizeof(corestr), "%d", cores);
+    pid_t pid = start_server((char *[]){ "-r", NO_LIMITS, cores ? "-C" : NULL, corestr, NULL });
+
+    // Which core takes each client is up to the kernel, so that some calls are within
+    // a core and the rest across cores.
+    struct pair *pairs = calloc(npairs, sizeof(struct pair));
+    int across = 0;
+    for(int i = 0; i < npairs; i++) {
+        client_connect(&pairs[i].a);
+        client_connect(&pairs[i].b);
+        if(cores && pairs[i].a.ext / (PBX_VIRTUAL_BASE / cores) != pairs[i].b.ext / (PBX_VIRTUAL_BASE / cores)) {
+            across++;
+        }
+    }
+    pthread_t *tids = malloc(npairs * sizeof(pthread_t));
+    running = 1;
+    double start = now();
+    for(int i = 0; i < npairs; i++) {
+        pthread_create(&tids[i], NULL, call_repeatedly, &pairs[i]);
+    }
+    usleep(seconds * 1e6);
+    running = 0;
+    long calls = 0;
+    for(int i = 0; i < npairs; i++) {
+        pthread_join(tids[i], NULL);
+        calls += pairs[i].calls;
+    }
+    double elapsed = now() - start;
+    printf("%2d cores, %d pairs (%d across cores): %.0f calls/s\n", cores, npairs, across, calls / elapsed);
+    fflush(stdout);
+
+    for(int i = 0; i < npairs; i++) {
+        client_close(&pairs[i].a);
+        client_close(&pairs[i].b);
+    }
+    stop_server(pid, SIGHUP);
+    free(tids);
+    free(pairs);
+}
+
+static int bench_cores(int argc, char *argv[]) {
+    int npairs = argc > 0 ? atoi(argv[0]) : 64;
+    double seconds = argc > 1 ? atof(argv[1]) : 3;
+    if(npairs <= 0 || npairs > MAX_PAIRS || seconds <= 0) {
+        return -1;
+    }
+    if(argc > 2) {
+        for(int i = 2; i < argc; i++) {
+            run_cores(atoi(argv[i]), npairs, seconds);
+        }
+        return 0;
+    }
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    for(int cores = 1; cores <= online && cores <= 16; cores *= 2) {
+        run_cores(cores, npairs, seconds);
+    }
+    return 0;
+}
+
+/*
+ * Get a field of the status of a process, in the units it is given in.
+ */
+static long status_field(pid_t pid, const char *field) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    long value = -1;
+    while(f && fgets(line, sizeof(line), f)) {
+        if(strncmp(line, field, strlen(field)) == 0) {
+            value = atol(line + strlen(field));
+        }
+    }
+    if(f) {
+        fclose(f);
+    }
+    return value;
+}
+
+static void run_coro(int loops, int nclients, double seconds) {
+    char loopstr[16];
+    snprintf(loopstr, sizeof(loopstr), "%d", loops);
+    pid_t pid = start_server((char *[]){ "-r", NO_LIMITS, loops ? "-E" : NULL, loopstr, NULL });
+
+    // The probe call, then the idle clients.
+    CLIENT a, b;
+    client_connect(&a);
+    client_connect(&b);
+    call(&a, &b);
+    int *fds = malloc(nclients * sizeof(int));
+    int connected = 0;
+    double start = now();
+    for(; connected < nclients; connected++) {
+        char line[64];
+        if((fds[connected] = try_connect_tcp()) == -1) {
+            break;
+        }
+        // Wait for the client to be registered, so that it is being served.
+        if(read(fds[connected], line, sizeof(line)) <= 0) {
+            close(fds[connected]);
+            break;
+        }
+    }
+    double elapsed = now() - start;
+    long threads = status_field(pid, "Threads:"), rss = status_field(pid, "VmRSS:");
+
+    double *probes = malloc(MAX_PROBES * sizeof(double));
+    int n = probe_hold(&a, seconds, 0, probes);
+    char what[256];
+    snprintf(what, sizeof(what), "%2d loops, %d clients connected in %.2f s: %ld threads, %ld kB RSS "
+             "(%.1f kB/client), hold/resume", loops, connected, elapsed, threads, rss,
+             connected ? (double)rss / connected : 0);
+    print_probes(what, probes, n);
+    fflush(stdout);
+
+    stop_server(pid, SIGKILL);
+    for(int i = 0; i < connected; i++) {
+        close(fds[i]);
+    }
+    client_close(&a);
+    client_close(&b);
+    free(fds);
+    free(probes);
+}
+
+static int bench_coro(int argc, char *argv[]) {
+    int nclients = argc > 0 ? atoi(argv[0]) : 5000;
+    double seconds = argc > 1 ? atof(argv[1]) : 2;
+    if(nclients < 0 || seconds <= 0) {
+        return -1;
+    }
+    // Room for all the clients, which the server raises its own limit for as well.
+    raise_file_limit();
+    if(argc > 2) {
+        for(int i = 2; i < argc; i++) {
+            run_coro(atoi(argv[i]), nclients, seconds);
+        }
+        return 0;
+    }
+    run_coro(0, nclients, seconds);
+    run_coro(1, nclients, seconds);
+    return 0;
+}
+
+/*
+ * The trunk of the executor load, written by several threads.
+ */
+#define EXEC_CHAT_SIZE (64 * 1024)
+#define EXEC_SLOW_READ 4096
+
+static int trunk;
+static pthread_mutex_t trunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The last response to a probe, handed from the thread reading the trunk.
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t probe_answered;
+
+/*
+ * Read the next frame from the trunk, returning its channel, or -1 at the end.
+ */
+static int read_frame(PROTO_HEADER *h, char *payload, size_t size) {
+    static char discard[65536];
+    uint32_t ch;
+    if(read_fully(trunk, &ch, sizeof(ch)) == -1 || read_fully(trunk, h, sizeof(*h)) == -1) {
+        return -1;
+    }
+    uint32_t len = ntohl(h->len);
+    for(uint32_t left = len; left > 0; ) {
+        uint32_t n = left < sizeof(discard) ? left : sizeof(discard);
+        if(read_fully(trunk, discard, n) == -1) {
+            return -1;
+        }
+        left -= n;
+    }
+    len = len < size ? len : size - 1;
+    memcpy(payload, discard, len);
+    payload[len] = '\0';
+    return ntohl(ch);
+}
+
+/*
+ * Read frames from the trunk until the response to a request, returning its payload.
+ */
+static void expect_response(uint32_t channel, uint32_t id, char *payload, size_t size) {
+    PROTO_HEADER h;
+    int ch;
+    while((ch = read_frame(&h, payload, size)) != -1) {
+        if(ch == channel && h.type == PROTO_RESPONSE && ntohl(h.id) == id) {
+            return;
+        }
+    }
+    fprintf(stderr, "Trunk closed while waiting for request %u\n", id);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Send a request on a channel of the trunk.
+ */
+static void request(uint32_t channel, int op, uint32_t id, int32_t arg, const char *text, size_t len) {
+    // The channel and header go in one write, so as not to wait on Nagle's algorithm.
+    char frame[sizeof(uint32_t) + sizeof(PROTO_HEADER)];
+    PROTO_HEADER h;
+    uint32_t ch = htonl(channel);
+    proto_header_pack(&h, PROTO_REQUEST, op, 0, id, arg, len);
+    memcpy(frame, &ch, sizeof(ch));
+    memcpy(frame + sizeof(ch), &h, sizeof(h));
+    pthread_mutex_lock(&trunk_lock);
+    write_fully(trunk, frame, sizeof(frame));
+    if(text) {
+        write_fully(trunk, text, len);
+    }
+    pthread_mutex_unlock(&trunk_lock);
+}
+
+/*
+ * Read everything from the trunk once the calls are set up, handing the responses to
+ * the probes on channel 2 to the main thread.
+ */
+static void *read_trunk(void *arg) {
+    PROTO_HEADER h;
+    char payload[256];
+    int ch;
+    while((ch = read_frame(&h, payload, sizeof(payload))) != -1) {
+        if(ch == 2 && h.type == PROTO_RESPONSE) {
+            pthread_mutex_lock(&probe_lock);
+            probe_answered = ntohl(h.id);
+            pthread_cond_signal(&probe_cond);
+            pthread_mutex_unlock(&probe_lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Read slowly from the text client called by channel 1, until its connection ends.
+ */
+static void *read_slowly(void *arg) {
+    char buf[EXEC_SLOW_READ];
+    while(read(*(int *)arg, buf, sizeof(buf)) > 0) {
+        usleep(1000);
+    }
+    return NULL;
+}
+
+/*
+ * Send the chats of channel 1, all at once.
+ */
+static void *flood_channel(void *arg) {
+    static char chat[EXEC_CHAT_SIZE];
+    memset(chat, 'x', sizeof(chat));
+    int chats = *(int *)arg;
+    for(int i = 0; i < chats && running; i++) {
+        request(1, PROTO_OP_CHAT, 1000 + i, 0, chat, sizeof(chat));
+    }
+    return NULL;
+}
+
+static void probe_wait(uint32_t id) {
+    pthread_mutex_lock(&probe_lock);
+    while(probe_answered != id) {
+        pthread_cond_wait(&probe_cond, &probe_lock);
+    }
+    pthread_mutex_unlock(&probe_lock);
+}
+
+static void run_executor(int workers, int chats, double seconds) {
+    char workerstr[16];
+    snprintf(workerstr, sizeof(workerstr), "%d", workers);
+    pid_t pid = start_server((char *[]){ "-r", NO_LIMITS, workers ? "-W" : NULL, workerstr, NULL });
+
+    // Open channels 1 to 3 of a trunk, and connect the slow text client.
+    char line[256], payload[256];
+    trunk = connect_tcp();
+    int slow = connect_tcp();
+    read_line(trunk, line, sizeof(line));
+    dprintf(trunk, "proto 3\r\n");
+    expect_response(0, 0, payload, sizeof(payload));
+    int exts[4];
+    for(int i = 1; i <= 3; i++) {
+        request(i, PROTO_OP_OPEN, i, 0, NULL, 0);
+        expect_response(i, i, payload, sizeof(payload));
+        exts[i] = atoi(payload + strlen("ON HOOK "));
+    }
+    int slow_ext = expect_line(slow, "ON HOOK ");
+
+    // Channel 1 calls the slow client, and channel 2 calls channel 3.
+    request(1, PROTO_OP_PICKUP, 10, 0, NULL, 0);
+    request(1, PROTO_OP_DIAL, 11, slow_ext, NULL, 0);
+    expect_response(1, 11, payload, sizeof(payload));
+    read_line(slow, line, sizeof(line));
+    dprintf(slow, "pickup\r\n");
+    read_line(slow, line, sizeof(line));
+    request(2, PROTO_OP_PICKUP, 20, 0, NULL, 0);
+    request(2, PROTO_OP_DIAL, 21, exts[3], NULL, 0);
+    expect_response(2, 21, payload, sizeof(payload));
+    request(3, PROTO_OP_PICKUP, 30, 0, NULL, 0);
+    expect_response(3, 30, payload, sizeof(payload));
+
+    pthread_t reader, slow_reader, flooder;
+    running = 1;
+    probe_answered = 0;
+    pthread_create(&reader, NULL, read_trunk, NULL);
+    pthread_create(&slow_reader, NULL, read_slowly, &slow);
+    pthread_create(&flooder, NULL, flood_channel, &chats);
+
+    // Measure the time for channel 2 to be put on hold and resumed.
+    double *probes = malloc(MAX_PROBES * sizeof(double));
+    int n = 0;
+    uint32_t id = 100;
+    double end = now() + seconds;
+    while(now() < end && n < MAX_PROBES) {
+        double start = now();
+        request(2, PROTO_OP_HOLD, id, 0, NULL, 0);
+        probe_wait(id++);
+        request(2, PROTO_OP_RESUME, id, 0, NULL, 0);
+        probe_wait(id++);
+        probes[n++] = now() - start;
+        usleep(1000);
+    }
+    running = 0;
+    pthread_join(flooder, NULL);
+    char what[128];
+    snprintf(what, sizeof(what), "%2d workers, %d chats on the heavy channel: hold/resume", workers, chats);
+    print_probes(what, probes, n);
+    fflush(stdout);
+
+    stop_server(pid, SIGKILL);
+    pthread_join(reader, NULL);
+    pthread_join(slow_reader, NULL);
+    close(trunk);
+    close(slow);
+    free(probes);
+}
+
+static int bench_executor(int argc, char *argv[]) {
+    int chats = argc > 0 ? atoi(argv[0]) : 200;
+    double seconds = argc > 1 ? atof(argv[1]) : 3;
+    if(chats < 0 || seconds <= 0) {
+        return -1;
+    }
+    if(argc > 2) {
+        for(int i = 2; i < argc; i++) {
+            run_executor(atoi(argv[i]), chats, seconds);
+        }
+        return 0;
+    }
+    run_executor(0, chats, seconds);
+    run_executor(4, chats, seconds);
+    return 0;
+}
+
+/*
+ * The modes, each with the usage of its arguments.  A mode returns 0 if successful,
+ * 1 if the load failed, and -1 if its arguments are not valid.
+ */
+static const struct mode {
+    const char *name;
+    int (*run)(int argc, char *argv[]);
+    const char *usage;
+} modes[] = {
+    { "chat", bench_chat, "[message-size] [total-MB]" },
+    { "proto", bench_proto, "[commands] [batch]" },
+    { "shm", bench_shm, "[socket-path] [commands] [batch]" },
+    { "handoff", bench_handoff, "[handoff-path] [connections]" },
+    { "overload", bench_overload, "[limits|-] [flooding-calls] [storm-clients] [seconds]" },
+    { "cores", bench_cores, "[pairs] [seconds] [cores]..." },
+    { "executor", bench_executor, "[chats] [seconds] [workers]..." },
+    { "coro", bench_coro, "[clients] [seconds] [loops]..." },
+};
+
+#define NUM_MODES (sizeof(modes) / sizeof(modes[0]))
+
+static void usage(const char *prog, const struct mode *m) {
+    for(size_t i = 0; i < NUM_MODES; i++) {
+        if(!m || m == &modes[i]) {
+            fprintf(stderr, "usage: %s %s [server-binary] [port] %s\n", prog, modes[i].name, modes[i].usage);
+        }
+    }
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const struct mode *m = NULL;
+    for(size_t i = 0; argc > 1 && i < NUM_MODES; i++) {
+        if(!strcmp(argv[1], modes[i].name)) {
+            m = &modes[i];
+        }
+    }
+    if(!m) {
+        usage(argv[0], NULL);
+    }
+    server = argc > 2 ? argv[2] : "bin/pbx";
+    port = argc > 3 ? atoi(argv[3]) : 9998;
+    if(port <= 0) {
+        usage(argv[0], m);
+    }
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    signal(SIGPIPE, SIG_IGN);
+    int ret = m->run(argc > 4 ? argc - 4 : 0, argv + 4);
+    if(ret == -1) {
+        usage(argv[0], m);
+    }
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,66 @@
+/*
+ * Benchmark of the cost of concealing a lost frame of audio.
+ *
+ * Usage: bin/plc_bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "plc.h"
+#include "media.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Alternate bursts of received and lost frames, timing only the lost ones.
+ * The first frame of each loss includes the pitch search; later ones only repeat.
+ */
+static void run(int rate, int iterations, int burst) {
+    PLC plc;
+    int16_t frame[MEDIA_MAX_FRAME];
+    int n = MEDIA_FRAME_SAMPLES(rate);
+    double first = 0, later = 0;
+    long t = 0, sink = 0;
+
+    plc_init(&plc, rate);
+    for(int it = 0; it < iterations; it++) {
+        for(int f = 0; f < 3; f++, t += n) {
+            for(int i = 0; i < n; i++) {
+                frame[i] = (int16_t)lrint(10000 * sin(2 * M_PI * (110 + it % 90) * (t + i) / rate));
+            }
+            plc_good_frame(&plc, frame, n);
+        }
+        for(int f = 0; f < burst; f++, t += n) {
+            double start = now();
+            plc_lost_frame(&plc, frame, n);
+            double elapsed = now() - start;
+            if(f == 0) {
+                first += elapsed;
+            }
+            else {
+                later += elapsed;
+            }
+            sink += frame[f % n];
+        }
+    }
+    printf("%5d Hz  first lost frame %7.0f ns  later lost frames %7.0f ns  (check %ld)\n",
+           rate, first / iterations * 1e9, burst > 1 ? later / (iterations * (burst - 1)) * 1e9 : 0.0, sink);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    if(iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    printf("Concealing %d losses of 3 frames (%d ms each)\n", iterations, MEDIA_FRAME_MSEC);
+    run(8000, iterations, 3);
+    run(16000, iterations, 3);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+/*
+ * Throughput benchmark for the 8 kHz <-> 16 kHz resampler.
+ *
+ * Usage: bin/resample_bench [seconds-of-audio]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "resample.h"
+#include "media.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Convert the given amount of audio one 20 ms frame at a time, as the media path does,
+ * and report throughput in samples/sec and in real-time streams per core.
+ */
+static void run(const char *name, int in_rate, int out_rate, int seconds) {
+    RESAMPLER rs;
+    int16_t in[MEDIA_MAX_FRAME], out[2 * MEDIA_MAX_FRAME];
+    int frame = MEDIA_FRAME_SAMPLES(in_rate);
+    long frames = (long)seconds * 1000 / MEDIA_FRAME_MSEC;
+    long sink = 0;
+
+    resampler_init(&rs, in_rate, out_rate);
+    for(int i = 0; i < frame; i++) {
+        in[i] = (int16_t)lrint(12000 * sin(2 * M_PI * 440 * i / in_rate));
+    }
+    double start = now();
+    for(long f = 0; f < frames; f++) {
+        sink += resampler_process(&rs, in, frame, out);
+        sink += out[f % frame];
+    }
+    double elapsed = now() - start;
+    double rate = (double)frames * frame / elapsed;
+    printf("%-12s %8.2f Msamples/s in  %8.0f x realtime  (%.3f s, check %ld)\n",
+           name, rate / 1e6, rate / in_rate, elapsed, sink);
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 600;
+    if(seconds <= 0) {
+        fprintf(stderr, "usage: %s [seconds-of-audio]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    printf("Converting %d s of audio per direction in %d ms frames\n", seconds, MEDIA_FRAME_MSEC);
+    run("8k -> 16k", 8000, 16000, seconds);
+    run("16k -> 8k", 16000, 8000, seconds);
+    return EXIT_SUCCESS;
+}
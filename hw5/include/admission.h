@@ -0,0 +1,53 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+/*
+ * Admission control: shedding load when the server is overloaded, rather than taking
+ * on every connection until all of them are served badly.
+ *
+ * Option "-O <clients>:<accept-queue>:<latency-ms>:<rss-MB>" sets the limits of four
+ * measures of load, any of which may be 0 for none, and trailing ones left out: the
+ * number of clients being served, the number of connections waiting to be accepted,
+ * the time taken to carry out a control command (averaged over recent commands), and
+ * the memory in use by the server.  Every ADMISSION_INTERVAL_MS a thread samples them,
+ * and the pressure is the highest of their ratios to their limits, as a percentage.
+ *
+ * From ADMISSION_SOFT_PERCENT on, chat is put behind call control: each chat command
+ * from a connection waits ADMISSION_CHAT_DELAY_MS before it is relayed, which by TCP
+ * flow control holds back clients flooding chat, while control commands are never held
+ * up.  Trunks, which carry the control commands of many calls, and UDP phones, all
+ * served by one thread, are left alone.  From 100% on,
+ * new registrations are also turned away: a new connection is sent "OVERLOAD <ms>",
+ * the time after which it may try again, and closed, and a new UDP phone gets no answer
+ * to its first datagram, so that it sends it again.  Clients already registered, and
+ * the calls they are in, are never shed.  A level that has been reached is held for at
+ * least ADMISSION_HOLD_MS, so that the server does not flap in and out of it.
+ *
+ * The level, the pressure, the sampled measures and the limits are all exported with
+ * the metrics (see metrics.h).
+ */
+
+#define ADMISSION_INTERVAL_MS 100
+#define ADMISSION_SOFT_PERCENT 75
+#define ADMISSION_CHAT_DELAY_MS 10
+#define ADMISSION_HOLD_MS 1000
+
+/*
+ * Levels of overload.
+ */
+#define ADMISSION_NORMAL 0
+#define ADMISSION_DEFER_CHAT 1
+#define ADMISSION_REJECT 2
+
+int admission_config(const char *spec);
+void admission_start(int listenfd);
+int admission_admit(void);
+void admission_enter(void);
+void admission_leave(void);
+uint64_t admission_command_start(void);
+void admission_command_done(uint64_t start);
+void admission_chat(void);
+
+#endif /* ADMISSION_H */
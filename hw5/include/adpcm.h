@@ -0,0 +1,25 @@
+#ifndef ADPCM_H
+#define ADPCM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * IMA-ADPCM codec: compresses 16-bit linear PCM to 4 bits per sample.
+ * Two samples are packed into each byte, the earlier one in the low nibble.
+ */
+
+/*
+ * State of the codec for one stream.  The encoder and decoder of a stream must
+ * start from the same state to stay in step.
+ */
+typedef struct adpcm_state {
+    int32_t predictor;   // Predicted value of the next sample.
+    int32_t index;       // Index into the step size table.
+} ADPCM_STATE;
+
+void adpcm_init(ADPCM_STATE *st);
+size_t adpcm_encode(ADPCM_STATE *st, const int16_t *in, size_t n, uint8_t *out);
+size_t adpcm_decode(ADPCM_STATE *st, const uint8_t *in, size_t n, int16_t *out);
+
+#endif /* ADPCM_H */
@@ -0,0 +1,78 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sys/uio.h>
+
+/*
+ * Coroutines: serving the clients of the server on a few threads, rather than a thread
+ * for each, while the code that serves a client still reads as one thread of control.
+ *
+ * Option "-E <loops>" starts that many event loops, each a thread with an epoll set,
+ * and each TCP client is then served by pbx_client_service() running as a coroutine
+ * on one of them, in turn, with a stack of its own of CORO_STACK_SIZE bytes.  Where
+ * the thread of a client would block, its coroutine is suspended instead, and its loop
+ * runs another:
+ *
+ *   - reading from a connection that has nothing to read, or writing to one that is
+ *     full (coro_read(), coro_writev()), until epoll finds it ready;
+ *   - waiting on a semaphore (P() in a coroutine calls coro_sem_wait()), parked on it
+ *     until V() (which calls coro_sem_post()) wakes it, or the first one parked on it;
+ *   - sleeping, as rate limits do (coro_nanosleep()), until a timer of the loop expires.
+ *
+ * Outside of a coroutine each of these does what it always did, so that the same code
+ * serves clients on threads of their own, as it does without -E and for clients on the
+ * Unix-domain socket, which can move to shared memory and wait there.  Since a loop
+ * runs one coroutine at a time, state kept per thread while a client is being served
+ * is kept per coroutine instead (see coro_local()).
+ *
+ * A stack is mapped with mmap, below CORO_GUARD_SIZE bytes that cannot be touched, so
+ * that overflowing it faults rather than overwriting whatever lies beyond.  The guard
+ * is larger than any frame on the paths that serve a client (tu_audio() has the largest,
+ * with a PATH_MAX buffer), so that no frame can step over it, and only the pages of a
+ * stack that are used take memory, so it can be several times the deepest of those
+ * paths.  Each coroutine takes two of the mappings that the kernel allows a process
+ * (vm.max_map_count), which bounds the clients at about half of those.  Hot restarts
+ * (-H) stop the threads serving clients with a signal, so they cannot be combined
+ * with -E.
+ *
+ * P() and V() only look for coroutines once coro_start() has turned them on, so that
+ * without -E semaphores cost what they always did.
+ */
+
+#define CORO_STACK_SIZE (256 * 1024)
+#define CORO_GUARD_SIZE (64 * 1024)
+#define CORO_MAX_LOOPS 64
+
+/*
+ * Bytes of storage that each coroutine has for coro_local().
+ */
+#define CORO_LOCAL_SIZE 16
+
+typedef struct coro CORO;
+
+extern int coro_on;
+
+int coro_config(const char *spec);
+void coro_start(void);
+int coro_spawn(void *(*fn)(void *), void *arg);
+CORO *coro_self(void);
+void *coro_local(void);
+void coro_yield(void);
+void coro_nanosleep(const struct timespec *ts);
+void coro_sem_wait(sem_t *sem);
+void coro_sem_post(sem_t *sem);
+ssize_t coro_read(int fd, void *buf, size_t len);
+ssize_t coro_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/*
+ * Determine whether clients are served by coroutines.  They are turned on before any
+ * coroutine exists, and never turned off.
+ */
+static inline int coro_enabled(void) {
+    return __atomic_load_n(&coro_on, __ATOMIC_ACQUIRE);
+}
+
+#endif /* CORO_H */
@@ -0,0 +1,84 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <stdint.h>
+#include <semaphore.h>
+
+/*
+ * Executor: a pool of worker threads carrying out the requests of trunks, so that a
+ * trunk is no longer served by the one thread reading its connection.
+ *
+ * Option "-W <workers>" starts the pool.  The thread serving a trunk still reads its
+ * frames and queues them in lanes (see lanes.h), but then posts each request as a task
+ * to the mailbox of its channel, rather than carrying it out itself.  A mailbox is an
+ * actor: it is scheduled on a worker when its first task arrives, and the worker then
+ * carries out all the tasks in it in the order they were posted, so that the requests
+ * on one channel, and so to one TU, are still carried out one at a time and in order,
+ * while those of different channels run on different workers.  A channel whose request
+ * blocks, such as a chat to a party that does not read it, holds up only its worker,
+ * not the whole trunk.
+ *
+ * Each worker keeps the mailboxes that it schedules in a deque of its own (Chase-Lev),
+ * from which it takes the latest, while idle workers steal the oldest from the others.
+ * Mailboxes scheduled by threads that are not workers go through a shared queue, as
+ * does a mailbox that still has tasks after a turn, so that it goes behind the others
+ * and a busy channel does not starve the rest.
+ *
+ * Requests that open or close a channel, or that are streamed, wait until all the tasks
+ * of the trunk are done (see exec_quiesce()), as does the end of the connection.  The
+ * thread serving a trunk also stops reading while EXEC_BACKLOG of its tasks are
+ * pending, so that a channel that is stuck cannot make it buffer without bound.
+ */
+
+/*
+ * Number of mailboxes that the deque of a worker can hold, a power of 2.  Any more
+ * go to the shared queue.
+ */
+#define EXEC_DEQUE_SIZE 1024
+
+#define EXEC_MAX_WORKERS 64
+
+/*
+ * Number of tasks of a trunk that may be pending before its thread stops reading.
+ */
+#define EXEC_BACKLOG 256
+
+/*
+ * A task, posted to a mailbox.
+ */
+typedef struct exec_task {
+    struct exec_task *next;
+    void (*run)(struct exec_task *task);
+} EXEC_TASK;
+
+/*
+ * Tasks to be waited for all together.
+ */
+typedef struct exec_group {
+    int64_t pending;          // Tasks posted and not yet done.
+    int64_t most;             // Number pending that the waiting thread waits for.
+    int waiting;              // Set while a thread waits for them.
+    sem_t idle;               // Posted when no more than most are pending, for that thread.
+} EXEC_GROUP;
+
+/*
+ * A mailbox.  All zeros is an empty mailbox, in no group.  It may only be moved while
+ * its group has no tasks pending.
+ */
+typedef struct exec_actor {
+    EXEC_TASK *mailbox;       // Tasks posted, latest first.
+    int64_t pending;          // Tasks posted and not yet taken, scheduled while above 0.
+    EXEC_GROUP *group;        // Group of the tasks posted to the mailbox.
+    struct exec_actor *next;  // Next mailbox in the shared queue.
+} EXEC_ACTOR;
+
+int exec_config(const char *spec);
+void exec_start(void);
+int exec_enabled(void);
+void exec_group_init(EXEC_GROUP *group);
+void exec_group_fini(EXEC_GROUP *group);
+void exec_post(EXEC_ACTOR *actor, EXEC_TASK *task);
+void exec_wait(EXEC_GROUP *group, int64_t most);
+void exec_quiesce(EXEC_GROUP *group);
+
+#endif /* EXECUTOR_H */
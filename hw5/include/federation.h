@@ -0,0 +1,50 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stddef.h>
+
+#include "shard.h"
+
+/*
+ * Federation: calls to extensions of other PBXs, each running as a server of its own,
+ * over trunks (see trunk.h) to them.
+ *
+ * Each option "-F <prefix>:<host>:<port>" adds a route to the dial plan: a number
+ * dialed that starts with the digits of the prefix, and has more digits after it, is
+ * the extension given by those digits at the PBX listening on the host and port.  The
+ * longest matching prefix wins, and routes are tried before the local extensions, so
+ * that a prefix shadows the local extensions that start with it.
+ *
+ * This server keeps a pool of FED_POOL_SIZE connections to each route, opened when it
+ * starts and opened again in the background if they end, and switches each to a trunk
+ * as any gateway would; while none is open, calls over the route fail at once.  Calls over a route take turns at the connections of its pool.
+ * A call has a channel of its own, on which a virtual TU at the other PBX dials the
+ * extension; the three requests opening the channel, picking up, and dialing are
+ * written at once, so that a call rings after one round trip.  The caller here is in a
+ * call with a proxy TU standing for the remote party (see shard.h), which follows the
+ * virtual TU there through RING BACK and CONNECTED and hangs up when it does; what the
+ * caller does to the proxy, and the chats it sends, become requests on the channel,
+ * each piece of a chat frame going on as soon as it arrives.
+ * The channel is closed when the call ends, and the calls on a connection that ends
+ * are hung up.
+ */
+
+/*
+ * Number of connections to each route.
+ */
+#define FED_POOL_SIZE 2
+
+/*
+ * Largest number of calls on one connection, plus one (channel 0 carries none).
+ */
+#define FED_LINK_CHANNELS 4096
+
+int fed_route_add(const char *spec);
+int fed_route_update(const char *spec);
+void fed_start(void);
+int fed_routed(int number);
+int fed_dial(TU *tu, int number);
+void fed_leg_state(SHARD_LEG *leg, int state);
+void fed_leg_chat(SHARD_LEG *leg, int op, const char *data, size_t len, size_t more);
+
+#endif /* FEDERATION_H */
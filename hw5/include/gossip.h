@@ -0,0 +1,55 @@
+#ifndef GOSSIP_H
+#define GOSSIP_H
+
+#include <stdint.h>
+
+/*
+ * Gossip: a directory of the extensions registered at every node of a cluster of PBXs,
+ * kept by each node without any central server, so that calls between nodes go over
+ * federation trunks (see federation.h) without a route configured for each node, and a
+ * dial to an extension that is not registered anywhere fails without a round trip.
+ *
+ * Each node is started with "-G <node>:<host>:<port>", giving its node ID (from 1 to
+ * GOSSIP_MAX_NODE) and the UDP address on which it gossips, and with "-P <host>:<port>"
+ * for each node it knows to begin with.  The ID is also the dial prefix of the node:
+ * extension e at node n is dialed as the digits of n followed by those of e, so no ID
+ * may be a prefix of another.  A node learns about the others from the ones it knows,
+ * and adds a federation route to each, at the host of its gossip address and the port
+ * on which it serves clients.
+ *
+ * Each node numbers the changes to its own registrations from 1 up, and each change
+ * makes an entry (extension, registered or not, version).  A node that starts again
+ * takes a higher incarnation, whose entries replace all of those of the one before.
+ * Every GOSSIP_INTERVAL_MS, a node sends a digest to a node chosen at random: for each
+ * node it knows, the incarnation and the highest version up to which it has all of the
+ * entries of that node (a version vector).  The receiver answers with the entries that
+ * the digest shows the sender to be missing, as a batch of deltas, and if the digest
+ * shows the receiver itself to be missing some, with a digest of its own.  Each
+ * datagram of deltas covers a range of versions following on from what the receiver
+ * is known to have, so that one lost on the way is not skipped over, but sent again
+ * on a later round.  The entries of each node are kept in order of version, so that
+ * those after a version are found without looking at the others.
+ *
+ * Each node looks up the entry of a dialed number in a hash table.  A node that goes
+ * away for good leaves its entries behind, and dials to its extensions fail at the
+ * connection to it.  A node that starts again at another address has its route
+ * changed to that address, and the calls over the connections to the old one end.
+ *
+ * The gossip network must be trusted: datagrams are not authenticated, and the address
+ * of a node is taken from records that other nodes pass on, not from the datagrams the
+ * node itself sends, so any host that can send to the gossip port can redirect the
+ * calls to a node.  Nodes should gossip only on a private network.
+ */
+
+#define GOSSIP_MAX_NODE 999
+#define GOSSIP_MAX_NODES 48
+#define GOSSIP_MAX_SEEDS 16
+#define GOSSIP_INTERVAL_MS 200
+
+int gossip_config(const char *spec);
+int gossip_seed(const char *spec);
+int gossip_start(const char *pbx_port);
+void gossip_publish(int ext, int registered);
+int gossip_absent(int number);
+
+#endif /* GOSSIP_H */
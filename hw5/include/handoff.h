@@ -0,0 +1,76 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "tu.h"
+#include "tu_ext.h"
+
+/*
+ * Hot restart: handing the live connections of a running server over to a new one.
+ *
+ * A server started with -H <path> first tries to take over from a server listening
+ * at that path, then listens there itself for the server that will replace it.
+ * On a takeover, the old server stops all of its service threads where they wait for
+ * input, and sends the new one, over a Unix-domain SOCK_SEQPACKET socket:
+ *
+ *   - its listening sockets, so that no client is refused in the meantime;
+ *   - for each connection, its socket (as SCM_RIGHTS, HANDOFF_BATCH at a time) and
+ *     the state of its TU: extension, state, peer, pickup group, park slot, protocol;
+ *   - the input received from each connection but not yet carried out;
+ *   - the chat history of each call.
+ *
+ * The new server puts each socket back at its old file descriptor, which is also its
+ * extension, rebuilds the registry, the calls, the park slots and the pickup lists
+ * without notifying anyone, and acknowledges.  The old server then exits, and the new
+ * one serves the connections from where the old one stopped.  If the new server goes
+ * away before acknowledging, or the old one cannot stop its threads within
+ * HANDOFF_QUIESCE_MS, the old server carries on as before.
+ *
+ * Connections moved to shared memory, trunks and UDP phones are not handed over: they
+ * are dropped when the old server exits, and their peers see them hang up.  (With a
+ * registry mirror, though, the new server takes up the UDP phones from it, as it would
+ * after a crash; see mirror.h.)
+ */
+
+#define HANDOFF_BATCH 200
+#define HANDOFF_CHUNK 32768
+#define HANDOFF_QUIESCE_MS 5000
+#define HANDOFF_ACK_MS 30000
+
+/*
+ * Listening sockets handed over, by index.
+ */
+#define HANDOFF_TCP 0
+#define HANDOFF_UNIX 1
+#define HANDOFF_UDP 2
+#define HANDOFF_LISTENERS 3
+
+/*
+ * A thread taking part in hot restarts: one serving a connection, or accepting them.
+ * Threads serving a connection fill in the fields below thread just before they stop,
+ * with the connection that they leave behind.
+ */
+typedef struct handoff_conn {
+    pthread_t thread;
+    int parked;                    // Set while the thread is stopped for a handoff.
+    struct handoff_conn *prev, *next;
+
+    TU *tu;                        // TU of the connection, or NULL if none can be handed over.
+    int fd;                        // Socket of the connection.
+    int proto;                     // PROTO_TEXT or PROTO_BINARY.
+    int discard;                   // Set while the rest of an overlong line is being skipped.
+    char *pending;                 // Input received but not yet carried out.
+    size_t pending_len;
+} HANDOFF_CONN;
+
+int handoff_take(const char *path, int listenfds[HANDOFF_LISTENERS]);
+void handoff_start(void);
+int handoff_serve(const char *path, int listenfds[HANDOFF_LISTENERS]);
+void handoff_join(HANDOFF_CONN *c);
+void handoff_leave(HANDOFF_CONN *c);
+int handoff_park(HANDOFF_CONN *c);
+
+#endif /* HANDOFF_H */
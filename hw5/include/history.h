@@ -0,0 +1,56 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Chat history of a call.
+ *
+ * The chat messages exchanged during a call are numbered in sequence, starting from 1,
+ * and the most recent ones are retained in a fixed-size ring so that a party can ask for
+ * them to be sent again.  Histories are taken from a pool when a call is connected and
+ * returned to it when the call ends, so recording a message never allocates memory.
+ */
+
+/*
+ * Capacity of a history: the number of messages, and the total bytes of text, retained.
+ * Messages longer than CHAT_HISTORY_BYTES are numbered but not retained.
+ */
+#define CHAT_HISTORY_RECORDS 64
+#define CHAT_HISTORY_BYTES 16384
+
+/*
+ * Number of histories added to the pool whenever it runs dry.
+ */
+#define CHAT_HISTORY_POOL_GROW 16
+
+/*
+ * A retained message.  Its text is stored in the byte ring of the history, and may wrap
+ * around the end of the ring.
+ */
+typedef struct chat_record {
+    uint32_t seq;     // Sequence number of the message within the call.
+    int from;         // Extension of the sender.
+    size_t offset;    // Start of the text in the byte ring.
+    size_t len;       // Length of the text.
+} CHAT_RECORD;
+
+typedef struct chat_history {
+    struct chat_history *next;   // Next history in the pool, while not in use.
+    uint32_t last_seq;           // Sequence number of the most recent message.
+    int first;                   // Index of the oldest retained record.
+    int count;                   // Number of retained records.
+    size_t used;                 // Bytes of text of the retained records.
+    size_t end;                  // Position in the byte ring following the newest text.
+    CHAT_RECORD records[CHAT_HISTORY_RECORDS];
+    char data[CHAT_HISTORY_BYTES];
+} CHAT_HISTORY;
+
+CHAT_HISTORY *chat_history_alloc(void);
+void chat_history_free(CHAT_HISTORY *h);
+uint32_t chat_history_add(CHAT_HISTORY *h, int from, const char *msg, size_t len);
+int chat_history_find(CHAT_HISTORY *h, uint32_t after, CHAT_RECORD *rec, struct iovec text[2]);
+
+#endif /* HISTORY_H */
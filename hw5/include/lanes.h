@@ -0,0 +1,62 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <stddef.h>
+
+/*
+ * Priority lanes: the order in which the requests read from a connection of the binary
+ * protocol, or a trunk, are carried out.
+ *
+ * The thread serving such a connection works in ticks.  In each tick it reads all the
+ * frames that have already arrived, up to LANE_READ_BUDGET bytes, waiting for input
+ * only if it has nothing else to do, and queues each in a lane by its command: call
+ * control (pickup, hangup, dial, hold, ...) above chat above bulk (messages, replays).
+ * It then carries out all that it queued, taking from the lanes in turn by weighted
+ * round robin, so that a hangup is not stuck behind a flood of chat that arrived before
+ * it, while chat still gets a share when control commands keep coming.  A request thus
+ * overtakes those of lower lanes that came before it: a chat sent before a hangup in
+ * the same tick is dropped, as it would be if sent after it.
+ *
+ * Each channel of a trunk (or the one TU of a binary connection) may have at most
+ * LANE_CHANNEL_BUDGET bytes of chat and bulk carried out in a tick; the rest are held
+ * over to the next tick, before anything read then, so that one heavy channel cannot
+ * crowd out the chat of the others.  Requests to open or close a channel, and chat
+ * streamed through in pieces, are carried out in order, after everything before them.
+ *
+ * Text connections are served strictly in order, since their answers carry no request
+ * IDs to tell them apart.
+ */
+
+#define LANE_CONTROL 0
+#define LANE_CHAT 1
+#define LANE_BULK 2
+#define LANE_COUNT 3
+
+/*
+ * Turns of each lane in a round, in order of lanes.
+ */
+#define LANE_WEIGHTS { 8, 2, 1 }
+
+#define LANE_READ_BUDGET (256 * 1024)
+#define LANE_CHANNEL_BUDGET (64 * 1024)
+
+/*
+ * Anything queued in a lane starts with this.
+ */
+typedef struct lane_item {
+    struct lane_item *next;
+} LANE_ITEM;
+
+typedef struct lanes {
+    LANE_ITEM *head[LANE_COUNT];
+    LANE_ITEM **tail[LANE_COUNT];
+    int turns[LANE_COUNT];    // Turns left to each lane in this round.
+    size_t queued;            // Number of items in all lanes.
+} LANES;
+
+int lane_of(int op);
+void lanes_init(LANES *lanes);
+void lanes_push(LANES *lanes, int lane, LANE_ITEM *item);
+LANE_ITEM *lanes_pop(LANES *lanes);
+
+#endif /* LANES_H */
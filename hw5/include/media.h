@@ -0,0 +1,56 @@
+#ifndef MEDIA_H
+#define MEDIA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "resample.h"
+#include "plc.h"
+#include "recorder.h"
+
+/*
+ * Audio media path: relaying frames between the two parties of a call, and mixing
+ * frames from the parties of a conference.  Audio is 16-bit linear PCM, exchanged in
+ * frames of fixed duration, at either the narrowband or the wideband sample rate.
+ */
+
+#define MEDIA_NARROWBAND_RATE 8000
+#define MEDIA_WIDEBAND_RATE 16000
+
+/*
+ * Duration of one frame of audio, and the number of samples in a frame at a given rate.
+ */
+#define MEDIA_FRAME_MSEC 20
+#define MEDIA_FRAME_SAMPLES(rate) ((rate) / 1000 * MEDIA_FRAME_MSEC)
+#define MEDIA_MAX_FRAME MEDIA_FRAME_SAMPLES(MEDIA_WIDEBAND_RATE)
+
+/*
+ * The conference mixer sums audio at the wideband rate.
+ */
+#define MEDIA_MIX_RATE MEDIA_WIDEBAND_RATE
+
+/*
+ * Maximum number of parties that can be mixed together.
+ */
+#define MEDIA_MAX_PARTIES 16
+
+/*
+ * State of the audio of one endpoint.
+ */
+typedef struct media_stream {
+    int rate;       // Native sample rate of the endpoint.
+    RESAMPLER tx;   // Converts audio sent by the endpoint to the rate of whoever consumes it.
+    RESAMPLER rx;   // Converts mixed audio to the rate of the endpoint.
+    PLC plc;        // Conceals frames lost on their way from the endpoint.
+    RECORDER *rec;  // Recording of the audio sent by the endpoint, if any.
+} MEDIA_STREAM;
+
+int media_stream_init(MEDIA_STREAM *ms, int rate);
+void media_receive(MEDIA_STREAM *ms, const int16_t *frame, int16_t *buf);
+size_t media_relay(MEDIA_STREAM *src, MEDIA_STREAM *dst, const int16_t *frame, int16_t *out);
+int media_mix(MEDIA_STREAM **ms, const int16_t **in, int16_t **out, int count);
+int media_record_start(MEDIA_STREAM *ms, const char *path, int codec);
+int media_record_stop(MEDIA_STREAM *ms);
+void media_record_discard(MEDIA_STREAM *ms);
+
+#endif /* MEDIA_H */
@@ -0,0 +1,63 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/*
+ * Server-wide counters.
+ *
+ * Counters are plain 64-bit words updated with relaxed atomic additions, so they can be
+ * bumped from any service thread without a lock.  A few are gauges instead, set outright
+ * to the latest value of what they measure.  The current values are written out,
+ * one "name value" line per counter, when the server receives SIGUSR1.
+ */
+typedef enum metric_id {
+    METRIC_COMMANDS_THROTTLED,     // Control commands dropped by the rate limiter.
+    METRIC_CHAT_BYTES_THROTTLED,   // Chat bytes held back by the rate limiter.
+    METRIC_THROTTLE_DELAY_USEC,    // Total time chat senders were held back.
+    METRIC_UDP_RETRANSMITS,        // Datagrams sent again to UDP phones.
+    METRIC_UDP_SESSIONS_EXPIRED,   // UDP sessions ended for want of an answer.
+    METRIC_UDP_SESSIONS_RECOVERED, // UDP sessions taken up from the registry mirror.
+    METRIC_SHARD_MESSAGES,         // Messages sent to other shards.
+    METRIC_SHARD_OVERFLOWS,        // Messages that had to wait for room in the inbox of a shard.
+    METRIC_SHARD_LEGS_DROPPED,     // Legs of calls hung up because their remote shard went away.
+    METRIC_FED_CALLS,              // Calls dialed to other PBXs.
+    METRIC_FED_LINKS_LOST,         // Connections to other PBXs that ended.
+    METRIC_GOSSIP_DATAGRAMS,       // Gossip datagrams sent to other nodes.
+    METRIC_GOSSIP_ENTRIES,         // Directory entries learned from other nodes.
+    METRIC_REGISTRATIONS_REJECTED, // New clients turned away as the server was overloaded.
+    METRIC_CHATS_DEFERRED,         // Chat commands held back as the server was overloaded.
+    METRIC_OVERLOAD_LEVEL,         // Gauge: level of overload (see admission.h).
+    METRIC_OVERLOAD_PRESSURE,      // Gauge: highest measure of load, as a percentage of its limit.
+    METRIC_CLIENTS,                // Gauge: clients being served.
+    METRIC_ACCEPT_QUEUE,           // Gauge: connections waiting to be accepted.
+    METRIC_COMMAND_LATENCY_USEC,   // Gauge: recent time taken by a control command.
+    METRIC_RSS_KB,                 // Gauge: memory in use by the server.
+    METRIC_LIMIT_CLIENTS,          // Limits of the measures of load, 0 for none.
+    METRIC_LIMIT_ACCEPT_QUEUE,
+    METRIC_LIMIT_LATENCY_USEC,
+    METRIC_LIMIT_RSS_KB,
+    METRIC_FRAMES_EXPEDITED,       // Control frames carried out ahead of chat read before them.
+    METRIC_FRAMES_HELD,            // Frames held over to the next tick, over the budget of their channel.
+    METRIC_TASKS_EXECUTED,         // Requests of trunks carried out by the workers (see executor.h).
+    METRIC_TASKS_STOLEN,           // Mailboxes taken by a worker from the deque of another.
+    NUM_METRICS
+} METRIC_ID;
+
+extern uint64_t pbx_metrics[NUM_METRICS];
+
+static inline void metrics_add(METRIC_ID id, uint64_t n) {
+    __atomic_fetch_add(&pbx_metrics[id], n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_set(METRIC_ID id, uint64_t n) {
+    __atomic_store_n(&pbx_metrics[id], n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_get(METRIC_ID id) {
+    return __atomic_load_n(&pbx_metrics[id], __ATOMIC_RELAXED);
+}
+
+void metrics_dump(int fd);
+
+#endif /* METRICS_H */
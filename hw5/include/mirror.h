@@ -0,0 +1,55 @@
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "tu_ext.h"
+
+/*
+ * Registry mirror: the sessions of UDP phones (see udp.h), kept in a file mapped into
+ * memory, so that a server restarted after a crash takes them up again instead of
+ * having every phone register anew.  (Phones on connections must connect again in any
+ * case, since their sockets go with the server.)
+ *
+ * The file holds a MIRROR_HEADER, giving the version of the layout, followed by one
+ * MIRROR_SLOT per session slot, indexed like the sessions themselves.  The thread
+ * serving the sessions is the only writer; each slot is updated under a seqlock: its
+ * seq field is odd while the slot is being written, so that a reader (such as the next
+ * server) can tell a consistent slot from one torn by a crash in the middle of an
+ * update.  A file with an unknown layout is cleared.
+ *
+ * Only one server may use a file at a time, except during a hot restart (see
+ * handoff.h), when the old server has stopped serving the sessions.
+ */
+
+#define MIRROR_MAGIC "PBXM"
+#define MIRROR_VERSION 1
+#define MIRROR_SLOTS 65536
+
+typedef struct mirror_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t slot_size;      // sizeof(MIRROR_SLOT).
+    uint32_t num_slots;
+} MIRROR_HEADER;
+
+typedef struct mirror_slot {
+    uint32_t seq;            // Seqlock: odd while the slot is being written.
+    uint32_t used;           // Set if the slot holds a session.
+    uint32_t token;
+    uint32_t received;       // Highest seq received in order from the phone.
+    uint32_t next_seq;       // Seq of the next datagram to the phone.
+    uint32_t acked;          // Highest seq acked by the phone.
+    TU_SNAPSHOT tu;          // State of the TU of the session.
+    uint32_t addrlen;
+    struct sockaddr_storage addr;
+} __attribute__((aligned(64))) MIRROR_SLOT;
+
+int mirror_open(const char *path);
+int mirror_enabled(void);
+void mirror_write(uint32_t slot, const MIRROR_SLOT *m);
+void mirror_clear(uint32_t slot);
+int mirror_read(uint32_t slot, MIRROR_SLOT *m);
+
+#endif /* MIRROR_H */
@@ -0,0 +1,26 @@
+#ifndef PBX_EXT_H
+#define PBX_EXT_H
+
+#include "pbx.h"
+
+/*
+ * Extensions.  A TU with a connection of its own is registered at the extension given
+ * by the file descriptor of the connection (offset by the shard of the server, if it
+ * is one; see shard.h), which must be below PBX_VIRTUAL_BASE.
+ * Virtual TUs, carried by trunks, are given the free extensions from there on up.
+ * The registry is indexed by extension, so that looking up a TU takes constant time.
+ */
+#define PBX_VIRTUAL_BASE 65536
+#define PBX_MAX_REGISTERED (2 * PBX_VIRTUAL_BASE)
+
+/*
+ * Additional PBX functions, beyond the basic interface given in pbx.h.
+ */
+
+void pbx_deliver_spool(int ext);
+int pbx_directed_pickup(PBX *pbx, TU *tu, int ext);
+int pbx_register_virtual(PBX *pbx, TU *tu);
+int pbx_restore(PBX *pbx, TU *tu);
+int pbx_dial_leg(PBX *pbx, TU *tu, int ext);
+
+#endif /* PBX_EXT_H */
@@ -1,14 +1,40 @@
+#include "media.h"
+#include "history.h"
+#include "trunk.h"
+#include "shm.h"
+#include "udp.h"
+#include "shard.h"
+#include "pbx_ext.h"
+
 // Telephone unit structure.
 struct tu {
-	int fd;             // File descriptor of network connection, doubles as extension of telephone unit.
+	int fd;             // File descriptor of network connection (that of the trunk, for a virtual TU).
+	int ext;            // Extension of telephone unit, the same as fd unless the TU is virtual.
+	TRUNK* trunk;       // Trunk carrying the telephone unit, or NULL if it has a connection of its own.
+	uint32_t channel;   // Channel of the telephone unit on its trunk.
+	SHM_LINK* shm;      // Shared-memory link that output goes to instead of the connection, if any.
+	UDP_SESSION* udp;   // UDP session that output goes to, for a phone registered over UDP.
+	SHARD_LEG* leg;     // Leg of a call with another shard, for a proxy TU standing for the remote party.
 	TU* target;         // Telephone unit that chat messages will be sent to (only NON-NULL when TU_CONNECTED).
+	int frame_open;     // Set while the pieces of a chat frame are being relayed.
+	TU* frame_peer;     // Peer that the chat frame in progress started with, or NULL if it is being dropped.
 	volatile int state; // Current state of telephone unit: TU_ON_HOOK, TU_RINGING, TU_DIAL_TONE, TU_RING_BACK, TU_BUSY_SIGNAL, TU_CONNECTED, TU_ERROR.
 	int ref_count;      // Reference count on telephone unit.
 	sem_t mutex;        // Mutex for the telephone unit such that it can only be accessed by one thread at a time.
+	MEDIA_STREAM media; // Audio state of the telephone unit.
+	size_t tone_cursor; // Position within the cadence of the shared buffer for the current tone.
+	CHAT_HISTORY* history; // Chat history of the current call, shared with the peer (only while TU_CONNECTED).
+	int group;          // Pickup group of the telephone unit, or 0 if none.
+	int ring_group;     // Pickup group on whose ringing list the telephone unit is, or 0 if none.
+	TU* ring_prev;      // Previous telephone unit on the ringing list.
+	TU* ring_next;      // Next telephone unit on the ringing list.
+	int park_slot;      // Park slot on which the telephone unit is parked (only when TU_PARKED).
+	int proto;          // Protocol spoken on the connection, PROTO_TEXT or PROTO_BINARY.
 };
 
 // Private branch exchange structure.
 struct pbx {
-	TU* PBX_REGISTRY[PBX_MAX_EXTENSIONS];	// Array containing all telephone units.
+	TU* PBX_REGISTRY[PBX_MAX_REGISTERED];	// Array containing all telephone units, indexed by extension.
+	int next_virtual;                       // Extension from which to look for a free virtual extension.
 	sem_t mutex;                            // Mutex for private branch exchange such that the array of telephone units can only be accessed by one thread at a time.
 };
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef PICKUP_H
+#define PICKUP_H
+
+#include "tu.h"
+
+/*
+ * Call pickup and call park.
+ *
+ * Every TU may belong to a pickup group.  For each group, the TUs of the group that
+ * are ringing are kept on a list, so that a member of the group can answer a call
+ * ringing elsewhere in the group without searching the PBX registry.  Separately,
+ * a call can be parked on a numbered park slot, from which any TU can retrieve it.
+ *
+ * The lists and the park slots are protected by a single lock, which is always taken
+ * last: a thread holding it never locks a TU.  A TU on a list or in a slot is not
+ * released before it leaves it, so a reference to it can be taken under the lock.
+ */
+
+/*
+ * Number of pickup groups, numbered from 1; group 0 means no group.
+ */
+#define PICKUP_GROUPS 64
+
+/*
+ * Number of park slots, numbered from 0.
+ */
+#define PARK_SLOTS 16
+
+void pickup_lock(void);
+void pickup_unlock(void);
+void pickup_ringing_add(TU *tu);
+void pickup_ringing_remove(TU *tu);
+TU *pickup_ringing_first(int group);
+int park_put(int slot, TU *tu);
+TU *park_peek(int slot);
+void park_clear(int slot, TU *tu);
+
+#endif /* PICKUP_H */
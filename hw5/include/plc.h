@@ -0,0 +1,44 @@
+#ifndef PLC_H
+#define PLC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Packet loss concealment, along the lines of ITU-T G.711 Appendix I.
+ *
+ * When a frame of audio is lost, a replacement is synthesized by repeating the most
+ * recent pitch period of the received audio, widening the repeated span to two and then
+ * three pitch periods as the loss continues, and fading it out over 60 ms.  When audio
+ * resumes, the synthesized signal is overlap-added into the first received samples to
+ * avoid a click.  All of the state for a stream is kept in a PLC; nothing is allocated.
+ */
+
+/*
+ * Amount of received audio kept for pitch detection and repetition.
+ * It must cover three maximum pitch periods, as well as the pitch search window
+ * plus one maximum pitch period.
+ */
+#define PLC_HIST_MSEC 45
+#define PLC_MAX_RATE 16000
+#define PLC_HIST_MAX (PLC_MAX_RATE / 1000 * PLC_HIST_MSEC)
+
+/*
+ * State of concealment for a single stream.
+ */
+typedef struct plc {
+    int rate;                   // Sample rate of the stream.
+    int hlen;                   // Number of samples of history at this rate.
+    int erased;                 // Number of samples synthesized in the current loss, 0 if none.
+    int pitch;                  // Pitch period found when the current loss began.
+    int span;                   // Number of pitch periods being repeated.
+    int offset;                 // Position within the repeated span.
+    int xfade;                  // Samples remaining in the crossfade after widening the span.
+    int16_t hist[PLC_HIST_MAX]; // Most recently received samples, oldest first.
+} PLC;
+
+int plc_init(PLC *plc, int rate);
+void plc_good_frame(PLC *plc, int16_t *frame, size_t n);
+void plc_lost_frame(PLC *plc, int16_t *out, size_t n);
+
+#endif /* PLC_H */
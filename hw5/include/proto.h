@@ -0,0 +1,146 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+ * Binary protocol (version 2).
+ *
+ * Every connection starts out with the text protocol (version 1).  A client switches
+ * its connection to the binary protocol by sending the text command "proto 2"; the
+ * server answers with the first binary frame, a response with request ID 0 giving the
+ * state of the TU.  From then on, all traffic in both directions consists of frames,
+ * each a fixed header followed by a payload of the length given in the header.
+ *
+ * The client tags each request with an ID of its choosing.  Every notification the
+ * server sends as a result of a request is a response frame carrying the ID of that
+ * request, so a client can send many requests without waiting for the answers and
+ * still tell which answer belongs to which request.  Everything else the server sends
+ * (notifications caused by the peer or by another TU, chat, delivered messages) is an
+ * event frame, with ID 0.
+ *
+ * A request gives the command in the op field, its numeric argument (the extension for
+ * PROTO_OP_DIAL, the slot for PROTO_OP_PARK, ...) in the arg field, and its text (the
+ * message for PROTO_OP_CHAT and PROTO_OP_MSG) as the payload.  The payload of a frame
+ * from the server is the corresponding line of the text protocol, without the EOL,
+ * except that the payload of PROTO_OP_CHAT and PROTO_OP_CHATF frames is just the
+ * bytes of the chat; the pieces of a chat frame other than the last are flagged with
+ * PROTO_FLAG_MORE, with the number of bytes of the chat still to come in the arg field.
+ * A chat request larger than the longest text line is relayed in pieces as it arrives,
+ * just like a PROTO_OP_CHATF request, which always is.  A PROTO_OP_CHATF request may
+ * itself be one piece of a chat frame, flagged in the same way, whose later pieces come
+ * in the requests that follow it.
+ *
+ * Audio, which has no text command, is carried in PROTO_OP_AUDIO frames in both
+ * directions, each holding one frame of 16-bit samples in network byte order (see
+ * media.h), at the rate of the receiving end; an empty request stands for a frame
+ * lost on its way to the client, which the server conceals.  Audio requests get no
+ * response and are not subject to the rate limit on commands.
+ *
+ * A request that the server rejects without carrying it out (bad header, unknown
+ * command, over the rate limit) is answered by a response with PROTO_FLAG_ERROR set
+ * and no payload.  A frame whose magic number is wrong ends the connection, since the
+ * frames that follow cannot be found.  PROTO_OP_OPEN and PROTO_OP_CLOSE are only
+ * accepted on trunks (see trunk.h), and rejected otherwise.
+ *
+ * Requests are not always carried out in the order sent: call control goes ahead of
+ * chat and messages sent before it (see lanes.h).
+ *
+ * All fields of the header are in network byte order.
+ */
+
+#define PROTO_TEXT 1
+#define PROTO_BINARY 2
+#define PROTO_TRUNK 3           // Binary frames on many channels (see trunk.h).
+
+#define PROTO_MAGIC 0xB2
+
+typedef struct proto_header {
+    uint8_t magic;      // PROTO_MAGIC.
+    uint8_t type;       // PROTO_REQUEST, PROTO_RESPONSE, or PROTO_EVENT.
+    uint8_t op;         // Command or kind of notification.
+    uint8_t flags;      // PROTO_FLAG_*.
+    uint32_t id;        // Request ID, or 0 in events.
+    int32_t arg;        // Numeric argument of a request.
+    uint32_t len;       // Length of the payload.
+} PROTO_HEADER;
+
+/*
+ * Frame types.
+ */
+#define PROTO_REQUEST 1
+#define PROTO_RESPONSE 2
+#define PROTO_EVENT 3
+
+/*
+ * Frame flags.
+ */
+#define PROTO_FLAG_MORE 0x01
+#define PROTO_FLAG_ERROR 0x02
+
+/*
+ * Commands, in requests, and kinds of notification, in frames from the server.
+ */
+#define PROTO_OP_STATE 0        // Notification of the state of the TU (server only).
+#define PROTO_OP_PICKUP 1
+#define PROTO_OP_HANGUP 2
+#define PROTO_OP_DIAL 3
+#define PROTO_OP_CHAT 4
+#define PROTO_OP_CHATF 5
+#define PROTO_OP_REPLAY 6
+#define PROTO_OP_MSG 7
+#define PROTO_OP_HOLD 8
+#define PROTO_OP_RESUME 9
+#define PROTO_OP_GROUP 10
+#define PROTO_OP_GPICKUP 11
+#define PROTO_OP_DPICKUP 12
+#define PROTO_OP_PARK 13
+#define PROTO_OP_UNPARK 14
+#define PROTO_OP_OPEN 15        // Open a channel of a trunk.
+#define PROTO_OP_CLOSE 16       // Close a channel of a trunk.
+#define PROTO_OP_AUDIO 17       // One frame of audio.
+#define PROTO_NUM_OPS 18
+
+/*
+ * Fill in a frame header, converting the fields to network byte order.
+ */
+static inline void proto_header_pack(PROTO_HEADER *h, int type, int op, int flags,
+                                     uint32_t id, int32_t arg, uint32_t len) {
+    h->magic = PROTO_MAGIC;
+    h->type = type;
+    h->op = op;
+    h->flags = flags;
+    h->id = htonl(id);
+    h->arg = htonl(arg);
+    h->len = htonl(len);
+}
+
+/*
+ * The arg field of a piece of a chat frame flagged PROTO_FLAG_MORE: the number of bytes
+ * still to come, held to what the field can give.
+ */
+static inline int32_t proto_more_arg(size_t more) {
+    return more > INT32_MAX ? INT32_MAX : (int32_t)more;
+}
+
+/*
+ * Decode a frame header from a buffer, which need not be aligned, converting the fields
+ * to host byte order.  The checks are combined so that a valid header costs one branch.
+ *
+ * @return 0 if the header is a well-formed request header, -1 otherwise (the header
+ * is still decoded, so that the payload can be skipped).
+ */
+static inline int proto_header_unpack(const void *buf, PROTO_HEADER *h) {
+    memcpy(h, buf, sizeof(*h));
+    h->id = ntohl(h->id);
+    h->arg = ntohl(h->arg);
+    h->len = ntohl(h->len);
+    int bad = (h->magic ^ PROTO_MAGIC) | (h->type ^ PROTO_REQUEST) |
+              ((uint8_t)(h->op - 1) >= PROTO_NUM_OPS - 1);
+    return bad ? -1 : 0;
+}
+
+#endif /* PROTO_H */
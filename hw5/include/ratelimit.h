@@ -0,0 +1,66 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-connection rate limiting of client commands.
+ *
+ * Each connection has two token buckets: one counting control commands (pickup, hangup,
+ * dial), which are dropped when their bucket is empty, and one counting bytes of chat,
+ * which are delayed until their bucket has refilled.  The rates are chosen by the class
+ * of the extension, which is a range of extension numbers configured with the -r option.
+ *
+ * Hangup and pickup are never dropped, since a client that lost one would be left in a
+ * call, or with a call ringing, that it meant to end or answer.  They are charged all
+ * the same, so that a client cannot send more commands by sending them.
+ */
+
+/*
+ * A token bucket that refills at a fixed rate up to a maximum burst.
+ * A rate of zero means that the bucket never runs out.
+ */
+typedef struct token_bucket {
+    double rate;      // Tokens added per second.
+    double burst;     // Maximum number of tokens held.
+    double tokens;    // Tokens currently held, negative if in debt.
+    uint64_t last;    // Time (nsec) of the last refill.
+} TOKEN_BUCKET;
+
+/*
+ * Limits of one class of extensions.
+ */
+typedef struct rate_class {
+    int first, last;      // Range of extensions in the class.
+    double command_rate;  // Control commands per second, 0 for no limit.
+    double chat_rate;     // Chat bytes per second, 0 for no limit.
+} RATE_CLASS;
+
+#define RATE_MAX_CLASSES 16
+
+/*
+ * Limits applied to extensions not in any configured class.
+ */
+#define RATE_DEFAULT_COMMANDS 100
+#define RATE_DEFAULT_CHAT 0
+
+/*
+ * The rate limiting state of one connection.
+ */
+typedef struct rate_limits {
+    TOKEN_BUCKET commands;
+    TOKEN_BUCKET chat;
+} RATE_LIMITS;
+
+uint64_t rate_clock(void);
+void bucket_init(TOKEN_BUCKET *b, double rate, double burst, uint64_t now);
+int bucket_take(TOKEN_BUCKET *b, double n, uint64_t now);
+uint64_t bucket_charge(TOKEN_BUCKET *b, double n, uint64_t now);
+
+int rate_class_add(const char *spec);
+void rate_limits_init(RATE_LIMITS *rl, int ext);
+int rate_limit_command(RATE_LIMITS *rl, int essential);
+void rate_limit_chat(RATE_LIMITS *rl, size_t len);
+
+#endif /* RATELIMIT_H */
@@ -0,0 +1,81 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "adpcm.h"
+
+/*
+ * Recording of audio (call recordings and voicemail) to spool files.
+ *
+ * A spool file starts with a RECORDING_HEADER that identifies the codec used for the
+ * audio that follows, so that a player can decode it on the fly.  Audio compressed
+ * with IMA-ADPCM is stored in independent blocks, each starting with a
+ * RECORDING_BLOCK_HEADER that carries the codec state at the start of the block.
+ */
+
+#define RECORDING_MAGIC "PBXR"
+#define RECORDING_VERSION 1
+
+typedef enum recording_codec {
+    RECORDING_PCM16, RECORDING_IMA_ADPCM
+} RECORDING_CODEC;
+
+/*
+ * Number of samples in a block: one stored as-is, plus 504 packed two to a byte,
+ * for 258 bytes per block including its header.
+ */
+#define RECORDING_BLOCK_SAMPLES 505
+
+typedef struct recording_header {
+    char magic[4];            // RECORDING_MAGIC.
+    uint16_t version;         // RECORDING_VERSION.
+    uint16_t codec;           // RECORDING_CODEC of the audio that follows.
+    uint32_t rate;            // Sample rate of the audio.
+    uint32_t block_samples;   // Samples per block.
+} RECORDING_HEADER;
+
+typedef struct recording_block_header {
+    uint16_t samples;         // Number of samples in the block.
+    int16_t predictor;        // First sample of the block, and the initial predictor.
+    uint8_t index;            // Initial step index.
+    uint8_t reserved;
+} __attribute__((packed)) RECORDING_BLOCK_HEADER;
+
+#define RECORDING_BLOCK_BYTES (sizeof(RECORDING_BLOCK_HEADER) + RECORDING_BLOCK_SAMPLES / 2)
+
+/*
+ * State of a recording in progress.
+ */
+typedef struct recorder {
+    FILE *file;                                // Spool file being written.
+    char *path;                                // Path of the spool file.
+    int codec;                                 // Codec applied before the audio is written.
+    ADPCM_STATE st;                            // State of the encoder.
+    size_t pending;                            // Number of samples waiting for a full block.
+    int16_t block[RECORDING_BLOCK_SAMPLES];    // Samples waiting for a full block.
+} RECORDER;
+
+/*
+ * State of playback of a recording.
+ */
+typedef struct player {
+    FILE *file;                                // Spool file being read.
+    RECORDING_HEADER header;                   // Header of the spool file.
+    size_t next;                               // Next decoded sample to be returned.
+    size_t avail;                              // Number of decoded samples.
+    int16_t block[RECORDING_BLOCK_SAMPLES];    // Decoded samples of the current block.
+} PLAYER;
+
+int recorder_open(RECORDER *rec, const char *path, int codec, int rate);
+int recorder_write(RECORDER *rec, const int16_t *pcm, size_t n);
+int recorder_close(RECORDER *rec);
+void recorder_discard(RECORDER *rec);
+
+int player_open(PLAYER *pl, const char *path);
+long player_read(PLAYER *pl, int16_t *pcm, size_t n);
+void player_close(PLAYER *pl);
+
+#endif /* RECORDER_H */
@@ -0,0 +1,42 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sample rate conversion between narrowband (8 kHz) and wideband (16 kHz) audio.
+ *
+ * Conversion is done with a 2:1 polyphase FIR filter whose coefficients are fixed
+ * at compile time.  All of the state needed to convert one stream is held in a
+ * RESAMPLER, so that a stream can be converted incrementally, one frame at a time,
+ * without any allocation.
+ */
+
+/*
+ * Number of taps in the prototype low-pass filter (at 16 kHz).
+ * Each of the two interpolation phases uses half of them.
+ */
+#define RESAMPLE_TAPS 64
+
+/*
+ * Number of input samples converted per pass over the internal work buffer.
+ */
+#define RESAMPLE_CHUNK 256
+
+/*
+ * State of the conversion of a single stream.
+ */
+typedef struct resampler {
+    int in_rate;                   // Sample rate of the input stream (Hz).
+    int out_rate;                  // Sample rate of the output stream (Hz).
+    int phase;                     // Parity of the number of input samples consumed so far.
+    int16_t hist[RESAMPLE_TAPS];   // Most recent input samples, oldest first.
+} RESAMPLER;
+
+int resampler_init(RESAMPLER *rs, int in_rate, int out_rate);
+void resampler_reset(RESAMPLER *rs);
+size_t resampler_out_max(RESAMPLER *rs, size_t n);
+size_t resampler_process(RESAMPLER *rs, const int16_t *in, size_t n, int16_t *out);
+
+#endif /* RESAMPLE_H */
@@ -0,0 +1,27 @@
+#ifndef SERVER_EXT_H
+#define SERVER_EXT_H
+
+#include <stddef.h>
+
+#include "tu.h"
+#include "ratelimit.h"
+
+/*
+ * Server configuration, beyond the basic interface given in server.h.
+ */
+
+/*
+ * Maximum length of a text command line, not counting the EOL.  Longer lines are
+ * discarded, so that the memory used to receive from a connection stays bounded.
+ * Chat bodies larger than this can still be sent as length-prefixed frames
+ * ("chatf <length>" followed by the raw bytes), which are streamed through to
+ * the peer in pieces no larger than the receive buffer.
+ */
+#define PBX_DEFAULT_MAX_LINE (1 << 20)
+#define PBX_MIN_MAX_LINE 64
+extern size_t pbx_max_line;
+
+int pbx_serve_line(TU *tu, RATE_LIMITS *rl, char *line, size_t len);
+void *pbx_resume_client(void *arg);
+
+#endif /* SERVER_EXT_H */
@@ -0,0 +1,101 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tu.h"
+
+/*
+ * Shards: several server processes on one host, each owning a partition of the
+ * extensions, so that calls are set up by as many processes, each with a registry
+ * of its own, and a crash takes down only the calls of one of them.
+ *
+ * Every shard is started with "-S <index>/<count>:<directory-file>", all with the same
+ * count and file, and they all listen on the same port with SO_REUSEPORT, so that the
+ * kernel spreads new connections over them.  With span = PBX_VIRTUAL_BASE / count,
+ * shard i registers the connection on file descriptor fd at extension i * span + fd,
+ * and gives out the virtual extensions from PBX_VIRTUAL_BASE + i * span on up, so that
+ * the shard owning an extension can be told from the extension itself.
+ *
+ * The directory file, mapped into memory by every shard, holds the pid and the
+ * generation of the process running each shard (bumped each time one starts), and one
+ * byte per extension, set while a TU is registered there, so that a dial to an empty
+ * extension of another shard fails at once, as it would locally.  It also holds a
+ * bounded ring of fixed-size cells for each ordered pair of shards (a shard sending to
+ * itself included), into which the threads of the sending shard put messages without
+ * a lock, and from which the thread of the receiving shard takes them, from each ring
+ * in turn.  A message that finds the ring full waits on a list in its own process, so
+ * that no thread ever waits for another shard while it holds a TU.
+ *
+ * A call between TUs of different shards has a leg in each: a proxy TU, registered
+ * nowhere, standing for the remote party.  The local party is in a call with the proxy
+ * as it would be with any other TU; the changes of state that it causes the proxy, and
+ * the chats that it sends, go to the other shard, whose thread carries them out on the
+ * proxy there, standing for the local party.  The calls of the proxies are ordinary
+ * calls in every other respect, except that a remote party cannot be picked up or
+ * parked from elsewhere, audio does not cross shards, and a caller hears ring back
+ * from a busy party of another shard until the answer comes from there.
+ *
+ * The same proxies stand for parties at other PBXs (see federation.h).
+ *
+ * When the process running a shard goes away, the others hang up their legs to it, and
+ * dials to its extensions fail until another process runs the shard.  Hot restart, the
+ * registry mirror and the UDP transport are not available to shards.
+ *
+ * With "-C <cores>" instead, the server starts that many shards itself, one per core:
+ * each is a process pinned to a core of its own, with all of its threads, and owns the
+ * extensions of the connections that it takes in.  Calls between TUs of one shard are
+ * set up as they are without shards, under the locks of the TUs, which only threads
+ * on that core take; calls between cores go through the rings, each of which is
+ * filled from one core, by any of its threads, and emptied on another.  So no lock is
+ * taken on more than one core, but a call within a core costs what it does without
+ * shards and a call across cores costs more: only with cores enough to run the shards
+ * side by side are calls set up any faster.  The directory is kept in memory rather
+ * than in a file, and where shard i runs on CPU i, the kernel hands each new
+ * connection to the shard on the core that took it in.  The process that started the
+ * shards passes SIGHUP and SIGUSR1 on to them, and starts again any shard that crashes.
+ */
+
+#define SHARD_MAX 16
+
+/*
+ * Interval at which each shard checks that the others are still running.
+ */
+#define SHARD_CHECK_MS 100
+
+/*
+ * The leg of a call in a shard, on which a proxy TU stands for the party in another.
+ * A call is known in both shards by the shard where it was dialed, the generation of
+ * the process running it, and the ID given to the call there.
+ */
+typedef struct shard_leg {
+    TU *tu;                   // The proxy.
+    uint32_t shard;           // Shard of the remote party.
+    uint32_t generation;      // Generation of the process running that shard.
+    uint32_t origin;          // Shard where the call was dialed.
+    uint32_t origin_generation; // Generation of the process running that shard.
+    uint32_t id;              // ID of the call in that shard.
+    int local_ext;            // Extension of the local party.
+    int remote_ext;           // Extension of the remote party.
+    int state;                // State of the proxy, as last notified.
+    struct fed_call *fed;     // The call, if the remote party is at another PBX instead
+                              // (see federation.h).
+    struct shard_leg *next;   // Next leg in the same bucket of the table of legs.
+} SHARD_LEG;
+
+int shard_init(const char *spec);
+int shard_fork(int count, int *listenfds);
+int shard_steer(int listenfd, int count);
+int shard_enabled(void);
+void shard_start(void);
+int shard_extension(int fd);
+void shard_virtual_range(int *first, int *last);
+int shard_remote(int ext);
+void shard_publish(int ext, int registered);
+int shard_dial(TU *tu, int ext);
+int shard_spool(int from, int ext, const char *msg, size_t len);
+void shard_leg_state(SHARD_LEG *leg, int state);
+void shard_leg_chat(SHARD_LEG *leg, int op, const char *data, size_t len, size_t more);
+
+#endif /* SHARD_H */
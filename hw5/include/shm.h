@@ -0,0 +1,78 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Shared-memory transport, for clients (such as gateways) on the same host.
+ *
+ * A client connected over the Unix-domain socket of the server (option -u) sends the
+ * text command "shm".  The server answers with the line "SHM <ring-size>" on the socket,
+ * carrying with it (as SCM_RIGHTS) a memory file holding two rings, one for each
+ * direction.  From then on, the bytes of the protocol (text or binary, as before) go
+ * through the rings instead of the socket, which is kept open only so that each side
+ * can tell when the other has gone.
+ *
+ * Each ring has a single producer and a single consumer, which exchange the ring by
+ * their free-running positions alone.  A side that finds its ring empty (or full) sleeps
+ * on a futex in the shared memory, after saying so in a flag; the other side makes the
+ * wakeup system call only when it sees that flag, that is, only when the ring goes from
+ * empty to non-empty (or from full to non-full) under a sleeping peer.
+ *
+ * Either side may write anywhere in the shared memory, so each keeps its own position
+ * in its own memory, and takes that of the other side only once it is found to be
+ * within SHM_RING_SIZE of its own.  A position out of that range is a violation of the
+ * protocol, and closes the link.
+ */
+
+/*
+ * Size of the data of each ring, a power of two.
+ */
+#define SHM_RING_SIZE (1 << 16)
+
+/*
+ * How long a side sleeps on its ring before it checks whether the other side is still
+ * there, in milliseconds.
+ */
+#define SHM_POLL_MS 1000
+
+/*
+ * One direction of a link, in the shared memory.  The positions of the two sides are
+ * kept on cache lines of their own.
+ */
+typedef struct shm_ring {
+    _Alignas(64) uint32_t head;   // Consumer position.
+    uint32_t consumer_waiting;    // Set while the consumer sleeps on tail.
+    _Alignas(64) uint32_t tail;   // Producer position.
+    uint32_t producer_waiting;    // Set while the producer sleeps on head.
+    _Alignas(64) uint32_t closed; // Set once either side has closed the link.
+    uint32_t size;                // Size of the data.
+    _Alignas(64) char data[];
+} SHM_RING;
+
+/*
+ * One side of a link, in the memory of its process.
+ */
+typedef struct shm_link {
+    void *map;             // Mapping of the shared memory.
+    size_t map_size;       // Size of the mapping.
+    SHM_RING *in;          // Ring that this side consumes.
+    SHM_RING *out;         // Ring that this side produces.
+    uint32_t in_head;      // Position of this side in its incoming ring.
+    uint32_t out_tail;     // Position of this side in its outgoing ring, under write_mutex.
+    sem_t write_mutex;     // Held while a message is written, since several threads may write.
+    int sockfd;            // Socket to the other side, for telling whether it is still there.
+} SHM_LINK;
+
+SHM_LINK *shm_link_create(int sockfd, int *memfd);
+SHM_LINK *shm_link_attach(int sockfd, int memfd);
+void shm_link_free(SHM_LINK *link);
+void shm_link_close(SHM_LINK *link);
+ssize_t shm_link_read(SHM_LINK *link, void *buf, size_t len);
+int shm_link_writev(SHM_LINK *link, const struct iovec *iov, int iovcnt);
+
+#endif /* SHM_H */
@@ -0,0 +1,81 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Store-and-forward message spool.
+ *
+ * Messages sent with "msg <ext> <text>" are appended to a spool file for the receiving
+ * extension, which is mapped into memory.  Each file starts with a header giving the
+ * range of undelivered records, followed by the records themselves:
+ *
+ *   uint32_t len, int32_t from, then len bytes of text, padded to a multiple of 4.
+ *
+ * Delivery is carried out by a dedicated thread.  When an extension registers or goes
+ * on hook, it is queued for that thread, which hands the pending messages out in
+ * batches; so the thread that triggered delivery never waits for it, no matter how
+ * many messages are waiting.  Space freed by delivered messages is reclaimed by moving
+ * the undelivered ones to the front of the file, once it makes up half the file.
+ *
+ * Voicemail, the audio a caller sends while its call is ringing, is recorded next to
+ * the spool files, in a file "<ext>-<caller>-<n>.pbxr" (see recorder.h) that is kept
+ * if the call goes unanswered.  A temporary spool keeps no voicemail.
+ */
+
+#define SPOOL_MAGIC "PBXS"
+#define SPOOL_VERSION 1
+
+typedef struct spool_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t head;      // Offset of the first undelivered record.
+    uint64_t tail;      // Offset following the last record.
+    uint64_t reserved;
+} SPOOL_HEADER;
+
+typedef struct spool_record {
+    uint32_t len;       // Length of the text.
+    int32_t from;       // Extension of the sender.
+} SPOOL_RECORD;
+
+#define SPOOL_ALIGN(n) (((n) + 3) & ~(size_t)3)
+#define SPOOL_RECORD_SIZE(len) (sizeof(SPOOL_RECORD) + SPOOL_ALIGN(len))
+
+/*
+ * Initial and maximum sizes of a spool file.
+ */
+#define SPOOL_INITIAL_SIZE (64 * 1024)
+#define SPOOL_MAX_SIZE (64 * 1024 * 1024)
+
+/*
+ * Maximum number of messages handed out in one batch.
+ */
+#define SPOOL_BATCH 64
+
+/*
+ * Function called on the delivery thread when an extension may have messages waiting.
+ */
+typedef void SPOOL_READY_FUNC(int ext);
+
+/*
+ * Function that sends a batch of messages, already formatted for the receiving client.
+ * Each message takes SPOOL_MSG_PARTS consecutive parts: "msg <from> ", the text, and
+ * the EOL.  It returns the number of messages sent, in order, which is fewer than in
+ * the batch only if the rest could not be sent.
+ */
+#define SPOOL_MSG_PARTS 3
+
+typedef int SPOOL_SEND_FUNC(void *arg, struct iovec *iov, int iovcnt);
+
+int spool_init(const char *dir, SPOOL_READY_FUNC *ready);
+void spool_fini(void);
+int spool_append(int ext, int from, const char *msg, size_t len);
+int spool_voicemail_path(int ext, int from, char *path);
+int spool_pending(int ext);
+void spool_kick(int ext);
+int spool_deliver(int ext, SPOOL_SEND_FUNC *send, void *arg);
+
+#endif /* SPOOL_H */
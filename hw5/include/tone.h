@@ -0,0 +1,24 @@
+#ifndef TONE_H
+#define TONE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Call-progress tones.
+ *
+ * Each tone cadence is rendered once, at startup, into a read-only PCM buffer at each
+ * supported sample rate.  These buffers are shared by every TU: a TU that is hearing a
+ * tone keeps only an offset cursor into the buffer for the tone, so any number of TUs
+ * can hear the same tone without any per-TU synthesis or buffering.
+ */
+typedef enum tone_id {
+    TONE_DIAL, TONE_RINGBACK, TONE_BUSY, TONE_ERROR, NUM_TONES
+} TONE_ID;
+
+int tones_init(void);
+void tones_fini(void);
+int tone_for_state(int state);
+const int16_t *tone_frame(int tone, int rate, size_t *cursor, size_t *len);
+
+#endif /* TONE_H */
@@ -0,0 +1,67 @@
+#ifndef TRUNK_H
+#define TRUNK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <sys/uio.h>
+
+#include "tu.h"
+#include "ratelimit.h"
+#include "executor.h"
+
+/*
+ * Trunk connections.
+ *
+ * A client such as a gateway switches its connection to a trunk by sending the text
+ * command "proto 3".  A trunk carries many virtual TUs, each on a channel of its own.
+ * Every frame on a trunk, in either direction, is a frame of the binary protocol
+ * (see proto.h) preceded by the channel ID, a 4-byte number in network byte order.
+ *
+ * Channel 0 is the TU of the connection itself.  The client opens another channel
+ * with a PROTO_OP_OPEN request on that channel, which plugs a new virtual TU into
+ * the PBX at an extension of its own, answered by the usual "ON HOOK <ext>"; and it
+ * closes the channel with PROTO_OP_CLOSE, which unplugs the TU.  All the channels of
+ * a trunk are served by the one thread serving the connection, or their requests are
+ * carried out by the workers of the executor, each channel's in order (see executor.h),
+ * and the TUs of a trunk write their frames to the connection under a lock shared by
+ * the trunk.
+ *
+ * Each channel has rate limits of its own, by the class of its extension.
+ */
+
+/*
+ * Largest channel ID, plus one.
+ */
+#define TRUNK_MAX_CHANNELS 65536
+
+/*
+ * State of one channel of a trunk.
+ */
+typedef struct trunk_channel {
+    TU *tu;              // The TU on the channel, or NULL if the channel is not open.
+    RATE_LIMITS rl;      // Rate limits of the channel.
+    uint64_t budget_tick; // Tick in which the channel used budget_bytes (see lanes.h).
+    size_t budget_bytes;
+    EXEC_ACTOR actor;    // Mailbox of the requests on the channel, for the executor.
+} TRUNK_CHANNEL;
+
+typedef struct trunk {
+    int fd;                   // File descriptor of the connection.
+    sem_t write_mutex;        // Held while a frame is written to the connection.
+    int ref_count;            // The serving thread holds one reference, and each TU one.
+    int closed;               // Set once the connection has ended; nothing more is written.
+    TRUNK_CHANNEL *channels;  // Channels, indexed by ID (serving thread only).
+    size_t num_channels;      // Number of entries in the table of channels.
+    EXEC_GROUP tasks;         // Requests of all the channels given to the executor.
+} TRUNK;
+
+TRUNK *trunk_create(int fd);
+void trunk_ref(TRUNK *trunk);
+void trunk_unref(TRUNK *trunk);
+void trunk_close(TRUNK *trunk);
+TRUNK_CHANNEL *trunk_channel(TRUNK *trunk, uint32_t channel);
+int trunk_send(TRUNK *trunk, uint32_t channel, struct iovec *iov, int iovcnt);
+int trunk_send_frames(TRUNK *trunk, const void *frames, size_t len);
+
+#endif /* TRUNK_H */
@@ -0,0 +1,75 @@
+#ifndef TU_EXT_H
+#define TU_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+#include "tu.h"
+#include "trunk.h"
+#include "shm.h"
+#include "udp.h"
+#include "shard.h"
+#include "history.h"
+
+/*
+ * Additional TU states, beyond those given in tu.h, for a call that is on hold.
+ * The TU that put the call on hold is TU_ON_HOLD, and its peer is TU_HELD.
+ * Their notifications are "ON HOLD <peer>" and "HELD <peer>".
+ */
+#define TU_ON_HOLD (TU_ERROR + 1)
+#define TU_HELD (TU_ERROR + 2)
+
+/*
+ * Additional TU state of a party whose call has been parked, waiting to be retrieved.
+ * Its notification is "PARKED <slot>".
+ */
+#define TU_PARKED (TU_ERROR + 3)
+
+/*
+ * The state of a TU, as handed over to a new server on a hot restart (see handoff.h).
+ */
+typedef struct tu_snapshot {
+    int32_t ext;
+    int32_t state;
+    int32_t peer;       // Extension of the peer, or -1 if none.
+    int32_t group;
+    int32_t park_slot;
+    int32_t proto;
+} TU_SNAPSHOT;
+
+/*
+ * Additional TU functions, beyond the basic interface given in tu.h.
+ */
+
+int tu_chatv(TU *tu, const char *msg, size_t len);
+int tu_chat_frame(TU *tu, const char *data, size_t len, size_t more);
+int tu_replay(TU *tu, uint32_t after);
+int tu_msg(TU *tu, int ext, const char *msg, size_t len);
+int tu_deliver_spool(TU *tu);
+int tu_hold(TU *tu);
+int tu_resume(TU *tu);
+int tu_audio(TU *tu, const char *data, size_t len);
+int tu_set_group(TU *tu, int group);
+int tu_group_pickup(TU *tu);
+int tu_directed_pickup(TU *tu, TU *ringing);
+int tu_park(TU *tu, int slot);
+int tu_unpark(TU *tu, int slot);
+const int16_t *tu_tone_frame(TU *tu, size_t *len);
+void tu_set_request(TU *tu, uint32_t id);
+int tu_set_protocol(TU *tu, int version);
+void tu_reject(TU *tu, int op);
+void tu_join_trunk(TU *tu, TRUNK *trunk, uint32_t channel);
+void tu_notify_state(TU *tu);
+int tu_attach_shm(TU *tu, SHM_LINK *link, int memfd);
+void tu_attach_udp(TU *tu, UDP_SESSION *s);
+int tu_writev_all(int fd, struct iovec *iov, int iovcnt);
+int tu_snapshot(TU *tu, TU_SNAPSHOT *snap, CHAT_HISTORY *history);
+int tu_restore(TU *tu, const TU_SNAPSHOT *snap);
+void tu_restore_call(TU *tu, TU *peer, const CHAT_HISTORY *history);
+void tu_restore_lost_peer(TU *tu);
+void tu_attach_leg(TU *tu, SHARD_LEG *leg);
+int tu_refuse(TU *tu, int state);
+
+#endif /* TU_EXT_H */
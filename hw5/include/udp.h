@@ -0,0 +1,121 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "tu.h"
+#include "ratelimit.h"
+
+/*
+ * UDP signaling transport, for phones that cannot afford a TCP connection each.
+ *
+ * Every datagram, in either direction, starts with a UDP_HEADER (all fields in network
+ * byte order), followed by a payload of bytes of the text protocol.  The payload of
+ * each side forms a byte stream, cut into datagrams numbered from 1 by the seq field;
+ * a phone must put only whole command lines in each of its datagrams, whereas a line
+ * from the server may be cut across datagrams.  The ack field of every datagram gives
+ * the highest seq received in order from the other side.  A datagram with seq 0 has no
+ * payload: it only carries an ack, or keeps the session alive.
+ *
+ * A phone registers by sending a datagram with token 0 and seq 1, in two rounds, so
+ * that nothing is allocated for, nor sent again to, an address that a datagram only
+ * claims to come from.  The server answers the first with a datagram with token 0,
+ * seq 0 and, in its ack field, a cookie: a hash, with a key known only to the server,
+ * of the address of the phone and of the current period of UDP_COOKIE_MS.  The phone
+ * registers again with the cookie in its ack field, within a period or so, and only
+ * then does the server plug a new virtual TU into the PBX for it, answering, as usual,
+ * with "ON HOOK <ext>", in a datagram whose token field gives the token of the session.
+ * (A registration whose cookie is missing, stale or wrong is answered with a cookie
+ * again.)  From then on the phone puts that token in all its datagrams, which are only
+ * accepted from the address that registered.  (A phone that registers again because
+ * the answer was lost ends up with a second session, which it ignores and which
+ * expires.)
+ *
+ * Each side sends datagrams that have not been acked again after UDP_RTO_MS, and the
+ * server ends a session whose datagrams still have not been acked after UDP_MAX_TRIES
+ * sends, or from which nothing has been heard for UDP_SESSION_TIMEOUT_MS; a phone
+ * with nothing to send sends a datagram with seq 0 every UDP_KEEPALIVE_MS.  The server
+ * only takes datagrams in order: it drops any that come after a gap, and they are
+ * sent again.
+ *
+ * All sessions are served by one thread, which receives datagrams in batches with
+ * recvmmsg() and sends all of the answers to a batch at once with sendmmsg().
+ * Commands that need a connection of their own (chatf, proto, shm) are not available,
+ * and chats over the rate limit are dropped rather than delayed.
+ *
+ * With a registry mirror (see mirror.h), a server that starts up takes up the sessions
+ * left by the one before, with their calls between phones, and sends each phone the
+ * state of its TU again.  Datagrams to a phone that were lost with the old server are
+ * replaced by ones with empty payloads, and the first datagram with a payload from the
+ * phone is taken even if some before it were lost, so that neither side waits forever.
+ */
+
+#define UDP_MAX_PAYLOAD 1200
+#define UDP_WINDOW 64
+#define UDP_BATCH 64
+#define UDP_MAX_SESSIONS 65536
+#define UDP_TICK_MS 50
+#define UDP_RTO_MS 200
+#define UDP_MAX_TRIES 10
+#define UDP_KEEPALIVE_MS 10000
+#define UDP_SESSION_TIMEOUT_MS (3 * UDP_KEEPALIVE_MS)
+#define UDP_COOKIE_MS 10000
+
+typedef struct udp_header {
+    uint32_t token;     // Session token, or 0 to register.
+    uint32_t seq;       // Number of the datagram, or 0 if it has no payload.
+    uint32_t ack;       // Highest seq received in order from the other side, or, on
+                        // a registration and its first answer, the cookie.
+} UDP_HEADER;
+
+/*
+ * A datagram sent by the server and not yet acked.
+ */
+typedef struct udp_segment {
+    uint32_t seq;
+    size_t len;                   // Length of the payload.
+    int queued;                   // Set while waiting for the serving thread to send it.
+    int tries;                    // Number of times sent.
+    uint64_t sent_at;             // Time (nsec) it was last sent.
+    char data[UDP_MAX_PAYLOAD];
+} UDP_SEGMENT;
+
+/*
+ * The session of one phone.  Only the thread serving the sessions uses the fields
+ * above the mutex; the mutex guards the sending state below it, which threads writing
+ * to the TU of the session use as well.
+ */
+typedef struct udp_session {
+    uint32_t token;
+    struct sockaddr_storage addr;  // Address of the phone.
+    socklen_t addrlen;
+    TU *tu;                        // The TU of the phone.
+    RATE_LIMITS rl;
+    uint32_t received;             // Highest seq received in order from the phone.
+    int ack_pending;               // Set if the phone is owed an ack.
+    int touched;                   // Set while on the list of sessions to flush.
+    struct udp_session *flush_next; // Next session on that list.
+    uint64_t last_heard;           // Time (nsec) the phone was last heard from.
+    int resync;                    // Set when taken up from the mirror, until the phone
+                                   // is next heard from with a payload.
+    struct udp_session *prev, *next; // List of sessions.
+
+    sem_t mutex;
+    int closed;                    // Set once the session has ended, or failed.
+    int dirty;                     // Set if it has changed since it was last mirrored.
+    uint32_t next_seq;             // Seq of the next datagram to the phone.
+    uint32_t acked;                // Highest seq acked by the phone.
+    int queued;                    // Number of datagrams waiting to be sent.
+    UDP_SEGMENT *window[UDP_WINDOW]; // Datagrams not yet acked, indexed by seq.
+} UDP_SESSION;
+
+int udp_open(const char *port);
+void udp_start(int fd);
+int udp_session_send(UDP_SESSION *s, struct iovec *iov, int iovcnt);
+void udp_session_free(UDP_SESSION *s);
+
+#endif /* UDP_H */
@@ -0,0 +1,248 @@
+/*
+ * Admission control: measuring load, and shedding it when the server is overloaded.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "admission.h"
+#include "metrics.h"
+#include "coro.h"
+#include "csapp.h"
+
+#define ADMISSION_NSEC_PER_MS 1000000
+
+/*
+ * Largest time a rejected client is told to wait before trying again.
+ */
+#define ADMISSION_MAX_RETRY_MS 10000
+
+/*
+ * Limits of the measures of load, 0 for none.  Set before any client is served.
+ */
+static uint64_t limit_clients, limit_accept_queue, limit_latency_ns, limit_rss_kb;
+static int admission_enabled;
+static int admission_listenfd = -1;
+
+// Shared with the service threads, and accessed atomically.
+static int admission_level;
+static int admission_pressure;
+static uint64_t admission_clients;
+static uint64_t admission_commands;      // Control commands carried out this interval.
+static uint64_t admission_command_ns;    // Total time they took.
+
+static uint64_t admission_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Set the limits of the measures of load, which turns on admission control.
+ *
+ * @param spec  The argument of the -O option,
+ * "<clients>[:<accept-queue>[:<latency-ms>[:<rss-MB>]]]".
+ * @return 0 if successful, -1 if the argument is malformed.
+ */
+int admission_config(const char *spec) {
+    uint64_t limits[4] = { 0 };
+    char *end;
+    for(int i = 0; i < 4; i++) {
+        errno = 0;
+        limits[i] = strtoull(spec, &end, 10);
+        if(end == spec || *spec == '-' || errno) {
+            return -1;
+        }
+        if(*end != ':') {
+            break;
+        }
+        spec = end + 1;
+    }
+    if(*end != '\0') {
+        return -1;
+    }
+    limit_clients = limits[0];
+    limit_accept_queue = limits[1];
+    limit_latency_ns = limits[2] * ADMISSION_NSEC_PER_MS;
+    limit_rss_kb = limits[3] * 1024;
+    admission_enabled = 1;
+    return 0;
+}
+
+/*
+ * Get the number of connections waiting to be accepted on the TCP listening socket.
+ */
+static uint64_t admission_accept_queue(void) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if(admission_listenfd == -1 ||
+       getsockopt(admission_listenfd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        return 0;
+    }
+    // For a listening socket, this is the length of its accept queue.
+    return info.tcpi_unacked;
+}
+
+/*
+ * Get the memory in use by the server (its resident set), in kilobytes.
+ */
+static uint64_t admission_rss_kb(void) {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    // The second field is the resident set, in pages.
+    char *end;
+    strtoull(buf, &end, 10);
+    return strtoull(end, NULL, 10) * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Get a measure of load as a percentage of its limit, or 0 if it has none.
+ */
+static int admission_percent(uint64_t value, uint64_t limit) {
+    if(limit == 0) {
+        return 0;
+    }
+    uint64_t percent = value * 100 / limit;
+    return percent > 1000 ? 1000 : percent;
+}
+
+/*
+ * Thread function for the thread that samples the load and sets the level of overload.
+ */
+static void *admission_thread(void *arg) {
+    Pthread_detach(pthread_self());
+    uint64_t latency = 0;
+    uint64_t held_until = 0;
+    while(1) {
+        struct timespec ts = { 0, ADMISSION_INTERVAL_MS * ADMISSION_NSEC_PER_MS };
+        while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+        uint64_t clients = __atomic_load_n(&admission_clients, __ATOMIC_RELAXED);
+        uint64_t queue = admission_accept_queue();
+        uint64_t rss = admission_rss_kb();
+        // The latency is smoothed across intervals, and decays while no commands come in.
+        uint64_t commands = __atomic_exchange_n(&admission_commands, 0, __ATOMIC_RELAXED);
+        uint64_t command_ns = __atomic_exchange_n(&admission_command_ns, 0, __ATOMIC_RELAXED);
+        latency = (latency * 3 + (commands ? command_ns / commands : 0)) / 4;
+
+        int pressure = admission_percent(clients, limit_clients);
+        int p = admission_percent(queue, limit_accept_queue);
+        pressure = p > pressure ? p : pressure;
+        p = admission_percent(latency, limit_latency_ns);
+        pressure = p > pressure ? p : pressure;
+        p = admission_percent(rss, limit_rss_kb);
+        pressure = p > pressure ? p : pressure;
+
+        int level = pressure >= 100 ? ADMISSION_REJECT :
+                    pressure >= ADMISSION_SOFT_PERCENT ? ADMISSION_DEFER_CHAT : ADMISSION_NORMAL;
+        uint64_t now = admission_clock();
+        int current = __atomic_load_n(&admission_level, __ATOMIC_RELAXED);
+        if(level >= current) {
+            if(level > current) {
+                held_until = now + (uint64_t)ADMISSION_HOLD_MS * ADMISSION_NSEC_PER_MS;
+            }
+            __atomic_store_n(&admission_level, level, __ATOMIC_RELAXED);
+        }
+        else if(now >= held_until) {
+            // Come down one level at a time, each held in turn.
+            held_until = now + (uint64_t)ADMISSION_HOLD_MS * ADMISSION_NSEC_PER_MS;
+            __atomic_store_n(&admission_level, current - 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&admission_pressure, pressure, __ATOMIC_RELAXED);
+
+        metrics_set(METRIC_OVERLOAD_LEVEL, __atomic_load_n(&admission_level, __ATOMIC_RELAXED));
+        metrics_set(METRIC_OVERLOAD_PRESSURE, pressure);
+        metrics_set(METRIC_CLIENTS, clients);
+        metrics_set(METRIC_ACCEPT_QUEUE, queue);
+        metrics_set(METRIC_COMMAND_LATENCY_USEC, latency / 1000);
+        metrics_set(METRIC_RSS_KB, rss);
+    }
+    return NULL;
+}
+
+/*
+ * Start sampling the load, if admission control is on.
+ *
+ * @param listenfd  The TCP listening socket, whose accept queue is watched.
+ */
+void admission_start(int listenfd) {
+    if(!admission_enabled) {
+        return;
+    }
+    admission_listenfd = listenfd;
+    metrics_set(METRIC_LIMIT_CLIENTS, limit_clients);
+    metrics_set(METRIC_LIMIT_ACCEPT_QUEUE, limit_accept_queue);
+    metrics_set(METRIC_LIMIT_LATENCY_USEC, limit_latency_ns / 1000);
+    metrics_set(METRIC_LIMIT_RSS_KB, limit_rss_kb);
+    pthread_t tid;
+    Pthread_create(&tid, NULL, admission_thread, NULL);
+}
+
+/*
+ * Decide whether a new client may register.
+ *
+ * @return 0 if it may, otherwise the time (ms) after which it may try again, which
+ * grows with the pressure.
+ */
+int admission_admit(void) {
+    if(__atomic_load_n(&admission_level, __ATOMIC_RELAXED) < ADMISSION_REJECT) {
+        return 0;
+    }
+    metrics_add(METRIC_REGISTRATIONS_REJECTED, 1);
+    uint64_t retry = (uint64_t)ADMISSION_HOLD_MS * __atomic_load_n(&admission_pressure, __ATOMIC_RELAXED) / 100;
+    return retry > ADMISSION_MAX_RETRY_MS ? ADMISSION_MAX_RETRY_MS : retry < ADMISSION_HOLD_MS ? ADMISSION_HOLD_MS : retry;
+}
+
+/*
+ * Count a client as being served, until it leaves.
+ */
+void admission_enter(void) {
+    __atomic_fetch_add(&admission_clients, 1, __ATOMIC_RELAXED);
+}
+
+void admission_leave(void) {
+    __atomic_fetch_sub(&admission_clients, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Note the start of a control command, whose latency is measured.
+ *
+ * @return the time it started, to be passed to admission_command_done(), or 0 if
+ * admission control is off.
+ */
+uint64_t admission_command_start(void) {
+    return admission_enabled ? admission_clock() : 0;
+}
+
+void admission_command_done(uint64_t start) {
+    if(start) {
+        __atomic_fetch_add(&admission_command_ns, admission_clock() - start, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&admission_commands, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Hold back a chat command from a connection, if the server is overloaded enough that
+ * chat is put behind call control.
+ */
+void admission_chat(void) {
+    if(__atomic_load_n(&admission_level, __ATOMIC_RELAXED) < ADMISSION_DEFER_CHAT) {
+        return;
+    }
+    metrics_add(METRIC_CHATS_DEFERRED, 1);
+    struct timespec ts = { 0, ADMISSION_CHAT_DELAY_MS * ADMISSION_NSEC_PER_MS };
+    coro_nanosleep(&ts);
+}
@@ -0,0 +1,129 @@
+/*
+ * ADPCM: IMA-ADPCM encoding and decoding of audio for the spool.
+ */
+#include "adpcm.h"
+
+/*
+ * Quantizer step sizes, and the adjustment of the step index after each code.
+ */
+static const int32_t adpcm_steps[89] = {
+        7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+       19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+       50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+      130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+      337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+      876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+     2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+     5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int32_t adpcm_index_adjust[8] = {
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+#define ADPCM_CLAMP(x, lo, hi) ((x) < (lo) ? (lo) : (x) > (hi) ? (hi) : (x))
+
+/*
+ * Initialize the codec state of a stream.
+ *
+ * @param st  The state to be initialized.
+ */
+void adpcm_init(ADPCM_STATE *st) {
+    st->predictor = 0;
+    st->index = 0;
+}
+
+/*
+ * Encode one sample, updating the state exactly as the decoder will.
+ * The quantization is done with masks rather than branches, so that the cost does
+ * not depend on the signal.
+ */
+static inline uint8_t adpcm_encode_sample(ADPCM_STATE *st, int32_t sample) {
+    int32_t step = adpcm_steps[st->index];
+    int32_t diff = sample - st->predictor;
+    int32_t sign = diff < 0 ? 8 : 0;
+    int32_t mask;
+    diff = sign ? -diff : diff;
+
+    // Successive approximation of diff by step, step/2 and step/4.
+    int32_t code = 0;
+    int32_t vpdiff = step >> 3;
+    mask = -(diff >= step);
+    code |= 4 & mask;
+    diff -= step & mask;
+    vpdiff += step & mask;
+    step >>= 1;
+    mask = -(diff >= step);
+    code |= 2 & mask;
+    diff -= step & mask;
+    vpdiff += step & mask;
+    step >>= 1;
+    mask = -(diff >= step);
+    code |= 1 & mask;
+    vpdiff += step & mask;
+
+    int32_t pred = st->predictor + (sign ? -vpdiff : vpdiff);
+    st->predictor = ADPCM_CLAMP(pred, INT16_MIN, INT16_MAX);
+    int32_t index = st->index + adpcm_index_adjust[code];
+    st->index = ADPCM_CLAMP(index, 0, 88);
+    return (uint8_t)(code | sign);
+}
+
+/*
+ * Decode one 4-bit code, updating the state.
+ */
+static inline int16_t adpcm_decode_sample(ADPCM_STATE *st, uint8_t code) {
+    int32_t step = adpcm_steps[st->index];
+    int32_t vpdiff = (step >> 3) + (step & -((code >> 2) & 1)) + ((step >> 1) & -((code >> 1) & 1))
+                   + ((step >> 2) & -(code & 1));
+    int32_t pred = st->predictor + ((code & 8) ? -vpdiff : vpdiff);
+    st->predictor = ADPCM_CLAMP(pred, INT16_MIN, INT16_MAX);
+    int32_t index = st->index + adpcm_index_adjust[code & 7];
+    st->index = ADPCM_CLAMP(index, 0, 88);
+    return (int16_t)st->predictor;
+}
+
+/*
+ * Encode a block of samples.
+ * If the number of samples is odd, the high nibble of the last byte is left zero.
+ *
+ * @param st  The codec state of the stream.
+ * @param in  The samples to be encoded.
+ * @param n  The number of samples.
+ * @param out  Buffer for the encoded data, with room for (n + 1) / 2 bytes.
+ * @return the number of bytes stored in out.
+ */
+size_t adpcm_encode(ADPCM_STATE *st, const int16_t *in, size_t n, uint8_t *out) {
+    size_t i;
+    for(i = 0; i + 1 < n; i += 2) {
+        uint8_t lo = adpcm_encode_sample(st, in[i]);
+        uint8_t hi = adpcm_encode_sample(st, in[i + 1]);
+        out[i / 2] = lo | (hi << 4);
+    }
+    if(i < n) {
+        out[i / 2] = adpcm_encode_sample(st, in[i]);
+    }
+    return (n + 1) / 2;
+}
+
+/*
+ * Decode a block of samples.
+ *
+ * @param st  The codec state of the stream.
+ * @param in  The encoded data, (n + 1) / 2 bytes.
+ * @param n  The number of samples to be decoded.
+ * @param out  Buffer for the decoded samples.
+ * @return the number of bytes of encoded data consumed.
+ */
+size_t adpcm_decode(ADPCM_STATE *st, const uint8_t *in, size_t n, int16_t *out) {
+    size_t i;
+    for(i = 0; i + 1 < n; i += 2) {
+        out[i] = adpcm_decode_sample(st, in[i / 2] & 0xf);
+        out[i + 1] = adpcm_decode_sample(st, in[i / 2] >> 4);
+    }
+    if(i < n) {
+        out[i] = adpcm_decode_sample(st, in[i / 2] & 0xf);
+    }
+    return (n + 1) / 2;
+}
@@ -0,0 +1,573 @@
+/*
+ * Coroutines: clients served on a few event loops, each with a stack of its own.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include "coro.h"
+#include "csapp.h"
+
+#define CORO_EVENTS 256
+#define CORO_SEM_BUCKETS 256
+
+typedef struct coro_loop CORO_LOOP;
+
+struct coro {
+    ucontext_t context;
+    CORO_LOOP *loop;          // Loop that runs the coroutine.
+    void *(*fn)(void *);
+    void *arg;
+    int done;                 // Set once fn has returned.
+    uint64_t deadline;        // When to wake it, while it sleeps.
+    sem_t *sem;               // Semaphore it waits on, while parked.
+    struct coro *next;        // Next in a queue of its loop.
+    char *stack;              // Mapping of the stack, guard first.
+    char local[CORO_LOCAL_SIZE] __attribute__((aligned(16)));
+};
+
+struct coro_loop {
+    int epfd;
+    int wakefd;               // Eventfd written to wake the loop from other threads.
+    int sleeping;             // Set while the loop may wait in epoll.
+    CORO *incoming;           // Woken by other threads, latest first.
+    CORO *ready;              // Ready to run, in order; only the loop touches these.
+    CORO **ready_tail;
+    CORO *timers;             // Asleep, by deadline.
+    ucontext_t context;       // The loop itself, between coroutines.
+};
+
+/*
+ * Coroutines waiting for a file descriptor.  The descriptor is in the epoll set of one
+ * loop, the first to wait for it, which wakes both the coroutine reading it and the one
+ * writing it, whatever loops they are on.
+ */
+typedef struct coro_fd {
+    int lock;
+    CORO_LOOP *loop;
+    CORO *reader;
+    CORO *writer;
+} CORO_FD;
+
+/*
+ * Coroutines parked on semaphores, in order, in buckets by the address of the
+ * semaphore.  A poster wakes the first one parked on its semaphore.
+ */
+typedef struct coro_sem_bucket {
+    int lock;
+    CORO *head;
+    CORO **tail;
+} CORO_SEM_BUCKET;
+
+static int coro_num_loops;
+static CORO_LOOP *coro_loops;
+static unsigned int coro_next_loop;
+static CORO_FD *coro_fds;
+static int coro_max_fds;
+static CORO_SEM_BUCKET coro_sem_buckets[CORO_SEM_BUCKETS];
+static int coro_sem_parked;   // Coroutines parked in all buckets, so that V() can skip them.
+
+int coro_on;                  // Set once the loops are running.
+
+static __thread CORO *coro_running;
+static __thread CORO_LOOP *coro_loop_self;
+
+/*
+ * Set the number of event loops, which turns coroutines on.
+ *
+ * @param spec  The argument of the -E option, "<loops>".
+ * @return 0 if successful, -1 if the argument is malformed.
+ */
+int coro_config(const char *spec) {
+    char *end;
+    long n = strtol(spec, &end, 10);
+    if(end == spec || *end != '\0' || n < 1 || n > CORO_MAX_LOOPS) {
+        return -1;
+    }
+    coro_num_loops = n;
+    return 0;
+}
+
+/*
+ * Get the coroutine that the calling thread is running, if any.
+ */
+CORO *coro_self(void) {
+    return coro_running;
+}
+
+/*
+ * Get the CORO_LOCAL_SIZE bytes of storage of the calling coroutine, for what would
+ * otherwise be kept per thread.
+ *
+ * @return the storage, or NULL if the caller is not a coroutine.
+ */
+void *coro_local(void) {
+    return coro_running ? coro_running->local : NULL;
+}
+
+static uint64_t coro_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void coro_ready(CORO_LOOP *loop, CORO *c) {
+    c->next = NULL;
+    *(loop->ready_tail) = c;
+    loop->ready_tail = &(c->next);
+}
+
+/*
+ * Make a suspended coroutine ready to run, on its loop.
+ */
+static void coro_wake(CORO *c) {
+    CORO_LOOP *loop = c->loop;
+    if(loop == coro_loop_self) {
+        coro_ready(loop, c);
+        return;
+    }
+    c->next = __atomic_load_n(&(loop->incoming), __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&(loop->incoming), &(c->next), c, 1, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_RELAXED))
+        ;
+    if(__atomic_load_n(&(loop->sleeping), __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if(write(loop->wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            unix_error("eventfd write error");
+        }
+    }
+}
+
+/*
+ * Go back to the loop from the calling coroutine, until it is woken.
+ */
+static void coro_suspend(void) {
+    CORO *c = coro_running;
+    if(swapcontext(&(c->context), &(c->loop->context)) == -1) {
+        unix_error("swapcontext error");
+    }
+}
+
+static void coro_entry(void) {
+    CORO *c = coro_running;
+    c->fn(c->arg);
+    c->done = 1;
+    coro_suspend();
+}
+
+/*
+ * Map a stack, with its guard below it.
+ *
+ * @return the start of the mapping, or NULL if it could not be made.
+ */
+static char *coro_stack_map(void) {
+    char *stack = mmap(NULL, CORO_GUARD_SIZE + CORO_STACK_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if(stack == MAP_FAILED) {
+        return NULL;
+    }
+    if(mprotect(stack + CORO_GUARD_SIZE, CORO_STACK_SIZE, PROT_READ | PROT_WRITE) == -1) {
+        munmap(stack, CORO_GUARD_SIZE + CORO_STACK_SIZE);
+        return NULL;
+    }
+    return stack;
+}
+
+/*
+ * Start a function in a new coroutine, on one of the loops in turn.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int coro_spawn(void *(*fn)(void *), void *arg) {
+    CORO *c = malloc(sizeof(CORO));
+    char *stack = c ? coro_stack_map() : NULL;
+    if(!stack) {
+        free(c);
+        return -1;
+    }
+    memset(c, 0, sizeof(*c));
+    c->fn = fn;
+    c->arg = arg;
+    c->stack = stack;
+    if(getcontext(&(c->context)) == -1) {
+        unix_error("getcontext error");
+    }
+    c->context.uc_stack.ss_sp = stack + CORO_GUARD_SIZE;
+    c->context.uc_stack.ss_size = CORO_STACK_SIZE;
+    c->context.uc_link = NULL;
+    makecontext(&(c->context), coro_entry, 0);
+    c->loop = &(coro_loops[__atomic_fetch_add(&coro_next_loop, 1, __ATOMIC_RELAXED) % coro_num_loops]);
+    coro_wake(c);
+    return 0;
+}
+
+/*
+ * Let the others run: the other coroutines of its loop, if the caller is a coroutine,
+ * otherwise other threads.
+ */
+void coro_yield(void) {
+    CORO *c = coro_running;
+    if(!c) {
+        sched_yield();
+        return;
+    }
+    coro_ready(c->loop, c);
+    coro_suspend();
+}
+
+/*
+ * Sleep for a given time, as nanosleep() does, but suspending only the calling
+ * coroutine, if it is one.
+ */
+void coro_nanosleep(const struct timespec *ts) {
+    CORO *c = coro_running;
+    if(!c) {
+        struct timespec left = *ts;
+        while(nanosleep(&left, &left) == -1 && errno == EINTR)
+            ;
+        return;
+    }
+    c->deadline = coro_clock() + (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+    CORO **link = &(c->loop->timers);
+    while(*link && (*link)->deadline <= c->deadline) {
+        link = &((*link)->next);
+    }
+    c->next = *link;
+    *link = c;
+    coro_suspend();
+}
+
+/*
+ * Locks held only for a few instructions, by loops and other threads alike.
+ */
+static void coro_lock(int *lock) {
+    while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void coro_unlock(int *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static CORO_SEM_BUCKET *coro_sem_bucket(sem_t *sem) {
+    uint64_t h = (uintptr_t)sem / sizeof(sem_t) * 0x9e3779b97f4a7c15ULL;
+    return &(coro_sem_buckets[(h >> 32) % CORO_SEM_BUCKETS]);
+}
+
+/*
+ * Wait on a semaphore in a coroutine, parked until coro_sem_post() finds it, while the
+ * other coroutines of its loop run.
+ */
+void coro_sem_wait(sem_t *sem) {
+    CORO *c = coro_running;
+    CORO_SEM_BUCKET *b = coro_sem_bucket(sem);
+    while(1) {
+        // The count of parked coroutines goes up before the semaphore is tried, so that
+        // a poster either is seen here or sees that it must look in the bucket.
+        coro_lock(&(b->lock));
+        __atomic_fetch_add(&coro_sem_parked, 1, __ATOMIC_SEQ_CST);
+        if(sem_trywait(sem) == 0) {
+            __atomic_fetch_sub(&coro_sem_parked, 1, __ATOMIC_RELAXED);
+            coro_unlock(&(b->lock));
+            return;
+        }
+        if(errno != EAGAIN) {
+            unix_error("P error");
+        }
+        c->sem = sem;
+        c->next = NULL;
+        *(b->tail) = c;
+        b->tail = &(c->next);
+        coro_unlock(&(b->lock));
+        coro_suspend();
+    }
+}
+
+/*
+ * Wake the first coroutine parked on a semaphore that has just been posted, if any.
+ * It tries the semaphore again once it runs, and parks again if it has been taken.
+ */
+void coro_sem_post(sem_t *sem) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!__atomic_load_n(&coro_sem_parked, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    CORO_SEM_BUCKET *b = coro_sem_bucket(sem);
+    CORO *c = NULL;
+    coro_lock(&(b->lock));
+    for(CORO **link = &(b->head); *link; link = &((*link)->next)) {
+        if((*link)->sem == sem) {
+            c = *link;
+            if(!(*link = c->next)) {
+                b->tail = link;
+            }
+            __atomic_fetch_sub(&coro_sem_parked, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    coro_unlock(&(b->lock));
+    if(c) {
+        coro_wake(c);
+    }
+}
+
+/*
+ * Ask the loop of a file descriptor to report it once it is ready for what the
+ * coroutines waiting for it are waiting for.  The caller holds the lock of its entry.
+ *
+ * @return 0 if successful, -1 if the descriptor cannot be waited for with epoll.
+ */
+static int coro_fd_arm(CORO_FD *e, int fd) {
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLONESHOT | (e->reader ? EPOLLIN | EPOLLRDHUP : 0) | (e->writer ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    // A descriptor is dropped from the epoll set when it is closed, and the next one
+    // with its number must be added again.
+    if(epoll_ctl(e->loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1 &&
+       (errno != ENOENT || epoll_ctl(e->loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Suspend the calling coroutine until a file descriptor is ready for reading, or for
+ * writing.
+ *
+ * @param events  EPOLLIN or EPOLLOUT.
+ * @return 0 once it is ready, or -1 if it cannot be waited for, in which case the
+ * caller must block instead.
+ */
+static int coro_wait_fd(int fd, uint32_t events) {
+    CORO *c = coro_running;
+    if(fd < 0 || fd >= coro_max_fds) {
+        return -1;
+    }
+    CORO_FD *e = &(coro_fds[fd]);
+    coro_lock(&(e->lock));
+    if(!e->loop) {
+        e->loop = c->loop;
+    }
+    CORO **waiter = events == EPOLLIN ? &(e->reader) : &(e->writer);
+    *waiter = c;
+    if(coro_fd_arm(e, fd) == -1) {
+        *waiter = NULL;
+        coro_unlock(&(e->lock));
+        return -1;
+    }
+    coro_unlock(&(e->lock));
+    coro_suspend();
+    return 0;
+}
+
+/*
+ * Wake the coroutines waiting for a file descriptor that epoll found ready.
+ */
+static void coro_fd_ready(int fd, uint32_t events) {
+    CORO_FD *e = &(coro_fds[fd]);
+    CORO *reader = NULL, *writer = NULL;
+    coro_lock(&(e->lock));
+    if(e->reader && (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) {
+        reader = e->reader;
+        e->reader = NULL;
+    }
+    if(e->writer && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        writer = e->writer;
+        e->writer = NULL;
+    }
+    if(e->reader || e->writer) {
+        coro_fd_arm(e, fd);
+    }
+    coro_unlock(&(e->lock));
+    if(reader) {
+        coro_wake(reader);
+    }
+    if(writer) {
+        coro_wake(writer);
+    }
+}
+
+/*
+ * Read from a connection, as read() does, but suspending only the calling coroutine,
+ * if it is one, while there is nothing to read.
+ */
+ssize_t coro_read(int fd, void *buf, size_t len) {
+    if(!coro_running) {
+        return read(fd, buf, len);
+    }
+    while(1) {
+        ssize_t n = recv(fd, buf, len, MSG_DONTWAIT);
+        if(n != -1 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTSOCK)) {
+            return n;
+        }
+        if(errno == ENOTSOCK || coro_wait_fd(fd, EPOLLIN) == -1) {
+            return read(fd, buf, len);
+        }
+    }
+}
+
+/*
+ * Write to a connection, as writev() does, but suspending only the calling coroutine,
+ * if it is one, while the connection has no room.
+ */
+ssize_t coro_writev(int fd, const struct iovec *iov, int iovcnt) {
+    if(!coro_running) {
+        return writev(fd, iov, iovcnt);
+    }
+    struct msghdr msg = { 0 };
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    while(1) {
+        ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT);
+        if(n != -1 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTSOCK)) {
+            return n;
+        }
+        if(errno == ENOTSOCK || coro_wait_fd(fd, EPOLLOUT) == -1) {
+            return writev(fd, iov, iovcnt);
+        }
+    }
+}
+
+/*
+ * Run a coroutine of the calling loop until it is suspended, and free it once it is done.
+ */
+static void coro_resume(CORO_LOOP *loop, CORO *c) {
+    coro_running = c;
+    if(swapcontext(&(loop->context), &(c->context)) == -1) {
+        unix_error("swapcontext error");
+    }
+    coro_running = NULL;
+    if(c->done) {
+        munmap(c->stack, CORO_GUARD_SIZE + CORO_STACK_SIZE);
+        free(c);
+    }
+}
+
+/*
+ * Make ready the coroutines woken by other threads, in the order they were woken, and
+ * those whose sleep is over.
+ */
+static void coro_gather(CORO_LOOP *loop) {
+    CORO *list = __atomic_exchange_n(&(loop->incoming), NULL, __ATOMIC_ACQUIRE);
+    CORO *ordered = NULL;
+    while(list) {
+        CORO *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while(ordered) {
+        CORO *next = ordered->next;
+        coro_ready(loop, ordered);
+        ordered = next;
+    }
+    uint64_t now = coro_clock();
+    while(loop->timers && loop->timers->deadline <= now) {
+        CORO *c = loop->timers;
+        loop->timers = c->next;
+        coro_ready(loop, c);
+    }
+}
+
+/*
+ * Thread function for an event loop.
+ */
+static void *coro_loop_thread(void *arg) {
+    Pthread_detach(pthread_self());
+    CORO_LOOP *loop = arg;
+    coro_loop_self = loop;
+    struct epoll_event events[CORO_EVENTS];
+    while(1) {
+        coro_gather(loop);
+        // Each coroutine ready now runs once; those that yield run again after the poll.
+        CORO *c = loop->ready;
+        loop->ready = NULL;
+        loop->ready_tail = &(loop->ready);
+        while(c) {
+            CORO *next = c->next;
+            coro_resume(loop, c);
+            c = next;
+        }
+
+        // Wait for a descriptor, a wakeup or the first timer, having said so before
+        // looking for wakeups one last time.
+        int timeout = -1;
+        if(loop->ready) {
+            timeout = 0;
+        }
+        else if(loop->timers) {
+            uint64_t now = coro_clock(), deadline = loop->timers->deadline;
+            timeout = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+        }
+        __atomic_store_n(&(loop->sleeping), 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&(loop->incoming), __ATOMIC_SEQ_CST)) {
+            timeout = 0;
+        }
+        int n = epoll_wait(loop->epfd, events, CORO_EVENTS, timeout);
+        __atomic_store_n(&(loop->sleeping), 0, __ATOMIC_RELAXED);
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.fd == loop->wakefd) {
+                uint64_t count;
+                if(read(loop->wakefd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                    unix_error("eventfd read error");
+                }
+            }
+            else {
+                coro_fd_ready(events[i].data.fd, events[i].events);
+            }
+        }
+        if(n == -1 && errno != EINTR) {
+            unix_error("epoll_wait error");
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start the event loops, if coroutines are on.  As many connections may be open as
+ * the hard limit on file descriptors allows.
+ */
+void coro_start(void) {
+    if(!coro_num_loops) {
+        return;
+    }
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    coro_max_fds = rl.rlim_cur;
+    coro_fds = Calloc(coro_max_fds, sizeof(CORO_FD));
+    for(int i = 0; i < CORO_SEM_BUCKETS; i++) {
+        coro_sem_buckets[i].tail = &(coro_sem_buckets[i].head);
+    }
+    CORO_LOOP *loops = Calloc(coro_num_loops, sizeof(CORO_LOOP));
+    for(int i = 0; i < coro_num_loops; i++) {
+        CORO_LOOP *loop = &(loops[i]);
+        struct epoll_event ev = { 0 };
+        if((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+           (loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+            unix_error("epoll error");
+        }
+        ev.events = EPOLLIN;
+        ev.data.fd = loop->wakefd;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) == -1) {
+            unix_error("epoll_ctl error");
+        }
+        loop->ready_tail = &(loop->ready);
+    }
+    coro_loops = loops;
+    __atomic_store_n(&coro_on, 1, __ATOMIC_RELEASE);
+    for(int i = 0; i < coro_num_loops; i++) {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, coro_loop_thread, &(loops[i]));
+    }
+}
@@ -23,6 +23,7 @@
  */
 /* $begin csapp.c */
 #include "csapp.h"
+#include "coro.h"
 
 /************************** 
  * Error-handling functions
@@ -683,14 +684,24 @@ void Sem_destroy(sem_t *sem)
 
 void P(sem_t *sem) 
 {
-    if (sem_wait(sem) < 0)
-    unix_error("P error");
+    /* A coroutine parks, letting the others on its thread run (see coro.h). */
+    if (coro_enabled() && coro_self()) {
+        coro_sem_wait(sem);
+        return;
+    }
+    /* A signal to the thread (as on a hot restart) does not abort the wait. */
+    while (sem_wait(sem) < 0)
+        if (errno != EINTR)
+            unix_error("P error");
 }
 
 void V(sem_t *sem) 
 {
     if (sem_post(sem) < 0)
     unix_error("V error");
+    /* Coroutines parked on the semaphore are not woken by the post itself. */
+    if (coro_enabled())
+        coro_sem_post(sem);
 }
 
 /****************************************
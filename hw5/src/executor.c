@@ -0,0 +1,347 @@
+/*
+ * Executor: a work-stealing pool of workers carrying out tasks posted to mailboxes.
+ */
+#include <stdlib.h>
+
+#include "executor.h"
+#include "metrics.h"
+#include "csapp.h"
+
+/*
+ * Deque of a worker (Chase-Lev, as set out for weak memory models by Lê et al.).  Only
+ * its worker puts mailboxes in at the bottom and takes them from there; other workers
+ * steal from the top.
+ */
+typedef struct exec_deque {
+    int64_t top __attribute__((aligned(64)));
+    int64_t bottom __attribute__((aligned(64)));
+    EXEC_ACTOR *cells[EXEC_DEQUE_SIZE];
+} EXEC_DEQUE;
+
+typedef struct exec_worker {
+    EXEC_DEQUE deque;
+    unsigned int seed;        // For choosing whom to steal from.
+} EXEC_WORKER;
+
+static int exec_num_workers;
+static EXEC_WORKER *exec_workers;
+
+// Mailboxes scheduled by threads that are not workers, or that found their deque full.
+static sem_t exec_shared_mutex;
+static EXEC_ACTOR *exec_shared_head;
+static EXEC_ACTOR **exec_shared_tail = &exec_shared_head;
+static int exec_shared_count;             // Read without the lock.
+
+// Idle workers wait on exec_wake, having said so in exec_sleepers.
+static sem_t exec_wake;
+static int exec_sleepers;
+
+static __thread EXEC_WORKER *exec_self;
+
+/*
+ * Set the number of workers, which turns on the executor.
+ *
+ * @param spec  The argument of the -W option, "<workers>".
+ * @return 0 if successful, -1 if the argument is malformed.
+ */
+int exec_config(const char *spec) {
+    char *end;
+    long n = strtol(spec, &end, 10);
+    if(end == spec || *end != '\0' || n < 1 || n > EXEC_MAX_WORKERS) {
+        return -1;
+    }
+    exec_num_workers = n;
+    return 0;
+}
+
+/*
+ * Determine whether requests are carried out by the workers.
+ */
+int exec_enabled(void) {
+    return exec_workers != NULL;
+}
+
+void exec_group_init(EXEC_GROUP *group) {
+    group->pending = 0;
+    group->most = 0;
+    group->waiting = 0;
+    Sem_init(&(group->idle), 0, 0);
+}
+
+void exec_group_fini(EXEC_GROUP *group) {
+    Sem_destroy(&(group->idle));
+}
+
+/*
+ * Put a mailbox in the deque of a worker, which only that worker may do.
+ *
+ * @return 0 if successful, -1 if the deque is full.
+ */
+static int exec_deque_push(EXEC_DEQUE *d, EXEC_ACTOR *actor) {
+    int64_t b = __atomic_load_n(&(d->bottom), __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&(d->top), __ATOMIC_ACQUIRE);
+    if(b - t >= EXEC_DEQUE_SIZE) {
+        return -1;
+    }
+    __atomic_store_n(&(d->cells[b % EXEC_DEQUE_SIZE]), actor, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&(d->bottom), b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Take the mailbox put last in the deque of a worker, which only that worker may do.
+ *
+ * @return the mailbox, or NULL if the deque is empty.
+ */
+static EXEC_ACTOR *exec_deque_take(EXEC_DEQUE *d) {
+    int64_t b = __atomic_load_n(&(d->bottom), __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&(d->bottom), b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&(d->top), __ATOMIC_RELAXED);
+    if(t > b) {
+        __atomic_store_n(&(d->bottom), b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    EXEC_ACTOR *actor = __atomic_load_n(&(d->cells[b % EXEC_DEQUE_SIZE]), __ATOMIC_RELAXED);
+    if(t == b) {
+        // The last one, which a thief may be taking at the same time.
+        if(!__atomic_compare_exchange_n(&(d->top), &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            actor = NULL;
+        }
+        __atomic_store_n(&(d->bottom), b + 1, __ATOMIC_RELAXED);
+    }
+    return actor;
+}
+
+/*
+ * Steal the mailbox put first in the deque of another worker.
+ *
+ * @return the mailbox, or NULL if the deque is empty or another thread took it first.
+ */
+static EXEC_ACTOR *exec_deque_steal(EXEC_DEQUE *d) {
+    int64_t t = __atomic_load_n(&(d->top), __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&(d->bottom), __ATOMIC_ACQUIRE);
+    if(t >= b) {
+        return NULL;
+    }
+    EXEC_ACTOR *actor = __atomic_load_n(&(d->cells[t % EXEC_DEQUE_SIZE]), __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&(d->top), &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return actor;
+}
+
+/*
+ * Wake an idle worker, if there is one, to take up a mailbox just scheduled.
+ */
+static void exec_notify(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&exec_sleepers, __ATOMIC_RELAXED) > 0) {
+        V(&exec_wake);
+    }
+}
+
+/*
+ * Schedule a mailbox that has tasks: on the deque of the calling thread, if it is a
+ * worker with room, otherwise on the shared queue.
+ *
+ * @param requeue  Nonzero to put it on the shared queue all the same, behind the
+ * mailboxes already scheduled.
+ */
+static void exec_schedule(EXEC_ACTOR *actor, int requeue) {
+    if(requeue || !exec_self || exec_deque_push(&(exec_self->deque), actor) == -1) {
+        P(&exec_shared_mutex);
+        actor->next = NULL;
+        *exec_shared_tail = actor;
+        exec_shared_tail = &(actor->next);
+        __atomic_add_fetch(&exec_shared_count, 1, __ATOMIC_RELEASE);
+        V(&exec_shared_mutex);
+    }
+    exec_notify();
+}
+
+static EXEC_ACTOR *exec_shared_take(void) {
+    if(__atomic_load_n(&exec_shared_count, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+    }
+    P(&exec_shared_mutex);
+    EXEC_ACTOR *actor = exec_shared_head;
+    if(actor) {
+        if(!(exec_shared_head = actor->next)) {
+            exec_shared_tail = &exec_shared_head;
+        }
+        __atomic_sub_fetch(&exec_shared_count, 1, __ATOMIC_RELEASE);
+    }
+    V(&exec_shared_mutex);
+    return actor;
+}
+
+/*
+ * Post a task to a mailbox, scheduling the mailbox if it had none.  The tasks that any
+ * one thread posts to a mailbox are carried out in the order posted.
+ */
+void exec_post(EXEC_ACTOR *actor, EXEC_TASK *task) {
+    __atomic_add_fetch(&(actor->group->pending), 1, __ATOMIC_RELAXED);
+    task->next = __atomic_load_n(&(actor->mailbox), __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&(actor->mailbox), &(task->next), task, 1, __ATOMIC_RELEASE,
+                                       __ATOMIC_RELAXED))
+        ;
+    // The task is counted only once it is in the mailbox, so that whoever makes the
+    // count go up from 0 finds it there.
+    if(__atomic_fetch_add(&(actor->pending), 1, __ATOMIC_ACQ_REL) == 0) {
+        exec_schedule(actor, 0);
+    }
+}
+
+/*
+ * Note that a number of tasks of a group are done, waking the thread waiting for the
+ * group if few enough are left.
+ */
+static void exec_group_done(EXEC_GROUP *group, int64_t n) {
+    int64_t left = __atomic_sub_fetch(&(group->pending), n, __ATOMIC_SEQ_CST);
+    if(left <= __atomic_load_n(&(group->most), __ATOMIC_SEQ_CST) &&
+       __atomic_exchange_n(&(group->waiting), 0, __ATOMIC_SEQ_CST)) {
+        V(&(group->idle));
+    }
+}
+
+/*
+ * Wait until no more than a given number of the tasks posted to the mailboxes of a
+ * group are pending.  Only the thread posting them may wait, and it posts none meanwhile.
+ */
+void exec_wait(EXEC_GROUP *group, int64_t most) {
+    __atomic_store_n(&(group->most), most, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&(group->pending), __ATOMIC_SEQ_CST) > most) {
+        __atomic_store_n(&(group->waiting), 1, __ATOMIC_SEQ_CST);
+        // If enough were done in the meantime, whoever took back the flag posts idle.
+        // A task done before most was set may post it too soon, hence the loop.
+        if(__atomic_load_n(&(group->pending), __ATOMIC_SEQ_CST) <= most &&
+           __atomic_exchange_n(&(group->waiting), 0, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+        P(&(group->idle));
+    }
+}
+
+/*
+ * Wait until all the tasks posted to the mailboxes of a group are done.
+ */
+void exec_quiesce(EXEC_GROUP *group) {
+    exec_wait(group, 0);
+}
+
+/*
+ * Carry out, in order, the tasks in a mailbox, which is scheduled on the calling worker.
+ */
+static void exec_run(EXEC_ACTOR *actor) {
+    EXEC_GROUP *group = actor->group;
+    EXEC_TASK *list = __atomic_exchange_n(&(actor->mailbox), NULL, __ATOMIC_ACQUIRE);
+    EXEC_TASK *ordered = NULL;
+    while(list) {
+        EXEC_TASK *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    int64_t n = 0;
+    while(ordered) {
+        EXEC_TASK *next = ordered->next;
+        ordered->run(ordered);
+        ordered = next;
+        n++;
+    }
+    metrics_add(METRIC_TASKS_EXECUTED, n);
+    // Tasks taken before they were counted make the count go below 0 for a while,
+    // and are not run again when they are counted.  A mailbox with more goes behind
+    // the others, so that a busy channel does not starve them.
+    if(__atomic_sub_fetch(&(actor->pending), n, __ATOMIC_ACQ_REL) > 0) {
+        exec_schedule(actor, 1);
+    }
+    // The mailbox is left alone from here on, since it may be moved once the group is done.
+    exec_group_done(group, n);
+}
+
+/*
+ * Look for a mailbox to run: in the deque of the calling worker, then in the shared
+ * queue, then in the deques of the other workers, starting with one chosen at random.
+ */
+static EXEC_ACTOR *exec_find(EXEC_WORKER *w) {
+    EXEC_ACTOR *actor = exec_deque_take(&(w->deque));
+    if(actor || (actor = exec_shared_take())) {
+        return actor;
+    }
+    int first = rand_r(&(w->seed)) % exec_num_workers;
+    for(int i = 0; i < exec_num_workers; i++) {
+        EXEC_WORKER *victim = &(exec_workers[(first + i) % exec_num_workers]);
+        if(victim != w && (actor = exec_deque_steal(&(victim->deque)))) {
+            metrics_add(METRIC_TASKS_STOLEN, 1);
+            return actor;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Determine whether any mailbox is waiting to be run, anywhere.
+ */
+static int exec_any_scheduled(void) {
+    if(__atomic_load_n(&exec_shared_count, __ATOMIC_SEQ_CST)) {
+        return 1;
+    }
+    for(int i = 0; i < exec_num_workers; i++) {
+        EXEC_DEQUE *d = &(exec_workers[i].deque);
+        if(__atomic_load_n(&(d->bottom), __ATOMIC_SEQ_CST) > __atomic_load_n(&(d->top), __ATOMIC_SEQ_CST)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Thread function for a worker.
+ */
+static void *exec_thread(void *arg) {
+    Pthread_detach(pthread_self());
+    EXEC_WORKER *w = arg;
+    exec_self = w;
+    while(1) {
+        EXEC_ACTOR *actor = exec_find(w);
+        if(actor) {
+            exec_run(actor);
+            continue;
+        }
+        // Wait for work, having said so before looking for it one last time.
+        __atomic_add_fetch(&exec_sleepers, 1, __ATOMIC_SEQ_CST);
+        if(!exec_any_scheduled()) {
+            P(&exec_wake);
+        }
+        __atomic_sub_fetch(&exec_sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/*
+ * Start the workers, if the executor is on.
+ */
+void exec_start(void) {
+    if(!exec_num_workers) {
+        return;
+    }
+    Sem_init(&exec_shared_mutex, 0, 1);
+    Sem_init(&exec_wake, 0, 0);
+    EXEC_WORKER *workers = aligned_alloc(64, exec_num_workers * sizeof(EXEC_WORKER));
+    if(!workers) {
+        unix_error("aligned_alloc error");
+    }
+    for(int i = 0; i < exec_num_workers; i++) {
+        workers[i].deque.top = workers[i].deque.bottom = 0;
+        workers[i].seed = i + 1;
+    }
+    exec_workers = workers;
+    for(int i = 0; i < exec_num_workers; i++) {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, exec_thread, &(workers[i]));
+    }
+}
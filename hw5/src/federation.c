@@ -0,0 +1,807 @@
+/*
+ * Federation: calls to extensions of other PBXs over trunks to them.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "federation.h"
+#include "trunk.h"
+#include "proto.h"
+#include "pbx.h"
+#include "tu_ext.h"
+#include "metrics.h"
+#include "csapp.h"
+
+#define FED_MAX_ROUTES 64
+#define FED_MAX_PREFIX 9
+
+/*
+ * Largest payload of a frame taken from another PBX, beyond which the connection is
+ * given up as garbled.
+ */
+#define FED_MAX_PAYLOAD (1 << 24)
+
+/*
+ * Delays, in microseconds, between attempts to open the connections of a route that
+ * cannot be opened, doubling from the first to the last.
+ */
+#define FED_RETRY_MIN 50000
+#define FED_RETRY_MAX 1000000
+
+/*
+ * Request IDs, by which the answers to the requests of a call are told apart.
+ */
+#define FED_REQ_OPEN 1       // Opening the channel.
+#define FED_REQ_CALL 2       // Anything else in the call.
+#define FED_REQ_CLOSE 3      // Closing the channel, which is answered last.
+
+/*
+ * Size of a frame with no payload on a trunk: the channel ID, then the header.
+ */
+#define FED_FRAME_SIZE (sizeof(uint32_t) + sizeof(PROTO_HEADER))
+
+typedef struct fed_link FED_LINK;
+
+/*
+ * A call over a trunk to another PBX.
+ */
+typedef struct fed_call {
+    SHARD_LEG *leg;          // The leg of the call, whose proxy stands for the remote party.
+    FED_LINK *link;          // The connection carrying the call.
+    uint32_t channel;        // Channel of the call on the connection.
+    int ext;                 // Extension called at the other PBX.
+    int remote;              // Last state of the virtual TU there.
+    int dialing;             // Nonzero while the caller is dialing the proxy.
+    int orphaned;            // Nonzero if the connection ended while it was.
+} FED_CALL;
+
+struct fed_link {
+    TRUNK *trunk;            // The connection, as a trunk of the other PBX.
+    sem_t mutex;             // Protects the table of calls.
+    FED_CALL *calls[FED_LINK_CHANNELS];
+    uint32_t next_channel;   // Where to start looking for a free channel.
+    int slot;                // Index of the connection in the pool of its route.
+    struct fed_route *route;
+    int lost;                // Nonzero once the connection has ended.
+    int refs;                // The thread reading from it, and the dials using it.
+};
+
+typedef struct fed_route {
+    char prefix[FED_MAX_PREFIX + 1];
+    size_t prefix_len;
+    char *host;              // Changed only under the lock, by an update of the route.
+    char *port;
+    unsigned int generation; // Number of times the route has been changed.
+    sem_t mutex;             // Held while the pool is used or changed.
+    FED_LINK *links[FED_POOL_SIZE];
+    unsigned int next;       // Connection to take the next call.
+    int connecting;          // Nonzero while a thread is opening connections.
+} FED_ROUTE;
+
+static FED_ROUTE fed_routes[FED_MAX_ROUTES];
+// Routes are only ever added, by one thread at a time (the main thread, and then the
+// gossip thread), and each is filled in before the count takes it in, so they are looked
+// up without a lock while another is being added.
+static int fed_num_routes;
+
+/*
+ * Split the specification of a route, "<prefix>:<host>:<port>", into its parts, which
+ * are left in place.
+ *
+ * @return 0 if successful, -1 if the specification is malformed.
+ */
+static int fed_route_parse(const char *spec, size_t *prefix_len, const char **host, const char **port) {
+    *host = strchr(spec, ':');
+    *port = *host ? strchr(*host + 1, ':') : NULL;
+    if(!*port) {
+        return -1;
+    }
+    // Dialed numbers have no leading zeros, so neither may a prefix.
+    *prefix_len = *host - spec;
+    if(*prefix_len == 0 || *prefix_len > FED_MAX_PREFIX || spec[0] == '0' || *port == *host + 1 || !(*port)[1]) {
+        return -1;
+    }
+    for(size_t i = 0; i < *prefix_len; i++) {
+        if(!isdigit((unsigned char)spec[i])) {
+            return -1;
+        }
+    }
+    (*host)++;
+    (*port)++;
+    return 0;
+}
+
+static FED_ROUTE *fed_route_of(const char *prefix, size_t prefix_len) {
+    for(int i = 0; i < fed_num_routes; i++) {
+        if(fed_routes[i].prefix_len == prefix_len && !memcmp(fed_routes[i].prefix, prefix, prefix_len)) {
+            return &(fed_routes[i]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add a route to the dial plan, from the command line or, as gossip learns of other
+ * PBXs, while calls are being made.
+ *
+ * @param spec  The argument of the -F option, "<prefix>:<host>:<port>".
+ * @return 0 if successful, -1 if the argument is malformed, the prefix already has a
+ * route, or there are too many routes.
+ */
+int fed_route_add(const char *spec) {
+    size_t prefix_len;
+    const char *host, *port;
+    if(fed_route_parse(spec, &prefix_len, &host, &port) == -1 ||
+       fed_num_routes == FED_MAX_ROUTES || fed_route_of(spec, prefix_len)) {
+        return -1;
+    }
+    FED_ROUTE *route = &(fed_routes[fed_num_routes]);
+    memset(route, 0, sizeof(*route));
+    memcpy(route->prefix, spec, prefix_len);
+    route->prefix_len = prefix_len;
+    route->host = strndup(host, port - host - 1);
+    route->port = strdup(port);
+    if(!route->host || !route->port) {
+        free(route->host);
+        free(route->port);
+        return -1;
+    }
+    Sem_init(&(route->mutex), 0, 1);
+    __atomic_store_n(&fed_num_routes, fed_num_routes + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void fed_route_connect(FED_ROUTE *route);
+
+/*
+ * Add a route to the dial plan, or point the route of its prefix at another PBX, as
+ * gossip learns that a node has moved.  The connections to the PBX the route led to
+ * are shut down, which hangs up the calls on them, and others are opened to the new
+ * one in the background.
+ *
+ * @param spec  The route, "<prefix>:<host>:<port>".
+ * @return 0 if successful, -1 if the argument is malformed, memory is short, or there
+ * are too many routes.
+ */
+int fed_route_update(const char *spec) {
+    size_t prefix_len;
+    const char *host, *port;
+    if(fed_route_parse(spec, &prefix_len, &host, &port) == -1) {
+        return -1;
+    }
+    FED_ROUTE *route = fed_route_of(spec, prefix_len);
+    if(!route) {
+        return fed_route_add(spec);
+    }
+    char *new_host = strndup(host, port - host - 1);
+    char *new_port = strdup(port);
+    if(!new_host || !new_port) {
+        free(new_host);
+        free(new_port);
+        return -1;
+    }
+    P(&(route->mutex));
+    if(!strcmp(route->host, new_host) && !strcmp(route->port, new_port)) {
+        V(&(route->mutex));
+        free(new_host);
+        free(new_port);
+        return 0;
+    }
+    char *old_host = route->host, *old_port = route->port;
+    route->host = new_host;
+    route->port = new_port;
+    route->generation++;
+    // The thread reading from each connection finds that it has ended, and gives it up.
+    for(int slot = 0; slot < FED_POOL_SIZE; slot++) {
+        if(route->links[slot]) {
+            shutdown(route->links[slot]->trunk->fd, SHUT_RDWR);
+        }
+    }
+    V(&(route->mutex));
+    free(old_host);
+    free(old_port);
+    fed_route_connect(route);
+    return 0;
+}
+
+/*
+ * Find the route of a dialed number.
+ *
+ * @param number  The number.
+ * @param ext  Set to the extension at the other PBX, unless NULL.
+ * @return the route with the longest prefix matching the number, or NULL if none does.
+ */
+static FED_ROUTE *fed_route_find(int number, int *ext) {
+    int num_routes = __atomic_load_n(&fed_num_routes, __ATOMIC_ACQUIRE);
+    if(number < 0 || num_routes == 0) {
+        return NULL;
+    }
+    char digits[16];
+    size_t n = snprintf(digits, sizeof(digits), "%d", number);
+    FED_ROUTE *best = NULL;
+    for(int i = 0; i < num_routes; i++) {
+        FED_ROUTE *route = &(fed_routes[i]);
+        if(n > route->prefix_len && !strncmp(digits, route->prefix, route->prefix_len) &&
+           (!best || route->prefix_len > best->prefix_len)) {
+            best = route;
+        }
+    }
+    if(best && ext) {
+        *ext = atoi(digits + best->prefix_len);
+    }
+    return best;
+}
+
+/*
+ * Determine whether a dialed number is routed to another PBX.
+ */
+int fed_routed(int number) {
+    return fed_route_find(number, NULL) != NULL;
+}
+
+static int fed_idle(int state) {
+    return state == TU_ON_HOOK || state == TU_DIAL_TONE || state == TU_BUSY_SIGNAL || state == TU_ERROR;
+}
+
+/*
+ * Get the state given by a notification of the text protocol, such as "CONNECTED 5".
+ *
+ * @return the state, or -1 if the notification gives none.
+ */
+static int fed_parse_state(const char *line, size_t len) {
+    static const struct {
+        const char *name;
+        int state;
+    } names[] = {
+        { "ON HOOK", TU_ON_HOOK }, { "RINGING", TU_RINGING }, { "DIAL TONE", TU_DIAL_TONE },
+        { "RING BACK", TU_RING_BACK }, { "BUSY SIGNAL", TU_BUSY_SIGNAL },
+        { "CONNECTED", TU_CONNECTED }, { "ERROR", TU_ERROR }, { "ON HOLD", TU_ON_HOLD },
+        { "HELD", TU_HELD }, { "PARKED", TU_PARKED }
+    };
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t n = strlen(names[i].name);
+        if(len >= n && !memcmp(line, names[i].name, n) && (len == n || line[n] == ' ')) {
+            return names[i].state;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Write a request without a payload into a buffer, as a frame on a channel.
+ */
+static void fed_pack(char *buf, uint32_t channel, int op, uint32_t id, int32_t arg) {
+    PROTO_HEADER h;
+    uint32_t c = htonl(channel);
+    proto_header_pack(&h, PROTO_REQUEST, op, 0, id, arg, 0);
+    memcpy(buf, &c, sizeof(c));
+    memcpy(buf + sizeof(c), &h, sizeof(h));
+}
+
+/*
+ * Send a request in a call to the other PBX.
+ */
+static void fed_request(FED_CALL *call, int op, int flags, uint32_t id, int32_t arg,
+                        const char *data, size_t len) {
+    PROTO_HEADER h;
+    proto_header_pack(&h, PROTO_REQUEST, op, flags, id, arg, len);
+    struct iovec iov[3] = { { NULL, 0 }, { &h, sizeof(h) }, { (void *)data, len } };
+    trunk_send(call->link->trunk, call->channel, iov, len ? 3 : 2);
+}
+
+/*
+ * Set up a call at the other PBX: open its channel, then have the virtual TU on it pick
+ * up and dial, all in one write.
+ */
+static void fed_setup(FED_CALL *call, int ext) {
+    char frames[3 * FED_FRAME_SIZE];
+    fed_pack(frames, call->channel, PROTO_OP_OPEN, FED_REQ_OPEN, 0);
+    fed_pack(frames + FED_FRAME_SIZE, call->channel, PROTO_OP_PICKUP, FED_REQ_CALL, 0);
+    fed_pack(frames + 2 * FED_FRAME_SIZE, call->channel, PROTO_OP_DIAL, FED_REQ_CALL, ext);
+    trunk_send_frames(call->link->trunk, frames, sizeof(frames));
+}
+
+/*
+ * Pass on a change in the state of a proxy, which is locked, to the other PBX.  A proxy
+ * that comes out of its call has its channel closed.  Changes that follow the virtual
+ * TU at the other PBX (the call being answered, put on hold from there, or turned away)
+ * have nothing to pass on.
+ *
+ * @param leg  The leg of the proxy.
+ * @param state  The new state of the proxy.
+ */
+void fed_leg_state(SHARD_LEG *leg, int state) {
+    int old = leg->state;
+    if(state == old) {
+        return;
+    }
+    leg->state = state;
+    FED_CALL *call = leg->fed;
+    if(old == TU_ON_HOOK && state == TU_RINGING) {
+        fed_setup(call, call->ext);
+    }
+    else if(old == TU_CONNECTED && state == TU_HELD) {
+        fed_request(call, PROTO_OP_HOLD, 0, FED_REQ_CALL, 0, NULL, 0);
+    }
+    else if(old == TU_HELD && state == TU_CONNECTED) {
+        fed_request(call, PROTO_OP_RESUME, 0, FED_REQ_CALL, 0, NULL, 0);
+    }
+    else if(!fed_idle(old) && fed_idle(state)) {
+        fed_request(call, PROTO_OP_CLOSE, 0, FED_REQ_CLOSE, 0, NULL, 0);
+    }
+}
+
+/*
+ * Pass on a chat, or a piece of a chat frame, sent to a proxy, to the other PBX.  Each
+ * piece of a frame goes as a request of its own, flagged as the pieces of a frame to a
+ * client are, so that nothing is held back.  The proxy and the sender are locked.
+ *
+ * @param leg  The leg of the proxy.
+ * @param op  PROTO_OP_CHAT for a whole chat, PROTO_OP_CHATF for a piece of a frame.
+ * @param data  The bytes of the chat or of the piece.
+ * @param len  The number of bytes.
+ * @param more  The number of bytes of the chat that follow this piece.
+ */
+void fed_leg_chat(SHARD_LEG *leg, int op, const char *data, size_t len, size_t more) {
+    fed_request(leg->fed, op, more ? PROTO_FLAG_MORE : 0, FED_REQ_CALL, proto_more_arg(more),
+                data, len);
+}
+
+/*
+ * Set up a call on a connection to another PBX, with a proxy standing for the remote
+ * party.  The proxy is on hook, and the table of calls holds the reference to it.
+ *
+ * The call is marked as being dialed, which the caller must undo once it has dialed.
+ *
+ * @param number  The number dialed, which the proxy takes as its extension.
+ * @param ext  The extension at the other PBX.
+ * @return the call, or NULL if memory is short, or the connection has ended or has no
+ * free channel.
+ */
+static FED_CALL *fed_call_create(FED_LINK *link, int local_ext, int number, int ext) {
+    SHARD_LEG *leg = calloc(1, sizeof(SHARD_LEG));
+    FED_CALL *call = calloc(1, sizeof(FED_CALL));
+    TU *tu = leg && call ? tu_init(-1) : NULL;
+    if(!tu) {
+        free(leg);
+        free(call);
+        return NULL;
+    }
+    leg->tu = tu;
+    leg->local_ext = local_ext;
+    leg->remote_ext = number;
+    leg->state = TU_ON_HOOK;
+    leg->fed = call;
+    tu_set_extension(tu, number);
+    tu_attach_leg(tu, leg);
+    call->leg = leg;
+    call->link = link;
+    call->ext = ext;
+    call->remote = TU_ON_HOOK;
+    call->dialing = 1;
+    P(&(link->mutex));
+    for(int n = 1; n < FED_LINK_CHANNELS && !call->channel && !link->lost; n++) {
+        uint32_t channel = link->next_channel;
+        link->next_channel = channel + 1 < FED_LINK_CHANNELS ? channel + 1 : 1;
+        if(!link->calls[channel]) {
+            link->calls[channel] = call;
+            call->channel = channel;
+        }
+    }
+    V(&(link->mutex));
+    if(!call->channel) {
+        free(call);
+        tu_unref(tu, "No channel for call to another PBX.");
+        return NULL;
+    }
+    metrics_add(METRIC_FED_CALLS, 1);
+    return call;
+}
+
+/*
+ * Be done with a call, if its proxy is no longer in it.  Only the thread reading from
+ * the connection of the call does so, once the channel has been closed, except for a
+ * call being dialed when the connection ended, which the dialing thread is left with.
+ */
+static void fed_call_reap(FED_CALL *call) {
+    TU_SNAPSHOT snap;
+    tu_snapshot(call->leg->tu, &snap, NULL);
+    if(!fed_idle(snap.state) || snap.peer != -1) {
+        return;
+    }
+    FED_LINK *link = call->link;
+    P(&(link->mutex));
+    link->calls[call->channel] = NULL;
+    V(&(link->mutex));
+    TU *tu = call->leg->tu;
+    free(call);
+    // The leg goes with the proxy.
+    tu_unref(tu, "Call to another PBX done with.");
+}
+
+/*
+ * Carry out on a proxy what the virtual TU at the other PBX has come to.
+ */
+static void fed_apply_state(FED_CALL *call, int state) {
+    TU *tu = call->leg->tu;
+    TU_SNAPSHOT snap;
+    tu_snapshot(tu, &snap, NULL);
+    int was = call->remote;
+    call->remote = state;
+    switch(state) {
+    case TU_ERROR:
+    case TU_BUSY_SIGNAL:
+        tu_refuse(tu, state);
+        break;
+    case TU_CONNECTED:
+        if(snap.state == TU_RINGING) {
+            tu_pickup(tu);
+        }
+        else if(snap.state == TU_ON_HOLD) {
+            tu_resume(tu);
+        }
+        break;
+    case TU_HELD:
+        tu_hold(tu);
+        break;
+    case TU_DIAL_TONE:
+    case TU_ON_HOOK:
+        if(was == TU_RING_BACK || was == TU_CONNECTED || was == TU_HELD || was == TU_ON_HOLD) {
+            tu_hangup(tu);
+        }
+        break;
+    }
+}
+
+/*
+ * Have a proxy send on a chat, or a piece of a chat frame, from the remote party, as it
+ * arrives.  A piece flagged as one that more follow keeps the frame open, even if the
+ * other PBX does not say how much.
+ */
+static void fed_apply_chat(FED_CALL *call, PROTO_HEADER *h, const char *payload) {
+    if(h->op == PROTO_OP_CHAT) {
+        tu_chatv(call->leg->tu, payload, h->len);
+        return;
+    }
+    size_t more = 0;
+    if(h->flags & PROTO_FLAG_MORE) {
+        more = h->arg > 0 ? (size_t)h->arg : 1;
+    }
+    tu_chat_frame(call->leg->tu, payload, h->len, more);
+}
+
+/*
+ * Carry out a frame from another PBX on the call on its channel.
+ */
+static void fed_receive(FED_LINK *link, uint32_t channel, PROTO_HEADER *h, const char *payload) {
+    // Channel 0 is the TU of the connection itself, which is in no call.
+    if(channel == 0 || channel >= FED_LINK_CHANNELS) {
+        return;
+    }
+    P(&(link->mutex));
+    FED_CALL *call = link->calls[channel];
+    V(&(link->mutex));
+    if(!call) {
+        return;
+    }
+    if(h->type == PROTO_RESPONSE && h->id == FED_REQ_CLOSE) {
+        fed_call_reap(call);
+    }
+    else if(h->flags & PROTO_FLAG_ERROR) {
+        // The other PBX had no virtual extension to spare.
+        if(h->id == FED_REQ_OPEN) {
+            tu_refuse(call->leg->tu, TU_ERROR);
+        }
+    }
+    else if(h->op == PROTO_OP_CHAT || h->op == PROTO_OP_CHATF) {
+        fed_apply_chat(call, h, payload);
+    }
+    else if(h->op == PROTO_OP_STATE) {
+        int state = fed_parse_state(payload, h->len);
+        if(state != -1) {
+            fed_apply_state(call, state);
+        }
+    }
+}
+
+/*
+ * Drop a reference to a connection, freeing it when the last is gone.
+ */
+static void fed_link_unref(FED_LINK *link) {
+    if(__atomic_sub_fetch(&(link->refs), 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    trunk_unref(link->trunk);
+    Sem_destroy(&(link->mutex));
+    free(link);
+}
+
+/*
+ * Give up a connection that has ended, hanging up the calls on it, and have another
+ * opened in the background.  A call that is still being dialed is left to the thread
+ * dialing it.
+ */
+static void fed_link_lost(FED_LINK *link) {
+    metrics_add(METRIC_FED_LINKS_LOST, 1);
+    FED_ROUTE *route = link->route;
+    P(&(route->mutex));
+    if(route->links[link->slot] == link) {
+        route->links[link->slot] = NULL;
+    }
+    V(&(route->mutex));
+    P(&(link->mutex));
+    link->lost = 1;
+    V(&(link->mutex));
+    trunk_close(link->trunk);
+    fed_route_connect(route);
+    int left = 0;
+    for(uint32_t channel = 1; channel < FED_LINK_CHANNELS; channel++) {
+        P(&(link->mutex));
+        FED_CALL *call = link->calls[channel];
+        if(call && call->dialing) {
+            call->orphaned = 1;
+            call = NULL;
+        }
+        V(&(link->mutex));
+        if(call) {
+            tu_hangup(call->leg->tu);
+            fed_call_reap(call);
+            P(&(link->mutex));
+            left += link->calls[channel] != NULL;
+            V(&(link->mutex));
+        }
+    }
+    // A proxy still in its call would still use the connection.
+    if(left) {
+        return;
+    }
+    fed_link_unref(link);
+}
+
+/*
+ * Thread function for the thread that reads the frames from a connection to another
+ * PBX, and carries them out on the calls on it, until the connection ends.
+ */
+static void *fed_link_thread(void *arg) {
+    FED_LINK *link = arg;
+    Pthread_detach(pthread_self());
+    rio_t rio;
+    rio_readinitb(&rio, link->trunk->fd);
+    char *payload = NULL;
+    size_t size = 0;
+    // The notification of the TU of the connection comes in the text protocol.
+    char c = '\0';
+    while(c != '\n' && rio_readnb(&rio, &c, 1) == 1) {
+        continue;
+    }
+    char frame[FED_FRAME_SIZE];
+    while(c == '\n' && rio_readnb(&rio, frame, sizeof(frame)) == sizeof(frame)) {
+        uint32_t channel;
+        PROTO_HEADER h;
+        memcpy(&channel, frame, sizeof(channel));
+        // Frames from a server are never well-formed requests; only the magic matters.
+        proto_header_unpack(frame + sizeof(channel), &h);
+        if(h.magic != PROTO_MAGIC || h.len > FED_MAX_PAYLOAD) {
+            break;
+        }
+        if(h.len + 1 > size) {
+            char *p = realloc(payload, h.len + 1);
+            if(!p) {
+                break;
+            }
+            payload = p;
+            size = h.len + 1;
+        }
+        if(rio_readnb(&rio, payload, h.len) != h.len) {
+            break;
+        }
+        fed_receive(link, ntohl(channel), &h, payload);
+    }
+    free(payload);
+    fed_link_lost(link);
+    return NULL;
+}
+
+/*
+ * Open a connection to the PBX of a route, switch it to a trunk, and put it in its slot
+ * in the pool of the route, which is locked only to do so.  A connection to a PBX that
+ * the route no longer leads to by then is given up.
+ *
+ * @return the connection, or NULL if it cannot be opened.
+ */
+static FED_LINK *fed_link_open(FED_ROUTE *route, int slot) {
+    P(&(route->mutex));
+    char *host = strdup(route->host);
+    char *port = strdup(route->port);
+    unsigned int generation = route->generation;
+    V(&(route->mutex));
+    int fd = host && port ? open_clientfd(host, port) : -1;
+    free(host);
+    free(port);
+    if(fd < 0) {
+        return NULL;
+    }
+    // The requests of a call are written together, and must not be held back.
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    struct iovec iov = { "proto 3" EOL, strlen("proto 3" EOL) };
+    FED_LINK *link = calloc(1, sizeof(FED_LINK));
+    TRUNK *trunk = link ? trunk_create(fd) : NULL;
+    if(!trunk || tu_writev_all(fd, &iov, 1) == -1) {
+        if(trunk) {
+            trunk_unref(trunk);
+        }
+        else {
+            close(fd);
+        }
+        free(link);
+        return NULL;
+    }
+    link->trunk = trunk;
+    Sem_init(&(link->mutex), 0, 1);
+    link->next_channel = 1;
+    link->slot = slot;
+    link->route = route;
+    link->refs = 1;
+    P(&(route->mutex));
+    int current = route->generation == generation;
+    if(current) {
+        route->links[slot] = link;
+    }
+    V(&(route->mutex));
+    if(!current) {
+        fed_link_unref(link);
+        return NULL;
+    }
+    pthread_t tid;
+    Pthread_create(&tid, NULL, fed_link_thread, link);
+    return link;
+}
+
+/*
+ * Open the connections missing from the pool of a route, without holding its lock while
+ * any is being opened.  Only the thread that has set the connecting flag of the route
+ * does so.
+ *
+ * @return the number of connections still missing, in which case the flag stays set;
+ * if none is, the flag is cleared.
+ */
+static int fed_route_fill(FED_ROUTE *route) {
+    for(int slot = 0; slot < FED_POOL_SIZE; slot++) {
+        P(&(route->mutex));
+        int empty = !route->links[slot];
+        V(&(route->mutex));
+        if(empty) {
+            fed_link_open(route, slot);
+        }
+    }
+    int missing = 0;
+    P(&(route->mutex));
+    for(int slot = 0; slot < FED_POOL_SIZE; slot++) {
+        missing += !route->links[slot];
+    }
+    if(!missing) {
+        route->connecting = 0;
+    }
+    V(&(route->mutex));
+    return missing;
+}
+
+/*
+ * Thread function for the thread that opens the connections of a route, trying again
+ * after longer and longer delays until they are all open.
+ */
+static void *fed_connect_thread(void *arg) {
+    FED_ROUTE *route = arg;
+    Pthread_detach(pthread_self());
+    useconds_t delay = FED_RETRY_MIN;
+    while(fed_route_fill(route)) {
+        usleep(delay);
+        delay = delay < FED_RETRY_MAX / 2 ? 2 * delay : FED_RETRY_MAX;
+    }
+    return NULL;
+}
+
+/*
+ * Have the missing connections of a route opened in the background, unless a thread is
+ * already at it.
+ */
+static void fed_route_connect(FED_ROUTE *route) {
+    P(&(route->mutex));
+    int start = !route->connecting;
+    route->connecting = 1;
+    V(&(route->mutex));
+    if(start) {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, fed_connect_thread, route);
+    }
+}
+
+/*
+ * Open the connections of the routes.  Those that cannot be opened yet are tried again
+ * in the background.
+ */
+void fed_start(void) {
+    for(int i = 0; i < fed_num_routes; i++) {
+        FED_ROUTE *route = &(fed_routes[i]);
+        P(&(route->mutex));
+        int start = !route->connecting;
+        route->connecting = 1;
+        V(&(route->mutex));
+        if(start && fed_route_fill(route)) {
+            pthread_t tid;
+            Pthread_create(&tid, NULL, fed_connect_thread, route);
+        }
+    }
+}
+
+/*
+ * Call a number routed to another PBX, through a proxy standing for the remote party.
+ * If no connection to the other PBX is open, or it cannot be reached, the call fails at
+ * once, as a dial to an empty local extension does, while the connections are opened
+ * again in the background.  No lock is held while the caller dials the proxy: the call
+ * is marked as being dialed instead, so that a connection ending in the meantime leaves
+ * it to this thread to hang up.
+ *
+ * @param tu  The TU that is dialing.
+ * @param number  The number dialed, which must be routed to another PBX.
+ * @return 0 if dialing succeeds, otherwise -1.
+ */
+int fed_dial(TU *tu, int number) {
+    int ext;
+    FED_ROUTE *route = fed_route_find(number, &ext);
+    // Only a TU with a dial tone can ring the proxy; for any other, dialing does nothing.
+    TU_SNAPSHOT snap;
+    tu_snapshot(tu, &snap, NULL);
+    if(!route || snap.state != TU_DIAL_TONE) {
+        return tu_dial(tu, NULL);
+    }
+    P(&(route->mutex));
+    FED_LINK *link = NULL;
+    int missing = 0;
+    unsigned int next = route->next++;
+    for(int n = 0; n < FED_POOL_SIZE; n++) {
+        FED_LINK *l = route->links[(next + n) % FED_POOL_SIZE];
+        missing += !l;
+        if(l && !link) {
+            link = l;
+            __atomic_add_fetch(&(link->refs), 1, __ATOMIC_RELAXED);
+        }
+    }
+    V(&(route->mutex));
+    if(missing) {
+        fed_route_connect(route);
+    }
+    if(!link) {
+        return tu_dial(tu, NULL);
+    }
+    FED_CALL *call = fed_call_create(link, tu_extension(tu), number, ext);
+    int ret = tu_dial(tu, call ? call->leg->tu : NULL);
+    if(call) {
+        P(&(link->mutex));
+        call->dialing = 0;
+        int orphaned = call->orphaned;
+        V(&(link->mutex));
+        if(orphaned) {
+            uint32_t channel = call->channel;
+            tu_hangup(call->leg->tu);
+            fed_call_reap(call);
+            P(&(link->mutex));
+            int left = link->calls[channel] != NULL;
+            V(&(link->mutex));
+            // As when the connection ended, a proxy still in its call would still use it.
+            if(left) {
+                return ret;
+            }
+        }
+    }
+    fed_link_unref(link);
+    return ret;
+}
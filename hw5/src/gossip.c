@@ -0,0 +1,639 @@
+/*
+ * Gossip: the directory of the extensions registered at every node of a cluster.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "gossip.h"
+#include "federation.h"
+#include "pbx_ext.h"
+#include "metrics.h"
+#include "csapp.h"
+
+#define GOSSIP_MAGIC "PBXG"
+#define GOSSIP_VERSION 1
+
+/*
+ * Largest datagram sent, and the number of deltas that fit in one.
+ */
+#define GOSSIP_DATAGRAM_SIZE 1400
+#define GOSSIP_DELTAS_PER_DATAGRAM \
+    ((GOSSIP_DATAGRAM_SIZE - sizeof(GOSSIP_HEADER) - sizeof(GOSSIP_RECORD) - sizeof(uint64_t)) / sizeof(GOSSIP_DELTA))
+
+/*
+ * Largest number of datagrams of deltas sent in answer to one digest.  The rest are
+ * sent on later rounds.
+ */
+#define GOSSIP_MAX_BATCH 16
+
+#define GOSSIP_BUCKETS 65536
+#define GOSSIP_NSEC_PER_MS 1000000
+
+/*
+ * Kinds of datagrams.
+ */
+enum {
+    GOSSIP_DIGEST = 1,    // A version vector, to be answered with deltas and a digest.
+    GOSSIP_REPLY,         // A version vector, to be answered with deltas only.
+    GOSSIP_DELTAS         // Entries of one node, following on from a version.
+};
+
+/*
+ * Every datagram starts with a header, followed by count records for a digest, or by
+ * one record, the version after which the deltas follow, and count deltas.  All fields
+ * are in network byte order.
+ */
+typedef struct gossip_header {
+    char magic[4];
+    uint8_t version;
+    uint8_t type;
+    uint16_t count;
+} __attribute__((packed)) GOSSIP_HEADER;
+
+typedef struct gossip_record {
+    uint32_t node;
+    uint32_t addr;              // IPv4 address of the node.
+    uint16_t gossip_port;       // Port on which it gossips.
+    uint16_t pbx_port;          // Port on which it serves clients.
+    uint64_t incarnation;
+    uint64_t version;           // For deltas, the version that they bring the receiver to.
+} __attribute__((packed)) GOSSIP_RECORD;
+
+typedef struct gossip_delta {
+    uint32_t ext;
+    uint8_t registered;
+    uint64_t version;
+} __attribute__((packed)) GOSSIP_DELTA;
+
+/*
+ * The entry of an extension of a node.
+ */
+typedef struct gossip_entry {
+    int number;                     // Number dialed for the extension from another node.
+    int ext;
+    int registered;
+    uint64_t version;
+    struct gossip_origin *origin;   // The node.
+    struct gossip_entry *prev, *next; // Entries of the node, in order of version.
+    struct gossip_entry *chain;     // Next entry in the same bucket of the lookup table.
+} GOSSIP_ENTRY;
+
+/*
+ * What is known of a node.  Entry 0 of the table is this one.
+ */
+typedef struct gossip_origin {
+    uint32_t node;
+    char prefix[8];                 // The node ID, as digits.
+    size_t prefix_len;
+    uint64_t incarnation;
+    uint64_t version;               // All entries of the node up to this one are known.
+    struct sockaddr_in addr;        // Gossip address of the node.
+    uint16_t pbx_port;
+    GOSSIP_ENTRY *head, *tail;
+} GOSSIP_ORIGIN;
+
+static int gossip_fd = -1;
+static uint32_t gossip_node;
+static char *gossip_host, *gossip_port;
+static char *gossip_seeds[GOSSIP_MAX_SEEDS];
+static struct sockaddr_in gossip_seed_addrs[GOSSIP_MAX_SEEDS];
+static int gossip_num_seeds;
+
+// All of the following are guarded by the mutex.
+static sem_t gossip_mutex;
+static GOSSIP_ORIGIN gossip_origins[GOSSIP_MAX_NODES];
+static int gossip_num_origins;
+static GOSSIP_ENTRY *gossip_table[GOSSIP_BUCKETS];
+
+static uint64_t gossip_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Split "<host>:<port>" into copies of its parts.
+ *
+ * @return 0 if successful, -1 if it is malformed or memory is short.
+ */
+static int gossip_split(const char *spec, char **host, char **port) {
+    const char *colon = strrchr(spec, ':');
+    if(!colon || colon == spec || !colon[1]) {
+        return -1;
+    }
+    *host = strndup(spec, colon - spec);
+    *port = strdup(colon + 1);
+    if(!*host || !*port) {
+        free(*host);
+        free(*port);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Look up an IPv4 address.
+ *
+ * @return 0 if successful, -1 if there is none.
+ */
+static int gossip_resolve(const char *host, const char *port, struct sockaddr_in *sin) {
+    struct addrinfo hints = { 0 };
+    struct addrinfo *list;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if(getaddrinfo(host, port, &hints, &list) != 0) {
+        return -1;
+    }
+    memcpy(sin, list->ai_addr, sizeof(*sin));
+    freeaddrinfo(list);
+    return 0;
+}
+
+/*
+ * Set the node ID and gossip address of this node.
+ *
+ * @param spec  The argument of the -G option, "<node>:<host>:<port>".
+ * @return 0 if successful, -1 if the argument is malformed.
+ */
+int gossip_config(const char *spec) {
+    char *end;
+    long node = strtol(spec, &end, 10);
+    if(end == spec || *end != ':' || node < 1 || node > GOSSIP_MAX_NODE) {
+        return -1;
+    }
+    if(gossip_split(end + 1, &gossip_host, &gossip_port) == -1) {
+        return -1;
+    }
+    // Registrations are recorded from here on, even those taken over before gossip starts.
+    GOSSIP_ORIGIN *self = &(gossip_origins[0]);
+    self->node = gossip_node = node;
+    self->prefix_len = snprintf(self->prefix, sizeof(self->prefix), "%u", gossip_node);
+    Sem_init(&gossip_mutex, 0, 1);
+    gossip_num_origins = 1;
+    return 0;
+}
+
+/*
+ * Add a node to gossip with to begin with.
+ *
+ * @param spec  The argument of the -P option, "<host>:<port>".
+ * @return 0 if successful, -1 if the argument is malformed or there are too many.
+ */
+int gossip_seed(const char *spec) {
+    char *host, *port;
+    if(gossip_num_seeds == GOSSIP_MAX_SEEDS || gossip_split(spec, &host, &port) == -1) {
+        return -1;
+    }
+    int n = strlen(host) + strlen(port) + 2;
+    gossip_seeds[gossip_num_seeds] = malloc(n);
+    if(!gossip_seeds[gossip_num_seeds]) {
+        free(host);
+        free(port);
+        return -1;
+    }
+    snprintf(gossip_seeds[gossip_num_seeds++], n, "%s:%s", host, port);
+    free(host);
+    free(port);
+    return 0;
+}
+
+/*
+ * Get the number dialed for an extension of a node from other nodes.
+ */
+static int gossip_number(GOSSIP_ORIGIN *o, int ext) {
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%s%d", o->prefix, ext);
+    return atoi(digits);
+}
+
+static GOSSIP_ENTRY **gossip_bucket(int number) {
+    return &(gossip_table[((uint32_t)number * 2654435761u) % GOSSIP_BUCKETS]);
+}
+
+static GOSSIP_ENTRY *gossip_lookup(int number) {
+    GOSSIP_ENTRY *e = *gossip_bucket(number);
+    while(e && e->number != number) {
+        e = e->chain;
+    }
+    return e;
+}
+
+/*
+ * Set an entry of a node to a new version, moving it to the end of the entries of the
+ * node, and creating it if need be.
+ *
+ * @return 0 if successful, -1 if memory is short.
+ */
+static int gossip_set(GOSSIP_ORIGIN *o, int ext, int registered, uint64_t version) {
+    int number = gossip_number(o, ext);
+    GOSSIP_ENTRY *e = gossip_lookup(number);
+    if(e && e->origin != o) {
+        return -1;
+    }
+    if(!e) {
+        if(!(e = calloc(1, sizeof(GOSSIP_ENTRY)))) {
+            return -1;
+        }
+        e->number = number;
+        e->ext = ext;
+        e->origin = o;
+        GOSSIP_ENTRY **bucket = gossip_bucket(number);
+        e->chain = *bucket;
+        *bucket = e;
+    }
+    else if(e->version >= version) {
+        return 0;
+    }
+    else {
+        // Take it out of the list of the node, to go back in at the end.
+        if(e->prev) {
+            e->prev->next = e->next;
+        }
+        else {
+            o->head = e->next;
+        }
+        if(e->next) {
+            e->next->prev = e->prev;
+        }
+        else {
+            o->tail = e->prev;
+        }
+    }
+    e->registered = registered;
+    e->version = version;
+    e->next = NULL;
+    e->prev = o->tail;
+    if(o->tail) {
+        o->tail->next = e;
+    }
+    else {
+        o->head = e;
+    }
+    o->tail = e;
+    return 0;
+}
+
+/*
+ * Forget all the entries of a node, as those of an incarnation that is gone.
+ */
+static void gossip_clear(GOSSIP_ORIGIN *o) {
+    GOSSIP_ENTRY *e = o->head;
+    while(e) {
+        GOSSIP_ENTRY *next = e->next;
+        GOSSIP_ENTRY **link = gossip_bucket(e->number);
+        while(*link != e) {
+            link = &((*link)->chain);
+        }
+        *link = e->chain;
+        free(e);
+        e = next;
+    }
+    o->head = o->tail = NULL;
+    o->version = 0;
+}
+
+static GOSSIP_ORIGIN *gossip_find(uint32_t node) {
+    for(int i = 0; i < gossip_num_origins; i++) {
+        if(gossip_origins[i].node == node) {
+            return &(gossip_origins[i]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Take note of what a record says about a node: a node not known before gets a route
+ * of its own, and one that has started again loses the entries of its last incarnation
+ * and has its route pointed at the address it now gives.
+ *
+ * @return the node, or NULL if the record is about this node, or comes from an older
+ * incarnation, or there is no room for another node.
+ */
+static GOSSIP_ORIGIN *gossip_learn(GOSSIP_RECORD *r) {
+    uint32_t node = ntohl(r->node);
+    uint64_t incarnation = be64toh(r->incarnation);
+    if(node == gossip_node || node < 1 || node > GOSSIP_MAX_NODE) {
+        return NULL;
+    }
+    GOSSIP_ORIGIN *o = gossip_find(node);
+    if(!o) {
+        if(gossip_num_origins == GOSSIP_MAX_NODES) {
+            return NULL;
+        }
+        o = &(gossip_origins[gossip_num_origins++]);
+        memset(o, 0, sizeof(*o));
+        o->node = node;
+        o->prefix_len = snprintf(o->prefix, sizeof(o->prefix), "%u", node);
+    }
+    else if(incarnation < o->incarnation) {
+        return NULL;
+    }
+    if(incarnation > o->incarnation || !o->pbx_port) {
+        gossip_clear(o);
+        o->incarnation = incarnation;
+        o->addr.sin_family = AF_INET;
+        o->addr.sin_addr.s_addr = r->addr;
+        o->addr.sin_port = r->gossip_port;
+        o->pbx_port = ntohs(r->pbx_port);
+        // Calls to the node go to the host at which it gossips, which may have changed
+        // since its last incarnation.
+        char spec[64], host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(o->addr.sin_addr), host, sizeof(host));
+        snprintf(spec, sizeof(spec), "%s:%s:%u", o->prefix, host, o->pbx_port);
+        fed_route_update(spec);
+    }
+    return o;
+}
+
+static void gossip_record(GOSSIP_ORIGIN *o, GOSSIP_RECORD *r, uint64_t version) {
+    r->node = htonl(o->node);
+    r->addr = o->addr.sin_addr.s_addr;
+    r->gossip_port = o->addr.sin_port;
+    r->pbx_port = htons(o->pbx_port);
+    r->incarnation = htobe64(o->incarnation);
+    r->version = htobe64(version);
+}
+
+static void gossip_send(const void *buf, size_t len, const struct sockaddr_in *to) {
+    if(sendto(gossip_fd, buf, len, 0, (const struct sockaddr *)to, sizeof(*to)) != -1) {
+        metrics_add(METRIC_GOSSIP_DATAGRAMS, 1);
+    }
+}
+
+/*
+ * Send a digest of what this node knows.
+ */
+static void gossip_send_digest(int type, const struct sockaddr_in *to) {
+    char buf[GOSSIP_DATAGRAM_SIZE];
+    GOSSIP_HEADER *h = (GOSSIP_HEADER *)buf;
+    memcpy(h->magic, GOSSIP_MAGIC, 4);
+    h->version = GOSSIP_VERSION;
+    h->type = type;
+    h->count = htons(gossip_num_origins);
+    GOSSIP_RECORD *r = (GOSSIP_RECORD *)(buf + sizeof(*h));
+    for(int i = 0; i < gossip_num_origins; i++) {
+        gossip_record(&(gossip_origins[i]), &(r[i]), gossip_origins[i].version);
+    }
+    gossip_send(buf, sizeof(*h) + gossip_num_origins * sizeof(*r), to);
+}
+
+/*
+ * Send the entries of a node after a given version, in datagrams each of which follows
+ * on from the one before.
+ */
+static void gossip_send_deltas(GOSSIP_ORIGIN *o, uint64_t from, const struct sockaddr_in *to) {
+    GOSSIP_ENTRY *e = o->tail;
+    while(e && e->prev && e->prev->version > from) {
+        e = e->prev;
+    }
+    if(e && e->version <= from) {
+        e = NULL;
+    }
+    char buf[GOSSIP_DATAGRAM_SIZE];
+    GOSSIP_HEADER *h = (GOSSIP_HEADER *)buf;
+    GOSSIP_RECORD *r = (GOSSIP_RECORD *)(buf + sizeof(*h));
+    uint64_t *after = (uint64_t *)(r + 1);
+    GOSSIP_DELTA *d = (GOSSIP_DELTA *)(after + 1);
+    memcpy(h->magic, GOSSIP_MAGIC, 4);
+    h->version = GOSSIP_VERSION;
+    h->type = GOSSIP_DELTAS;
+    for(int n = 0; n < GOSSIP_MAX_BATCH && e; n++) {
+        size_t count = 0;
+        for(; e && count < GOSSIP_DELTAS_PER_DATAGRAM; e = e->next, count++) {
+            d[count].ext = htonl(e->ext);
+            d[count].registered = e->registered;
+            d[count].version = htobe64(e->version);
+        }
+        // The last datagram brings the receiver up to date, versions superseded included.
+        uint64_t version = e ? d[count - 1].version : htobe64(o->version);
+        gossip_record(o, r, be64toh(version));
+        *after = htobe64(from);
+        h->count = htons(count);
+        gossip_send(buf, (char *)(d + count) - buf, to);
+        from = be64toh(version);
+    }
+}
+
+/*
+ * Answer a digest with the entries that it shows its sender to be missing, and if it
+ * shows this node to be missing some, and is not itself an answer, with a digest.
+ */
+static void gossip_receive_digest(int type, GOSSIP_RECORD *r, int count, const struct sockaddr_in *from) {
+    int behind = 0;
+    for(int i = 0; i < count; i++) {
+        GOSSIP_ORIGIN *o = gossip_learn(&(r[i]));
+        if(o && be64toh(r[i].incarnation) == o->incarnation && be64toh(r[i].version) > o->version) {
+            behind = 1;
+        }
+    }
+    for(int i = 0; i < gossip_num_origins; i++) {
+        GOSSIP_ORIGIN *o = &(gossip_origins[i]);
+        uint64_t version = 0;
+        int j = 0;
+        while(j < count && ntohl(r[j].node) != o->node) {
+            j++;
+        }
+        if(j < count && be64toh(r[j].incarnation) > o->incarnation) {
+            continue;
+        }
+        if(j < count && be64toh(r[j].incarnation) == o->incarnation) {
+            version = be64toh(r[j].version);
+        }
+        if(o->version > version) {
+            gossip_send_deltas(o, version, from);
+        }
+    }
+    if(behind && type == GOSSIP_DIGEST) {
+        gossip_send_digest(GOSSIP_REPLY, from);
+    }
+}
+
+/*
+ * Apply a datagram of entries of a node, if it follows on from those known here.
+ */
+static void gossip_receive_deltas(GOSSIP_RECORD *r, uint64_t after, GOSSIP_DELTA *d, int count) {
+    GOSSIP_ORIGIN *o = gossip_learn(r);
+    if(!o || be64toh(r->incarnation) != o->incarnation || after > o->version) {
+        return;
+    }
+    for(int i = 0; i < count; i++) {
+        uint64_t version = be64toh(d[i].version);
+        if(version > o->version && gossip_set(o, ntohl(d[i].ext), d[i].registered, version) == 0) {
+            metrics_add(METRIC_GOSSIP_ENTRIES, 1);
+        }
+    }
+    uint64_t version = be64toh(r->version);
+    if(version > o->version) {
+        o->version = version;
+    }
+}
+
+/*
+ * Check and carry out a datagram from another node.
+ */
+static void gossip_receive(char *buf, size_t len, const struct sockaddr_in *from) {
+    GOSSIP_HEADER *h = (GOSSIP_HEADER *)buf;
+    if(len < sizeof(*h) || memcmp(h->magic, GOSSIP_MAGIC, 4) || h->version != GOSSIP_VERSION) {
+        return;
+    }
+    int count = ntohs(h->count);
+    char *body = buf + sizeof(*h);
+    if(h->type == GOSSIP_DIGEST || h->type == GOSSIP_REPLY) {
+        if(len >= sizeof(*h) + count * sizeof(GOSSIP_RECORD)) {
+            gossip_receive_digest(h->type, (GOSSIP_RECORD *)body, count, from);
+        }
+    }
+    else if(h->type == GOSSIP_DELTAS) {
+        size_t need = sizeof(*h) + sizeof(GOSSIP_RECORD) + sizeof(uint64_t) + count * sizeof(GOSSIP_DELTA);
+        if(len >= need) {
+            uint64_t after;
+            memcpy(&after, body + sizeof(GOSSIP_RECORD), sizeof(after));
+            gossip_receive_deltas((GOSSIP_RECORD *)body, be64toh(after),
+                                  (GOSSIP_DELTA *)(body + sizeof(GOSSIP_RECORD) + sizeof(after)), count);
+        }
+    }
+}
+
+/*
+ * Send a digest to a node chosen at random among those known and those to begin with.
+ */
+static void gossip_round(void) {
+    int n = gossip_num_origins - 1 + gossip_num_seeds;
+    if(n == 0) {
+        return;
+    }
+    int i = rand() % n;
+    if(i < gossip_num_origins - 1) {
+        gossip_send_digest(GOSSIP_DIGEST, &(gossip_origins[i + 1].addr));
+    }
+    else {
+        gossip_send_digest(GOSSIP_DIGEST, &(gossip_seed_addrs[i - (gossip_num_origins - 1)]));
+    }
+}
+
+/*
+ * Thread function for the thread that gossips with the other nodes.
+ */
+static void *gossip_thread(void *arg) {
+    uint64_t next_round = gossip_clock();
+    char buf[GOSSIP_DATAGRAM_SIZE];
+    while(1) {
+        uint64_t now = gossip_clock();
+        if(now >= next_round) {
+            P(&gossip_mutex);
+            gossip_round();
+            V(&gossip_mutex);
+            next_round = now + (uint64_t)GOSSIP_INTERVAL_MS * GOSSIP_NSEC_PER_MS;
+        }
+        struct pollfd pfd = { gossip_fd, POLLIN, 0 };
+        if(poll(&pfd, 1, (next_round - now) / GOSSIP_NSEC_PER_MS + 1) <= 0) {
+            continue;
+        }
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t len = recvfrom(gossip_fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+        if(len > 0 && from.sin_family == AF_INET) {
+            P(&gossip_mutex);
+            gossip_receive(buf, len, &from);
+            V(&gossip_mutex);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Join the cluster, if a node ID was given: open the gossip socket, take a new
+ * incarnation, and start gossiping.
+ *
+ * @param pbx_port  The port on which this server serves clients.
+ * @return 0 if successful, -1 if the gossip socket cannot be opened.
+ */
+int gossip_start(const char *pbx_port) {
+    if(!gossip_node) {
+        return 0;
+    }
+    GOSSIP_ORIGIN *self = &(gossip_origins[0]);
+    if(gossip_resolve(gossip_host, gossip_port, &(self->addr)) == -1) {
+        return -1;
+    }
+    if((gossip_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+        return -1;
+    }
+    if(bind(gossip_fd, (struct sockaddr *)&(self->addr), sizeof(self->addr)) == -1) {
+        close(gossip_fd);
+        gossip_fd = -1;
+        return -1;
+    }
+    for(int i = 0; i < gossip_num_seeds; i++) {
+        char *host, *port;
+        if(gossip_split(gossip_seeds[i], &host, &port) == -1) {
+            return -1;
+        }
+        int ret = gossip_resolve(host, port, &(gossip_seed_addrs[i]));
+        free(host);
+        free(port);
+        if(ret == -1) {
+            return -1;
+        }
+    }
+    self->pbx_port = atoi(pbx_port);
+    // An incarnation that only grows from one start to the next.
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    self->incarnation = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    srand(self->incarnation ^ getpid());
+    pthread_t tid;
+    Pthread_create(&tid, NULL, gossip_thread, NULL);
+    return 0;
+}
+
+/*
+ * Record a change to the registration of an extension of this node, to be passed on to
+ * the others.
+ */
+void gossip_publish(int ext, int registered) {
+    if(!gossip_node) {
+        return;
+    }
+    P(&gossip_mutex);
+    GOSSIP_ORIGIN *self = &(gossip_origins[0]);
+    if(gossip_set(self, ext, registered, self->version + 1) == 0) {
+        self->version++;
+    }
+    V(&gossip_mutex);
+}
+
+/*
+ * Determine whether a dialed number is that of an extension of another node which the
+ * directory shows is not registered there.
+ */
+int gossip_absent(int number) {
+    if(!gossip_node) {
+        return 0;
+    }
+    P(&gossip_mutex);
+    GOSSIP_ENTRY *e = gossip_lookup(number);
+    int absent = e ? !e->registered && e->origin != &(gossip_origins[0]) : 0;
+    if(!e) {
+        // A number of a known node, at an extension it has never had.
+        char digits[16];
+        size_t n = snprintf(digits, sizeof(digits), "%d", number);
+        for(int i = 1; i < gossip_num_origins && !absent; i++) {
+            GOSSIP_ORIGIN *o = &(gossip_origins[i]);
+            absent = n > o->prefix_len && !strncmp(digits, o->prefix, o->prefix_len);
+        }
+    }
+    V(&gossip_mutex);
+    return absent;
+}
@@ -0,0 +1,664 @@
+/*
+ * Hot restart: handing the live connections of a running server over to a new one.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "server_ext.h"
+#include "ratelimit.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Kinds of messages sent between the servers.
+ */
+#define HANDOFF_LISTENERS_MSG 1  // Listening sockets; payload: their indices; arg: largest extension.
+#define HANDOFF_CLIENTS_MSG 2    // Connections; payload: a HANDOFF_CLIENT for each socket.
+#define HANDOFF_PENDING_MSG 3    // Part of the pending input of the connection at extension arg.
+#define HANDOFF_HISTORY_MSG 4    // Chat history of the call of the connection at extension arg.
+#define HANDOFF_END_MSG 5        // Nothing more to come.
+#define HANDOFF_DONE_MSG 6       // From the new server: everything has been taken over.
+
+typedef struct handoff_msg {
+    uint32_t type;
+    uint32_t count;     // Number of sockets or records.
+    int32_t arg;
+} HANDOFF_MSG;
+
+typedef struct handoff_client {
+    TU_SNAPSHOT snap;
+    int32_t discard;
+    uint32_t pending_len;
+} HANDOFF_CLIENT;
+
+/*
+ * Largest payload of a message.
+ */
+#define HANDOFF_MAX_PAYLOAD (HANDOFF_BATCH * sizeof(HANDOFF_CLIENT) > sizeof(CHAT_HISTORY) ? \
+                             HANDOFF_BATCH * sizeof(HANDOFF_CLIENT) : sizeof(CHAT_HISTORY))
+
+/*
+ * Threads taking part in hot restarts, and the state of the one under way, if any.
+ * The mutex guards all of these but the flag that handoffs are enabled.
+ */
+static pthread_once_t handoff_once = PTHREAD_ONCE_INIT;
+static int handoff_enabled;
+static sem_t handoff_mutex;
+static sem_t handoff_resume;     // Posted for each stopped thread if a handoff fails.
+static HANDOFF_CONN *handoff_list;
+static int handoff_joined;
+static int handoff_parked;
+static int handoff_waiting;      // Threads that joined during a handoff.
+static int handoff_active;
+static int handoff_listenfds[HANDOFF_LISTENERS];
+
+/*
+ * Connections taken over, waiting for handoff_start(), linked through their next fields.
+ */
+static HANDOFF_CONN *handoff_taken;
+
+/*
+ * A connection taken over by the new server, until it is served again.
+ */
+typedef struct handoff_taken {
+    HANDOFF_CLIENT client;
+    char *pending;
+    size_t pending_len;          // Bytes of pending input received so far.
+    CHAT_HISTORY *history;
+    TU *tu;
+} HANDOFF_TAKEN;
+
+/*
+ * The signal sent to stop threads.  It only needs to interrupt the system call that the
+ * thread is waiting in, so its handler does nothing.
+ */
+static void handoff_signal(int sig) {
+}
+
+static void handoff_setup(void) {
+    Sem_init(&handoff_mutex, 0, 1);
+    Sem_init(&handoff_resume, 0, 0);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handoff_signal;
+    sigemptyset(&sa.sa_mask);
+    // Not SA_RESTART: the waits must be interrupted.
+    sa.sa_flags = 0;
+    sigaction(SIGUSR2, &sa, NULL);
+    handoff_enabled = 1;
+}
+
+/*
+ * Add the calling thread to the threads that a hot restart stops.  A thread joining
+ * during a handoff waits until it is over: its connection is not handed over.
+ *
+ * @param c  The thread's record, which stays in use until handoff_leave().
+ */
+void handoff_join(HANDOFF_CONN *c) {
+    if(!handoff_enabled) {
+        return;
+    }
+    c->thread = pthread_self();
+    c->parked = 0;
+    P(&handoff_mutex);
+    c->prev = NULL;
+    c->next = handoff_list;
+    if(handoff_list) {
+        handoff_list->prev = c;
+    }
+    handoff_list = c;
+    handoff_joined++;
+    int wait = handoff_active;
+    if(wait) {
+        handoff_waiting++;
+    }
+    V(&handoff_mutex);
+    if(wait) {
+        P(&handoff_resume);
+    }
+}
+
+/*
+ * Remove the calling thread from the threads that a hot restart stops.
+ */
+void handoff_leave(HANDOFF_CONN *c) {
+    if(!handoff_enabled) {
+        return;
+    }
+    P(&handoff_mutex);
+    if(c->prev) {
+        c->prev->next = c->next;
+    }
+    else {
+        handoff_list = c->next;
+    }
+    if(c->next) {
+        c->next->prev = c->prev;
+    }
+    handoff_joined--;
+    V(&handoff_mutex);
+}
+
+/*
+ * Stop the calling thread if a handoff is under way, once it has filled in its record
+ * with what it leaves behind.  If the handoff succeeds, the process exits while the
+ * thread is stopped; otherwise the thread goes on.
+ *
+ * @return 1 if the thread was stopped, 0 if there is no handoff under way.
+ */
+int handoff_park(HANDOFF_CONN *c) {
+    if(!__atomic_load_n(&handoff_active, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    P(&handoff_mutex);
+    if(!handoff_active) {
+        V(&handoff_mutex);
+        return 0;
+    }
+    c->parked = 1;
+    handoff_parked++;
+    V(&handoff_mutex);
+    P(&handoff_resume);
+    return 1;
+}
+
+/*
+ * Send a message, with a payload and sockets.
+ *
+ * @return 0 if successful, -1 if an error occurs.
+ */
+static int handoff_send(int sock, uint32_t type, uint32_t count, int32_t arg,
+                        const void *data, size_t len, const int *fds, int nfds) {
+    HANDOFF_MSG h = { type, count, arg };
+    struct iovec iov[2] = { { &h, sizeof(h) }, { (void *)data, len } };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    } control;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len > 0 ? 2 : 1;
+    if(nfds > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+    while(sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+        if(errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Receive a message, with its payload and sockets.
+ *
+ * @param fds  Receives the sockets, of which there are at most HANDOFF_BATCH.
+ * @param nfds  Receives the number of sockets.
+ * @return the length of the payload, or -1 if an error occurs or the connection ends.
+ */
+static ssize_t handoff_recv(int sock, HANDOFF_MSG *h, void *data, int *fds, int *nfds) {
+    struct iovec iov[2] = { { h, sizeof(*h) }, { data, HANDOFF_MAX_PAYLOAD } };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    } control;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    while((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    *nfds = 0;
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nfds);
+        }
+    }
+    if(n < (ssize_t)sizeof(*h) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        for(int i = 0; i < *nfds; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return n - sizeof(*h);
+}
+
+/*
+ * Stop all of the threads taking part, waiting for at most HANDOFF_QUIESCE_MS.
+ * Each is sent a signal, again every few milliseconds, until it has stopped: one that
+ * was not waiting when the signal came only stops when it next waits.
+ *
+ * @return 0 if successful, -1 if the time ran out.
+ */
+static int handoff_quiesce(void) {
+    uint64_t deadline = rate_clock() + HANDOFF_QUIESCE_MS * 1000000ULL;
+    while(1) {
+        P(&handoff_mutex);
+        if(handoff_parked == handoff_joined - handoff_waiting) {
+            V(&handoff_mutex);
+            return 0;
+        }
+        for(HANDOFF_CONN *c = handoff_list; c; c = c->next) {
+            if(!c->parked) {
+                pthread_kill(c->thread, SIGUSR2);
+            }
+        }
+        V(&handoff_mutex);
+        if(rate_clock() >= deadline) {
+            return -1;
+        }
+        usleep(10000);
+    }
+}
+
+/*
+ * Send the state of the stopped threads: the listening sockets, then the connections
+ * in batches, each batch followed by the pending input and chat histories that go
+ * with it.
+ *
+ * @return 0 if successful, -1 if an error occurs.
+ */
+static int handoff_send_state(int sock) {
+    // The new server moves its own sockets above the largest extension taken over.
+    int max_ext = -1;
+    for(HANDOFF_CONN *c = handoff_list; c; c = c->next) {
+        if(c->tu && c->fd > max_ext) {
+            max_ext = c->fd;
+        }
+    }
+    int32_t indices[HANDOFF_LISTENERS];
+    int fds[HANDOFF_BATCH];
+    int n = 0;
+    for(int i = 0; i < HANDOFF_LISTENERS; i++) {
+        if(handoff_listenfds[i] != -1) {
+            indices[n] = i;
+            fds[n++] = handoff_listenfds[i];
+        }
+    }
+    if(handoff_send(sock, HANDOFF_LISTENERS_MSG, n, max_ext, indices, sizeof(int32_t) * n, fds, n) == -1) {
+        return -1;
+    }
+
+    static HANDOFF_CLIENT clients[HANDOFF_BATCH];
+    static HANDOFF_CONN *batch[HANDOFF_BATCH];
+    static CHAT_HISTORY history;
+    HANDOFF_CONN *c = handoff_list;
+    while(c) {
+        n = 0;
+        for(; c && n < HANDOFF_BATCH; c = c->next) {
+            if(!c->tu) {
+                continue;
+            }
+            batch[n] = c;
+            fds[n] = c->fd;
+            memset(&clients[n], 0, sizeof(clients[n]));
+            tu_snapshot(c->tu, &(clients[n].snap), NULL);
+            clients[n].snap.proto = c->proto;
+            clients[n].discard = c->discard;
+            clients[n].pending_len = c->pending_len;
+            n++;
+        }
+        if(n == 0) {
+            break;
+        }
+        if(handoff_send(sock, HANDOFF_CLIENTS_MSG, n, 0, clients, sizeof(HANDOFF_CLIENT) * n, fds, n) == -1) {
+            return -1;
+        }
+        for(int i = 0; i < n; i++) {
+            int ext = clients[i].snap.ext;
+            for(size_t off = 0; off < batch[i]->pending_len; off += HANDOFF_CHUNK) {
+                size_t len = batch[i]->pending_len - off < HANDOFF_CHUNK ? batch[i]->pending_len - off : HANDOFF_CHUNK;
+                if(handoff_send(sock, HANDOFF_PENDING_MSG, 0, ext, batch[i]->pending + off, len, NULL, 0) == -1) {
+                    return -1;
+                }
+            }
+            // The history of a call is shared by its parties, so it goes with the one
+            // with the lower extension.
+            int peer = clients[i].snap.peer;
+            TU_SNAPSHOT snap;
+            if(peer > ext && peer < PBX_VIRTUAL_BASE && tu_snapshot(batch[i]->tu, &snap, &history) &&
+               handoff_send(sock, HANDOFF_HISTORY_MSG, 0, ext, &history, sizeof(history), NULL, 0) == -1) {
+                return -1;
+            }
+        }
+    }
+    return handoff_send(sock, HANDOFF_END_MSG, 0, 0, NULL, 0, NULL, 0);
+}
+
+/*
+ * Hand everything over to a new server that has connected, and exit once it has
+ * acknowledged.  If anything goes wrong, the stopped threads go on instead.
+ *
+ * @param sock  The connection to the new server.
+ */
+static void handoff_give(int sock) {
+    debug("Handing over to a new server...");
+    P(&handoff_mutex);
+    __atomic_store_n(&handoff_active, 1, __ATOMIC_RELEASE);
+    V(&handoff_mutex);
+    if(handoff_quiesce() == 0) {
+        P(&handoff_mutex);
+        int ret = handoff_send_state(sock);
+        V(&handoff_mutex);
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        HANDOFF_MSG h;
+        if(ret == 0 && poll(&pfd, 1, HANDOFF_ACK_MS) == 1 &&
+           recv(sock, &h, sizeof(h), 0) == sizeof(h) && h.type == HANDOFF_DONE_MSG) {
+            debug("Handed over, exiting");
+            exit(EXIT_SUCCESS);
+        }
+    }
+    debug("Handoff failed, carrying on");
+    P(&handoff_mutex);
+    int n = handoff_parked + handoff_waiting;
+    for(HANDOFF_CONN *c = handoff_list; c; c = c->next) {
+        c->parked = 0;
+    }
+    handoff_parked = handoff_waiting = 0;
+    __atomic_store_n(&handoff_active, 0, __ATOMIC_RELEASE);
+    V(&handoff_mutex);
+    while(n-- > 0) {
+        V(&handoff_resume);
+    }
+}
+
+/*
+ * Thread function for the thread that waits for a new server to take over.
+ */
+static void *handoff_thread(void *arg) {
+    int listenfd = *((int *)arg);
+    free(arg);
+    Pthread_detach(pthread_self());
+    while(1) {
+        int sock = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if(sock == -1) {
+            if(errno != EINTR) {
+                usleep(10000);
+            }
+            continue;
+        }
+        handoff_give(sock);
+        close(sock);
+    }
+    return NULL;
+}
+
+/*
+ * Listen for a new server to take over from this one.
+ *
+ * @param path  The path of the Unix-domain socket to listen at.
+ * @param listenfds  The listening sockets of the server, by index, or -1 for none.
+ * @return 0 if successful, -1 if the socket cannot be set up.
+ */
+int handoff_serve(const char *path, int listenfds[HANDOFF_LISTENERS]) {
+    pthread_once(&handoff_once, handoff_setup);
+    memcpy(handoff_listenfds, listenfds, sizeof(handoff_listenfds));
+    struct sockaddr_un addr = { 0 };
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        return -1;
+    }
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        close(fd);
+        return -1;
+    }
+    int *fdp = Malloc(sizeof(int));
+    *fdp = fd;
+    pthread_t tid;
+    Pthread_create(&tid, NULL, handoff_thread, fdp);
+    return 0;
+}
+
+/*
+ * Move a socket received in a batch to the file descriptor that is its extension.
+ * A socket of the same batch that is in the way is moved elsewhere first.
+ *
+ * @param fds  The sockets of the batch, as they are now; those before i are in place.
+ * @return 0 if successful, -1 if the file descriptor is taken by something else.
+ */
+static int handoff_place(int *fds, int n, int i, int ext) {
+    if(fds[i] == ext) {
+        return 0;
+    }
+    if(fcntl(ext, F_GETFD) != -1) {
+        int j;
+        for(j = i + 1; j < n && fds[j] != ext; j++)
+            ;
+        if(j == n || (fds[j] = fcntl(ext, F_DUPFD_CLOEXEC, 0)) == -1) {
+            return -1;
+        }
+        close(ext);
+    }
+    if(dup2(fds[i], ext) == -1) {
+        return -1;
+    }
+    close(fds[i]);
+    fds[i] = ext;
+    return 0;
+}
+
+static int handoff_history_valid(const CHAT_HISTORY *h) {
+    if(h->first < 0 || h->first >= CHAT_HISTORY_RECORDS || h->count < 0 || h->count > CHAT_HISTORY_RECORDS ||
+       h->used > CHAT_HISTORY_BYTES || h->end >= CHAT_HISTORY_BYTES) {
+        return 0;
+    }
+    for(int i = 0; i < h->count; i++) {
+        const CHAT_RECORD *r = &(h->records[(h->first + i) % CHAT_HISTORY_RECORDS]);
+        if(r->offset >= CHAT_HISTORY_BYTES || r->len > CHAT_HISTORY_BYTES) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Receive the state sent by handoff_send_state(), putting each socket in place.
+ *
+ * @param taken  Receives the connections, indexed by extension.
+ * @return 0 if successful, -1 if an error occurs.
+ */
+static int handoff_receive(int *sockp, int listenfds[HANDOFF_LISTENERS], HANDOFF_TAKEN **taken) {
+    char *data = Malloc(HANDOFF_MAX_PAYLOAD);
+    int fds[HANDOFF_BATCH];
+    int nfds, max_ext = -1, ret = -1;
+    HANDOFF_MSG h;
+    ssize_t len;
+    while((len = handoff_recv(*sockp, &h, data, fds, &nfds)) != -1) {
+        HANDOFF_TAKEN *t = h.arg >= 0 && h.arg <= max_ext ? taken[h.arg] : NULL;
+        if(h.type == HANDOFF_LISTENERS_MSG && max_ext == -1 && h.arg < PBX_VIRTUAL_BASE &&
+           nfds == h.count && len == sizeof(int32_t) * h.count) {
+            // Keep the sockets of this server clear of the connections to come.
+            max_ext = h.arg < 0 ? 0 : h.arg;
+            int sock = fcntl(*sockp, F_DUPFD_CLOEXEC, max_ext + 1);
+            if(sock == -1) {
+                break;
+            }
+            close(*sockp);
+            *sockp = sock;
+            for(int i = 0; i < nfds; i++) {
+                int32_t idx;
+                memcpy(&idx, data + sizeof(int32_t) * i, sizeof(idx));
+                int fd = fcntl(fds[i], F_DUPFD_CLOEXEC, max_ext + 1);
+                close(fds[i]);
+                if(idx < 0 || idx >= HANDOFF_LISTENERS || fd == -1) {
+                    goto done;
+                }
+                listenfds[idx] = fd;
+            }
+        }
+        else if(h.type == HANDOFF_CLIENTS_MSG && max_ext != -1 && nfds == h.count &&
+                len == sizeof(HANDOFF_CLIENT) * h.count) {
+            HANDOFF_CLIENT *clients = (HANDOFF_CLIENT *)data;
+            for(int i = 0; i < nfds; i++) {
+                int ext = clients[i].snap.ext;
+                if(ext < 0 || ext > max_ext || taken[ext] || handoff_place(fds, nfds, i, ext) == -1) {
+                    for(int j = i; j < nfds; j++) {
+                        close(fds[j]);
+                    }
+                    goto done;
+                }
+                t = calloc(1, sizeof(HANDOFF_TAKEN));
+                if(!t || (clients[i].pending_len > 0 && !(t->pending = malloc(clients[i].pending_len)))) {
+                    goto done;
+                }
+                t->client = clients[i];
+                taken[ext] = t;
+            }
+        }
+        else if(h.type == HANDOFF_PENDING_MSG && nfds == 0 && t && len <= t->client.pending_len - t->pending_len) {
+            memcpy(t->pending + t->pending_len, data, len);
+            t->pending_len += len;
+        }
+        else if(h.type == HANDOFF_HISTORY_MSG && nfds == 0 && t && !t->history && len == sizeof(CHAT_HISTORY) &&
+                handoff_history_valid((CHAT_HISTORY *)data)) {
+            t->history = Malloc(sizeof(CHAT_HISTORY));
+            memcpy(t->history, data, sizeof(CHAT_HISTORY));
+        }
+        else if(h.type == HANDOFF_END_MSG && max_ext != -1) {
+            ret = 0;
+            break;
+        }
+        else {
+            for(int i = 0; i < nfds; i++) {
+                close(fds[i]);
+            }
+            break;
+        }
+    }
+done:
+    free(data);
+    return ret;
+}
+
+/*
+ * Take over from a server listening for a new one at a given path, if there is one.
+ * On success, the connections of the old server are registered, to be served once
+ * handoff_start() is called, and its listening sockets are returned, to be used
+ * instead of opening new ones.
+ * This must be called before any other file descriptor is opened, since the sockets
+ * of the connections go back to the file descriptors that they had.
+ *
+ * @param path  The path of the Unix-domain socket of the old server.
+ * @param listenfds  Receives the listening sockets handed over, by index, or -1 for none.
+ * @return 1 if the server took over, 0 if there was no server to take over from,
+ * -1 if taking over failed (the old server then carries on).
+ */
+int handoff_take(const char *path, int listenfds[HANDOFF_LISTENERS]) {
+    pthread_once(&handoff_once, handoff_setup);
+    for(int i = 0; i < HANDOFF_LISTENERS; i++) {
+        listenfds[i] = -1;
+    }
+    struct sockaddr_un addr = { 0 };
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sock == -1) {
+        return -1;
+    }
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return 0;
+    }
+    // The connections need as many file descriptors as they had in the old server.
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    HANDOFF_TAKEN **taken = calloc(PBX_VIRTUAL_BASE, sizeof(HANDOFF_TAKEN *));
+    if(!taken || handoff_receive(&sock, listenfds, taken) == -1) {
+        return -1;
+    }
+
+    // Rebuild the registry, then the calls between connections that were both handed over.
+    for(int ext = 0; ext < PBX_VIRTUAL_BASE; ext++) {
+        HANDOFF_TAKEN *t = taken[ext];
+        if(!t) {
+            continue;
+        }
+        if(t->pending_len != t->client.pending_len || !(t->tu = tu_init(ext)) ||
+           tu_restore(t->tu, &(t->client.snap)) == -1 || pbx_restore(pbx, t->tu) == -1) {
+            return -1;
+        }
+    }
+    for(int ext = 0; ext < PBX_VIRTUAL_BASE; ext++) {
+        HANDOFF_TAKEN *t = taken[ext];
+        int peer = t ? t->client.snap.peer : -1;
+        if(peer > ext && peer < PBX_VIRTUAL_BASE && taken[peer] && taken[peer]->client.snap.peer == ext) {
+            tu_restore_call(t->tu, taken[peer]->tu, t->history);
+            t->client.snap.peer = taken[peer]->client.snap.peer = -1;
+        }
+    }
+    if(handoff_send(sock, HANDOFF_DONE_MSG, 0, 0, NULL, 0, NULL, 0) == -1) {
+        return -1;
+    }
+    close(sock);
+
+    // Calls with parties that were not handed over are over.
+    for(int ext = 0; ext < PBX_VIRTUAL_BASE; ext++) {
+        HANDOFF_TAKEN *t = taken[ext];
+        if(!t) {
+            continue;
+        }
+        if(t->client.snap.peer != -1) {
+            tu_restore_lost_peer(t->tu);
+        }
+        HANDOFF_CONN *c = Malloc(sizeof(HANDOFF_CONN));
+        memset(c, 0, sizeof(*c));
+        c->tu = t->tu;
+        c->fd = ext;
+        c->proto = t->client.snap.proto;
+        c->discard = t->client.discard;
+        c->pending = t->pending;
+        c->pending_len = t->pending_len;
+        c->next = handoff_taken;
+        handoff_taken = c;
+        free(t->history);
+        free(t);
+    }
+    free(taken);
+    debug("Took over from the old server");
+    return 1;
+}
+
+/*
+ * Start serving the connections taken over by handoff_take().
+ */
+void handoff_start(void) {
+    while(handoff_taken) {
+        HANDOFF_CONN *c = handoff_taken;
+        handoff_taken = c->next;
+        pthread_t tid;
+        Pthread_create(&tid, NULL, pbx_resume_client, c);
+    }
+}
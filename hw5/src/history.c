@@ -0,0 +1,134 @@
+/*
+ * History: per-call ring of recent chat messages, for replay.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <semaphore.h>
+
+#include "history.h"
+#include "csapp.h"
+
+/*
+ * Pool of histories not in use.  Histories are allocated in blocks and never freed,
+ * so the pool only grows to the largest number of calls connected at once.
+ */
+static CHAT_HISTORY *history_pool;
+static sem_t history_pool_mutex;
+static pthread_once_t history_pool_once = PTHREAD_ONCE_INIT;
+
+static void history_pool_init(void) {
+    Sem_init(&history_pool_mutex, 0, 1);
+}
+
+/*
+ * Take an empty history from the pool, for a call that has just been connected.
+ *
+ * @return the history, or NULL if the pool is empty and could not be refilled.
+ */
+CHAT_HISTORY *chat_history_alloc(void) {
+    pthread_once(&history_pool_once, history_pool_init);
+    P(&history_pool_mutex);
+    if(!history_pool) {
+        CHAT_HISTORY *block = malloc(CHAT_HISTORY_POOL_GROW * sizeof(CHAT_HISTORY));
+        if(!block) {
+            V(&history_pool_mutex);
+            return NULL;
+        }
+        for(int i = 0; i < CHAT_HISTORY_POOL_GROW; i++) {
+            block[i].next = history_pool;
+            history_pool = &block[i];
+        }
+    }
+    CHAT_HISTORY *h = history_pool;
+    history_pool = h->next;
+    V(&history_pool_mutex);
+
+    h->next = NULL;
+    h->last_seq = 0;
+    h->first = h->count = 0;
+    h->used = h->end = 0;
+    return h;
+}
+
+/*
+ * Return the history of a call that has ended to the pool.
+ *
+ * @param h  The history, or NULL.
+ */
+void chat_history_free(CHAT_HISTORY *h) {
+    if(!h) {
+        return;
+    }
+    P(&history_pool_mutex);
+    h->next = history_pool;
+    history_pool = h;
+    V(&history_pool_mutex);
+}
+
+/*
+ * Record a message, discarding the oldest retained messages as needed to make room.
+ * The caller must ensure that the history is not being used by any other thread.
+ *
+ * @param h  The history of the call.
+ * @param from  The extension of the sender.
+ * @param msg  The text of the message.
+ * @param len  The length of the text.
+ * @return the sequence number assigned to the message.
+ */
+uint32_t chat_history_add(CHAT_HISTORY *h, int from, const char *msg, size_t len) {
+    uint32_t seq = ++h->last_seq;
+    if(len > CHAT_HISTORY_BYTES) {
+        return seq;
+    }
+    while(h->count == CHAT_HISTORY_RECORDS || h->used + len > CHAT_HISTORY_BYTES) {
+        h->used -= h->records[h->first].len;
+        h->first = (h->first + 1) % CHAT_HISTORY_RECORDS;
+        h->count--;
+    }
+
+    // Copy the text into the byte ring, wrapping around its end if necessary.
+    size_t part = CHAT_HISTORY_BYTES - h->end < len ? CHAT_HISTORY_BYTES - h->end : len;
+    memcpy(h->data + h->end, msg, part);
+    memcpy(h->data, msg + part, len - part);
+
+    CHAT_RECORD *rec = &(h->records[(h->first + h->count) % CHAT_HISTORY_RECORDS]);
+    rec->seq = seq;
+    rec->from = from;
+    rec->offset = h->end;
+    rec->len = len;
+    h->count++;
+    h->used += len;
+    h->end = (h->end + len) % CHAT_HISTORY_BYTES;
+    return seq;
+}
+
+/*
+ * Find the oldest retained message with a sequence number greater than a given one.
+ * The text is described in place, in one or two parts depending on whether it wraps
+ * around the end of the byte ring, and remains valid until the next message is added.
+ *
+ * @param h  The history of the call.
+ * @param after  The sequence number after which to look.
+ * @param rec  Set to the record of the message.
+ * @param text  Set to the parts of the text of the message.
+ * @return the number of parts of the text, or -1 if there is no such message.
+ */
+int chat_history_find(CHAT_HISTORY *h, uint32_t after, CHAT_RECORD *rec, struct iovec text[2]) {
+    for(int i = 0; i < h->count; i++) {
+        CHAT_RECORD *r = &(h->records[(h->first + i) % CHAT_HISTORY_RECORDS]);
+        if(r->seq <= after) {
+            continue;
+        }
+        *rec = *r;
+        size_t part = CHAT_HISTORY_BYTES - r->offset < r->len ? CHAT_HISTORY_BYTES - r->offset : r->len;
+        text[0].iov_base = h->data + r->offset;
+        text[0].iov_len = part;
+        if(part == r->len) {
+            return 1;
+        }
+        text[1].iov_base = h->data;
+        text[1].iov_len = r->len - part;
+        return 2;
+    }
+    return -1;
+}
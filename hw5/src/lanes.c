@@ -0,0 +1,73 @@
+/*
+ * Priority lanes: weighted round robin over queues of requests of different priorities.
+ */
+#include <stdlib.h>
+
+#include "lanes.h"
+#include "proto.h"
+
+static const int lane_weights[LANE_COUNT] = LANE_WEIGHTS;
+
+/*
+ * Get the lane of a command of the binary protocol.  Anything not known to be chat or
+ * bulk, bad requests included, goes in the control lane, to be answered promptly.
+ */
+int lane_of(int op) {
+    switch(op) {
+    case PROTO_OP_CHAT:
+    case PROTO_OP_CHATF:
+        return LANE_CHAT;
+    case PROTO_OP_MSG:
+    case PROTO_OP_REPLAY:
+        return LANE_BULK;
+    default:
+        return LANE_CONTROL;
+    }
+}
+
+void lanes_init(LANES *lanes) {
+    for(int i = 0; i < LANE_COUNT; i++) {
+        lanes->head[i] = NULL;
+        lanes->tail[i] = &(lanes->head[i]);
+        lanes->turns[i] = lane_weights[i];
+    }
+    lanes->queued = 0;
+}
+
+/*
+ * Queue an item at the end of a lane.
+ */
+void lanes_push(LANES *lanes, int lane, LANE_ITEM *item) {
+    item->next = NULL;
+    *(lanes->tail[lane]) = item;
+    lanes->tail[lane] = &(item->next);
+    lanes->queued++;
+}
+
+/*
+ * Take the next item: from the highest lane that has items and turns left in this
+ * round, starting a new round when none has.
+ *
+ * @return the item, or NULL if all the lanes are empty.
+ */
+LANE_ITEM *lanes_pop(LANES *lanes) {
+    if(lanes->queued == 0) {
+        return NULL;
+    }
+    while(1) {
+        for(int i = 0; i < LANE_COUNT; i++) {
+            LANE_ITEM *item = lanes->head[i];
+            if(item && lanes->turns[i] > 0) {
+                lanes->turns[i]--;
+                if(!(lanes->head[i] = item->next)) {
+                    lanes->tail[i] = &(lanes->head[i]);
+                }
+                lanes->queued--;
+                return item;
+            }
+        }
+        for(int i = 0; i < LANE_COUNT; i++) {
+            lanes->turns[i] = lane_weights[i];
+        }
+    }
+}
@@ -1,9 +1,26 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/un.h>
 
 #include "pbx.h"
 #include "server.h"
+#include "server_ext.h"
+#include "tone.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "spool.h"
+#include "udp.h"
+#include "handoff.h"
+#include "mirror.h"
+#include "shard.h"
+#include "federation.h"
+#include "gossip.h"
+#include "admission.h"
+#include "executor.h"
+#include "coro.h"
+#include "pbx_ext.h"
 #include "debug.h"
 #include "csapp.h"
 
@@ -16,32 +33,287 @@ void SIGHUP_handler(int sig) {
     terminate(EXIT_SUCCESS);
 }
 
+/*
+ * Signal handler for SIGUSR1, which writes the current values of the server's counters
+ * to the standard error output.
+ */
+void SIGUSR1_handler(int sig) {
+    metrics_dump(STDERR_FILENO);
+}
+
+/*
+ * Open a Unix-domain socket listening for clients at a given path, replacing any
+ * socket left there by an earlier run.
+ *
+ * @return the listening socket, or -1 if it cannot be set up.
+ */
+static int open_unix_listenfd(const char *path) {
+    struct sockaddr_un addr = { 0 };
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenfd == -1) {
+        return -1;
+    }
+    unlink(path);
+    if(bind(listenfd, (SA *)&addr, sizeof(addr)) == -1 || listen(listenfd, LISTENQ) == -1) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * Open a TCP socket listening for clients on a given port, which other servers may
+ * listen on as well, as the shards do.  This is Open_listenfd() with SO_REUSEPORT.
+ *
+ * @return the listening socket, or -1 if it cannot be set up.
+ */
+static int open_shard_listenfd(const char *port) {
+    struct addrinfo hints, *listp, *p;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if(getaddrinfo(NULL, port, &hints, &listp) != 0) {
+        return -1;
+    }
+    int listenfd = -1, optval = 1;
+    for(p = listp; p; p = p->ai_next) {
+        if((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == 0 &&
+           bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(listenfd);
+        listenfd = -1;
+    }
+    freeaddrinfo(listp);
+    if(listenfd != -1 && listen(listenfd, LISTENQ) == -1) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * Accept clients on a listening socket, starting a service thread for each, or a
+ * coroutine if asked to (see coro.h).  On a hot restart, this stops where it waits,
+ * leaving the clients still to come to the next server.
+ */
+static void accept_clients(int listenfd, int coroutines) {
+    HANDOFF_CONN conn = { 0 };
+    handoff_join(&conn);
+    while(1) {
+        int connfd = accept(listenfd, NULL, NULL);
+        if(connfd == -1) {
+            if(errno == EINTR) {
+                handoff_park(&conn);
+                continue;
+            }
+            unix_error("Accept error");
+        }
+        // Under overload, a new client is told when to try again, and turned away.
+        int retry_ms = admission_admit();
+        if(retry_ms) {
+            dprintf(connfd, "OVERLOAD %d\r\n", retry_ms);
+            close(connfd);
+            continue;
+        }
+        int *connfdp = Malloc(sizeof(int));
+        *connfdp = connfd;
+        if(coroutines) {
+            if(coro_spawn(pbx_client_service, connfdp) == -1) {
+                free(connfdp);
+                close(connfd);
+                continue;
+            }
+        }
+        else {
+            pthread_t tid;
+            Pthread_create(&tid, NULL, pbx_client_service, connfdp);
+        }
+        debug("Accepted new client.");
+    }
+}
+
+/*
+ * Thread function for the thread that accepts clients on the Unix-domain socket,
+ * as the main thread does for TCP clients.  These are always served by threads of
+ * their own, since they can move to shared memory, which is waited on in the thread.
+ */
+static void *unix_accept_thread(void *arg) {
+    int listenfd = *((int *)arg);
+    free(arg);
+    accept_clients(listenfd, 0);
+    return NULL;
+}
+
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx <port>
+ * Usage: pbx -p <port> [-l <max-line>] [-r <first>[-<last>]:<commands/s>[:<chat bytes/s>]]... [-s <spool-dir>]
+ *            [-u <socket-path>] [-d <udp-port>] [-H <handoff-path>] [-M <mirror-file>]
+ *            [-S <index>/<count>:<directory-file> | -C <cores>] [-F <prefix>:<host>:<port>]...
+ *            [-G <node>:<host>:<port> [-P <host>:<port>]...]
+ *            [-O <clients>[:<accept-queue>[:<latency-ms>[:<rss-MB>]]]] [-W <workers>] [-E <loops>]
  */
 int main(int argc, char* argv[]){
     char* port;
-    int listenfd, *connfdp;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
     pthread_t tid;
 
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
-    // on which the server should listen.
-    if(argc != 3 || strcmp(argv[1], "-p") != 0) {
-        fprintf(stderr, "usage: bin/pbx -p <port>\n");
-        exit(EXIT_FAILURE);
-    }
+    // on which the server should listen.  Option '-l <bytes>' sets the
+    // maximum length of a command line.  Each option '-r' sets the rate
+    // limits of a class of extensions.  Option '-s <dir>' keeps the message
+    // spool in files in the given directory, so that it survives a restart, and
+    // records voicemail there.
+    // Option '-u <path>' also listens on a Unix-domain socket, for clients on the
+    // same host, which can then move to shared memory (see shm.h).  Option '-d <port>'
+    // also takes phones that register over UDP (see udp.h).  Option '-H <path>' takes
+    // over the connections of a server listening at the path, then listens there for
+    // a server to hand them over to in turn (see handoff.h).  Option '-M <file>' keeps
+    // the sessions of UDP phones in the file, so that they survive a crash (see mirror.h).
+    // Option '-S <index>/<count>:<file>' runs the server as one of several shards sharing
+    // the port and the extensions, which find each other through the file, and option
+    // '-C <cores>' starts such shards itself, one pinned to each core (see shard.h).
+    // Each option '-F <prefix>:<host>:<port>' routes the numbers dialed with the prefix
+    // to the extensions of the PBX at the host and port (see federation.h).  Option
+    // '-G <node>:<host>:<port>' joins a cluster of PBXs as the given node, gossiping at
+    // the host and port, and each option '-P <host>:<port>' gives a node of the cluster
+    // to gossip with to begin with (see gossip.h).  Option '-O <clients>:...' sheds load
+    // when the server is overloaded beyond the given limits (see admission.h).  Option
+    // '-W <workers>' carries out the requests of trunks on a pool of that many worker
+    // threads (see executor.h).  Option '-E <loops>' serves TCP clients with coroutines
+    // on that many event loops, rather than with a thread each (see coro.h).
+    port = NULL;
+    char* spool_dir = NULL;
+    char* unix_path = NULL;
+    char* udp_port = NULL;
+    char* handoff_path = NULL;
+    char* mirror_path = NULL;
+    char* shard_spec = NULL;
+    long cores = 0;
+    int gossip = 0;
+    int seeded = 0;
+    int loops = 0;
+    int opt;
     char* endptr;
-    strtol(argv[2], &endptr, 10);
-    if(endptr == argv[2] || *endptr != '\0') {
-        fprintf(stderr, "usage: bin/pbx -p <port>\n");
+    while((opt = getopt(argc, argv, "p:l:r:s:u:d:H:M:S:C:F:G:P:O:W:E:")) != -1) {
+        if(opt == 'p') {
+            strtol(optarg, &endptr, 10);
+            if(endptr == optarg || *endptr != '\0') {
+                break;
+            }
+            port = optarg;
+        }
+        else if(opt == 'l') {
+            long max_line = strtol(optarg, &endptr, 10);
+            if(endptr == optarg || *endptr != '\0' || max_line < PBX_MIN_MAX_LINE) {
+                break;
+            }
+            pbx_max_line = max_line;
+        }
+        else if(opt == 's') {
+            spool_dir = optarg;
+        }
+        else if(opt == 'u') {
+            unix_path = optarg;
+        }
+        else if(opt == 'd') {
+            strtol(optarg, &endptr, 10);
+            if(endptr == optarg || *endptr != '\0') {
+                break;
+            }
+            udp_port = optarg;
+        }
+        else if(opt == 'H') {
+            handoff_path = optarg;
+        }
+        else if(opt == 'M') {
+            mirror_path = optarg;
+        }
+        else if(opt == 'S') {
+            shard_spec = optarg;
+        }
+        else if(opt == 'C') {
+            cores = strtol(optarg, &endptr, 10);
+            if(endptr == optarg || *endptr != '\0' || cores < 1 || cores > SHARD_MAX) {
+                break;
+            }
+        }
+        else if(opt == 'F') {
+            if(fed_route_add(optarg) == -1) {
+                break;
+            }
+        }
+        else if(opt == 'G') {
+            if(gossip_config(optarg) == -1) {
+                break;
+            }
+            gossip = 1;
+        }
+        else if(opt == 'P') {
+            if(gossip_seed(optarg) == -1) {
+                break;
+            }
+            seeded = 1;
+        }
+        else if(opt == 'O') {
+            if(admission_config(optarg) == -1) {
+                break;
+            }
+        }
+        else if(opt == 'W') {
+            if(exec_config(optarg) == -1) {
+                break;
+            }
+        }
+        else if(opt == 'E') {
+            if(coro_config(optarg) == -1) {
+                break;
+            }
+            loops = 1;
+        }
+        else if(opt == 'r') {
+            if(rate_class_add(optarg) == -1) {
+                break;
+            }
+        }
+        else {
+            break;
+        }
+    }
+    // Shards do not hand over their connections, mirror sessions, take UDP phones or gossip,
+    // and coroutines cannot be stopped for a hot restart.
+    if(opt != -1 || optind != argc || !port || (shard_spec && (handoff_path || mirror_path || udp_port || gossip)) ||
+       (cores && (shard_spec || handoff_path || mirror_path || udp_port || gossip || unix_path)) ||
+       (seeded && !gossip) || (loops && handoff_path)) {
+        fprintf(stderr, "usage: bin/pbx -p <port> [-l <max-line>] [-r <first>[-<last>]:<commands/s>[:<chat bytes/s>]]... [-s <spool-dir>] [-u <socket-path>] [-d <udp-port>] [-H <handoff-path>] [-M <mirror-file>] [-S <index>/<count>:<directory-file> | -C <cores>] [-F <prefix>:<host>:<port>]... [-G <node>:<host>:<port> [-P <host>:<port>]...] [-O <clients>[:<accept-queue>[:<latency-ms>[:<rss-MB>]]]] [-W <workers>] [-E <loops>]\n");
         exit(EXIT_FAILURE);
     }
-    port = argv[2];
+
+    // With one shard per core, this process starts them all, and goes on as one of them.
+    int core_listenfd = -1;
+    if(cores) {
+        int core_listenfds[SHARD_MAX];
+        for(int i = 0; i < cores; i++) {
+            if((core_listenfds[i] = open_shard_listenfd(port)) == -1) {
+                fprintf(stderr, "Cannot listen on port %s\n", port);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if((core_listenfd = shard_fork(cores, core_listenfds)) == -1) {
+            fprintf(stderr, "Cannot start shards\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Perform required initialization of the PBX module.
     debug("Initializing PBX...");
@@ -49,6 +321,26 @@ int main(int argc, char* argv[]){
     if(!pbx) {
         exit(EXIT_FAILURE);
     }
+    if(shard_spec && shard_init(shard_spec) == -1) {
+        fprintf(stderr, "Cannot use shard directory\n");
+        exit(EXIT_FAILURE);
+    }
+    // Take over from the server that ran before, if any, before anything else takes
+    // the file descriptors that its connections had.
+    int listenfds[HANDOFF_LISTENERS] = { -1, -1, -1 };
+    if(handoff_path && handoff_take(handoff_path, listenfds) == -1) {
+        fprintf(stderr, "Cannot take over from %s\n", handoff_path);
+        exit(EXIT_FAILURE);
+    }
+    // Render the call-progress tones shared by all TUs.
+    if(tones_init() == -1) {
+        exit(EXIT_FAILURE);
+    }
+    // Set up the spool for messages to extensions that cannot take them yet.
+    if(spool_init(spool_dir, pbx_deliver_spool) == -1) {
+        fprintf(stderr, "Cannot use spool directory\n");
+        exit(EXIT_FAILURE);
+    }
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -56,15 +348,68 @@ int main(int argc, char* argv[]){
     // a SIGHUP handler, so that receipt of SIGHUP will perform a clean
     // shutdown of the server.
     Signal(SIGHUP, SIGHUP_handler);
-    listenfd = Open_listenfd(port);
-    debug("Listening for clients...");
-    while(1) {
-        clientlen = sizeof(struct sockaddr_storage);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, pbx_client_service, connfdp);
-        debug("Accepted new client.");
+    Signal(SIGUSR1, SIGUSR1_handler);
+    // Writing to a connection that has ended fails with EPIPE, rather than killing the
+    // server.
+    Signal(SIGPIPE, SIG_IGN);
+    // Sockets handed over by the server that ran before are used as they are, and
+    // those that this server has no use for are closed.
+    if(cores) {
+        listenfds[HANDOFF_TCP] = core_listenfd;
+    }
+    else if(shard_spec) {
+        if((listenfds[HANDOFF_TCP] = open_shard_listenfd(port)) == -1) {
+            fprintf(stderr, "Cannot listen on port %s\n", port);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if(listenfds[HANDOFF_TCP] == -1) {
+        listenfds[HANDOFF_TCP] = Open_listenfd(port);
+    }
+    if(unix_path) {
+        if(listenfds[HANDOFF_UNIX] == -1 && (listenfds[HANDOFF_UNIX] = open_unix_listenfd(unix_path)) == -1) {
+            fprintf(stderr, "Cannot listen on %s\n", unix_path);
+            exit(EXIT_FAILURE);
+        }
+        int *unixfdp = Malloc(sizeof(int));
+        *unixfdp = listenfds[HANDOFF_UNIX];
+        Pthread_create(&tid, NULL, unix_accept_thread, unixfdp);
+    }
+    else if(listenfds[HANDOFF_UNIX] != -1) {
+        close(listenfds[HANDOFF_UNIX]);
+        listenfds[HANDOFF_UNIX] = -1;
+    }
+    if(mirror_path && mirror_open(mirror_path) == -1) {
+        fprintf(stderr, "Cannot use mirror file %s\n", mirror_path);
+        exit(EXIT_FAILURE);
     }
+    if(udp_port) {
+        if(listenfds[HANDOFF_UDP] == -1 && (listenfds[HANDOFF_UDP] = udp_open(udp_port)) == -1) {
+            fprintf(stderr, "Cannot listen on UDP port %s\n", udp_port);
+            exit(EXIT_FAILURE);
+        }
+        udp_start(listenfds[HANDOFF_UDP]);
+    }
+    else if(listenfds[HANDOFF_UDP] != -1) {
+        close(listenfds[HANDOFF_UDP]);
+        listenfds[HANDOFF_UDP] = -1;
+    }
+    handoff_start();
+    shard_start();
+    fed_start();
+    admission_start(listenfds[HANDOFF_TCP]);
+    exec_start();
+    coro_start();
+    if(gossip_start(port) == -1) {
+        fprintf(stderr, "Cannot gossip on the address given by -G\n");
+        exit(EXIT_FAILURE);
+    }
+    if(handoff_path && handoff_serve(handoff_path, listenfds) == -1) {
+        fprintf(stderr, "Cannot listen for handoffs on %s\n", handoff_path);
+        exit(EXIT_FAILURE);
+    }
+    debug("Listening for clients...");
+    accept_clients(listenfds[HANDOFF_TCP], coro_enabled());
     debug("An impossibility occured.");
     terminate(EXIT_FAILURE);
 }
@@ -75,6 +420,8 @@ int main(int argc, char* argv[]){
 static void terminate(int status) {
     debug("Shutting down PBX...");
     pbx_shutdown(pbx);
+    spool_fini();
+    tones_fini();
     debug("PBX server terminating");
     exit(status);
 }
@@ -0,0 +1,178 @@
+/*
+ * Media: relays and mixes audio between TUs whose sample rates may differ.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "media.h"
+
+/*
+ * Initialize the audio state of an endpoint.
+ *
+ * @param ms  The media stream to be initialized.
+ * @param rate  The native sample rate of the endpoint, either MEDIA_NARROWBAND_RATE
+ * or MEDIA_WIDEBAND_RATE.
+ * @return 0 if successful, -1 if the rate is not supported.
+ */
+int media_stream_init(MEDIA_STREAM *ms, int rate) {
+    if(!ms || (rate != MEDIA_NARROWBAND_RATE && rate != MEDIA_WIDEBAND_RATE)) {
+        return -1;
+    }
+    ms->rate = rate;
+    resampler_init(&(ms->tx), rate, rate);
+    resampler_init(&(ms->rx), MEDIA_MIX_RATE, rate);
+    plc_init(&(ms->plc), rate);
+    ms->rec = NULL;
+    return 0;
+}
+
+/*
+ * Point the transmit converter of a stream at a particular output rate.
+ * The filter history is only discarded if the output rate actually changes.
+ */
+static void media_tx_rate(MEDIA_STREAM *ms, int rate) {
+    if(ms->tx.out_rate != rate) {
+        resampler_init(&(ms->tx), ms->rate, rate);
+    }
+}
+
+/*
+ * Take delivery of one frame of audio sent by an endpoint, synthesizing a replacement
+ * if the frame was lost.  If the endpoint is being recorded, the frame is passed on
+ * to the recorder as well.
+ *
+ * @param ms  The stream of the endpoint.
+ * @param frame  The frame, or NULL if it was lost.
+ * @param buf  Buffer for the frame to be used from here on.
+ */
+void media_receive(MEDIA_STREAM *ms, const int16_t *frame, int16_t *buf) {
+    size_t n = MEDIA_FRAME_SAMPLES(ms->rate);
+    if(frame) {
+        memcpy(buf, frame, n * sizeof(int16_t));
+        plc_good_frame(&(ms->plc), buf, n);
+    }
+    else {
+        plc_lost_frame(&(ms->plc), buf, n);
+    }
+    if(ms->rec && recorder_write(ms->rec, buf, n) == -1) {
+        media_record_stop(ms);
+    }
+}
+
+/*
+ * Relay one frame of audio from one party of a call to the other, converting it to
+ * the sample rate of the receiving party if the two rates differ.  A lost frame is
+ * concealed.
+ *
+ * @param src  The stream of the sending party.
+ * @param dst  The stream of the receiving party.
+ * @param frame  One frame of audio at the rate of the sending party, or NULL if it was lost.
+ * @param out  Buffer for one frame of audio at the rate of the receiving party.
+ * @return the number of samples stored in out.
+ */
+size_t media_relay(MEDIA_STREAM *src, MEDIA_STREAM *dst, const int16_t *frame, int16_t *out) {
+    int16_t buf[MEDIA_MAX_FRAME];
+    media_receive(src, frame, buf);
+    media_tx_rate(src, dst->rate);
+    return resampler_process(&(src->tx), buf, MEDIA_FRAME_SAMPLES(src->rate), out);
+}
+
+/*
+ * Mix one frame of audio for each party of a conference.
+ * Each party receives the sum of the audio of all the other parties, at its own rate.
+ * Narrowband parties are brought up to MEDIA_MIX_RATE before mixing and the mix is
+ * brought back down for them afterwards.
+ *
+ * @param ms  The streams of the parties.
+ * @param in  For each party, one frame of audio at its own rate, or NULL if the
+ * frame was lost, in which case it is concealed.
+ * @param out  For each party, a buffer for one frame of audio at its own rate.
+ * @param count  The number of parties.
+ * @return 0 if successful, -1 if there are too many parties.
+ */
+int media_mix(MEDIA_STREAM **ms, const int16_t **in, int16_t **out, int count) {
+    if(count < 0 || count > MEDIA_MAX_PARTIES) {
+        return -1;
+    }
+    int16_t wide[MEDIA_MAX_PARTIES][MEDIA_MAX_FRAME];
+    int32_t sum[MEDIA_MAX_FRAME];
+    memset(sum, 0, sizeof(sum));
+
+    // Convert every party to the mixing rate and accumulate the total.
+    for(int i = 0; i < count; i++) {
+        int16_t buf[MEDIA_MAX_FRAME];
+        media_receive(ms[i], in[i], buf);
+        media_tx_rate(ms[i], MEDIA_MIX_RATE);
+        resampler_process(&(ms[i]->tx), buf, MEDIA_FRAME_SAMPLES(ms[i]->rate), wide[i]);
+        for(int j = 0; j < MEDIA_MAX_FRAME; j++) {
+            sum[j] += wide[i][j];
+        }
+    }
+
+    // Remove each party's own contribution and convert the result back to its rate.
+    for(int i = 0; i < count; i++) {
+        int16_t mix[MEDIA_MAX_FRAME];
+        for(int j = 0; j < MEDIA_MAX_FRAME; j++) {
+            int32_t s = sum[j] - wide[i][j];
+            mix[j] = s > INT16_MAX ? INT16_MAX : s < INT16_MIN ? INT16_MIN : s;
+        }
+        resampler_process(&(ms[i]->rx), mix, MEDIA_MAX_FRAME, out[i]);
+    }
+    return 0;
+}
+
+/*
+ * Start recording the audio sent by an endpoint to a spool file.
+ *
+ * @param ms  The stream of the endpoint.
+ * @param path  The path of the spool file.
+ * @param codec  The codec to be applied before the audio reaches the spool,
+ * normally RECORDING_IMA_ADPCM.
+ * @return 0 if successful, otherwise -1.
+ */
+int media_record_start(MEDIA_STREAM *ms, const char *path, int codec) {
+    if(ms->rec) {
+        return -1;
+    }
+    RECORDER *rec = malloc(sizeof(RECORDER));
+    if(!rec) {
+        return -1;
+    }
+    if(recorder_open(rec, path, codec, ms->rate) == -1) {
+        free(rec);
+        return -1;
+    }
+    ms->rec = rec;
+    return 0;
+}
+
+/*
+ * Stop recording the audio sent by an endpoint, if it is being recorded.
+ *
+ * @param ms  The stream of the endpoint.
+ * @return 0 if successful, -1 if the recording could not be completed.
+ */
+int media_record_stop(MEDIA_STREAM *ms) {
+    if(!ms->rec) {
+        return 0;
+    }
+    int ret = recorder_close(ms->rec);
+    free(ms->rec);
+    ms->rec = NULL;
+    return ret;
+}
+
+/*
+ * Abandon the recording of the audio sent by an endpoint, if it is being recorded,
+ * removing what has been recorded so far.
+ *
+ * @param ms  The stream of the endpoint.
+ */
+void media_record_discard(MEDIA_STREAM *ms) {
+    if(!ms->rec) {
+        return;
+    }
+    recorder_discard(ms->rec);
+    free(ms->rec);
+    ms->rec = NULL;
+}
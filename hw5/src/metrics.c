@@ -0,0 +1,73 @@
+/*
+ * Metrics: server-wide counters, exported on request.
+ */
+#include <string.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+uint64_t pbx_metrics[NUM_METRICS];
+
+static const char *metric_names[NUM_METRICS] = {
+    [METRIC_COMMANDS_THROTTLED]    "commands_throttled",
+    [METRIC_CHAT_BYTES_THROTTLED]  "chat_bytes_throttled",
+    [METRIC_THROTTLE_DELAY_USEC]   "throttle_delay_usec",
+    [METRIC_UDP_RETRANSMITS]       "udp_retransmits",
+    [METRIC_UDP_SESSIONS_EXPIRED]  "udp_sessions_expired",
+    [METRIC_UDP_SESSIONS_RECOVERED] "udp_sessions_recovered",
+    [METRIC_SHARD_MESSAGES]        "shard_messages",
+    [METRIC_SHARD_OVERFLOWS]       "shard_overflows",
+    [METRIC_SHARD_LEGS_DROPPED]    "shard_legs_dropped",
+    [METRIC_FED_CALLS]             "fed_calls",
+    [METRIC_FED_LINKS_LOST]        "fed_links_lost",
+    [METRIC_GOSSIP_DATAGRAMS]      "gossip_datagrams",
+    [METRIC_GOSSIP_ENTRIES]        "gossip_entries",
+    [METRIC_REGISTRATIONS_REJECTED] "registrations_rejected",
+    [METRIC_CHATS_DEFERRED]        "chats_deferred",
+    [METRIC_OVERLOAD_LEVEL]        "overload_level",
+    [METRIC_OVERLOAD_PRESSURE]     "overload_pressure",
+    [METRIC_CLIENTS]               "clients",
+    [METRIC_ACCEPT_QUEUE]          "accept_queue",
+    [METRIC_COMMAND_LATENCY_USEC]  "command_latency_usec",
+    [METRIC_RSS_KB]                "rss_kb",
+    [METRIC_LIMIT_CLIENTS]         "limit_clients",
+    [METRIC_LIMIT_ACCEPT_QUEUE]    "limit_accept_queue",
+    [METRIC_LIMIT_LATENCY_USEC]    "limit_latency_usec",
+    [METRIC_LIMIT_RSS_KB]          "limit_rss_kb",
+    [METRIC_FRAMES_EXPEDITED]      "frames_expedited",
+    [METRIC_FRAMES_HELD]           "frames_held",
+    [METRIC_TASKS_EXECUTED]        "tasks_executed",
+    [METRIC_TASKS_STOLEN]          "tasks_stolen"
+};
+
+/*
+ * Write the current value of every counter to a file descriptor, one "name value"
+ * line per counter.  Only async-signal-safe functions are used, so that this can be
+ * called from a signal handler.
+ *
+ * @param fd  The file descriptor to write to.
+ */
+void metrics_dump(int fd) {
+    for(int i = 0; i < NUM_METRICS; i++) {
+        char line[64];
+        char digits[24];
+        size_t len = strlen(metric_names[i]);
+        memcpy(line, metric_names[i], len);
+        line[len++] = ' ';
+
+        // Format the value by hand, since snprintf() is not async-signal-safe.
+        uint64_t value = metrics_get(i);
+        int n = 0;
+        do {
+            digits[n++] = '0' + value % 10;
+            value /= 10;
+        } while(value);
+        while(n) {
+            line[len++] = digits[--n];
+        }
+        line[len++] = '\n';
+        if(write(fd, line, len) < 0) {
+            return;
+        }
+    }
+}
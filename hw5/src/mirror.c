@@ -0,0 +1,128 @@
+/*
+ * Registry mirror: the sessions of UDP phones, kept in a file mapped into memory.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mirror.h"
+
+/*
+ * Offset of the first slot in the file, which keeps the slots aligned.
+ */
+#define MIRROR_SLOTS_OFFSET 64
+#define MIRROR_SIZE (MIRROR_SLOTS_OFFSET + MIRROR_SLOTS * sizeof(MIRROR_SLOT))
+
+/*
+ * Number of times a reader looks again at a slot that is being written.
+ */
+#define MIRROR_READ_TRIES 1000
+
+static MIRROR_SLOT *mirror_slots;
+
+/*
+ * Map a mirror file into memory, creating it if it does not exist.  A file that holds
+ * a mirror with the current layout is kept, so that its sessions can be taken up again;
+ * any other is cleared.
+ *
+ * @param path  The path of the file.
+ * @return 0 if successful, -1 if the file cannot be opened or mapped.
+ */
+int mirror_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd == -1) {
+        return -1;
+    }
+    MIRROR_HEADER hdr;
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    int valid = st.st_size == MIRROR_SIZE && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+                !memcmp(hdr.magic, MIRROR_MAGIC, 4) && hdr.version == MIRROR_VERSION &&
+                hdr.slot_size == sizeof(MIRROR_SLOT) && hdr.num_slots == MIRROR_SLOTS;
+    // Truncating first clears the file without writing to every page of it.
+    if(!valid && (ftruncate(fd, 0) == -1 || ftruncate(fd, MIRROR_SIZE) == -1)) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, MIRROR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+    if(!valid) {
+        MIRROR_HEADER *h = (MIRROR_HEADER *)map;
+        h->version = MIRROR_VERSION;
+        h->slot_size = sizeof(MIRROR_SLOT);
+        h->num_slots = MIRROR_SLOTS;
+        memcpy(h->magic, MIRROR_MAGIC, 4);
+    }
+    mirror_slots = (MIRROR_SLOT *)(map + MIRROR_SLOTS_OFFSET);
+    return 0;
+}
+
+/*
+ * Determine whether sessions are being mirrored.
+ */
+int mirror_enabled(void) {
+    return mirror_slots != NULL;
+}
+
+/*
+ * Write a session to its slot.  Only one thread may write to the mirror.
+ *
+ * @param slot  The slot.
+ * @param m  The contents of the slot, other than its seq field.
+ */
+void mirror_write(uint32_t slot, const MIRROR_SLOT *m) {
+    MIRROR_SLOT *s = &(mirror_slots[slot % MIRROR_SLOTS]);
+    // A slot left odd by a crash is made even again by this write.
+    uint32_t seq = s->seq | 1;
+    __atomic_store_n(&(s->seq), seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)s + offsetof(MIRROR_SLOT, used), (char *)m + offsetof(MIRROR_SLOT, used),
+           sizeof(MIRROR_SLOT) - offsetof(MIRROR_SLOT, used));
+    __atomic_store_n(&(s->seq), seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Mark a slot as holding no session.  Only one thread may write to the mirror.
+ */
+void mirror_clear(uint32_t slot) {
+    MIRROR_SLOT *s = &(mirror_slots[slot % MIRROR_SLOTS]);
+    uint32_t seq = s->seq | 1;
+    __atomic_store_n(&(s->seq), seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->used = 0;
+    __atomic_store_n(&(s->seq), seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Read a consistent copy of a slot.
+ *
+ * @param slot  The slot.
+ * @param m  Receives the contents of the slot.
+ * @return 1 if the slot holds a session, 0 if it does not, -1 if it stays in the
+ * middle of being written (as it does if its writer crashed there).
+ */
+int mirror_read(uint32_t slot, MIRROR_SLOT *m) {
+    MIRROR_SLOT *s = &(mirror_slots[slot % MIRROR_SLOTS]);
+    for(int i = 0; i < MIRROR_READ_TRIES; i++) {
+        uint32_t seq = __atomic_load_n(&(s->seq), __ATOMIC_ACQUIRE);
+        if(seq & 1) {
+            continue;
+        }
+        memcpy(m, s, sizeof(MIRROR_SLOT));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&(s->seq), __ATOMIC_RELAXED) == seq) {
+            return m->used ? 1 : 0;
+        }
+    }
+    return -1;
+}
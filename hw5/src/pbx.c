@@ -6,6 +6,12 @@
 #include <semaphore.h>
 
 #include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+#include "spool.h"
+#include "shard.h"
+#include "federation.h"
+#include "gossip.h"
 #include "debug.h"
 #include "pbx_registry.h"
 #include "csapp.h"
@@ -22,9 +28,10 @@ PBX *pbx_init() {
         return NULL;
     }
     // Initialize pbx registry.
-    for(int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
+    for(int i = 0; i < PBX_MAX_REGISTERED; i++) {
         pbx->PBX_REGISTRY[i] = NULL;
     }
+    pbx->next_virtual = PBX_VIRTUAL_BASE;
     // Initialize the mutex.
     Sem_init(&(pbx->mutex), 0, 1);
     return pbx;
@@ -42,7 +49,7 @@ PBX *pbx_init() {
  */
 void pbx_shutdown(PBX *pbx) {
     // Perform shutdown call on all sockets to prevent further communiations.
-    for(int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
+    for(int i = 0; i < PBX_MAX_REGISTERED; i++) {
         if(pbx->PBX_REGISTRY[i]) {
             shutdown(pbx->PBX_REGISTRY[i]->fd, SHUT_RDWR);
         }
@@ -50,7 +57,7 @@ void pbx_shutdown(PBX *pbx) {
     // Waiting for all client threads to finish.
     while(1) {
         int finished = 0;
-        for(int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
+        for(int i = 0; i < PBX_MAX_REGISTERED; i++) {
             if(pbx->PBX_REGISTRY[i]) {
                 finished = -1;
             }
@@ -80,23 +87,96 @@ void pbx_shutdown(PBX *pbx) {
  * @return 0 if registration succeeds, otherwise -1.
  */
 int pbx_register(PBX *pbx, TU *tu, int ext) {
-    // Impose lock so that two spaces are not selected at once.
+    if(ext < 0 || ext >= PBX_VIRTUAL_BASE) {
+        return -1;
+    }
+    // Impose lock so that two TUs are not registered at the same extension.
+    P(&(pbx->mutex));
+    if(pbx->PBX_REGISTRY[ext]) {
+        V(&(pbx->mutex));
+        return -1;
+    }
+    tu_set_extension(tu, ext);
+    pbx->PBX_REGISTRY[ext] = tu;
+    shard_publish(ext, 1);
+    gossip_publish(ext, 1);
+    tu_notify_state(tu);
+    V(&(pbx->mutex));
+    // Messages stored while the extension was unplugged can now be delivered.
+    spool_kick(ext);
+    return 0;
+}
+
+/*
+ * Register a virtual TU, carried by a trunk, with a PBX at a free extension chosen by
+ * the PBX, among the virtual extensions of its shard if it is one.  Otherwise, this
+ * behaves like pbx_register().
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The TU to be registered.
+ * @return the extension, or -1 if all the virtual extensions are taken.
+ */
+int pbx_register_virtual(PBX *pbx, TU *tu) {
+    int first, last;
+    shard_virtual_range(&first, &last);
     P(&(pbx->mutex));
-    for(int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
-        // Found empty space to register.
-        if(!pbx->PBX_REGISTRY[i]) {
-            // Register, then release lock.
-            pbx->PBX_REGISTRY[i] = tu;
-            dprintf(ext, "ON HOOK %d\r\n", ext);
+    // Look for a free extension, going on from the last one given out.
+    int ext = pbx->next_virtual >= first && pbx->next_virtual < last ? pbx->next_virtual : first;
+    for(int n = 0; n < last - first; n++) {
+        if(!pbx->PBX_REGISTRY[ext]) {
+            tu_set_extension(tu, ext);
+            pbx->PBX_REGISTRY[ext] = tu;
+            pbx->next_virtual = ext + 1 < last ? ext + 1 : first;
+            shard_publish(ext, 1);
+            gossip_publish(ext, 1);
+            tu_notify_state(tu);
             V(&(pbx->mutex));
-            return 0;
+            spool_kick(ext);
+            return ext;
         }
+        ext = ext + 1 < last ? ext + 1 : first;
     }
-    // Error, release lock.
     V(&(pbx->mutex));
     return -1;
 }
 
+/*
+ * Register a TU restored on a hot restart (see handoff.h) at its extension, without
+ * notifying its client, which already knows it.
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The TU to be registered.
+ * @return 0 if registration succeeds, -1 if the extension is invalid or taken.
+ */
+int pbx_restore(PBX *pbx, TU *tu) {
+    int ext = tu_extension(tu);
+    if(ext < 0 || ext >= PBX_MAX_REGISTERED) {
+        return -1;
+    }
+    P(&(pbx->mutex));
+    if(pbx->PBX_REGISTRY[ext]) {
+        V(&(pbx->mutex));
+        return -1;
+    }
+    pbx->PBX_REGISTRY[ext] = tu;
+    shard_publish(ext, 1);
+    gossip_publish(ext, 1);
+    V(&(pbx->mutex));
+    return 0;
+}
+
+/*
+ * Find the TU registered at an extension.  The PBX must be locked.
+ *
+ * @return the TU, or NULL if there is none.
+ */
+static TU *pbx_lookup(PBX *pbx, int ext) {
+    if(ext < 0 || ext >= PBX_MAX_REGISTERED) {
+        return NULL;
+    }
+    return pbx->PBX_REGISTRY[ext];
+}
+
 /*
  * Unregister a TU from a PBX.
  * This amounts to "unplugging a telephone unit from the PBX".
@@ -112,21 +192,18 @@ int pbx_register(PBX *pbx, TU *tu, int ext) {
 int pbx_unregister(PBX *pbx, TU *tu) {
     // Impose lock.
     P(&(pbx->mutex));
-    for(int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
-        // Found telephone unit in registry.
-        if(pbx->PBX_REGISTRY[i] == tu) {
-            // Unregister, then release lock.
-            if(tu->state != TU_CONNECTED && tu->state != TU_RINGING && tu->state != TU_RING_BACK) {
-                tu_hangup(tu);
-                tu_unref(tu, "Unregistering telephone unit.\n");
-            }
-            else {
-                tu_hangup(tu);
-            }
-            pbx->PBX_REGISTRY[i] = NULL;
-            V(&(pbx->mutex));
-            return 0;
-        }
+    int ext = tu_extension(tu);
+    // Found telephone unit in registry.
+    if(tu && pbx_lookup(pbx, ext) == tu) {
+        // Unregister, then release lock.  Hanging up drops the references of a call, so
+        // that the one held by the PBX is the last, unless the TU is still being used.
+        tu_hangup(tu);
+        tu_unref(tu, "Unregistering telephone unit.\n");
+        pbx->PBX_REGISTRY[ext] = NULL;
+        shard_publish(ext, 0);
+        gossip_publish(ext, 0);
+        V(&(pbx->mutex));
+        return 0;
     }
     // Error, release lock.
     V(&(pbx->mutex));
@@ -144,25 +221,90 @@ int pbx_unregister(PBX *pbx, TU *tu) {
 int pbx_dial(PBX *pbx, TU *tu, int ext) {
     // Impose lock.
     P(&(pbx->mutex));
-    for(int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
-        // Found telephone unit initiating call.
-        if(pbx->PBX_REGISTRY[i] == tu) {
-            // Find telephone unit to be called.
-            for(int j = 0; j < PBX_MAX_EXTENSIONS; j++) {
-                //Found telephone unit to call.
-                if(tu_fileno(pbx->PBX_REGISTRY[j]) == ext) {
-                    tu_dial(tu, pbx->PBX_REGISTRY[j]);
-                    V(&(pbx->mutex));
-                    return 0;
-                }
-            }
-            // Could not determine telephone unit to be called.
+    // Did not find telephone unit initiating call.
+    if(!tu || pbx_lookup(pbx, tu_extension(tu)) != tu) {
+        V(&(pbx->mutex));
+        return -1;
+    }
+    // A number routed to another PBX is called over a trunk to it.
+    // One that the directory shows is not registered there fails at once.
+    if(fed_routed(ext)) {
+        V(&(pbx->mutex));
+        if(gossip_absent(ext)) {
             tu_dial(tu, NULL);
-            V(&(pbx->mutex));
-            return 0;
         }
+        else {
+            fed_dial(tu, ext);
+        }
+        return 0;
     }
-    // Did not find telephone unit initiating call.
+    // An extension of another shard is called through a leg of the call there.
+    if(shard_remote(ext)) {
+        V(&(pbx->mutex));
+        shard_dial(tu, ext);
+        return 0;
+    }
+    // Call the telephone unit at the extension, or fail to if there is none.
+    tu_dial(tu, pbx_lookup(pbx, ext));
     V(&(pbx->mutex));
-    return -1;
+    return 0;
+}
+
+/*
+ * Call, from a proxy TU standing for a party in another shard (see shard.h), the TU
+ * at an extension of this one.  The proxy is not registered.
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The proxy.
+ * @param ext  The extension number to be called.
+ * @return 0 if the call rings, otherwise -1.
+ */
+int pbx_dial_leg(PBX *pbx, TU *tu, int ext) {
+    P(&(pbx->mutex));
+    int ret = tu_dial(tu, pbx_lookup(pbx, ext));
+    V(&(pbx->mutex));
+    return ret;
+}
+
+/*
+ * Use the PBX to answer, from a specified TU, the call ringing on a specified extension.
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The TU that is answering the call.
+ * @param ext  The extension on which the call is ringing.
+ * @return 0 if the call was answered, otherwise -1.
+ */
+int pbx_directed_pickup(PBX *pbx, TU *tu, int ext) {
+    // The ringing TU is held by a reference rather than by the registry lock, since
+    // the pickup may have to wait for it, and the registry must not wait with it.
+    TU *ringing = NULL;
+    P(&(pbx->mutex));
+    if((ringing = pbx_lookup(pbx, ext))) {
+        tu_ref(ringing, "Picking up call.");
+    }
+    V(&(pbx->mutex));
+    int ret = tu_directed_pickup(tu, ringing);
+    if(ringing) {
+        tu_unref(ringing, "Picked up call.");
+    }
+    return ret;
+}
+
+/*
+ * Deliver the messages spooled for an extension, if a TU is registered on it.
+ * This is called on the spool's delivery thread.
+ *
+ * @param ext  The extension.
+ */
+void pbx_deliver_spool(int ext) {
+    TU *tu = NULL;
+    P(&(pbx->mutex));
+    if((tu = pbx_lookup(pbx, ext))) {
+        tu_ref(tu, "Delivering spooled messages.");
+    }
+    V(&(pbx->mutex));
+    if(tu) {
+        tu_deliver_spool(tu);
+        tu_unref(tu, "Delivered spooled messages.");
+    }
 }
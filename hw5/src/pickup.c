@@ -0,0 +1,136 @@
+/*
+ * Pickup: index of ringing TUs by pickup group, and park slots.
+ */
+#include <stdlib.h>
+#include <semaphore.h>
+
+#include "pbx.h"
+#include "pickup.h"
+#include "pbx_registry.h"
+#include "csapp.h"
+
+/*
+ * For each pickup group, a doubly linked list of its ringing TUs, linked through
+ * the TUs themselves, oldest first.
+ */
+static TU *ringing_head[PICKUP_GROUPS];
+static TU *ringing_tail[PICKUP_GROUPS];
+
+/*
+ * The TU parked on each park slot, if any.
+ */
+static TU *park_slots[PARK_SLOTS];
+
+static sem_t pickup_mutex;
+static pthread_once_t pickup_once = PTHREAD_ONCE_INIT;
+
+static void pickup_init(void) {
+    Sem_init(&pickup_mutex, 0, 1);
+}
+
+/*
+ * Lock the ringing lists and the park slots.  All the other functions of this module
+ * must be called with this lock held.
+ */
+void pickup_lock(void) {
+    pthread_once(&pickup_once, pickup_init);
+    P(&pickup_mutex);
+}
+
+void pickup_unlock(void) {
+    V(&pickup_mutex);
+}
+
+/*
+ * Add a TU that has just started ringing to the list of its pickup group, if it has one.
+ * The TU must be locked.
+ */
+void pickup_ringing_add(TU *tu) {
+    if(tu->group <= 0 || tu->group >= PICKUP_GROUPS || tu->ring_group) {
+        return;
+    }
+    int g = tu->group;
+    tu->ring_group = g;
+    tu->ring_next = NULL;
+    tu->ring_prev = ringing_tail[g];
+    if(ringing_tail[g]) {
+        ringing_tail[g]->ring_next = tu;
+    }
+    else {
+        ringing_head[g] = tu;
+    }
+    ringing_tail[g] = tu;
+}
+
+/*
+ * Remove a TU that has stopped ringing from the list of its pickup group, if it is on it.
+ * The TU must be locked.
+ */
+void pickup_ringing_remove(TU *tu) {
+    int g = tu->ring_group;
+    if(!g) {
+        return;
+    }
+    if(tu->ring_prev) {
+        tu->ring_prev->ring_next = tu->ring_next;
+    }
+    else {
+        ringing_head[g] = tu->ring_next;
+    }
+    if(tu->ring_next) {
+        tu->ring_next->ring_prev = tu->ring_prev;
+    }
+    else {
+        ringing_tail[g] = tu->ring_prev;
+    }
+    tu->ring_prev = tu->ring_next = NULL;
+    tu->ring_group = 0;
+}
+
+/*
+ * Get the TU of a pickup group that has been ringing the longest.
+ * A TU remains on the list until it is removed with its lock held, so a caller that
+ * manages to lock the TU while still holding the pickup lock knows it is ringing.
+ *
+ * @return the TU, or NULL if no TU of the group is ringing.
+ */
+TU *pickup_ringing_first(int group) {
+    if(group <= 0 || group >= PICKUP_GROUPS) {
+        return NULL;
+    }
+    return ringing_head[group];
+}
+
+/*
+ * Park a TU on a park slot.  The TU must be locked.
+ *
+ * @return 0 if successful, -1 if the slot is invalid or already occupied.
+ */
+int park_put(int slot, TU *tu) {
+    if(slot < 0 || slot >= PARK_SLOTS || park_slots[slot]) {
+        return -1;
+    }
+    park_slots[slot] = tu;
+    return 0;
+}
+
+/*
+ * Get the TU parked on a park slot.
+ *
+ * @return the TU, or NULL if the slot is invalid or empty.
+ */
+TU *park_peek(int slot) {
+    if(slot < 0 || slot >= PARK_SLOTS) {
+        return NULL;
+    }
+    return park_slots[slot];
+}
+
+/*
+ * Empty a park slot, if a particular TU is parked on it.  The TU must be locked.
+ */
+void park_clear(int slot, TU *tu) {
+    if(slot >= 0 && slot < PARK_SLOTS && park_slots[slot] == tu) {
+        park_slots[slot] = NULL;
+    }
+}
@@ -0,0 +1,172 @@
+/*
+ * PLC: conceals lost frames of audio in the media path.
+ */
+#include <string.h>
+
+#include "plc.h"
+
+/*
+ * Parameters of the concealment, in milliseconds (pitch limits are those of G.711
+ * Appendix I, i.e. 66 Hz to 200 Hz).
+ */
+#define PLC_MIN_PITCH_MSEC 5
+#define PLC_MAX_PITCH_MSEC 15
+#define PLC_WINDOW_MSEC 20
+#define PLC_STEP_MSEC 10
+#define PLC_MAX_SPAN 3
+#define PLC_OLA_STEP_MSEC 4
+
+#define PLC_MSEC(plc, ms) ((plc)->rate / 1000 * (ms))
+
+/*
+ * Initialize the concealment state of a stream.
+ *
+ * @param plc  The state to be initialized.
+ * @param rate  The sample rate of the stream, a multiple of 8000 no greater than PLC_MAX_RATE.
+ * @return 0 if successful, -1 if the rate is not supported.
+ */
+int plc_init(PLC *plc, int rate) {
+    if(!plc || rate <= 0 || rate > PLC_MAX_RATE || rate % 8000 != 0) {
+        return -1;
+    }
+    memset(plc, 0, sizeof(*plc));
+    plc->rate = rate;
+    plc->hlen = PLC_MSEC(plc, PLC_HIST_MSEC);
+    return 0;
+}
+
+/*
+ * Find the pitch period of the most recent history by maximizing the normalized
+ * cross-correlation between the last PLC_WINDOW_MSEC of history and earlier windows.
+ * A coarse search at a reduced resolution is followed by a fine search around the best
+ * coarse candidate.
+ */
+static int plc_find_pitch(PLC *plc) {
+    int step = plc->rate / 4000;
+    int minp = PLC_MSEC(plc, PLC_MIN_PITCH_MSEC);
+    int maxp = PLC_MSEC(plc, PLC_MAX_PITCH_MSEC);
+    int win = PLC_MSEC(plc, PLC_WINDOW_MSEC);
+    const int16_t *x = plc->hist + plc->hlen - win;
+    int best = maxp;
+    float best_score = 0;
+
+    for(int pass = 0; pass < 2; pass++) {
+        int lo = pass == 0 ? minp : best - step + 1;
+        int hi = pass == 0 ? maxp : best + step - 1;
+        int stride = pass == 0 ? step : 1;
+        if(lo < minp) {
+            lo = minp;
+        }
+        if(hi > maxp) {
+            hi = maxp;
+        }
+        for(int lag = lo; lag <= hi; lag += stride) {
+            int64_t corr = 0, energy = 1;
+            for(int j = 0; j < win; j += stride) {
+                corr += (int32_t)x[j] * x[j - lag];
+                energy += (int32_t)x[j - lag] * x[j - lag];
+            }
+            float score = (float)corr * (float)(corr < 0 ? -corr : corr) / (float)energy;
+            if(score > best_score) {
+                best_score = score;
+                best = lag;
+            }
+        }
+    }
+    return best;
+}
+
+/*
+ * Produce the next synthesized sample, repeating the last span pitch periods of
+ * history, and crossfading from the previous span just after it has been widened.
+ * The fade-out of long losses is applied here as well.
+ */
+static int16_t plc_synth(PLC *plc) {
+    int len = plc->span * plc->pitch;
+    int32_t s = plc->hist[plc->hlen - len + plc->offset];
+    if(plc->xfade > 0) {
+        int olen = (plc->span - 1) * plc->pitch;
+        int32_t old = plc->hist[plc->hlen - olen + plc->offset % olen];
+        int fade = plc->pitch / 4;
+        s = (old * plc->xfade + s * (fade - plc->xfade)) / fade;
+        plc->xfade--;
+    }
+    plc->offset = (plc->offset + 1) % len;
+
+    // After the first PLC_STEP_MSEC, attenuate by 20% per PLC_STEP_MSEC, reaching silence at 60 ms.
+    int ten = PLC_MSEC(plc, PLC_STEP_MSEC);
+    if(plc->erased > ten) {
+        int32_t gain = 32768 - (int32_t)((int64_t)(plc->erased - ten) * 32768 / (5 * ten));
+        if(gain < 0) {
+            gain = 0;
+        }
+        s = (s * gain) >> 15;
+    }
+    plc->erased++;
+    return (int16_t)s;
+}
+
+/*
+ * Synthesize a replacement for a lost frame of audio.
+ *
+ * @param plc  The concealment state of the stream.
+ * @param out  Buffer for the synthesized samples.
+ * @param n  The number of samples in the lost frame.
+ */
+void plc_lost_frame(PLC *plc, int16_t *out, size_t n) {
+    int ten = PLC_MSEC(plc, PLC_STEP_MSEC);
+
+    // A new loss: find the pitch of the audio just received and start repeating its last period.
+    if(plc->erased == 0) {
+        plc->pitch = plc_find_pitch(plc);
+        plc->span = 1;
+        plc->offset = 0;
+        plc->xfade = 0;
+    }
+    for(size_t i = 0; i < n; i++) {
+        // Widen the repeated span every PLC_STEP_MSEC to make the repetition less buzzy.
+        if(plc->erased == ten * plc->span && plc->span < PLC_MAX_SPAN) {
+            plc->span++;
+            plc->xfade = plc->pitch / 4;
+        }
+        out[i] = plc_synth(plc);
+    }
+}
+
+/*
+ * Record a frame of audio that was received.
+ * If it ends a loss, the start of the frame is overlap-added with a continuation of
+ * the synthesized signal, over a quarter of a pitch period plus PLC_OLA_STEP_MSEC for
+ * every further PLC_STEP_MSEC of loss.
+ *
+ * @param plc  The concealment state of the stream.
+ * @param frame  The received samples, modified in place if a loss has just ended.
+ * @param n  The number of samples in the frame.
+ */
+void plc_good_frame(PLC *plc, int16_t *frame, size_t n) {
+    if(plc->erased) {
+        int ten = PLC_MSEC(plc, PLC_STEP_MSEC);
+        int extra = plc->erased / ten - 1;
+        size_t ola = plc->pitch / 4 + PLC_MSEC(plc, PLC_OLA_STEP_MSEC) * (extra > 0 ? extra : 0);
+        if(ola > (size_t)ten) {
+            ola = ten;
+        }
+        if(ola > n) {
+            ola = n;
+        }
+        for(size_t k = 0; k < ola; k++) {
+            int32_t s = plc_synth(plc);
+            frame[k] = (int16_t)((s * (int32_t)(ola - k) + frame[k] * (int32_t)k) / (int32_t)ola);
+        }
+        plc->erased = 0;
+    }
+
+    // Shift the frame into the history.
+    if(n >= (size_t)plc->hlen) {
+        memcpy(plc->hist, frame + n - plc->hlen, plc->hlen * sizeof(int16_t));
+    }
+    else {
+        memmove(plc->hist, plc->hist + n, (plc->hlen - n) * sizeof(int16_t));
+        memcpy(plc->hist + plc->hlen - n, frame, n * sizeof(int16_t));
+    }
+}
@@ -0,0 +1,194 @@
+/*
+ * Rate limiting: token buckets that keep one client from monopolizing the PBX.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "metrics.h"
+#include "coro.h"
+
+/*
+ * Configured classes of extensions, in the order given.  The first class containing
+ * an extension applies to it.  The table is filled in before any client is served.
+ */
+static RATE_CLASS rate_classes[RATE_MAX_CLASSES];
+static int num_rate_classes;
+
+/*
+ * Read the clock used for rate limiting.  The coarse monotonic clock is read without a
+ * system call and its resolution of a few milliseconds is plenty for this purpose.
+ *
+ * @return the current time in nanoseconds.
+ */
+uint64_t rate_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Initialize a token bucket, initially full.
+ *
+ * @param b  The bucket.
+ * @param rate  Tokens added per second, or 0 for a bucket that never runs out.
+ * @param burst  Maximum number of tokens held.
+ * @param now  The current time, from rate_clock().
+ */
+void bucket_init(TOKEN_BUCKET *b, double rate, double burst, uint64_t now) {
+    b->rate = rate;
+    b->burst = burst;
+    b->tokens = burst;
+    b->last = now;
+}
+
+/*
+ * Add the tokens accumulated since the last refill.
+ */
+static void bucket_refill(TOKEN_BUCKET *b, uint64_t now) {
+    if(now > b->last) {
+        b->tokens += b->rate * (now - b->last) / 1e9;
+        if(b->tokens > b->burst) {
+            b->tokens = b->burst;
+        }
+        b->last = now;
+    }
+}
+
+/*
+ * Take tokens from a bucket if it holds enough of them.
+ *
+ * @return 0 if the tokens were taken, -1 if there were not enough.
+ */
+int bucket_take(TOKEN_BUCKET *b, double n, uint64_t now) {
+    if(b->rate == 0) {
+        return 0;
+    }
+    bucket_refill(b, now);
+    if(b->tokens < n) {
+        return -1;
+    }
+    b->tokens -= n;
+    return 0;
+}
+
+/*
+ * Take tokens from a bucket unconditionally, going into debt if there are not enough.
+ * This lets a single request larger than the burst go through, at the cost of
+ * waiting for the debt to be repaid.
+ *
+ * @return the time (nsec) until the bucket is out of debt, 0 if it is not in debt.
+ */
+uint64_t bucket_charge(TOKEN_BUCKET *b, double n, uint64_t now) {
+    if(b->rate == 0) {
+        return 0;
+    }
+    bucket_refill(b, now);
+    b->tokens -= n;
+    return b->tokens < 0 ? (uint64_t)(-b->tokens / b->rate * 1e9) : 0;
+}
+
+/*
+ * Add a class of extensions with its own limits.
+ *
+ * @param spec  Description of the class, "<first>[-<last>]:<commands/s>[:<chat bytes/s>]".
+ * A rate of 0 means no limit; if the chat rate is omitted, chat is not limited.
+ * @return 0 if successful, -1 if the description is invalid or there are too many classes.
+ */
+int rate_class_add(const char *spec) {
+    if(num_rate_classes == RATE_MAX_CLASSES) {
+        return -1;
+    }
+    RATE_CLASS rc = { 0 };
+    char *end;
+    errno = 0;
+    rc.first = rc.last = strtol(spec, &end, 10);
+    if(end == spec) {
+        return -1;
+    }
+    if(*end == '-') {
+        spec = end + 1;
+        rc.last = strtol(spec, &end, 10);
+        if(end == spec) {
+            return -1;
+        }
+    }
+    if(*end != ':') {
+        return -1;
+    }
+    spec = end + 1;
+    rc.command_rate = strtod(spec, &end);
+    if(end == spec) {
+        return -1;
+    }
+    if(*end == ':') {
+        spec = end + 1;
+        rc.chat_rate = strtod(spec, &end);
+        if(end == spec) {
+            return -1;
+        }
+    }
+    if(*end != '\0' || errno || rc.first > rc.last || rc.command_rate < 0 || rc.chat_rate < 0) {
+        return -1;
+    }
+    rate_classes[num_rate_classes++] = rc;
+    return 0;
+}
+
+/*
+ * Set up the rate limiting state of a connection according to the class of its extension.
+ * Each bucket holds up to one second's worth of tokens.
+ *
+ * @param rl  The state to be initialized.
+ * @param ext  The extension of the connection.
+ */
+void rate_limits_init(RATE_LIMITS *rl, int ext) {
+    RATE_CLASS rc = { 0, 0, RATE_DEFAULT_COMMANDS, RATE_DEFAULT_CHAT };
+    for(int i = 0; i < num_rate_classes; i++) {
+        if(ext >= rate_classes[i].first && ext <= rate_classes[i].last) {
+            rc = rate_classes[i];
+            break;
+        }
+    }
+    uint64_t now = rate_clock();
+    bucket_init(&(rl->commands), rc.command_rate, rc.command_rate < 1 ? 1 : rc.command_rate, now);
+    bucket_init(&(rl->chat), rc.chat_rate, rc.chat_rate, now);
+}
+
+/*
+ * Account for a control command received on a connection.
+ *
+ * @param essential  Nonzero for a command that must not be dropped, which is charged
+ * all the same, going into debt if need be, so that it holds back the others.
+ * @return 0 if the command may be executed, -1 if it must be dropped.
+ */
+int rate_limit_command(RATE_LIMITS *rl, int essential) {
+    if(essential) {
+        bucket_charge(&(rl->commands), 1, rate_clock());
+        return 0;
+    }
+    if(bucket_take(&(rl->commands), 1, rate_clock()) == -1) {
+        metrics_add(METRIC_COMMANDS_THROTTLED, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Account for chat received on a connection, waiting for as long as the connection
+ * is over its limit.  Since the connection is not read in the meantime, the sender
+ * is eventually held back by TCP flow control.
+ *
+ * @param len  The number of bytes of chat.
+ */
+void rate_limit_chat(RATE_LIMITS *rl, size_t len) {
+    uint64_t wait = bucket_charge(&(rl->chat), len, rate_clock());
+    if(wait == 0) {
+        return;
+    }
+    metrics_add(METRIC_CHAT_BYTES_THROTTLED, len);
+    metrics_add(METRIC_THROTTLE_DELAY_USEC, wait / 1000);
+    struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+    coro_nanosleep(&ts);
+}
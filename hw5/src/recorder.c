@@ -0,0 +1,226 @@
+/*
+ * Recorder: spools call recordings and voicemail, compressing them on the way.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "debug.h"
+
+/*
+ * Open a spool file for a new recording and write its header.
+ *
+ * @param rec  The recorder to be initialized.
+ * @param path  The path of the spool file, which is created or truncated.
+ * @param codec  The codec to be applied to the audio.
+ * @param rate  The sample rate of the audio.
+ * @return 0 if successful, otherwise -1.
+ */
+int recorder_open(RECORDER *rec, const char *path, int codec, int rate) {
+    if(codec != RECORDING_PCM16 && codec != RECORDING_IMA_ADPCM) {
+        return -1;
+    }
+    if(!(rec->path = strdup(path))) {
+        return -1;
+    }
+    rec->file = fopen(path, "w");
+    if(!rec->file) {
+        free(rec->path);
+        return -1;
+    }
+    rec->codec = codec;
+    rec->pending = 0;
+    adpcm_init(&(rec->st));
+
+    RECORDING_HEADER header;
+    memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+    header.version = RECORDING_VERSION;
+    header.codec = codec;
+    header.rate = rate;
+    header.block_samples = RECORDING_BLOCK_SAMPLES;
+    if(fwrite(&header, sizeof(header), 1, rec->file) != 1) {
+        recorder_discard(rec);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Encode and write out the samples waiting in the block buffer.
+ */
+static int recorder_flush_block(RECORDER *rec) {
+    if(rec->pending == 0) {
+        return 0;
+    }
+    uint8_t buf[RECORDING_BLOCK_BYTES];
+    RECORDING_BLOCK_HEADER *bh = (RECORDING_BLOCK_HEADER *)buf;
+
+    // The first sample is stored as-is and resets the predictor, so each block decodes on its own.
+    bh->samples = rec->pending;
+    bh->predictor = rec->block[0];
+    bh->index = rec->st.index;
+    bh->reserved = 0;
+    rec->st.predictor = rec->block[0];
+    size_t len = sizeof(*bh) + adpcm_encode(&(rec->st), rec->block + 1, rec->pending - 1, buf + sizeof(*bh));
+    rec->pending = 0;
+    return fwrite(buf, len, 1, rec->file) == 1 ? 0 : -1;
+}
+
+/*
+ * Append audio to a recording.
+ *
+ * @param rec  The recorder.
+ * @param pcm  The samples to be recorded.
+ * @param n  The number of samples.
+ * @return 0 if successful, otherwise -1.
+ */
+int recorder_write(RECORDER *rec, const int16_t *pcm, size_t n) {
+    if(rec->codec == RECORDING_PCM16) {
+        return fwrite(pcm, sizeof(int16_t), n, rec->file) == n ? 0 : -1;
+    }
+    while(n > 0) {
+        size_t len = RECORDING_BLOCK_SAMPLES - rec->pending;
+        if(len > n) {
+            len = n;
+        }
+        memcpy(rec->block + rec->pending, pcm, len * sizeof(int16_t));
+        rec->pending += len;
+        pcm += len;
+        n -= len;
+        if(rec->pending == RECORDING_BLOCK_SAMPLES && recorder_flush_block(rec) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Finish a recording, writing out any partial block, and close its spool file.
+ *
+ * @param rec  The recorder.
+ * @return 0 if successful, otherwise -1.
+ */
+int recorder_close(RECORDER *rec) {
+    int ret = 0;
+    if(rec->codec == RECORDING_IMA_ADPCM && recorder_flush_block(rec) == -1) {
+        ret = -1;
+    }
+    if(fclose(rec->file) == EOF) {
+        ret = -1;
+    }
+    rec->file = NULL;
+    free(rec->path);
+    return ret;
+}
+
+/*
+ * Abandon a recording, closing its spool file and removing it.
+ *
+ * @param rec  The recorder.
+ */
+void recorder_discard(RECORDER *rec) {
+    fclose(rec->file);
+    rec->file = NULL;
+    unlink(rec->path);
+    free(rec->path);
+}
+
+/*
+ * Open a spool file for playback, checking its header.
+ *
+ * @param pl  The player to be initialized.
+ * @param path  The path of the spool file.
+ * @return 0 if successful, -1 if the file cannot be read or is not a recording.
+ */
+int player_open(PLAYER *pl, const char *path) {
+    pl->file = fopen(path, "r");
+    if(!pl->file) {
+        return -1;
+    }
+    pl->next = pl->avail = 0;
+    if(fread(&(pl->header), sizeof(pl->header), 1, pl->file) != 1
+       || memcmp(pl->header.magic, RECORDING_MAGIC, sizeof(pl->header.magic)) != 0
+       || pl->header.version != RECORDING_VERSION
+       || (pl->header.codec != RECORDING_PCM16 && pl->header.codec != RECORDING_IMA_ADPCM)
+       || pl->header.block_samples != RECORDING_BLOCK_SAMPLES) {
+        debug("Not a playable recording: %s", path);
+        fclose(pl->file);
+        pl->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read and decode the next block of a recording.
+ * Returns the number of samples decoded, 0 at the end of the recording, or -1 on error.
+ */
+static long player_fill(PLAYER *pl) {
+    pl->next = 0;
+    if(pl->header.codec == RECORDING_PCM16) {
+        pl->avail = fread(pl->block, sizeof(int16_t), RECORDING_BLOCK_SAMPLES, pl->file);
+        return ferror(pl->file) ? -1 : (long)pl->avail;
+    }
+    RECORDING_BLOCK_HEADER bh;
+    uint8_t data[RECORDING_BLOCK_SAMPLES / 2];
+    pl->avail = 0;
+    if(fread(&bh, sizeof(bh), 1, pl->file) != 1) {
+        return ferror(pl->file) ? -1 : 0;
+    }
+    if(bh.samples == 0 || bh.samples > RECORDING_BLOCK_SAMPLES || bh.index > 88) {
+        return -1;
+    }
+    size_t len = bh.samples / 2;
+    if(fread(data, 1, len, pl->file) != len) {
+        return -1;
+    }
+    ADPCM_STATE st = { bh.predictor, bh.index };
+    pl->block[0] = bh.predictor;
+    adpcm_decode(&st, data, bh.samples - 1, pl->block + 1);
+    pl->avail = bh.samples;
+    return pl->avail;
+}
+
+/*
+ * Read audio from a recording, decoding it if necessary.
+ *
+ * @param pl  The player.
+ * @param pcm  Buffer for the samples.
+ * @param n  The maximum number of samples to be read.
+ * @return the number of samples read, 0 at the end of the recording, or -1 on error.
+ */
+long player_read(PLAYER *pl, int16_t *pcm, size_t n) {
+    size_t done = 0;
+    while(done < n) {
+        if(pl->next == pl->avail) {
+            long ret = player_fill(pl);
+            if(ret == -1) {
+                return done ? (long)done : -1;
+            }
+            if(ret == 0) {
+                break;
+            }
+        }
+        size_t len = pl->avail - pl->next;
+        if(len > n - done) {
+            len = n - done;
+        }
+        memcpy(pcm + done, pl->block + pl->next, len * sizeof(int16_t));
+        pl->next += len;
+        done += len;
+    }
+    return done;
+}
+
+/*
+ * Finish playback of a recording.
+ *
+ * @param pl  The player.
+ */
+void player_close(PLAYER *pl) {
+    if(pl->file) {
+        fclose(pl->file);
+        pl->file = NULL;
+    }
+}
@@ -0,0 +1,186 @@
+/*
+ * Resampler: converts audio streams between 8 kHz and 16 kHz.
+ */
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "resample.h"
+
+/*
+ * Prototype low-pass filter: 63-tap Kaiser-windowed sinc (beta 8) with a 3.6 kHz cutoff
+ * at 16 kHz, in Q15, padded to 64 taps.  The tables below are stored time-reversed, so
+ * that an output sample is a plain dot product with a window of consecutive input samples.
+ *
+ * Decimation (16 kHz -> 8 kHz) uses all 64 taps for every other input sample.
+ */
+static const int16_t resample_down[RESAMPLE_TAPS] __attribute__((aligned(16))) = {
+         0,      0,     -2,     -1,      6,      4,    -12,    -15,
+        17,     36,    -17,    -69,      0,    114,     45,   -162,
+      -132,    194,    270,   -183,   -462,     91,    700,    131,
+      -963,   -558,   1221,   1338,  -1440,  -2991,   1587,  10262,
+     14746,  10262,   1587,  -2991,  -1440,   1338,   1221,   -558,
+      -963,    131,    700,     91,   -462,   -183,    270,    194,
+      -132,   -162,     45,    114,      0,    -69,    -17,     36,
+        17,    -15,    -12,      4,      6,     -1,     -2,      0,
+};
+
+/*
+ * Interpolation (8 kHz -> 16 kHz) splits the prototype into its even and odd phases,
+ * each scaled by 2 to make up for the inserted zeros.
+ */
+static const int16_t resample_up[2][RESAMPLE_TAPS / 2] __attribute__((aligned(16))) = {
+    {
+         0,     -1,      9,    -30,     71,   -139,    229,   -324,
+       388,   -366,    183,    263,  -1115,   2675,  -5982,  20524,
+     20524,  -5982,   2675,  -1115,    263,    183,   -366,    388,
+      -324,    229,   -139,     71,    -30,      9,     -1,      0,
+    },
+    {
+         0,     -4,     12,    -23,     34,    -33,      0,     90,
+      -264,    540,   -924,   1400,  -1925,   2442,  -2880,   3173,
+     29492,   3173,  -2880,   2442,  -1925,   1400,   -924,    540,
+      -264,     90,      0,    -33,     34,    -23,     12,     -4,
+    }
+};
+
+/*
+ * Dot product of a window of input samples with a (reversed) coefficient table,
+ * rounded back from Q15 and saturated to 16 bits.
+ *
+ * @param x  The first (oldest) sample of the window.
+ * @param h  The coefficient table, which must be 16-byte aligned.
+ * @param taps  The number of taps, a multiple of 8.
+ * @return the filtered output sample.
+ */
+static inline int16_t resample_dot(const int16_t *x, const int16_t *h, int taps) {
+    int32_t sum;
+#ifdef __SSE2__
+    // Multiply pairs of samples and accumulate into four 32-bit lanes, then fold the lanes.
+    __m128i acc = _mm_setzero_si128();
+    for(int i = 0; i < taps; i += 8) {
+        __m128i xv = _mm_loadu_si128((const __m128i *)(x + i));
+        __m128i hv = _mm_load_si128((const __m128i *)(h + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(xv, hv));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = _mm_cvtsi128_si32(acc);
+#else
+    sum = 0;
+    for(int i = 0; i < taps; i++) {
+        sum += (int32_t)x[i] * h[i];
+    }
+#endif
+    sum = (sum + (1 << 14)) >> 15;
+    if(sum > INT16_MAX) {
+        return INT16_MAX;
+    }
+    if(sum < INT16_MIN) {
+        return INT16_MIN;
+    }
+    return (int16_t)sum;
+}
+
+/*
+ * Initialize a resampler for converting between two sample rates.
+ * Supported conversions are 8000 <-> 16000, and any rate to itself.
+ *
+ * @param rs  The resampler to be initialized.
+ * @param in_rate  The sample rate of the input stream.
+ * @param out_rate  The sample rate of the output stream.
+ * @return 0 if the conversion is supported, otherwise -1.
+ */
+int resampler_init(RESAMPLER *rs, int in_rate, int out_rate) {
+    if(!rs || in_rate <= 0 || out_rate <= 0) {
+        return -1;
+    }
+    if(in_rate != out_rate && in_rate * 2 != out_rate && out_rate * 2 != in_rate) {
+        return -1;
+    }
+    if(in_rate != out_rate && in_rate != 8000 && in_rate != 16000) {
+        return -1;
+    }
+    rs->in_rate = in_rate;
+    rs->out_rate = out_rate;
+    resampler_reset(rs);
+    return 0;
+}
+
+/*
+ * Discard the filter history of a resampler, e.g. when its stream restarts.
+ *
+ * @param rs  The resampler to be reset.
+ */
+void resampler_reset(RESAMPLER *rs) {
+    rs->phase = 0;
+    memset(rs->hist, 0, sizeof(rs->hist));
+}
+
+/*
+ * Determine an upper bound on the number of output samples produced from an input block.
+ *
+ * @param rs  The resampler.
+ * @param n  The number of input samples.
+ * @return the maximum number of output samples.
+ */
+size_t resampler_out_max(RESAMPLER *rs, size_t n) {
+    if(rs->out_rate > rs->in_rate) {
+        return 2 * n;
+    }
+    else if(rs->out_rate < rs->in_rate) {
+        return (n + 1) / 2;
+    }
+    return n;
+}
+
+/*
+ * Convert a block of input samples, continuing from where the previous block left off.
+ *
+ * @param rs  The resampler holding the state of the stream.
+ * @param in  The input samples.
+ * @param n  The number of input samples.
+ * @param out  Buffer for the output samples, with room for at least
+ * resampler_out_max(rs, n) samples.  It must not overlap the input.
+ * @return the number of output samples produced.
+ */
+size_t resampler_process(RESAMPLER *rs, const int16_t *in, size_t n, int16_t *out) {
+    // Same rate, nothing to filter.
+    if(rs->in_rate == rs->out_rate) {
+        memcpy(out, in, n * sizeof(int16_t));
+        return n;
+    }
+
+    // Work buffer holding the filter history followed by the current chunk of input.
+    int16_t work[RESAMPLE_TAPS + RESAMPLE_CHUNK];
+    size_t produced = 0;
+    while(n > 0) {
+        size_t len = n < RESAMPLE_CHUNK ? n : RESAMPLE_CHUNK;
+        memcpy(work, rs->hist, sizeof(rs->hist));
+        memcpy(work + RESAMPLE_TAPS, in, len * sizeof(int16_t));
+
+        // Interpolate: every input sample produces one output sample from each phase.
+        if(rs->out_rate > rs->in_rate) {
+            const int16_t *win = work + RESAMPLE_TAPS - (RESAMPLE_TAPS / 2 - 1);
+            for(size_t i = 0; i < len; i++) {
+                out[produced++] = resample_dot(win + i, resample_up[0], RESAMPLE_TAPS / 2);
+                out[produced++] = resample_dot(win + i, resample_up[1], RESAMPLE_TAPS / 2);
+            }
+        }
+        // Decimate: only input samples at even positions in the stream produce output.
+        else {
+            const int16_t *win = work + 1;
+            for(size_t i = rs->phase; i < len; i += 2) {
+                out[produced++] = resample_dot(win + i, resample_down, RESAMPLE_TAPS);
+            }
+            rs->phase = (rs->phase + len) & 1;
+        }
+
+        // Keep the most recent input samples as history for the next chunk.
+        memcpy(rs->hist, work + len, sizeof(rs->hist));
+        in += len;
+        n -= len;
+    }
+    return produced;
+}
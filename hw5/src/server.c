@@ -2,72 +2,1063 @@
  * "PBX" server module.
  * Manages interaction with a client telephone unit (TU).
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "debug.h"
 #include "pbx.h"
 #include "server.h"
+#include "server_ext.h"
+#include "tu_ext.h"
+#include "pbx_ext.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "proto.h"
+#include "handoff.h"
+#include "admission.h"
+#include "lanes.h"
+#include "executor.h"
+#include "coro.h"
 #include "csapp.h"
 
 /*
- * This function takes a file descriptor used for comunicating between client and thread, and reads the full message.
+ * Maximum length of a text command line, set with the -l option.
  */
-char* read_client_msg(int fd, TU *tu) {
-    char static_buf;
-    FILE *stream;
-    char *output_buf;
-    size_t len;
-    stream = open_memstream(&output_buf, &len);
-    if(stream == NULL) {
-         return NULL;
+size_t pbx_max_line = PBX_DEFAULT_MAX_LINE;
+
+/*
+ * Initial capacity of the receive buffer of a client connection.
+ */
+#define CLIENT_BUF_INITIAL 4096
+
+/*
+ * Receive buffer of a client connection.
+ * Input is read from the connection in large chunks, and each message is handed out
+ * as a pointer into the buffer, so that the content of a message (e.g. the body of a
+ * chat) is not copied on its way from the connection to the TU functions.
+ * The buffer grows as needed, but never beyond room for a line of pbx_max_line bytes.
+ */
+typedef struct client_buf {
+    int fd;          // File descriptor of the client connection.
+    char *data;      // Buffered input.
+    size_t size;     // Capacity of the buffer.
+    size_t start;    // Start of the input that has not yet been handed out.
+    size_t scan;     // Position from which the search for the next EOL continues.
+    size_t end;      // End of the buffered input.
+    int discard;     // Set while skipping the rest of a line that was too long.
+    size_t limit;    // Largest capacity the buffer may grow to.
+    int proto;       // Protocol spoken on the connection, PROTO_TEXT, PROTO_BINARY or PROTO_TRUNK.
+    TRUNK *trunk;    // The trunk carried by the connection, if it is one.
+    SHM_LINK *shm;   // The shared-memory link that input comes from instead, if any.
+    size_t mark;     // Start of the message being read, which may already be partly taken.
+    int streaming;   // Set while streaming the body of a chat frame.
+    HANDOFF_CONN conn; // The connection, as left behind on a hot restart.
+    LANES lanes;     // Frames read in this tick, not yet carried out (see lanes.h).
+    LANE_ITEM *held; // Frames held over to the next tick.
+    LANE_ITEM **held_tail;
+    uint64_t tick;   // Number of the current tick.
+    uint64_t budget_tick; // Tick in which the TU of a binary connection used budget_bytes.
+    size_t budget_bytes;
+} CLIENT_BUF;
+
+/*
+ * Set up the receive buffer of a connection, holding to begin with some input that
+ * has already been received.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated or the input does not fit.
+ */
+static int client_buf_init(CLIENT_BUF *cb, int fd, int proto, const char *pending, size_t len) {
+    memset(cb, 0, sizeof(*cb));
+    cb->fd = fd;
+    cb->proto = proto;
+    lanes_init(&(cb->lanes));
+    cb->held_tail = &(cb->held);
+    cb->limit = pbx_max_line + (proto == PROTO_BINARY ? sizeof(PROTO_HEADER) : strlen(EOL));
+    cb->size = cb->limit < CLIENT_BUF_INITIAL ? cb->limit : CLIENT_BUF_INITIAL;
+    if(len > cb->limit) {
+        return -1;
     }
+    if(len > cb->size) {
+        cb->size = len;
+    }
+    if(!(cb->data = malloc(cb->size))) {
+        return -1;
+    }
+    if(len > 0) {
+        memcpy(cb->data, pending, len);
+    }
+    cb->end = len;
+    return 0;
+}
 
-    // Perform read calls until end of arg string or EOF encountered.
-    int bytes_read = read(fd, &static_buf, 1);
+/*
+ * Stop the thread serving a connection for a hot restart, if one is under way, leaving
+ * behind the input of the message that it was reading.  The middle of a chat frame
+ * cannot be handed over, so there the thread carries on until the frame is done.
+ */
+static void park_client(CLIENT_BUF *cb) {
+    if(cb->streaming) {
+        return;
+    }
+    // The TUs of a trunk are handed over only once the workers are done with them.
+    if(cb->trunk) {
+        exec_quiesce(&(cb->trunk->tasks));
+    }
+    cb->conn.proto = cb->proto;
+    cb->conn.discard = cb->discard;
+    cb->conn.pending = cb->data + cb->mark;
+    cb->conn.pending_len = cb->end - cb->mark;
+    handoff_park(&(cb->conn));
+}
+
+/*
+ * Read what input is available from a client connection, or its shared-memory link,
+ * into a buffer, waiting until there is some (in a coroutine, suspending it instead).
+ *
+ * A wait interrupted by a signal is where the thread stops for a hot restart.
+ *
+ * @return the number of bytes read, 0 at EOF, or -1 if an error occurs.
+ */
+static ssize_t read_client(CLIENT_BUF *cb, char *buf, size_t len) {
+    while(1) {
+        ssize_t n = cb->shm ? shm_link_read(cb->shm, buf, len) : coro_read(cb->fd, buf, len);
+        if(n != -1 || errno != EINTR) {
+            return n;
+        }
+        park_client(cb);
+    }
+}
+
+/*
+ * Grow the receive buffer of a connection, up to its limit, which allows for a line of
+ * pbx_max_line bytes in the text protocol, or a frame with a payload of pbx_max_line
+ * bytes in the binary protocol.
+ *
+ * @return 0 if successful, -1 if the buffer is already as large as allowed or
+ * memory could not be allocated.
+ */
+static int grow_client_buf(CLIENT_BUF *cb) {
+    size_t max = cb->limit;
+    if(cb->size >= max) {
+        return -1;
+    }
+    size_t size = cb->size * 2 < max ? cb->size * 2 : max;
+    char *data = realloc(cb->data, size);
+    if(!data) {
+        return -1;
+    }
+    cb->data = data;
+    cb->size = size;
+    return 0;
+}
+
+/*
+ * This function reads the next full message from a client connection.
+ * The message is returned as a pointer into the receive buffer, with the EOL replaced
+ * by a null terminator.  It remains valid until the next call.
+ * Lines longer than pbx_max_line are skipped.
+ */
+char* read_client_msg(CLIENT_BUF *cb, size_t *len) {
     while(1) {
-        // EOF encountered, terminate thread.
-        if(bytes_read == 0) {
-            fclose(stream);
-            free(output_buf);
+        // Look for the end of a message among the bytes that have not been searched yet.
+        char *eol = memmem(cb->data + cb->scan, cb->end - cb->scan, EOL, strlen(EOL));
+        if(eol) {
+            char *msg = cb->data + cb->start;
+            *eol = '\0';
+            *len = eol - msg;
+            cb->start = cb->scan = eol - cb->data + strlen(EOL);
+            if(cb->discard) {
+                cb->discard = 0;
+                continue;
+            }
+            return msg;
+        }
+        // The last byte could be the first half of the EOL, so search it again next time.
+        cb->scan = cb->end > cb->start ? cb->end - 1 : cb->start;
+
+        // Move the partial message to the front of the buffer, growing it if it is full.
+        if(cb->start > 0) {
+            memmove(cb->data, cb->data + cb->start, cb->end - cb->start);
+            cb->end -= cb->start;
+            cb->scan -= cb->start;
+            cb->start = 0;
+        }
+        if(cb->end == cb->size && grow_client_buf(cb) == -1) {
+            // The line is too long: drop all of it but the last byte and skip the rest.
+            cb->data[0] = cb->data[cb->end - 1];
+            cb->end = 1;
+            cb->scan = 0;
+            cb->discard = 1;
+        }
+
+        // EOF or error, terminate thread.
+        cb->mark = cb->start;
+        ssize_t bytes_read = read_client(cb, cb->data + cb->end, cb->size - cb->end);
+        if(bytes_read <= 0) {
             return NULL;
         }
-        // Error.
-        else if(bytes_read == -1) {
-            fclose(stream);
-            free(output_buf);
+        cb->end += bytes_read;
+    }
+}
+
+/*
+ * This function takes up to a given number of raw bytes from a client connection,
+ * reading more from the connection only if none are buffered.  The bytes are returned
+ * as a pointer into the receive buffer, which remains valid until the next call.
+ */
+static char* read_client_bytes(CLIENT_BUF *cb, size_t max, size_t *len) {
+    if(cb->start == cb->end) {
+        // Nothing is buffered, so the whole buffer is free for the bytes still to come.
+        cb->start = cb->scan = cb->end = cb->mark = 0;
+        if(max > cb->size) {
+            grow_client_buf(cb);
+        }
+        cb->streaming = 1;
+        ssize_t bytes_read = read_client(cb, cb->data, cb->size);
+        cb->streaming = 0;
+        if(bytes_read <= 0) {
             return NULL;
         }
-        // Push buffered contents to dynamic buffer or exit if \r\n encountered.
+        cb->end = bytes_read;
+    }
+    char *bytes = cb->data + cb->start;
+    *len = cb->end - cb->start < max ? cb->end - cb->start : max;
+    cb->start += *len;
+    if(cb->scan < cb->start) {
+        cb->scan = cb->start;
+    }
+    return bytes;
+}
+
+/*
+ * This function takes exactly a given number of bytes from a client connection, which
+ * together with what has been taken of the same message must not exceed the limit of
+ * the receive buffer, reading more from the connection as needed.  The bytes are
+ * returned as a pointer into the receive buffer, which remains valid until the next call.
+ */
+static char* read_client_exact(CLIENT_BUF *cb, size_t len) {
+    while(cb->end - cb->start < len) {
+        // Move the partial message to the front of the buffer, growing it if it is too small.
+        if(cb->mark > 0) {
+            memmove(cb->data, cb->data + cb->mark, cb->end - cb->mark);
+            cb->end -= cb->mark;
+            cb->start -= cb->mark;
+            cb->mark = 0;
+        }
+        while(cb->size < cb->start + len) {
+            if(grow_client_buf(cb) == -1) {
+                return NULL;
+            }
+        }
+        ssize_t bytes_read = read_client(cb, cb->data + cb->end, cb->size - cb->end);
+        if(bytes_read <= 0) {
+            return NULL;
+        }
+        cb->end += bytes_read;
+    }
+    char *bytes = cb->data + cb->start;
+    cb->start += len;
+    cb->scan = cb->start;
+    return bytes;
+}
+
+/*
+ * Consume and drop a given number of bytes from a client connection.
+ *
+ * @return 0 if successful, -1 if the connection ended first.
+ */
+static int skip_client_bytes(CLIENT_BUF *cb, size_t len) {
+    while(len > 0) {
+        size_t n;
+        if(!read_client_bytes(cb, len, &n)) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Stream the body of a length-prefixed chat frame from a client connection through
+ * to the peer of its TU, a piece at a time as it arrives, subject to the chat rate limit
+ * of the connection.  If the TU is not in a call, the body is consumed and dropped.
+ *
+ * @param len  The length of the body.
+ * @param more  The number of bytes of the frame to come in later requests, after this one.
+ * @return 0 if successful, -1 if the connection ended before the whole body arrived.
+ */
+static int relay_chat_frame(CLIENT_BUF *cb, TU *tu, RATE_LIMITS *rl, size_t len, size_t more) {
+    do {
+        char *bytes = "";
+        size_t n = 0;
+        if(len > 0 && !(bytes = read_client_bytes(cb, len, &n))) {
+            return -1;
+        }
+        len -= n;
+        rate_limit_chat(rl, n);
+        tu_chat_frame(tu, bytes, n, len + more);
+    } while(len > 0);
+    return 0;
+}
+
+/*
+ * A command from a client, in either protocol.
+ */
+typedef struct client_cmd {
+    int op;          // Command, PROTO_OP_*, CMD_PROTO or CMD_SHM.
+    long arg;        // Numeric argument, or 0 if none; bytes to come, after a chat frame.
+    char *text;      // Text of a chat or a message, in the receive buffer, or NULL.
+    size_t len;      // Length of the text, or of the body of a chat frame still to be read.
+} CLIENT_CMD;
+
+/*
+ * Text command switching the connection to another version of the protocol.
+ */
+#define CMD_PROTO PROTO_NUM_OPS
+
+/*
+ * Text command moving the connection to a shared-memory link (see shm.h).
+ */
+#define CMD_SHM (PROTO_NUM_OPS + 1)
+
+/*
+ * Forms that the argument of a text command may take.
+ */
+#define ARG_NONE 0       // No argument.
+#define ARG_NUMBER 1     // A number.
+#define ARG_OPTIONAL 2   // An optional number.
+#define ARG_TEXT 3       // Text, spaces included, possibly empty.
+#define ARG_NUMBER_TEXT 4 // A number, then text.
+#define ARG_LENGTH 5     // The length of a chat frame, whose body follows the line.
+
+static const struct text_command {
+    const char *name;
+    int op;
+    int arg;
+} text_commands[] = {
+    { "pickup", PROTO_OP_PICKUP, ARG_NONE },
+    { "hangup", PROTO_OP_HANGUP, ARG_NONE },
+    { "dial", PROTO_OP_DIAL, ARG_NUMBER },
+    { "chat", PROTO_OP_CHAT, ARG_TEXT },
+    { "chatf", PROTO_OP_CHATF, ARG_LENGTH },
+    { "replay", PROTO_OP_REPLAY, ARG_OPTIONAL },
+    { "msg", PROTO_OP_MSG, ARG_NUMBER_TEXT },
+    { "hold", PROTO_OP_HOLD, ARG_NONE },
+    { "resume", PROTO_OP_RESUME, ARG_NONE },
+    { "group", PROTO_OP_GROUP, ARG_NUMBER },
+    { "gpickup", PROTO_OP_GPICKUP, ARG_NONE },
+    { "dpickup", PROTO_OP_DPICKUP, ARG_NUMBER },
+    { "park", PROTO_OP_PARK, ARG_NUMBER },
+    { "unpark", PROTO_OP_UNPARK, ARG_NUMBER },
+    { "proto", CMD_PROTO, ARG_NUMBER },
+    { "shm", CMD_SHM, ARG_NONE }
+};
+
+/*
+ * Determine whether a command is charged against the chat rate limit of a connection,
+ * rather than the command rate limit.
+ */
+static int is_chat_cmd(int op) {
+    return op == PROTO_OP_CHAT || op == PROTO_OP_CHATF || op == PROTO_OP_MSG;
+}
+
+/*
+ * Account for a command against the command rate limit of a connection, unless it is
+ * charged against the chat rate limit, or is audio, which is not limited.  Hangup and
+ * pickup are never dropped (see ratelimit.h).
+ *
+ * @return 0 if the command may be carried out, -1 if it must be dropped.
+ */
+static int rate_limit_cmd(RATE_LIMITS *rl, int op) {
+    if(is_chat_cmd(op) || op == PROTO_OP_AUDIO) {
+        return 0;
+    }
+    return rate_limit_command(rl, op == PROTO_OP_HANGUP || op == PROTO_OP_PICKUP);
+}
+
+/*
+ * Parse a line of the text protocol, which is modified in place.
+ * The text of a chat or a message is left in the line, spaces included.
+ *
+ * @param msg  The line, without the EOL.
+ * @param len  The length of the line.
+ * @param cmd  Set to the command.  Its op is set as soon as the command is recognized,
+ * even if its argument turns out to be malformed.
+ * @return 0 if successful, -1 if the command is unknown or malformed.
+ */
+static int parse_text_cmd(char *msg, size_t len, CLIENT_CMD *cmd) {
+    // Split the command from its argument.
+    char* arg = strchr(msg, ' ');
+    size_t arg_len = 0;
+    if(arg) {
+        *arg++ = '\0';
+        arg_len = len - (arg - msg);
+    }
+    const struct text_command *tc = NULL;
+    for(size_t i = 0; i < sizeof(text_commands) / sizeof(text_commands[0]); i++) {
+        if(strcmp(msg, text_commands[i].name) == 0) {
+            tc = &text_commands[i];
+            break;
+        }
+    }
+    if(!tc) {
+        return -1;
+    }
+    cmd->op = tc->op;
+    cmd->arg = 0;
+    cmd->text = NULL;
+    cmd->len = 0;
+
+    char *end;
+    switch(tc->arg) {
+    case ARG_NONE:
+        return arg ? -1 : 0;
+    case ARG_NUMBER:
+        if(!arg || strchr(arg, ' ')) {
+            return -1;
+        }
+        cmd->arg = atoi(arg);
+        return 0;
+    case ARG_OPTIONAL:
+        cmd->arg = arg ? strtoul(arg, NULL, 10) : 0;
+        return 0;
+    case ARG_TEXT:
+        cmd->text = arg ? arg : "";
+        cmd->len = arg_len;
+        return 0;
+    case ARG_NUMBER_TEXT:
+        // The text is the rest of the line after the number, spaces included.
+        if(!arg) {
+            return -1;
+        }
+        cmd->arg = strtol(arg, &end, 10);
+        if(end == arg || (*end != ' ' && *end != '\0')) {
+            return -1;
+        }
+        cmd->text = *end ? end + 1 : end;
+        cmd->len = arg_len - (cmd->text - arg);
+        return 0;
+    case ARG_LENGTH:
+        if(!arg) {
+            return -1;
+        }
+        cmd->len = strtoull(arg, &end, 10);
+        if(end == arg || *end != '\0' || *arg == '-') {
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Switch a connection to a trunk (see trunk.h), with the TU of the connection on
+ * channel 0.  A notification of the state of the TU follows, as for any switch of
+ * protocol, on channel 0; if the trunk cannot be set up, it is sent as a text line.
+ */
+static void start_trunk(CLIENT_BUF *cb, TU *tu, RATE_LIMITS *rl) {
+    TRUNK *trunk = trunk_create(cb->fd);
+    TRUNK_CHANNEL *ch = trunk ? trunk_channel(trunk, 0) : NULL;
+    if(!ch) {
+        if(trunk) {
+            trunk_unref(trunk);
+        }
+        tu_notify_state(tu);
+        return;
+    }
+    ch->tu = tu;
+    ch->rl = *rl;
+    tu_join_trunk(tu, trunk, 0);
+    cb->trunk = trunk;
+    cb->conn.tu = NULL;
+    cb->proto = PROTO_TRUNK;
+    cb->limit = pbx_max_line + sizeof(uint32_t) + sizeof(PROTO_HEADER);
+    tu_notify_state(tu);
+}
+
+/*
+ * Move a connection to a shared-memory link (see shm.h).  Only a client on the Unix-domain
+ * socket can be passed the memory of the link; for any other, or if the link cannot be
+ * set up, the command just gets a notification of the state of the TU.
+ */
+static void start_shm(CLIENT_BUF *cb, TU *tu) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    SHM_LINK *link = NULL;
+    int memfd;
+    if(cb->proto == PROTO_TEXT && !cb->shm &&
+       getsockname(cb->fd, (struct sockaddr *)&addr, &addrlen) == 0 && addr.ss_family == AF_UNIX &&
+       (link = shm_link_create(cb->fd, &memfd))) {
+        if(tu_attach_shm(tu, link, memfd) == 0) {
+            cb->shm = link;
+            cb->conn.tu = NULL;
+        }
         else {
-            // Encountered \r.
-            if(static_buf == '\r') {
-                bytes_read = read(fd, &static_buf, 1);
-                //Error.
-                if(bytes_read == -1) {
-                    fclose(stream);
-                    free(output_buf);
-                    return NULL;
-                }
-                // Encountered \n, exit.
-                else if(static_buf == '\n') {
-                    break;
-                }
-                // Not the end, push characters into dynamic buffer.
-                else {
-                    fprintf(stream, "%c", '\r');
-                    fprintf(stream, "%c", static_buf);
-                }
+            shm_link_free(link);
+            link = NULL;
+        }
+        close(memfd);
+    }
+    if(!link) {
+        tu_notify_state(tu);
+    }
+}
+
+/*
+ * Carry out a command from the client of a TU.
+ *
+ * @return 0 if the connection can go on, -1 if it ended in the course of the command.
+ */
+static int run_client_cmd(CLIENT_BUF *cb, TU *tu, RATE_LIMITS *rl, CLIENT_CMD *cmd) {
+    // Under overload, chat waits behind call control.  A trunk, which carries the
+    // control commands of many calls, is never held up.
+    if(is_chat_cmd(cmd->op) && cb && cb->proto != PROTO_TRUNK) {
+        admission_chat();
+    }
+    uint64_t start = is_chat_cmd(cmd->op) ? 0 : admission_command_start();
+    switch(cmd->op) {
+    case PROTO_OP_PICKUP:
+        tu_pickup(tu);
+        debug("Picked up.");
+        break;
+    case PROTO_OP_HANGUP:
+        tu_hangup(tu);
+        debug("Hanged up.");
+        break;
+    case PROTO_OP_DIAL:
+        pbx_dial(pbx, tu, cmd->arg);
+        break;
+    case PROTO_OP_CHAT:
+        // The body is relayed straight from the receive buffer.
+        rate_limit_chat(rl, cmd->len);
+        tu_chatv(tu, cmd->text, cmd->len);
+        debug("Sent chat message.");
+        break;
+    case PROTO_OP_CHATF:
+        if(relay_chat_frame(cb, tu, rl, cmd->len, cmd->arg) == -1) {
+            return -1;
+        }
+        debug("Sent chat frame.");
+        break;
+    case PROTO_OP_REPLAY:
+        tu_replay(tu, cmd->arg);
+        break;
+    case PROTO_OP_MSG:
+        rate_limit_chat(rl, cmd->len);
+        tu_msg(tu, cmd->arg, cmd->text, cmd->len);
+        debug("Left message.");
+        break;
+    case PROTO_OP_HOLD:
+        tu_hold(tu);
+        debug("Held call.");
+        break;
+    case PROTO_OP_RESUME:
+        tu_resume(tu);
+        debug("Resumed call.");
+        break;
+    case PROTO_OP_GROUP:
+        tu_set_group(tu, cmd->arg);
+        break;
+    case PROTO_OP_GPICKUP:
+        tu_group_pickup(tu);
+        break;
+    case PROTO_OP_DPICKUP:
+        pbx_directed_pickup(pbx, tu, cmd->arg);
+        break;
+    case PROTO_OP_PARK:
+        tu_park(tu, cmd->arg);
+        break;
+    case PROTO_OP_UNPARK:
+        tu_unpark(tu, cmd->arg);
+        break;
+    case PROTO_OP_AUDIO:
+        tu_audio(tu, cmd->text, cmd->len);
+        break;
+    case CMD_SHM:
+        start_shm(cb, tu);
+        break;
+    case CMD_PROTO:
+        // A trunk writes to its connection directly, so it cannot use a shared-memory link.
+        if(cmd->arg == PROTO_TRUNK && cb->proto == PROTO_TEXT && !cb->shm) {
+            start_trunk(cb, tu, rl);
+        }
+        else if(tu_set_protocol(tu, cmd->arg) == 0) {
+            cb->proto = cmd->arg;
+            cb->limit = pbx_max_line + (cb->proto == PROTO_BINARY ? sizeof(PROTO_HEADER) : strlen(EOL));
+        }
+        break;
+    }
+    admission_command_done(start);
+    return 0;
+}
+
+/*
+ * Read and carry out the next command from a client that speaks the text protocol.
+ * Lines that are not valid commands are ignored.
+ *
+ * @return 0 if the connection can go on, -1 if it has ended.
+ */
+static int serve_text_cmd(CLIENT_BUF *cb, TU *tu, RATE_LIMITS *rl) {
+    size_t len;
+    char* client_msg = read_client_msg(cb, &len);
+
+    // Failed to read from client or EOF encountered.
+    if(!client_msg) {
+        return -1;
+    }
+    CLIENT_CMD cmd = { -1 };
+    int ret = parse_text_cmd(client_msg, len, &cmd);
+
+    // Control commands over the rate limit are dropped, even malformed ones.
+    if(rate_limit_cmd(rl, cmd.op) == -1) {
+        return 0;
+    }
+    // If not a valid command, then do nothing.
+    if(ret == -1) {
+        return 0;
+    }
+    return run_client_cmd(cb, tu, rl, &cmd);
+}
+
+/*
+ * Carry out a line of the text protocol for a TU that has no connection of its own to
+ * be read from or held up, such as that of a UDP phone (see udp.h).  Commands that need
+ * such a connection are not available, and chats over the rate limit are dropped rather
+ * than delayed.
+ *
+ * @param line  The line, without the EOL, which is modified in place.
+ * @param len  The length of the line.
+ * @return 0 if the command was carried out, -1 if it was dropped.
+ */
+int pbx_serve_line(TU *tu, RATE_LIMITS *rl, char *line, size_t len) {
+    CLIENT_CMD cmd = { -1 };
+    int ret = parse_text_cmd(line, len, &cmd);
+    if(rate_limit_cmd(rl, cmd.op) == -1) {
+        return -1;
+    }
+    if(ret == -1 || cmd.op == PROTO_OP_CHATF || cmd.op == CMD_PROTO || cmd.op == CMD_SHM) {
+        return -1;
+    }
+    if(is_chat_cmd(cmd.op) && bucket_take(&(rl->chat), cmd.len, rate_clock()) == -1) {
+        metrics_add(METRIC_CHAT_BYTES_THROTTLED, cmd.len);
+        return -1;
+    }
+    if(cmd.op == PROTO_OP_CHAT) {
+        tu_chatv(tu, cmd.text, cmd.len);
+    }
+    else if(cmd.op == PROTO_OP_MSG) {
+        tu_msg(tu, cmd.arg, cmd.text, cmd.len);
+    }
+    else {
+        run_client_cmd(NULL, tu, rl, &cmd);
+    }
+    return 0;
+}
+
+/*
+ * Determine whether the payload of a request is streamed through to the peer in pieces,
+ * rather than read whole: that of a chat frame, or of any frame too large for the
+ * receive buffer.
+ */
+static int frame_streamed(PROTO_HEADER *h) {
+    return h->op == PROTO_OP_CHATF || h->len > pbx_max_line;
+}
+
+/*
+ * Carry out a request, of which the header, and the payload unless it is streamed, have
+ * been read, from a client that speaks the binary protocol.  Rejected requests are
+ * answered by an error response.
+ *
+ * @param h  The decoded header.
+ * @param bad  Nonzero if the header is not a well-formed request header.
+ * @param payload  The payload, or NULL if it is streamed and still to be read.
+ * @return 0 if the connection can go on, -1 if it has ended.
+ */
+static int serve_binary_request(CLIENT_BUF *cb, TU *tu, RATE_LIMITS *rl, PROTO_HEADER *h, int bad, char *payload) {
+    tu_set_request(tu, h->id);
+
+    // Chat frames, and chats too large for the buffer, are streamed through to the peer.
+    CLIENT_CMD cmd = { h->op, h->arg, payload, h->len };
+    int stream = !payload;
+    if(!bad && stream && h->op == PROTO_OP_CHAT) {
+        cmd.op = PROTO_OP_CHATF;
+    }
+    // A chat frame may go on in the requests that follow, as it does from another PBX.
+    if(cmd.op == PROTO_OP_CHATF) {
+        cmd.arg = h->op == PROTO_OP_CHATF && (h->flags & PROTO_FLAG_MORE) && h->arg > 0 ? h->arg : 0;
+    }
+    // Channels can only be opened and closed on a trunk, which handles them itself.
+    if(bad || (stream && cmd.op != PROTO_OP_CHATF) ||
+       cmd.op == PROTO_OP_OPEN || cmd.op == PROTO_OP_CLOSE ||
+       rate_limit_cmd(rl, cmd.op) == -1) {
+        tu_reject(tu, h->op);
+        return stream ? skip_client_bytes(cb, h->len) : 0;
+    }
+    return run_client_cmd(cb, tu, rl, &cmd);
+}
+
+/*
+ * Answer a request on a trunk by an error response, when there is no TU on its channel
+ * to answer it.
+ */
+static void trunk_reject(TRUNK *trunk, uint32_t channel, PROTO_HEADER *h) {
+    PROTO_HEADER response;
+    proto_header_pack(&response, PROTO_RESPONSE, h->op, PROTO_FLAG_ERROR, h->id, 0, 0);
+    struct iovec iov[2] = { { NULL, 0 }, { &response, sizeof(response) } };
+    trunk_send(trunk, channel, iov, 2);
+}
+
+/*
+ * Plug a new virtual TU into the PBX on a channel of a trunk.
+ *
+ * @return 0 if successful, -1 if the channel is in use or the TU cannot be registered.
+ */
+static int open_trunk_channel(TRUNK *trunk, uint32_t channel, uint32_t id) {
+    TRUNK_CHANNEL *ch = trunk_channel(trunk, channel);
+    if(!ch || ch->tu) {
+        return -1;
+    }
+    TU *tu = tu_init(trunk->fd);
+    if(!tu) {
+        return -1;
+    }
+    tu_join_trunk(tu, trunk, channel);
+    // The "ON HOOK" notification sent on registration answers the request.
+    tu_set_request(tu, id);
+    int ext = pbx_register_virtual(pbx, tu);
+    if(ext == -1) {
+        tu_unref(tu, "Virtual extensions exhausted.");
+        return -1;
+    }
+    ch->tu = tu;
+    rate_limits_init(&(ch->rl), ext);
+    return 0;
+}
+
+/*
+ * Unplug the virtual TU on a channel of a trunk.
+ */
+static void close_trunk_channel(TRUNK_CHANNEL *ch) {
+    pbx_unregister(pbx, ch->tu);
+    ch->tu = NULL;
+}
+
+/*
+ * Carry out a request from a trunk, of which the header, and the payload unless it is
+ * streamed, have been read.  Requests to open and close channels are handled here; all
+ * others are carried out by the TU on their channel.
+ *
+ * @return 0 if the connection can go on, -1 if it has ended.
+ */
+static int serve_trunk_request(CLIENT_BUF *cb, uint32_t channel, PROTO_HEADER *h, int bad, char *payload) {
+    TRUNK *trunk = cb->trunk;
+    TRUNK_CHANNEL *ch = channel < trunk->num_channels ? &(trunk->channels[channel]) : NULL;
+    if(!bad && h->op == PROTO_OP_OPEN) {
+        if(open_trunk_channel(trunk, channel, h->id) == -1) {
+            trunk_reject(trunk, channel, h);
+        }
+        return payload ? 0 : skip_client_bytes(cb, h->len);
+    }
+    if(!ch || !ch->tu) {
+        trunk_reject(trunk, channel, h);
+        return payload ? 0 : skip_client_bytes(cb, h->len);
+    }
+    if(!bad && h->op == PROTO_OP_CLOSE && channel != 0) {
+        tu_set_request(ch->tu, h->id);
+        close_trunk_channel(ch);
+        return payload ? 0 : skip_client_bytes(cb, h->len);
+    }
+    return serve_binary_request(cb, ch->tu, &(ch->rl), h, bad, payload);
+}
+
+/*
+ * A frame read in a tick, waiting in a lane to be carried out, then on a trunk possibly
+ * in the mailbox of its channel.
+ */
+typedef struct lane_frame {
+    LANE_ITEM item;
+    EXEC_TASK task;
+    CLIENT_BUF *cb;
+    int lane;
+    uint32_t channel;
+    PROTO_HEADER h;
+    int bad;
+    char payload[];
+} LANE_FRAME;
+
+/*
+ * Carry out a frame from a connection of the binary protocol or a trunk.
+ */
+static int serve_frame(CLIENT_BUF *cb, TU *tu, RATE_LIMITS *rl, uint32_t channel, PROTO_HEADER *h, int bad,
+                       char *payload) {
+    if(cb->proto == PROTO_TRUNK) {
+        return serve_trunk_request(cb, channel, h, bad, payload);
+    }
+    return serve_binary_request(cb, tu, rl, h, bad, payload);
+}
+
+/*
+ * Determine whether a whole frame, or the header of one whose payload is streamed, is
+ * in the receive buffer, so that it can be read without waiting.
+ */
+static int frame_buffered(CLIENT_BUF *cb) {
+    size_t prefix = cb->proto == PROTO_TRUNK ? sizeof(uint32_t) : 0;
+    size_t avail = cb->end - cb->start;
+    PROTO_HEADER h;
+    if(avail < prefix + sizeof(h)) {
+        return 0;
+    }
+    proto_header_unpack(cb->data + cb->start + prefix, &h);
+    return frame_streamed(&h) || avail - prefix - sizeof(h) >= h.len;
+}
+
+/*
+ * Read what more input has already arrived on a connection, without waiting for any,
+ * so that frames further ahead can be found.  The input before the read position,
+ * which has all been taken, makes room for it.
+ *
+ * @return the number of bytes read, 0 if there were none, or on a shared-memory link.
+ */
+static size_t read_client_ahead(CLIENT_BUF *cb) {
+    if(cb->shm) {
+        return 0;
+    }
+    if(cb->start > 0) {
+        memmove(cb->data, cb->data + cb->start, cb->end - cb->start);
+        cb->end -= cb->start;
+        cb->start = cb->scan = cb->mark = 0;
+    }
+    if(cb->end == cb->size && grow_client_buf(cb) == -1) {
+        return 0;
+    }
+    // The end of the connection, or an error, is found by the next read that waits.
+    ssize_t n = recv(cb->fd, cb->data + cb->end, cb->size - cb->end, MSG_DONTWAIT);
+    if(n <= 0) {
+        return 0;
+    }
+    cb->end += n;
+    return n;
+}
+
+/*
+ * Read the header of the next frame, and on a trunk its channel.
+ *
+ * @return 0 if successful, -1 if the connection ended or the frames can no longer be found.
+ */
+static int read_frame_header(CLIENT_BUF *cb, uint32_t *channel, PROTO_HEADER *h, int *bad) {
+    size_t prefix = cb->proto == PROTO_TRUNK ? sizeof(uint32_t) : 0;
+    char *frame = read_client_exact(cb, prefix + sizeof(*h));
+    if(!frame) {
+        return -1;
+    }
+    *channel = 0;
+    if(prefix) {
+        memcpy(channel, frame, prefix);
+        *channel = ntohl(*channel);
+    }
+    *bad = proto_header_unpack(frame + prefix, h);
+    return h->magic == PROTO_MAGIC ? 0 : -1;
+}
+
+/*
+ * Queue a frame in its lane, unless its channel has used up its budget for the tick,
+ * in which case it is held over to the next.
+ */
+static void queue_frame(CLIENT_BUF *cb, LANE_FRAME *f) {
+    if(f->lane == LANE_CONTROL) {
+        if(cb->lanes.head[LANE_CHAT] || cb->lanes.head[LANE_BULK]) {
+            metrics_add(METRIC_FRAMES_EXPEDITED, 1);
+        }
+        lanes_push(&(cb->lanes), f->lane, &(f->item));
+        return;
+    }
+    uint64_t *tick = &(cb->budget_tick);
+    size_t *bytes = &(cb->budget_bytes);
+    if(cb->proto == PROTO_TRUNK && f->channel < cb->trunk->num_channels) {
+        tick = &(cb->trunk->channels[f->channel].budget_tick);
+        bytes = &(cb->trunk->channels[f->channel].budget_bytes);
+    }
+    if(*tick != cb->tick) {
+        *tick = cb->tick;
+        *bytes = 0;
+    }
+    if(*bytes >= LANE_CHANNEL_BUDGET) {
+        metrics_add(METRIC_FRAMES_HELD, 1);
+        f->item.next = NULL;
+        *(cb->held_tail) = &(f->item);
+        cb->held_tail = &(f->item.next);
+        return;
+    }
+    *bytes += f->h.len;
+    lanes_push(&(cb->lanes), f->lane, &(f->item));
+}
+
+/*
+ * Task function for a request of a trunk, carried out by a worker of the executor.
+ */
+static void run_frame_task(EXEC_TASK *task) {
+    LANE_FRAME *f = (LANE_FRAME *)((char *)task - offsetof(LANE_FRAME, task));
+    serve_trunk_request(f->cb, f->channel, &(f->h), f->bad, f->payload);
+    free(f);
+}
+
+/*
+ * Carry out the frames queued in the lanes, and if so asked, those held over as well.
+ * On a trunk, the executor is given those for channels in the table, to be carried out
+ * in the order taken from the lanes (see executor.h).
+ */
+static void run_frames(CLIENT_BUF *cb, TU *tu, RATE_LIMITS *rl, int all) {
+    while(1) {
+        LANE_ITEM *item;
+        while((item = lanes_pop(&(cb->lanes)))) {
+            LANE_FRAME *f = (LANE_FRAME *)item;
+            if(cb->trunk && exec_enabled() && f->channel < cb->trunk->num_channels) {
+                f->cb = cb;
+                f->task.run = run_frame_task;
+                exec_post(&(cb->trunk->channels[f->channel].actor), &(f->task));
+                continue;
             }
-            // Otherwise push to dynamic buffer.
-            else {
-                fprintf(stream, "%c", static_buf);
+            // Queued frames are never streamed, so they cannot end the connection.
+            serve_frame(cb, tu, rl, f->channel, &(f->h), f->bad, f->payload);
+            free(f);
+        }
+        if(!all || !cb->held) {
+            return;
+        }
+        while(cb->held) {
+            item = cb->held;
+            cb->held = item->next;
+            lanes_push(&(cb->lanes), ((LANE_FRAME *)item)->lane, item);
+        }
+        cb->held_tail = &(cb->held);
+    }
+}
+
+/*
+ * Serve a tick of a connection of the binary protocol or a trunk: read the frames that
+ * have arrived, waiting for some only if there is nothing else to do, and carry them out
+ * by their lanes (see lanes.h).
+ *
+ * @return 0 if the connection can go on, -1 if it has ended.
+ */
+static int serve_frames(CLIENT_BUF *cb, TU *tu, RATE_LIMITS *rl) {
+    // Read no more from a trunk while the workers are too far behind with it.
+    if(cb->trunk) {
+        exec_wait(&(cb->trunk->tasks), EXEC_BACKLOG);
+    }
+    // The frames held over from the last tick go before those read in this one.
+    cb->tick++;
+    LANE_ITEM *held = cb->held;
+    cb->held = NULL;
+    cb->held_tail = &(cb->held);
+    while(held) {
+        LANE_ITEM *next = held->next;
+        queue_frame(cb, (LANE_FRAME *)held);
+        held = next;
+    }
+    size_t read = 0;
+    int ret = 0;
+    while(read < LANE_READ_BUDGET) {
+        int ahead = 1;
+        while(!frame_buffered(cb) && (cb->lanes.queued || cb->held) && (ahead = read_client_ahead(cb)))
+            ;
+        if(!ahead) {
+            break;
+        }
+        cb->mark = cb->start;
+        uint32_t channel;
+        PROTO_HEADER h;
+        int bad;
+        if(read_frame_header(cb, &channel, &h, &bad) == -1) {
+            ret = -1;
+            break;
+        }
+        char *payload = frame_streamed(&h) ? NULL : read_client_exact(cb, h.len);
+        if(!frame_streamed(&h) && !payload) {
+            ret = -1;
+            break;
+        }
+        // Opening and closing channels, and streaming, are carried out in order.
+        LANE_FRAME *f = NULL;
+        if(!payload || (!bad && (h.op == PROTO_OP_OPEN || h.op == PROTO_OP_CLOSE)) ||
+           !(f = malloc(sizeof(LANE_FRAME) + h.len))) {
+            run_frames(cb, tu, rl, 1);
+            if(cb->trunk) {
+                exec_quiesce(&(cb->trunk->tasks));
             }
+            return serve_frame(cb, tu, rl, channel, &h, bad, payload);
         }
-        bytes_read = read(fd, &static_buf, 1);
-   }
-   fprintf(stream, "%s", "\0");
-   fclose(stream);
-   return output_buf;
+        f->lane = bad ? LANE_CONTROL : lane_of(h.op);
+        f->channel = channel;
+        f->h = h;
+        f->bad = bad;
+        memcpy(f->payload, payload, h.len);
+        queue_frame(cb, f);
+        read += sizeof(h) + h.len;
+    }
+    // If the connection has ended, what was read before it is carried out all the same.
+    run_frames(cb, tu, rl, ret == -1);
+    return ret;
+}
+
+/*
+ * Serve the client of a TU over its connection, until the connection ends, then
+ * unregister the TU.
+ */
+static void serve_client(CLIENT_BUF *cb, TU *tu) {
+    // Apply the rate limits of the class of the extension.
+    RATE_LIMITS rl;
+    rate_limits_init(&rl, tu_extension(tu));
+
+    // Enter service loop.  Commands are pickup, hangup, dial #, chat str, chatf #
+    // followed by that many bytes of chat, replay [#], msg # str, hold, resume, group #,
+    // gpickup, dpickup #, park #, unpark #, and proto #, which switches the connection
+    // to the binary protocol, in which they are sent as frames instead (see proto.h),
+    // or to a trunk (see trunk.h); frames are carried out by priority (see lanes.h).
+    // Command shm moves the connection to shared memory.
+    cb->conn.tu = tu;
+    cb->conn.fd = cb->fd;
+    admission_enter();
+    handoff_join(&(cb->conn));
+    tu_set_request(tu, 0);
+    while(1) {
+        cb->mark = cb->start;
+        int ret = cb->proto == PROTO_TEXT ? serve_text_cmd(cb, tu, &rl) : serve_frames(cb, tu, &rl);
+        // Failed to read from client or EOF encountered, exit loop.
+        if(ret == -1) {
+            break;
+        }
+    }
+    handoff_leave(&(cb->conn));
+    admission_leave();
+    free(cb->data);
+    if(cb->shm) {
+        // The link itself goes with the TU, which may still be written to for a while.
+        shm_link_close(cb->shm);
+    }
+    if(cb->trunk) {
+        // Unplug the virtual TUs of the trunk, once the workers are done with them.  The
+        // connection is closed once the last of the TUs, which may still be in calls,
+        // is gone.
+        exec_quiesce(&(cb->trunk->tasks));
+        trunk_close(cb->trunk);
+        for(size_t i = 1; i < cb->trunk->num_channels; i++) {
+            if(cb->trunk->channels[i].tu) {
+                close_trunk_channel(&(cb->trunk->channels[i]));
+            }
+        }
+        pbx_unregister(pbx, tu);
+        trunk_unref(cb->trunk);
+        return;
+    }
+    // End the connection when finished.  The descriptor, which is also the extension,
+    // is closed with the TU, so that no new client gets it while the TU is still
+    // registered or in a call.
+    shutdown(cb->fd, SHUT_RDWR);
+    pbx_unregister(pbx, tu);
 }
 
 /*
@@ -76,10 +1067,19 @@ char* read_client_msg(int fd, TU *tu) {
  * thread and a new thread has been created to handle the connection.
  */
 void *pbx_client_service(void *arg) {
-    // Fetch file descriptor for communication with the client, then detatch the thread.
+    // Fetch file descriptor for communication with the client, then detatch the thread,
+    // unless this is a coroutine, on a thread of an event loop (see coro.h).
     int connfd = *((int *)arg);
     free(arg);
-    Pthread_detach(pthread_self());
+    if(!coro_self()) {
+        Pthread_detach(pthread_self());
+    }
+
+    // Send each notification as soon as it is written.  Otherwise, when a client sends
+    // several commands without waiting, the answers after the first are held back until
+    // the client acknowledges it, which it may delay.  Failure (not TCP) is harmless.
+    int nodelay = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
     // Register with the PBX module.
     TU* tu;
@@ -87,93 +1087,49 @@ void *pbx_client_service(void *arg) {
         close(connfd);
         return NULL;
     }
-    if(pbx_register(pbx, tu, connfd) == -1) {
-        close(connfd);
+    // A shard registers the connection at an extension among its own (see shard.h).
+    // A client that cannot be registered, as on a descriptor beyond the extensions of
+    // the shard, is told so and turned away.
+    int ext = shard_extension(connfd);
+    if(ext == -1 || pbx_register(pbx, tu, ext) == -1) {
+        dprintf(connfd, "%s%s", tu_state_names[TU_ERROR], EOL);
+        tu_unref(tu, "No extension for the connection.");
         return NULL;
     }
 
-    // Enter service loop.
-    while(1) {
-        // Check # of args.
-        int argc = 0;
-        char* arg2_start = NULL;
-        char* client_msg = read_client_msg(connfd, tu);
-
-        // Successful read from client.
-        if(client_msg) {
-            // Iterate through read string.
-            char* curr = client_msg;
-            while(*curr) {
-                // Maximum number of arguments is 2, any more is invalid.
-                if(argc == 2) {
-                    break;
-                }
-                // Check if command is chat, in which case spaces should not be treated as a new argument.
-                else if(argc == 1 && strcmp(client_msg, "chat") == 0) {
-                    break;
-                }
-                // Otherwise treat spaces normally (new arg).
-                else if(*curr == ' ') {
-                    *curr = '\0';
-                    argc++;
-                    arg2_start = curr + 1;
-                }
-                curr++;
-            }
-            argc++;
-
-            // Commands are pickup, hangup, dial #, and chat str. Max # of args is 2.
-            char* argv[argc];
-            if(argc == 1) {
-                argv[0] = strdup(client_msg);
-            }
-            else if(argc == 2) {
-                argv[0] = strdup(client_msg);
-                argv[1] = strdup(arg2_start);
-            }
-
-            // Check which case the command falls into and execute appropriate one.
-            if(argc == 1 && strcmp(argv[0], "pickup") == 0) {
-                tu_pickup(tu);
-                debug("Picked up.");
-            }
-            else if(argc == 1 && strcmp(argv[0], "hangup") == 0){
-                tu_hangup(tu);
-                debug("Hanged up.");
-            }
-            else if(argc == 2 && strcmp(argv[0], "dial") == 0) {
-                int ext = atoi(argv[1]);
-                pbx_dial(pbx, tu, ext);
-            }
-            else if(strcmp(argv[0], "chat") == 0) {
-                if(argc == 1) {
-                    tu_chat(tu, "");
-                }
-                else {
-                    tu_chat(tu, argv[1]);
-                }
-                debug("Sent chat message.");
-            }
-
-            // Free dynamic buffer and arguments that were strdup'd.
-            free(client_msg);
-            if(argc == 1) {
-                free(argv[0]);
-            }
-            else if(argc == 2) {
-                free(argv[0]);
-                free(argv[1]);
-            }
+    // Set up the receive buffer for the connection.
+    CLIENT_BUF cb;
+    if(client_buf_init(&cb, connfd, PROTO_TEXT, NULL, 0) == -1) {
+        shutdown(connfd, SHUT_RDWR);
+        pbx_unregister(pbx, tu);
+        return NULL;
+    }
+    serve_client(&cb, tu);
+    return NULL;
+}
 
-            // If none of the cases, then do nothing.
-        }
-        // Failed to read from client or EOF encountered, exit loop.
-        else {
-            break;
-        }
+/*
+ * Thread function for the thread that goes on serving a connection handed over by
+ * the server that ran before, on a hot restart.  The TU is already registered and
+ * the client is not notified: it carries on with the input left behind.
+ *
+ * @param arg  The HANDOFF_CONN of the connection, with its pending input, both
+ * allocated with malloc, which the thread frees.
+ */
+void *pbx_resume_client(void *arg) {
+    HANDOFF_CONN *c = arg;
+    Pthread_detach(pthread_self());
+    CLIENT_BUF cb;
+    int ret = client_buf_init(&cb, c->fd, c->proto, c->pending, c->pending_len);
+    TU *tu = c->tu;
+    cb.discard = c->discard;
+    free(c->pending);
+    free(c);
+    if(ret == -1) {
+        shutdown(cb.fd, SHUT_RDWR);
+        pbx_unregister(pbx, tu);
+        return NULL;
     }
-    // Close file descriptor when finished.
-    close(connfd);
-    pbx_unregister(pbx, tu);
+    serve_client(&cb, tu);
     return NULL;
-}
\ No newline at end of file
+}
@@ -0,0 +1,1216 @@
+/*
+ * Shards: server processes on one host that share out the extensions between them.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/filter.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "shard.h"
+#include "federation.h"
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+#include "proto.h"
+#include "spool.h"
+#include "metrics.h"
+#include "csapp.h"
+
+#define SHARD_MAGIC "PBXD"
+#define SHARD_VERSION 2
+
+/*
+ * Number of cells in each ring between two shards, a power of 2, and the size of each.
+ */
+#define SHARD_RING_CELLS 512
+#define SHARD_CELL_SIZE 1024
+
+/*
+ * Largest number of messages taken from the inbox before the thread of a shard sees
+ * to anything else.
+ */
+#define SHARD_BATCH 256
+
+/*
+ * Interval at which messages waiting for room in the inbox of another shard are tried
+ * again.
+ */
+#define SHARD_RETRY_MS 1
+
+#define SHARD_LEG_BUCKETS 4096
+#define SHARD_NSEC_PER_MS 1000000
+
+/*
+ * Kinds of messages between shards.  All but SHARD_DIAL and SHARD_SPOOL are about an
+ * existing call, and are carried out on the proxy of its leg in the receiving shard.
+ */
+enum {
+    SHARD_DIAL,      // Ring to_ext for the caller at from_ext in the sending shard.
+    SHARD_REFUSE,    // The call could not ring; state is for the caller.
+    SHARD_ANSWER,    // The remote party answered.
+    SHARD_HANGUP,    // The remote party hung up.
+    SHARD_HOLD,      // The remote party put the call on hold.
+    SHARD_RESUME,    // The remote party took the call off hold.
+    SHARD_CHAT,      // A piece of a chat from the remote party.
+    SHARD_CHATF,     // A piece of one piece of a chat frame from the remote party.
+    SHARD_SPOOL,     // A piece of a message for to_ext, from from_ext, to be spooled.
+    SHARD_REAP       // Sent by a shard to itself: the leg may be done with.
+};
+
+typedef struct shard_msg {
+    uint32_t type;
+    uint32_t shard;             // Sending shard.
+    uint32_t generation;        // Generation of the process running it.
+    uint32_t origin;            // The call, as in SHARD_LEG, or for SHARD_SPOOL,
+    uint32_t origin_generation; // the message.
+    uint32_t id;
+    int32_t from_ext;
+    int32_t to_ext;
+    int32_t state;
+    uint32_t len;               // Number of bytes of data.
+    uint64_t more;              // Number of bytes still to come in later messages.
+    uint64_t frame_more;        // For SHARD_CHATF, number of bytes of the frame after the piece.
+    char data[SHARD_CELL_SIZE - 64];
+} SHARD_MSG;
+
+#define SHARD_DATA_MAX sizeof(((SHARD_MSG *)0)->data)
+#define SHARD_MSG_SIZE(m) (offsetof(SHARD_MSG, data) + (m)->len)
+
+/*
+ * A cell of a ring, which holds a message when its seq is one more than its position
+ * in the ring, and is free for the message at a position when its seq equals it.
+ */
+typedef struct shard_cell {
+    uint32_t seq;
+    uint32_t pad;
+    SHARD_MSG msg;
+} SHARD_CELL;
+
+_Static_assert(sizeof(SHARD_CELL) == SHARD_CELL_SIZE, "Cells fill their size exactly");
+
+/*
+ * The ring carrying the messages from one shard to another (or to itself).  Any of the
+ * threads of the sending shard may fill cells, claiming them with a compare-and-swap
+ * on the head, and only the thread of the receiving shard takes them.  With one shard
+ * per core, the head is written only on the core of the sending shard and the tail
+ * only on that of the receiving one.
+ */
+typedef struct shard_ring {
+    uint32_t head __attribute__((aligned(64)));  // Position of the next cell to fill.
+    uint32_t tail __attribute__((aligned(64)));  // Position of the next cell to take.
+    SHARD_CELL cells[SHARD_RING_CELLS] __attribute__((aligned(64)));
+} SHARD_RING;
+
+/*
+ * What wakes the thread of a shard, shared by all the rings into it.
+ */
+typedef struct shard_inbox {
+    uint32_t wake __attribute__((aligned(64)));  // Futex word, bumped to wake the taker.
+    uint32_t sleeping;                           // Set while the taker may wait on wake.
+} SHARD_INBOX;
+
+typedef struct shard_info {
+    int32_t pid;                // Process running the shard, or 0 if none has yet.
+    uint32_t generation;        // Bumped each time a process starts running the shard.
+} SHARD_INFO;
+
+typedef struct shard_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;             // Number of shards.
+    uint32_t cell_size;         // sizeof(SHARD_CELL).
+    SHARD_INFO info[SHARD_MAX];
+    SHARD_INBOX inbox[SHARD_MAX];
+} SHARD_HEADER;
+
+/*
+ * Layout of the directory file: the header, one byte per extension, then the rings,
+ * those into shard 0 first, each set in order of sending shard.
+ */
+#define SHARD_DIR_OFFSET 4096
+#define SHARD_RINGS_OFFSET (SHARD_DIR_OFFSET + PBX_MAX_REGISTERED)
+#define SHARD_FILE_SIZE(count) (SHARD_RINGS_OFFSET + (count) * (count) * sizeof(SHARD_RING))
+
+_Static_assert(sizeof(SHARD_HEADER) <= SHARD_DIR_OFFSET, "The header fits before the directory");
+
+/*
+ * A message waiting, in the sending process, for room in the ring to another shard.
+ */
+typedef struct shard_pending {
+    struct shard_pending *next;
+    SHARD_MSG msg;
+} SHARD_PENDING;
+
+typedef struct shard_overflow {
+    sem_t mutex;
+    SHARD_PENDING *head, *tail;
+    int count;                  // Number of messages waiting, read without the lock.
+} SHARD_OVERFLOW;
+
+/*
+ * A chat or message arriving in pieces, put together by the thread of the shard.
+ */
+typedef struct shard_partial {
+    uint32_t shard, origin, origin_generation, id, type;
+    char *data;
+    size_t len;
+    struct shard_partial *next;
+} SHARD_PARTIAL;
+
+static SHARD_HEADER *shard_header;
+static uint8_t *shard_dir;
+static SHARD_RING *shard_rings;
+static int shard_self = -1;
+static int shard_count;
+static int shard_span;
+static uint32_t shard_generation;
+
+static SHARD_OVERFLOW shard_overflows[SHARD_MAX];
+static SHARD_LEG *shard_legs[SHARD_LEG_BUCKETS];
+static sem_t shard_legs_mutex;
+static uint32_t shard_next_id;
+
+// The process that started one shard per core only.
+static pid_t shard_pids[SHARD_MAX];
+static volatile sig_atomic_t shard_stopping;
+
+// Thread of the shard only.
+static SHARD_PARTIAL *shard_partials;
+static uint32_t shard_live[SHARD_MAX];   // Generation of each shard last seen running, or 0.
+
+/*
+ * The leg whose proxy the calling thread is acting on, on behalf of the remote party.
+ * The changes of state that this causes the proxy came from the other shard, and are
+ * not sent back there.
+ */
+static __thread SHARD_LEG *shard_applying;
+
+static uint64_t shard_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Fill in the cells of a ring out of this shard that the process that ran the shard
+ * before claimed but never filled, having gone away in between, with messages that the
+ * receiving shard drops, so that it does not wait for them forever.  Only the sending
+ * shard fills cells, and this process is the only one running it, so no other process
+ * makes them ready meanwhile.
+ */
+static void shard_ring_repair(SHARD_RING *ring) {
+    uint32_t head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+    for(uint32_t pos = tail; pos != head; pos++) {
+        SHARD_CELL *cell = &(ring->cells[pos % SHARD_RING_CELLS]);
+        if(__atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE) == pos) {
+            // A message from no shard at all.
+            memset(&(cell->msg), 0, offsetof(SHARD_MSG, data));
+            cell->msg.shard = UINT32_MAX;
+            __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/*
+ * Join the shards sharing a directory file open on a file descriptor, which is closed.
+ * A file laid out for another version or number of shards is cleared.
+ *
+ * @return 0 if successful, -1 if the file cannot be used, or the shard is already
+ * being run by another process.
+ */
+static int shard_join(int fd, int index, int count) {
+    size_t size = SHARD_FILE_SIZE(count);
+    // Shards starting at the same time set up the file one at a time.
+    struct stat st;
+    SHARD_HEADER hdr;
+    if(flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    int valid = (size_t)st.st_size == size && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+                !memcmp(hdr.magic, SHARD_MAGIC, 4) && hdr.version == SHARD_VERSION &&
+                hdr.count == count && hdr.cell_size == sizeof(SHARD_CELL);
+    if(!valid && (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1)) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    shard_header = (SHARD_HEADER *)map;
+    shard_dir = (uint8_t *)(map + SHARD_DIR_OFFSET);
+    shard_rings = (SHARD_RING *)(map + SHARD_RINGS_OFFSET);
+    if(!valid) {
+        shard_header->version = SHARD_VERSION;
+        shard_header->count = count;
+        shard_header->cell_size = sizeof(SHARD_CELL);
+        memcpy(shard_header->magic, SHARD_MAGIC, 4);
+    }
+    shard_self = index;
+    shard_count = count;
+    shard_span = PBX_VIRTUAL_BASE / count;
+
+    SHARD_INFO *info = &(shard_header->info[index]);
+    if(info->pid > 0 && kill(info->pid, 0) == 0) {
+        munmap(map, size);
+        flock(fd, LOCK_UN);
+        close(fd);
+        shard_self = -1;
+        return -1;
+    }
+    // Anything left by the process that ran the shard before is dropped: the rings into
+    // it, and its extensions, which it no longer has.  The messages it left in the rings
+    // out of it are dropped by the other shards, which see that it has gone, but those
+    // it did not get to finish must be finished for them.
+    for(int i = 0; i < count; i++) {
+        SHARD_RING *ring = &(shard_rings[index * count + i]);
+        ring->head = ring->tail = 0;
+        for(uint32_t j = 0; j < SHARD_RING_CELLS; j++) {
+            ring->cells[j].seq = j;
+        }
+        if(valid && i != index) {
+            shard_ring_repair(&(shard_rings[i * count + index]));
+        }
+    }
+    shard_header->inbox[index].sleeping = 0;
+    memset(shard_dir + index * shard_span, 0, shard_span);
+    memset(shard_dir + PBX_VIRTUAL_BASE + index * shard_span, 0, shard_span);
+    // Generation 0 stands for no process at all.
+    if(!(shard_generation = info->generation + 1)) {
+        shard_generation = 1;
+    }
+    __atomic_store_n(&(info->generation), shard_generation, __ATOMIC_RELEASE);
+    __atomic_store_n(&(info->pid), getpid(), __ATOMIC_RELEASE);
+    // The mapping keeps the file open, and with it the lock, until this lets go of it.
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    for(int i = 0; i < count; i++) {
+        Sem_init(&(shard_overflows[i].mutex), 0, 1);
+    }
+    Sem_init(&shard_legs_mutex, 0, 1);
+    return 0;
+}
+
+/*
+ * Join the shards sharing a directory file, creating the file if it does not exist.
+ *
+ * @param spec  The argument of the -S option, "<index>/<count>:<directory-file>".
+ * @return 0 if successful, -1 if the argument is malformed, the file cannot be used,
+ * or the shard is already being run by another process.
+ */
+int shard_init(const char *spec) {
+    char *end;
+    long index = strtol(spec, &end, 10);
+    if(end == spec || *end != '/') {
+        return -1;
+    }
+    const char *p = end + 1;
+    long count = strtol(p, &end, 10);
+    if(end == p || *end != ':' || !end[1] || index < 0 || count < 1 || index >= count || count > SHARD_MAX) {
+        return -1;
+    }
+    int fd = open(end + 1, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd == -1) {
+        return -1;
+    }
+    return shard_join(fd, index, count);
+}
+
+/*
+ * Get the CPU of the core on which a shard runs, when there is one shard per core:
+ * the CPUs on which the server may run are given out in order, and over again if
+ * there are more shards than them.
+ */
+static int shard_core_cpu(const cpu_set_t *cpus, int index) {
+    int k = index % CPU_COUNT(cpus);
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, cpus) && k-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Have the kernel hand each new connection to a socket listening on a port, shared
+ * with SO_REUSEPORT, by the number of the CPU that took the connection in, rather than
+ * by a hash of its addresses: CPU c hands it to the socket opened c % count'th among
+ * those sharing the port.
+ *
+ * @param listenfd  One of the sockets sharing the port.
+ * @param count  The number of sockets sharing the port.
+ * @return 0 if successful, -1 if the program could not be attached.
+ */
+int shard_steer(int listenfd, int count) {
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    return setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+/*
+ * Have the kernel hand each new connection to the shard on the core that took it in.
+ * This is done only if shard i runs on CPU i, since the program picks the listening
+ * socket by its place among those sharing the port, which is the order in which they
+ * were opened.  Otherwise, connections are spread by the hash, as they are among other
+ * shards.
+ */
+static void shard_steer_cores(const cpu_set_t *cpus, int count, int listenfd) {
+    for(int i = 0; i < count; i++) {
+        if(shard_core_cpu(cpus, i) != i || CPU_COUNT(cpus) < count) {
+            return;
+        }
+    }
+    shard_steer(listenfd, count);
+}
+
+/*
+ * Signal handler, in the process that started one shard per core, for the signals
+ * that it passes on to them.  After SIGHUP, shards that exit are not started again.
+ */
+static void shard_forward(int sig) {
+    if(sig == SIGHUP) {
+        shard_stopping = 1;
+    }
+    for(int i = 0; i < shard_count; i++) {
+        if(shard_pids[i] > 0) {
+            kill(shard_pids[i], sig);
+        }
+    }
+}
+
+/*
+ * Start a process running a shard on its core.
+ *
+ * @return in the process that was started, the listening socket of the shard;
+ * otherwise -1.
+ */
+static int shard_fork_core(int index, int count, int dirfd, int *listenfds, const cpu_set_t *cpus) {
+    pid_t parent = getpid();
+    if((shard_pids[index] = fork()) != 0) {
+        return -1;
+    }
+    // The shard goes with the process that started it.
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if(getppid() != parent) {
+        exit(EXIT_FAILURE);
+    }
+    Signal(SIGHUP, SIG_DFL);
+    Signal(SIGUSR1, SIG_IGN);
+    cpu_set_t core;
+    CPU_ZERO(&core);
+    CPU_SET(shard_core_cpu(cpus, index), &core);
+    // The threads that the shard starts stay on its core with it.
+    sched_setaffinity(0, sizeof(core), &core);
+    for(int i = 0; i < count; i++) {
+        if(i != index) {
+            close(listenfds[i]);
+        }
+    }
+    if(shard_join(dirfd, index, count) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    return listenfds[index];
+}
+
+/*
+ * Run the server as one shard per core: start a process for each, sharing a directory
+ * in memory rather than in a file, and see to them, starting again any that crashes,
+ * until told to stop.
+ *
+ * @param count  The number of shards.
+ * @param listenfds  A TCP socket listening on the port for each shard, all sharing it,
+ * in order of shards.
+ * @return in each process running a shard, its listening socket, or -1 if the shards
+ * cannot be started.  The process that started them does not return.
+ */
+int shard_fork(int count, int *listenfds) {
+    cpu_set_t cpus;
+    if(count < 1 || count > SHARD_MAX || sched_getaffinity(0, sizeof(cpus), &cpus) == -1) {
+        return -1;
+    }
+    int dirfd = memfd_create("pbx-shards", MFD_CLOEXEC);
+    if(dirfd == -1) {
+        return -1;
+    }
+    shard_steer_cores(&cpus, count, listenfds[0]);
+    shard_count = count;
+    Signal(SIGHUP, shard_forward);
+    Signal(SIGUSR1, shard_forward);
+    for(int i = 0; i < count; i++) {
+        if(shard_fork_core(i, count, dirfd, listenfds, &cpus) != -1) {
+            return listenfds[i];
+        }
+    }
+    // This process keeps the directory and the listening sockets, for shards started
+    // again, until none is left.
+    while(1) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if(pid == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            exit(EXIT_SUCCESS);
+        }
+        for(int i = 0; i < count; i++) {
+            if(shard_pids[i] != pid) {
+                continue;
+            }
+            shard_pids[i] = 0;
+            if(!shard_stopping && WIFSIGNALED(status)) {
+                struct timespec ts = { 0, (long)SHARD_CHECK_MS * SHARD_NSEC_PER_MS };
+                nanosleep(&ts, NULL);
+                if(shard_fork_core(i, count, dirfd, listenfds, &cpus) != -1) {
+                    return listenfds[i];
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Determine whether this server is one of several shards.
+ */
+int shard_enabled(void) {
+    return shard_self != -1;
+}
+
+/*
+ * Get the extension at which to register the TU of a connection.
+ *
+ * @param fd  The file descriptor of the connection.
+ * @return the extension, or -1 if the descriptor is beyond the extensions of the shard.
+ */
+int shard_extension(int fd) {
+    if(!shard_enabled()) {
+        return fd;
+    }
+    return fd < shard_span ? shard_self * shard_span + fd : -1;
+}
+
+/*
+ * Get the range of virtual extensions that this server gives out.
+ *
+ * @param first  Set to the first of them.
+ * @param last  Set to the one after the last.
+ */
+void shard_virtual_range(int *first, int *last) {
+    if(!shard_enabled()) {
+        *first = PBX_VIRTUAL_BASE;
+        *last = PBX_MAX_REGISTERED;
+        return;
+    }
+    *first = PBX_VIRTUAL_BASE + shard_self * shard_span;
+    *last = *first + shard_span;
+}
+
+/*
+ * Get the shard owning an extension.
+ *
+ * @return the shard, or -1 if no shard owns the extension.
+ */
+static int shard_owner(int ext) {
+    if(ext < 0 || ext >= PBX_MAX_REGISTERED) {
+        return -1;
+    }
+    int owner = (ext % PBX_VIRTUAL_BASE) / shard_span;
+    return owner < shard_count ? owner : -1;
+}
+
+/*
+ * Determine whether an extension is owned by another shard.
+ */
+int shard_remote(int ext) {
+    if(!shard_enabled()) {
+        return 0;
+    }
+    int owner = shard_owner(ext);
+    return owner != -1 && owner != shard_self;
+}
+
+/*
+ * Record in the directory whether a TU is registered at an extension of this shard.
+ */
+void shard_publish(int ext, int registered) {
+    if(shard_enabled() && shard_owner(ext) == shard_self) {
+        __atomic_store_n(&(shard_dir[ext]), registered ? 1 : 0, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Get the generation of the process running a shard, if one is.
+ *
+ * @return the generation, or 0 if no process is running the shard.
+ */
+static uint32_t shard_running(int shard) {
+    SHARD_INFO *info = &(shard_header->info[shard]);
+    int pid = __atomic_load_n(&(info->pid), __ATOMIC_ACQUIRE);
+    uint32_t generation = __atomic_load_n(&(info->generation), __ATOMIC_ACQUIRE);
+    if(pid <= 0 || (kill(pid, 0) == -1 && errno == ESRCH)) {
+        return 0;
+    }
+    return generation;
+}
+
+/*
+ * Get the ring carrying messages from one shard to another.
+ */
+static SHARD_RING *shard_ring_between(int from, int to) {
+    return &(shard_rings[to * shard_count + from]);
+}
+
+/*
+ * Put a message in a ring, unless it is full.  Any number of threads of the sending
+ * shard may do so at once.
+ *
+ * @return 0 if successful, -1 if the ring is full.
+ */
+static int shard_ring_put(SHARD_RING *ring, const SHARD_MSG *m) {
+    uint32_t pos = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+    while(1) {
+        SHARD_CELL *cell = &(ring->cells[pos % SHARD_RING_CELLS]);
+        int32_t diff = (int32_t)(__atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE) - pos);
+        if(diff < 0) {
+            return -1;
+        }
+        if(diff > 0) {
+            pos = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+        }
+        else if(__atomic_compare_exchange_n(&(ring->head), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            memcpy(&(cell->msg), m, SHARD_MSG_SIZE(m));
+            __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+}
+
+/*
+ * Take the next message from a ring into this shard.  Only the thread of the shard
+ * may do so.
+ *
+ * @return 0 if successful, -1 if the ring is empty.
+ */
+static int shard_ring_take(SHARD_RING *ring, SHARD_MSG *m) {
+    uint32_t pos = ring->tail;
+    SHARD_CELL *cell = &(ring->cells[pos % SHARD_RING_CELLS]);
+    if(__atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE) != pos + 1) {
+        return -1;
+    }
+    if(cell->msg.len > SHARD_DATA_MAX) {
+        cell->msg.len = SHARD_DATA_MAX;
+    }
+    memcpy(m, &(cell->msg), SHARD_MSG_SIZE(&(cell->msg)));
+    __atomic_store_n(&(cell->seq), pos + SHARD_RING_CELLS, __ATOMIC_RELEASE);
+    // The tail is read by the sending shard only when it starts again.
+    __atomic_store_n(&(ring->tail), pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Wake the thread of a shard, if it is waiting for messages.
+ */
+static void shard_wake(int shard) {
+    SHARD_INBOX *inbox = &(shard_header->inbox[shard]);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&(inbox->sleeping), __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&(inbox->wake), 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &(inbox->wake), FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Send a message to a shard.  If the ring to it is full, or messages sent before are
+ * still waiting for room, the message waits behind them, to be put in the ring by the
+ * thread of this shard, so that the caller never waits.
+ *
+ * @param shard  The shard, which may be this one.
+ * @param m  The message, with all but its sender filled in.
+ */
+static void shard_send(int shard, SHARD_MSG *m) {
+    m->shard = shard_self;
+    m->generation = shard_generation;
+    SHARD_OVERFLOW *o = &(shard_overflows[shard]);
+    if(shard != shard_self) {
+        metrics_add(METRIC_SHARD_MESSAGES, 1);
+    }
+    if(__atomic_load_n(&(o->count), __ATOMIC_ACQUIRE) == 0 && shard_ring_put(shard_ring_between(shard_self, shard), m) == 0) {
+        shard_wake(shard);
+        return;
+    }
+    SHARD_PENDING *p = malloc(offsetof(SHARD_PENDING, msg) + SHARD_MSG_SIZE(m));
+    if(!p) {
+        return;
+    }
+    memcpy(&(p->msg), m, SHARD_MSG_SIZE(m));
+    p->next = NULL;
+    P(&(o->mutex));
+    if(o->tail) {
+        o->tail->next = p;
+    }
+    else {
+        o->head = p;
+    }
+    o->tail = p;
+    __atomic_add_fetch(&(o->count), 1, __ATOMIC_RELEASE);
+    V(&(o->mutex));
+    metrics_add(METRIC_SHARD_OVERFLOWS, 1);
+    shard_wake(shard_self);
+}
+
+/*
+ * Put the messages waiting for room into the rings to their shards, as far as they go.
+ *
+ * @return nonzero if some are still waiting.
+ */
+static int shard_flush(void) {
+    int waiting = 0;
+    for(int i = 0; i < shard_count; i++) {
+        SHARD_OVERFLOW *o = &(shard_overflows[i]);
+        if(__atomic_load_n(&(o->count), __ATOMIC_ACQUIRE) == 0) {
+            continue;
+        }
+        int moved = 0;
+        P(&(o->mutex));
+        while(o->head && shard_ring_put(shard_ring_between(shard_self, i), &(o->head->msg)) == 0) {
+            SHARD_PENDING *p = o->head;
+            if(!(o->head = p->next)) {
+                o->tail = NULL;
+            }
+            free(p);
+            __atomic_sub_fetch(&(o->count), 1, __ATOMIC_RELEASE);
+            moved = 1;
+        }
+        waiting |= o->head != NULL;
+        V(&(o->mutex));
+        if(moved) {
+            shard_wake(i);
+        }
+    }
+    return waiting;
+}
+
+static SHARD_LEG **shard_leg_bucket(uint32_t origin, uint32_t origin_generation, uint32_t id) {
+    uint32_t h = (id * 2654435761u) ^ (origin * 40503u) ^ origin_generation;
+    return &(shard_legs[h % SHARD_LEG_BUCKETS]);
+}
+
+/*
+ * Set up the leg of a call in this shard, with its proxy standing for the remote party.
+ * The proxy is on hook, and the table of legs holds the reference to it.
+ *
+ * @return the leg, or NULL if memory is short.
+ */
+static SHARD_LEG *shard_leg_create(uint32_t shard, uint32_t generation, uint32_t origin,
+                                   uint32_t origin_generation, uint32_t id, int local_ext, int remote_ext) {
+    SHARD_LEG *leg = malloc(sizeof(SHARD_LEG));
+    TU *tu = leg ? tu_init(-1) : NULL;
+    if(!tu) {
+        free(leg);
+        return NULL;
+    }
+    leg->tu = tu;
+    leg->shard = shard;
+    leg->generation = generation;
+    leg->origin = origin;
+    leg->origin_generation = origin_generation;
+    leg->id = id;
+    leg->local_ext = local_ext;
+    leg->remote_ext = remote_ext;
+    leg->state = TU_ON_HOOK;
+    leg->fed = NULL;
+    tu_set_extension(tu, remote_ext);
+    tu_attach_leg(tu, leg);
+    SHARD_LEG **bucket = shard_leg_bucket(origin, origin_generation, id);
+    P(&shard_legs_mutex);
+    leg->next = *bucket;
+    *bucket = leg;
+    V(&shard_legs_mutex);
+    return leg;
+}
+
+/*
+ * Find the leg of a call in this shard.  Only the thread of the shard removes legs,
+ * so that the leg stays valid for it.
+ *
+ * @return the leg, or NULL if there is none.
+ */
+static SHARD_LEG *shard_leg_find(uint32_t origin, uint32_t origin_generation, uint32_t id) {
+    P(&shard_legs_mutex);
+    SHARD_LEG *leg = *shard_leg_bucket(origin, origin_generation, id);
+    while(leg && (leg->origin != origin || leg->origin_generation != origin_generation || leg->id != id)) {
+        leg = leg->next;
+    }
+    V(&shard_legs_mutex);
+    return leg;
+}
+
+static int shard_idle(int state) {
+    return state == TU_ON_HOOK || state == TU_DIAL_TONE || state == TU_BUSY_SIGNAL || state == TU_ERROR;
+}
+
+/*
+ * Be done with the leg of a call, if its proxy is no longer in the call.  A proxy does
+ * nothing of its own accord, so once it is out of its call it stays out.
+ */
+static void shard_reap(uint32_t origin, uint32_t origin_generation, uint32_t id) {
+    SHARD_LEG *leg = shard_leg_find(origin, origin_generation, id);
+    if(!leg) {
+        return;
+    }
+    TU_SNAPSHOT snap;
+    tu_snapshot(leg->tu, &snap, NULL);
+    if(!shard_idle(snap.state) || snap.peer != -1) {
+        return;
+    }
+    P(&shard_legs_mutex);
+    SHARD_LEG **link = shard_leg_bucket(origin, origin_generation, id);
+    while(*link != leg) {
+        link = &((*link)->next);
+    }
+    *link = leg->next;
+    V(&shard_legs_mutex);
+    // The leg goes with the proxy.
+    tu_unref(leg->tu, "Leg of call done with.");
+}
+
+static void shard_msg_init(SHARD_MSG *m, int type, SHARD_LEG *leg) {
+    m->type = type;
+    m->origin = leg->origin;
+    m->origin_generation = leg->origin_generation;
+    m->id = leg->id;
+    m->from_ext = leg->local_ext;
+    m->to_ext = leg->remote_ext;
+    m->state = 0;
+    m->len = 0;
+    m->more = m->frame_more = 0;
+}
+
+/*
+ * Pass on a change in the state of a proxy, which is locked, to the shard of the remote
+ * party, unless it came from there.  A proxy that comes out of its call is reaped.
+ * A proxy for a party at another PBX passes it on there instead.
+ *
+ * @param leg  The leg of the proxy.
+ * @param state  The new state of the proxy.
+ */
+void shard_leg_state(SHARD_LEG *leg, int state) {
+    if(leg->fed) {
+        fed_leg_state(leg, state);
+        return;
+    }
+    int old = leg->state;
+    if(state == old) {
+        return;
+    }
+    leg->state = state;
+    SHARD_MSG m;
+    int type = -1;
+    if(old == TU_ON_HOOK && state == TU_RINGING) {
+        type = SHARD_DIAL;
+    }
+    else if(old == TU_RING_BACK && state == TU_CONNECTED) {
+        type = SHARD_ANSWER;
+    }
+    else if(old == TU_CONNECTED && state == TU_HELD) {
+        type = SHARD_HOLD;
+    }
+    else if(old == TU_HELD && state == TU_CONNECTED) {
+        type = SHARD_RESUME;
+    }
+    else if(!shard_idle(old) && shard_idle(state)) {
+        type = SHARD_HANGUP;
+    }
+    if(type != -1 && leg != shard_applying) {
+        shard_msg_init(&m, type, leg);
+        shard_send(leg->shard, &m);
+    }
+    if(!shard_idle(old) && shard_idle(state)) {
+        shard_msg_init(&m, SHARD_REAP, leg);
+        shard_send(shard_self, &m);
+    }
+}
+
+/*
+ * Send data to a shard in as many messages as it takes, each saying how many bytes
+ * are still to come.
+ */
+static void shard_send_data(int shard, SHARD_MSG *m, const char *data, size_t len) {
+    do {
+        size_t n = len < SHARD_DATA_MAX ? len : SHARD_DATA_MAX;
+        memcpy(m->data, data, n);
+        m->len = n;
+        m->more = len - n;
+        shard_send(shard, m);
+        data += n;
+        len -= n;
+    } while(len > 0);
+}
+
+/*
+ * Pass on a chat, or a piece of a chat frame, sent to a proxy, to the shard of the
+ * remote party, or to its PBX.  The proxy and the sender are locked.
+ *
+ * @param leg  The leg of the proxy.
+ * @param op  PROTO_OP_CHAT for a whole chat, PROTO_OP_CHATF for a piece of a frame.
+ * @param data  The bytes of the chat or of the piece.
+ * @param len  The number of bytes.
+ * @param more  The number of bytes of the chat that follow this piece.
+ */
+void shard_leg_chat(SHARD_LEG *leg, int op, const char *data, size_t len, size_t more) {
+    if(leg->fed) {
+        fed_leg_chat(leg, op, data, len, more);
+        return;
+    }
+    SHARD_MSG m;
+    shard_msg_init(&m, op == PROTO_OP_CHAT ? SHARD_CHAT : SHARD_CHATF, leg);
+    m.frame_more = more;
+    shard_send_data(leg->shard, &m, data, len);
+}
+
+/*
+ * Call a TU at an extension of another shard, through a new leg whose proxy stands for
+ * the remote party.  If there is no TU at the extension, or no process running its
+ * shard, the call fails at once, as a dial to an empty local extension does.
+ *
+ * @param tu  The TU that is dialing.
+ * @param ext  The extension, which must be owned by another shard.
+ * @return 0 if dialing succeeds, otherwise -1.
+ */
+int shard_dial(TU *tu, int ext) {
+    int owner = shard_owner(ext);
+    uint32_t generation = shard_running(owner);
+    SHARD_LEG *leg = NULL;
+    if(generation && __atomic_load_n(&(shard_dir[ext]), __ATOMIC_ACQUIRE)) {
+        uint32_t id = __atomic_add_fetch(&shard_next_id, 1, __ATOMIC_RELAXED);
+        leg = shard_leg_create(owner, generation, shard_self, shard_generation, id, tu_extension(tu), ext);
+    }
+    if(!leg) {
+        return tu_dial(tu, NULL);
+    }
+    // The proxy rings, which sends the call to the other shard, unless the TU was not
+    // ready to dial; either way it is reaped once out of the call.
+    SHARD_MSG m;
+    shard_msg_init(&m, SHARD_REAP, leg);
+    int ret = tu_dial(tu, leg->tu);
+    shard_send(shard_self, &m);
+    return ret;
+}
+
+/*
+ * Leave a message for an extension of another shard, to be spooled there.
+ *
+ * @param from  The extension of the sender.
+ * @param ext  The extension, which must be owned by another shard.
+ * @param msg  The text of the message.
+ * @param len  The length of the text.
+ * @return 0 if the message was sent, -1 if no process is running the shard.
+ */
+int shard_spool(int from, int ext, const char *msg, size_t len) {
+    int owner = shard_owner(ext);
+    if(!shard_running(owner)) {
+        return -1;
+    }
+    SHARD_MSG m = { SHARD_SPOOL };
+    m.origin = shard_self;
+    m.origin_generation = shard_generation;
+    m.id = __atomic_add_fetch(&shard_next_id, 1, __ATOMIC_RELAXED);
+    m.from_ext = from;
+    m.to_ext = ext;
+    shard_send_data(owner, &m, msg, len);
+    return 0;
+}
+
+/*
+ * Add a piece of a chat or a message to what has arrived of it.
+ *
+ * @return the whole of it once the last piece has arrived, otherwise NULL.
+ */
+static SHARD_PARTIAL *shard_assemble(SHARD_MSG *m) {
+    SHARD_PARTIAL **link = &shard_partials;
+    while(*link && ((*link)->shard != m->shard || (*link)->origin != m->origin || (*link)->id != m->id ||
+                    (*link)->origin_generation != m->origin_generation || (*link)->type != m->type)) {
+        link = &((*link)->next);
+    }
+    SHARD_PARTIAL *p = *link;
+    if(!p) {
+        if(!(p = calloc(1, sizeof(SHARD_PARTIAL)))) {
+            return NULL;
+        }
+        p->shard = m->shard;
+        p->origin = m->origin;
+        p->origin_generation = m->origin_generation;
+        p->id = m->id;
+        p->type = m->type;
+        p->next = shard_partials;
+        shard_partials = p;
+        link = &shard_partials;
+    }
+    char *data = realloc(p->data, p->len + m->len + 1);
+    if(data) {
+        memcpy(data + p->len, m->data, m->len);
+        p->data = data;
+        p->len += m->len;
+    }
+    if(m->more > 0) {
+        return NULL;
+    }
+    *link = p->next;
+    return p;
+}
+
+static void shard_partial_free(SHARD_PARTIAL *p) {
+    free(p->data);
+    free(p);
+}
+
+/*
+ * Ring an extension of this shard for a caller in another, on a new leg.  If the call
+ * cannot ring, the caller is told why.
+ */
+static void shard_ring(SHARD_MSG *m) {
+    SHARD_LEG *leg = shard_leg_create(m->shard, m->generation, m->origin, m->origin_generation,
+                                      m->id, m->to_ext, m->from_ext);
+    TU_SNAPSHOT snap = { .state = TU_ERROR };
+    if(leg) {
+        shard_applying = leg;
+        tu_pickup(leg->tu);
+        pbx_dial_leg(pbx, leg->tu, m->to_ext);
+        shard_applying = NULL;
+        tu_snapshot(leg->tu, &snap, NULL);
+    }
+    if(shard_idle(snap.state)) {
+        SHARD_MSG reply;
+        reply.type = SHARD_REFUSE;
+        reply.origin = m->origin;
+        reply.origin_generation = m->origin_generation;
+        reply.id = m->id;
+        reply.from_ext = m->to_ext;
+        reply.to_ext = m->from_ext;
+        reply.state = snap.state;
+        reply.len = 0;
+        reply.more = reply.frame_more = 0;
+        shard_send(m->shard, &reply);
+        if(leg) {
+            shard_reap(leg->origin, leg->origin_generation, leg->id);
+        }
+    }
+}
+
+/*
+ * Carry out on the proxy of a leg what the remote party did.
+ */
+static void shard_apply(SHARD_LEG *leg, SHARD_MSG *m, SHARD_PARTIAL *p) {
+    shard_applying = leg;
+    switch(m->type) {
+    case SHARD_REFUSE:
+        tu_refuse(leg->tu, m->state);
+        break;
+    case SHARD_ANSWER:
+        tu_pickup(leg->tu);
+        break;
+    case SHARD_HANGUP:
+        tu_hangup(leg->tu);
+        break;
+    case SHARD_HOLD:
+        tu_hold(leg->tu);
+        break;
+    case SHARD_RESUME:
+        tu_resume(leg->tu);
+        break;
+    case SHARD_CHAT:
+        tu_chatv(leg->tu, p->data, p->len);
+        break;
+    case SHARD_CHATF:
+        tu_chat_frame(leg->tu, p->data, p->len, m->frame_more);
+        break;
+    }
+    shard_applying = NULL;
+}
+
+/*
+ * Hang up the legs to a shard that is no longer run by the process they were set up
+ * with, and forget the pieces of chats and messages from that process.
+ *
+ * @param shard  The shard.
+ * @param generation  The generation of the process now running it, or 0 if none is.
+ */
+static void shard_drop(int shard, uint32_t generation) {
+    P(&shard_legs_mutex);
+    for(int i = 0; i < SHARD_LEG_BUCKETS; i++) {
+        for(SHARD_LEG *leg = shard_legs[i]; leg; leg = leg->next) {
+            if(leg->shard == (uint32_t)shard && leg->generation != generation) {
+                shard_applying = leg;
+                tu_hangup(leg->tu);
+                shard_applying = NULL;
+                metrics_add(METRIC_SHARD_LEGS_DROPPED, 1);
+            }
+        }
+    }
+    V(&shard_legs_mutex);
+    SHARD_PARTIAL **link = &shard_partials;
+    while(*link) {
+        SHARD_PARTIAL *p = *link;
+        if(p->shard == (uint32_t)shard) {
+            *link = p->next;
+            shard_partial_free(p);
+        }
+        else {
+            link = &(p->next);
+        }
+    }
+}
+
+/*
+ * See whether the process running a shard has changed since it was last seen, and if
+ * so, drop what depended on the one before.
+ *
+ * @return the generation of the process now running the shard, or 0 if none is.
+ */
+static uint32_t shard_check(int shard) {
+    uint32_t generation = shard_running(shard);
+    if(generation != shard_live[shard]) {
+        shard_live[shard] = generation;
+        shard_drop(shard, generation);
+    }
+    return generation;
+}
+
+/*
+ * Carry out a message taken from a ring.  Messages from a process that is no longer
+ * running its shard are dropped.
+ */
+static void shard_receive(SHARD_MSG *m) {
+    if(m->type == SHARD_REAP) {
+        shard_reap(m->origin, m->origin_generation, m->id);
+        return;
+    }
+    if(m->shard >= (uint32_t)shard_count || m->shard == (uint32_t)shard_self ||
+       (m->generation != shard_live[m->shard] && m->generation != shard_check(m->shard))) {
+        return;
+    }
+    SHARD_PARTIAL *p = NULL;
+    if(m->type == SHARD_CHAT || m->type == SHARD_CHATF || m->type == SHARD_SPOOL) {
+        if(!(p = shard_assemble(m))) {
+            return;
+        }
+    }
+    if(m->type == SHARD_DIAL) {
+        shard_ring(m);
+    }
+    else if(m->type == SHARD_SPOOL) {
+        if(shard_owner(m->to_ext) == shard_self && spool_append(m->to_ext, m->from_ext, p->data, p->len) == 0) {
+            spool_kick(m->to_ext);
+        }
+    }
+    else {
+        SHARD_LEG *leg = shard_leg_find(m->origin, m->origin_generation, m->id);
+        if(leg && leg->shard == m->shard) {
+            shard_apply(leg, m, p);
+        }
+    }
+    if(p) {
+        shard_partial_free(p);
+    }
+}
+
+/*
+ * Determine whether any ring into this shard has a message in it.
+ */
+static int shard_pending(void) {
+    for(int i = 0; i < shard_count; i++) {
+        SHARD_RING *ring = shard_ring_between(i, shard_self);
+        SHARD_CELL *cell = &(ring->cells[ring->tail % SHARD_RING_CELLS]);
+        if(__atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE) == ring->tail + 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Thread function for the thread of the shard, which carries out the messages in the
+ * rings into it, taking from each in turn, puts the messages that were waiting for room
+ * into the rings to the other shards, and checks every SHARD_CHECK_MS that the other
+ * shards are still running.
+ */
+static void *shard_thread(void *arg) {
+    Pthread_detach(pthread_self());
+    SHARD_INBOX *inbox = &(shard_header->inbox[shard_self]);
+    SHARD_MSG m;
+    uint64_t checked = 0;
+    while(1) {
+        int n = 0, taken = 1;
+        while(n < SHARD_BATCH && taken) {
+            taken = 0;
+            for(int i = 0; i < shard_count; i++) {
+                if(shard_ring_take(shard_ring_between(i, shard_self), &m) == 0) {
+                    shard_receive(&m);
+                    n++;
+                    taken = 1;
+                }
+            }
+        }
+        int waiting = shard_flush();
+        uint64_t now = shard_clock();
+        if(now - checked >= (uint64_t)SHARD_CHECK_MS * SHARD_NSEC_PER_MS) {
+            for(int i = 0; i < shard_count; i++) {
+                if(i != shard_self) {
+                    shard_check(i);
+                }
+            }
+            checked = now;
+        }
+        if(taken) {
+            continue;
+        }
+        // Wait for a message, having said so before looking at the rings one last time.
+        __atomic_store_n(&(inbox->sleeping), 1, __ATOMIC_SEQ_CST);
+        uint32_t wake = __atomic_load_n(&(inbox->wake), __ATOMIC_SEQ_CST);
+        if(!shard_pending()) {
+            int ms = waiting ? SHARD_RETRY_MS : SHARD_CHECK_MS;
+            struct timespec timeout = { 0, (long)ms * SHARD_NSEC_PER_MS };
+            syscall(SYS_futex, &(inbox->wake), FUTEX_WAIT, wake, &timeout, NULL, 0);
+        }
+        __atomic_store_n(&(inbox->sleeping), 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * Start the thread of the shard, if the server is one.
+ */
+void shard_start(void) {
+    if(!shard_enabled()) {
+        return;
+    }
+    for(int i = 0; i < shard_count; i++) {
+        if(i != shard_self) {
+            shard_live[i] = shard_running(i);
+        }
+    }
+    pthread_t tid;
+    Pthread_create(&tid, NULL, shard_thread, NULL);
+}
@@ -0,0 +1,257 @@
+/*
+ * Shared-memory transport: a pair of single-producer, single-consumer rings.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "shm.h"
+#include "csapp.h"
+
+/*
+ * Offset of the second ring in the shared memory.
+ */
+#define SHM_RING_OFFSET (sizeof(SHM_RING) + SHM_RING_SIZE)
+
+/*
+ * Sleep on a futex in the shared memory while it holds a given value, for at most
+ * SHM_POLL_MS.  The futex is not private, since the other side is another process.
+ *
+ * @return 0 if woken (or the value had changed), 1 if interrupted by a signal, -1 if
+ * the time ran out.
+ */
+static int shm_futex_wait(uint32_t *addr, uint32_t val) {
+    struct timespec ts = { SHM_POLL_MS / 1000, (SHM_POLL_MS % 1000) * 1000000L };
+    if(syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0) == -1) {
+        return errno == ETIMEDOUT ? -1 : errno == EINTR ? 1 : 0;
+    }
+    return 0;
+}
+
+static void shm_futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Determine whether the other side of a link is still there, by its end of the socket.
+ */
+static int shm_link_alive(SHM_LINK *link) {
+    struct pollfd pfd = { link->sockfd, POLLRDHUP, 0 };
+    return poll(&pfd, 1, 0) == 0 || !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL));
+}
+
+/*
+ * Set up one side of a link on a mapping of the shared memory.
+ */
+static SHM_LINK *shm_link_map(int sockfd, int memfd, int server) {
+    size_t map_size = 2 * SHM_RING_OFFSET;
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if(map == MAP_FAILED) {
+        return NULL;
+    }
+    SHM_LINK *link = malloc(sizeof(SHM_LINK));
+    if(!link) {
+        munmap(map, map_size);
+        return NULL;
+    }
+    link->map = map;
+    link->map_size = map_size;
+    // The first ring carries the bytes from the client, the second those to it.
+    SHM_RING *to_server = map;
+    SHM_RING *to_client = (SHM_RING *)((char *)map + SHM_RING_OFFSET);
+    link->in = server ? to_server : to_client;
+    link->out = server ? to_client : to_server;
+    link->in_head = link->out_tail = 0;
+    Sem_init(&(link->write_mutex), 0, 1);
+    link->sockfd = sockfd;
+    return link;
+}
+
+/*
+ * Create the shared memory of a new link, and the server side of it.
+ *
+ * @param sockfd  The socket of the connection to the client.
+ * @param memfd  Set to the memory file, to be passed to the client, and then closed.
+ * @return the server side of the link, or NULL if the memory cannot be set up.
+ */
+SHM_LINK *shm_link_create(int sockfd, int *memfd) {
+    int fd = memfd_create("pbx-shm", MFD_CLOEXEC);
+    if(fd == -1) {
+        return NULL;
+    }
+    SHM_LINK *link = NULL;
+    if(ftruncate(fd, 2 * SHM_RING_OFFSET) == -1 || !(link = shm_link_map(sockfd, fd, 1))) {
+        close(fd);
+        return NULL;
+    }
+    // The memory file starts out zeroed, so only the sizes need to be filled in.
+    link->in->size = link->out->size = SHM_RING_SIZE;
+    *memfd = fd;
+    return link;
+}
+
+/*
+ * Set up the client side of a link, from the memory file passed by the server.
+ *
+ * @param sockfd  The socket of the connection to the server.
+ * @param memfd  The memory file, which may be closed afterwards.
+ * @return the client side of the link, or NULL if the memory file is not a link.
+ */
+SHM_LINK *shm_link_attach(int sockfd, int memfd) {
+    struct stat st;
+    if(fstat(memfd, &st) == -1 || st.st_size != 2 * SHM_RING_OFFSET) {
+        return NULL;
+    }
+    return shm_link_map(sockfd, memfd, 0);
+}
+
+void shm_link_free(SHM_LINK *link) {
+    Sem_destroy(&(link->write_mutex));
+    munmap(link->map, link->map_size);
+    free(link);
+}
+
+/*
+ * Close a link, in both directions, waking the other side if it is asleep on either ring.
+ */
+void shm_link_close(SHM_LINK *link) {
+    SHM_RING *rings[2] = { link->in, link->out };
+    for(int i = 0; i < 2; i++) {
+        __atomic_store_n(&(rings[i]->closed), 1, __ATOMIC_SEQ_CST);
+        shm_futex_wake(&(rings[i]->head));
+        shm_futex_wake(&(rings[i]->tail));
+    }
+}
+
+/*
+ * Close a link on finding a position of the other side that cannot be.
+ */
+static void shm_link_violated(SHM_LINK *link) {
+    shm_link_close(link);
+    errno = EPROTO;
+}
+
+/*
+ * Take up to a given number of bytes from the incoming ring of a link, sleeping until
+ * there are some.
+ *
+ * @return the number of bytes taken, 0 if the link has been closed, the other side
+ * has gone or its position is out of range, or -1 (with errno EINTR) if a signal
+ * interrupted the wait.
+ */
+ssize_t shm_link_read(SHM_LINK *link, void *buf, size_t len) {
+    SHM_RING *r = link->in;
+    uint32_t head = link->in_head;
+    uint32_t tail;
+    while((tail = __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE)) == head) {
+        if(__atomic_load_n(&(r->closed), __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        // Say that this side is going to sleep, then look again, so that a producer
+        // either sees the flag or its bytes are seen here.
+        __atomic_store_n(&(r->consumer_waiting), 1, __ATOMIC_SEQ_CST);
+        int woke = 0;
+        if(__atomic_load_n(&(r->tail), __ATOMIC_SEQ_CST) == head &&
+           !__atomic_load_n(&(r->closed), __ATOMIC_SEQ_CST)) {
+            woke = shm_futex_wait(&(r->tail), head);
+        }
+        __atomic_store_n(&(r->consumer_waiting), 0, __ATOMIC_RELAXED);
+        if(woke == 1) {
+            errno = EINTR;
+            return -1;
+        }
+        if(woke == -1 && !shm_link_alive(link)) {
+            return 0;
+        }
+    }
+
+    if(tail - head > SHM_RING_SIZE) {
+        shm_link_violated(link);
+        return 0;
+    }
+    size_t n = tail - head < len ? tail - head : len;
+    size_t pos = head & (SHM_RING_SIZE - 1);
+    size_t first = n < SHM_RING_SIZE - pos ? n : SHM_RING_SIZE - pos;
+    memcpy(buf, r->data + pos, first);
+    memcpy((char *)buf + first, r->data, n - first);
+    link->in_head = head + n;
+    __atomic_store_n(&(r->head), head + n, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&(r->producer_waiting), __ATOMIC_SEQ_CST)) {
+        shm_futex_wake(&(r->head));
+    }
+    return n;
+}
+
+/*
+ * Put all of the data described by an I/O vector into the outgoing ring of a link,
+ * sleeping whenever the ring is full.  Each writer gets the ring to itself until it
+ * is done, so that the messages of different threads do not mix.
+ *
+ * @return 0 if successful, -1 if the link has been closed, the other side has gone or
+ * its position is out of range.
+ */
+int shm_link_writev(SHM_LINK *link, const struct iovec *iov, int iovcnt) {
+    SHM_RING *r = link->out;
+    int ret = 0;
+    P(&(link->write_mutex));
+    uint32_t tail = link->out_tail;
+    size_t done = 0;
+    while(iovcnt > 0) {
+        if(__atomic_load_n(&(r->closed), __ATOMIC_ACQUIRE)) {
+            ret = -1;
+            break;
+        }
+        uint32_t head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+        if(tail - head > SHM_RING_SIZE) {
+            shm_link_violated(link);
+            ret = -1;
+            break;
+        }
+        if(tail - head == SHM_RING_SIZE) {
+            // Full: sleep as the consumer does when the ring is empty.
+            __atomic_store_n(&(r->producer_waiting), 1, __ATOMIC_SEQ_CST);
+            if(__atomic_load_n(&(r->head), __ATOMIC_SEQ_CST) == head &&
+               !__atomic_load_n(&(r->closed), __ATOMIC_SEQ_CST) &&
+               shm_futex_wait(&(r->head), head) == -1 && !shm_link_alive(link)) {
+                ret = -1;
+                __atomic_store_n(&(r->producer_waiting), 0, __ATOMIC_RELAXED);
+                break;
+            }
+            __atomic_store_n(&(r->producer_waiting), 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Copy as much as there is room for, then publish it all at once.
+        size_t space = SHM_RING_SIZE - (tail - head);
+        while(iovcnt > 0 && space > 0) {
+            size_t n = iov->iov_len - done < space ? iov->iov_len - done : space;
+            size_t pos = tail & (SHM_RING_SIZE - 1);
+            size_t first = n < SHM_RING_SIZE - pos ? n : SHM_RING_SIZE - pos;
+            memcpy(r->data + pos, (char *)iov->iov_base + done, first);
+            memcpy(r->data, (char *)iov->iov_base + done + first, n - first);
+            tail += n;
+            space -= n;
+            done += n;
+            if(done == iov->iov_len) {
+                iov++;
+                iovcnt--;
+                done = 0;
+            }
+        }
+        link->out_tail = tail;
+        __atomic_store_n(&(r->tail), tail, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&(r->consumer_waiting), __ATOMIC_SEQ_CST)) {
+            shm_futex_wake(&(r->tail));
+        }
+    }
+    V(&(link->write_mutex));
+    return ret;
+}
@@ -0,0 +1,422 @@
+/*
+ * Spool: stores messages for extensions that cannot take them yet, and forwards
+ * them later.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pbx.h"
+#include "spool.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * The mapped spool file of one extension.
+ */
+typedef struct spool {
+    sem_t mutex;         // Serializes appending, delivery, and compaction.
+    int fd;              // Spool file, or -1 if not open.
+    char *map;           // Mapping of the whole file.
+    size_t size;         // Size of the file and its mapping.
+    volatile int pending; // Set if there may be undelivered messages.
+} SPOOL;
+
+static SPOOL spools[PBX_MAX_EXTENSIONS];
+static char spool_dir[PATH_MAX - 32];
+static int spool_temporary;
+static SPOOL_READY_FUNC *spool_ready;
+
+/*
+ * Queue of extensions awaiting the delivery thread.  Each extension is queued at most
+ * once at a time, so the queue never holds more than PBX_MAX_EXTENSIONS entries.
+ */
+static int spool_queue[PBX_MAX_EXTENSIONS];
+static char spool_queued[PBX_MAX_EXTENSIONS];
+static int spool_queue_head, spool_queue_count;
+static sem_t spool_queue_mutex, spool_queue_items;
+
+/*
+ * The delivery thread, and the flag that tells it to stop.
+ */
+static pthread_t spool_tid;
+static int spool_stopping;
+
+#define SPOOL_HEADER_OF(sp) ((SPOOL_HEADER *)(sp)->map)
+
+static void spool_path(int ext, char *path) {
+    snprintf(path, PATH_MAX, "%s/%d.spool", spool_dir, ext);
+}
+
+/*
+ * Map the spool file of an extension, if that has not been done yet.
+ * The spool must be locked.
+ *
+ * @param create  Nonzero if the file is to be created if it does not exist.
+ * @return 0 if successful, -1 if there is no file or it could not be mapped.
+ */
+static int spool_open(int ext, SPOOL *sp, int create) {
+    if(sp->fd != -1) {
+        return 0;
+    }
+    // A temporary spool is kept in anonymous memory files, which vanish with the server.
+    int fd = -1;
+    if(spool_temporary) {
+        if(create) {
+            fd = memfd_create("pbx-spool", 0);
+        }
+    }
+    else {
+        char path[PATH_MAX];
+        spool_path(ext, path);
+        fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0600);
+    }
+    if(fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (st.st_size < SPOOL_INITIAL_SIZE && ftruncate(fd, SPOOL_INITIAL_SIZE) == -1)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size < SPOOL_INITIAL_SIZE ? SPOOL_INITIAL_SIZE : st.st_size;
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    sp->fd = fd;
+    sp->map = map;
+    sp->size = size;
+
+    // A new file, or one that is not a valid spool, starts out empty.
+    SPOOL_HEADER *hdr = SPOOL_HEADER_OF(sp);
+    if(memcmp(hdr->magic, SPOOL_MAGIC, 4) || hdr->version != SPOOL_VERSION ||
+       hdr->head < sizeof(SPOOL_HEADER) || hdr->head > hdr->tail || hdr->tail > size) {
+        memcpy(hdr->magic, SPOOL_MAGIC, 4);
+        hdr->version = SPOOL_VERSION;
+        hdr->head = hdr->tail = sizeof(SPOOL_HEADER);
+        hdr->reserved = 0;
+    }
+    return 0;
+}
+
+/*
+ * Change the size of a spool file and its mapping.  The spool must be locked.
+ */
+static int spool_resize(SPOOL *sp, size_t size) {
+    if(ftruncate(sp->fd, size) == -1) {
+        return -1;
+    }
+    char *map = mremap(sp->map, sp->size, size, MREMAP_MAYMOVE);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+    sp->map = map;
+    sp->size = size;
+    return 0;
+}
+
+/*
+ * Reclaim the space of delivered records, by moving the undelivered ones to the
+ * front of the file.  A file that has become empty is shrunk back to its initial size.
+ * The spool must be locked.
+ */
+static void spool_compact(SPOOL *sp) {
+    SPOOL_HEADER *hdr = SPOOL_HEADER_OF(sp);
+    size_t live = hdr->tail - hdr->head;
+    if(hdr->head == sizeof(SPOOL_HEADER)) {
+        return;
+    }
+    memmove(sp->map + sizeof(SPOOL_HEADER), sp->map + hdr->head, live);
+    hdr->head = sizeof(SPOOL_HEADER);
+    hdr->tail = sizeof(SPOOL_HEADER) + live;
+    if(live == 0 && sp->size > SPOOL_INITIAL_SIZE) {
+        spool_resize(sp, SPOOL_INITIAL_SIZE);
+    }
+}
+
+/*
+ * Thread function of the delivery thread, which runs until spool_fini() stops it.
+ */
+static void *spool_thread(void *arg) {
+    while(1) {
+        P(&spool_queue_items);
+        if(__atomic_load_n(&spool_stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        P(&spool_queue_mutex);
+        int ext = spool_queue[spool_queue_head];
+        spool_queue_head = (spool_queue_head + 1) % PBX_MAX_EXTENSIONS;
+        spool_queue_count--;
+        spool_queued[ext] = 0;
+        V(&spool_queue_mutex);
+        spool_ready(ext);
+    }
+    return NULL;
+}
+
+/*
+ * Initialize the spool and start the delivery thread.
+ * Messages left undelivered in the spool directory by an earlier run are picked up.
+ *
+ * @param dir  The spool directory, or NULL for a temporary spool held in anonymous
+ * memory files, which does not outlive the server.
+ * @param ready  The function called on the delivery thread when an extension that
+ * may have messages waiting registers or goes on hook.
+ * @return 0 if successful, -1 if the directory cannot be used.
+ */
+int spool_init(const char *dir, SPOOL_READY_FUNC *ready) {
+    for(int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
+        Sem_init(&(spools[i].mutex), 0, 1);
+        spools[i].fd = -1;
+        spools[i].pending = 0;
+    }
+    spool_temporary = !dir;
+    if(dir) {
+        if(strlen(dir) >= sizeof(spool_dir) || (mkdir(dir, 0700) == -1 && errno != EEXIST)) {
+            return -1;
+        }
+        strcpy(spool_dir, dir);
+        DIR *d = opendir(spool_dir);
+        if(!d) {
+            return -1;
+        }
+        struct dirent *de;
+        while((de = readdir(d))) {
+            int ext;
+            char rest[8];
+            if(sscanf(de->d_name, "%d.%7s", &ext, rest) == 2 && !strcmp(rest, "spool") &&
+               ext >= 0 && ext < PBX_MAX_EXTENSIONS) {
+                spools[ext].pending = 1;
+            }
+        }
+        closedir(d);
+    }
+
+    spool_ready = ready;
+    spool_queue_head = spool_queue_count = 0;
+    memset(spool_queued, 0, sizeof(spool_queued));
+    Sem_init(&spool_queue_mutex, 0, 1);
+    Sem_init(&spool_queue_items, 0, 0);
+    spool_stopping = 0;
+    Pthread_create(&spool_tid, NULL, spool_thread, NULL);
+    return 0;
+}
+
+/*
+ * Stop the delivery thread, once it has finished with the extension it is delivering
+ * to, if any, and unmap all spool files.  Extensions still queued are not delivered to.
+ */
+void spool_fini(void) {
+    // This is called on shutdown from a signal handler, which may run on any thread.
+    __atomic_store_n(&spool_stopping, 1, __ATOMIC_RELEASE);
+    V(&spool_queue_items);
+    if(!pthread_equal(spool_tid, pthread_self())) {
+        Pthread_join(spool_tid, NULL);
+    }
+    spool_ready = NULL;
+    Sem_destroy(&spool_queue_mutex);
+    Sem_destroy(&spool_queue_items);
+    for(int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
+        SPOOL *sp = &spools[i];
+        if(sp->fd != -1) {
+            munmap(sp->map, sp->size);
+            close(sp->fd);
+            sp->fd = -1;
+        }
+        Sem_destroy(&(sp->mutex));
+    }
+}
+
+/*
+ * Append a message to the spool of an extension.
+ *
+ * @param ext  The extension to which the message is addressed.
+ * @param from  The extension of the sender.
+ * @param msg  The text of the message.
+ * @param len  The length of the text.
+ * @return 0 if successful, -1 if the extension is invalid, its spool is full,
+ * or the spool file could not be written.
+ */
+int spool_append(int ext, int from, const char *msg, size_t len) {
+    if(ext < 0 || ext >= PBX_MAX_EXTENSIONS || len > SPOOL_MAX_SIZE) {
+        return -1;
+    }
+    SPOOL *sp = &spools[ext];
+    size_t rec_size = SPOOL_RECORD_SIZE(len);
+    P(&(sp->mutex));
+    if(spool_open(ext, sp, 1) == -1) {
+        V(&(sp->mutex));
+        return -1;
+    }
+    SPOOL_HEADER *hdr = SPOOL_HEADER_OF(sp);
+    if(hdr->tail + rec_size > sp->size) {
+        // Reclaim delivered space before growing the file.
+        spool_compact(sp);
+        hdr = SPOOL_HEADER_OF(sp);
+        size_t size = sp->size;
+        while(hdr->tail + rec_size > size) {
+            size *= 2;
+        }
+        if(size > SPOOL_MAX_SIZE || (size > sp->size && spool_resize(sp, size) == -1)) {
+            V(&(sp->mutex));
+            return -1;
+        }
+        hdr = SPOOL_HEADER_OF(sp);
+    }
+    SPOOL_RECORD *rec = (SPOOL_RECORD *)(sp->map + hdr->tail);
+    rec->len = len;
+    rec->from = from;
+    memcpy(rec + 1, msg, len);
+    hdr->tail += rec_size;
+    sp->pending = 1;
+    V(&(sp->mutex));
+    return 0;
+}
+
+/*
+ * Name a new voicemail for an extension, to be recorded in the spool directory (see
+ * recorder.h).  Each name is distinct from those given out before it by this server.
+ *
+ * @param ext  The extension for which the voicemail is left.
+ * @param from  The extension of the caller.
+ * @param path  Buffer of PATH_MAX bytes for the path of the recording.
+ * @return 0 if successful, -1 if the spool is temporary, and so keeps no voicemail.
+ */
+int spool_voicemail_path(int ext, int from, char *path) {
+    static uint32_t seq;
+    if(spool_temporary) {
+        return -1;
+    }
+    snprintf(path, PATH_MAX, "%s/%d-%d-%u.pbxr", spool_dir, ext, from,
+             __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/*
+ * Determine whether an extension may have messages waiting.
+ */
+int spool_pending(int ext) {
+    return ext >= 0 && ext < PBX_MAX_EXTENSIONS && spools[ext].pending;
+}
+
+/*
+ * Ask the delivery thread to deliver the messages waiting for an extension, if any.
+ * This only queues the extension, so it is cheap enough to call on every state change.
+ *
+ * @param ext  The extension.
+ */
+void spool_kick(int ext) {
+    if(!spool_pending(ext) || !spool_ready) {
+        return;
+    }
+    P(&spool_queue_mutex);
+    if(!spool_queued[ext]) {
+        spool_queued[ext] = 1;
+        spool_queue[(spool_queue_head + spool_queue_count) % PBX_MAX_EXTENSIONS] = ext;
+        spool_queue_count++;
+        V(&spool_queue_items);
+    }
+    V(&spool_queue_mutex);
+}
+
+/*
+ * Deliver the messages waiting for an extension, in batches of up to SPOOL_BATCH.
+ * Each message is formatted as "msg <from> <text>".  Each batch is copied out of the
+ * spool, which is not locked while it is sent, so that messages can be appended
+ * while a long backlog is delivered, or while the client is slow to take it.  Only
+ * one delivery to an extension may run at a time, as on the delivery thread.
+ *
+ * @param ext  The extension.
+ * @param send  The function that sends each batch to the client of the extension.
+ * @param arg  Argument for the send function.
+ * @return the number of messages delivered, or -1 if sending failed, in which case
+ * the messages that were not sent are kept.
+ */
+int spool_deliver(int ext, SPOOL_SEND_FUNC *send, void *arg) {
+    if(ext < 0 || ext >= PBX_MAX_EXTENSIONS) {
+        return -1;
+    }
+    SPOOL *sp = &spools[ext];
+    int delivered = 0;
+    while(1) {
+        P(&(sp->mutex));
+        if(spool_open(ext, sp, 0) == -1) {
+            sp->pending = 0;
+            V(&(sp->mutex));
+            return delivered;
+        }
+        SPOOL_HEADER *hdr = SPOOL_HEADER_OF(sp);
+        int n = 0;
+        size_t off = hdr->head;
+        while(n < SPOOL_BATCH && off < hdr->tail) {
+            SPOOL_RECORD *rec = (SPOOL_RECORD *)(sp->map + off);
+            if(off + SPOOL_RECORD_SIZE(rec->len) > hdr->tail) {
+                // The file is damaged: drop the rest of it.
+                hdr->tail = off;
+                break;
+            }
+            off += SPOOL_RECORD_SIZE(rec->len);
+            n++;
+        }
+        if(n == 0) {
+            // Everything has been delivered: empty the file.
+            sp->pending = 0;
+            spool_compact(sp);
+            V(&(sp->mutex));
+            return delivered;
+        }
+        size_t len = off - hdr->head;
+        char *batch = malloc(len);
+        if(!batch) {
+            V(&(sp->mutex));
+            return -1;
+        }
+        memcpy(batch, sp->map + hdr->head, len);
+        V(&(sp->mutex));
+
+        struct iovec iov[SPOOL_MSG_PARTS * SPOOL_BATCH];
+        char prefix[SPOOL_BATCH][32];
+        size_t sizes[SPOOL_BATCH];
+        off = 0;
+        for(int i = 0; i < n; i++) {
+            SPOOL_RECORD *rec = (SPOOL_RECORD *)(batch + off);
+            iov[SPOOL_MSG_PARTS * i].iov_base = prefix[i];
+            iov[SPOOL_MSG_PARTS * i].iov_len = snprintf(prefix[i], sizeof(prefix[i]), "msg %d ", rec->from);
+            iov[SPOOL_MSG_PARTS * i + 1].iov_base = rec + 1;
+            iov[SPOOL_MSG_PARTS * i + 1].iov_len = rec->len;
+            iov[SPOOL_MSG_PARTS * i + 2].iov_base = EOL;
+            iov[SPOOL_MSG_PARTS * i + 2].iov_len = strlen(EOL);
+            sizes[i] = SPOOL_RECORD_SIZE(rec->len);
+            off += sizes[i];
+        }
+        int sent = send(arg, iov, SPOOL_MSG_PARTS * n);
+        free(batch);
+        size_t done = 0;
+        for(int i = 0; i < sent; i++) {
+            done += sizes[i];
+        }
+
+        // Appending and compaction keep the records in order, and only this removes
+        // any, so those sent are still the first.
+        P(&(sp->mutex));
+        hdr = SPOOL_HEADER_OF(sp);
+        hdr->head += done;
+        delivered += sent;
+        if(hdr->head - sizeof(SPOOL_HEADER) >= sp->size / 2) {
+            spool_compact(sp);
+        }
+        V(&(sp->mutex));
+        if(sent < n) {
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,192 @@
+/*
+ * Tone: shared, precomputed call-progress tone streams.
+ */
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "tu.h"
+#include "tone.h"
+#include "media.h"
+#include "debug.h"
+
+/*
+ * Description of a tone cadence: a pair of frequencies that sound together for a while,
+ * followed by a silence.  A cadence without silence is a continuous tone.
+ * The durations are chosen so that both frequencies complete a whole number of cycles,
+ * which lets the rendered buffer be repeated without clicks.
+ */
+typedef struct tone_spec {
+    int freq1, freq2;   // Frequencies (Hz) of the two components.
+    int on_msec;        // Duration of the tone burst.
+    int off_msec;       // Duration of the silence that follows.
+} TONE_SPEC;
+
+static const TONE_SPEC tone_specs[NUM_TONES] = {
+    [TONE_DIAL]       { 350, 440, 1000,    0 },
+    [TONE_RINGBACK]   { 440, 480, 2000, 4000 },
+    [TONE_BUSY]       { 480, 620,  500,  500 },
+    [TONE_ERROR]      { 480, 620,  250,  250 }
+};
+
+/*
+ * Peak amplitude of each of the two components of a tone.
+ */
+#define TONE_AMPLITUDE 6000
+
+/*
+ * Number of supported sample rates, and the index of a rate in the tables below.
+ */
+#define TONE_RATES 2
+#define TONE_RATE_INDEX(rate) ((rate) == MEDIA_WIDEBAND_RATE)
+
+/*
+ * A rendered tone: the samples of the burst, followed (implicitly) by silence
+ * until the end of the cadence period.
+ */
+typedef struct tone {
+    const int16_t *pcm;   // Samples of the tone burst.
+    size_t on;            // Number of samples in the burst.
+    size_t period;        // Number of samples in the whole cadence.
+} TONE;
+
+static TONE tones[TONE_RATES][NUM_TONES];
+
+/*
+ * Read-only region holding the samples of all the rendered tones.
+ */
+static void *tone_region;
+static size_t tone_region_size;
+
+/*
+ * Silence, shared by all tones for the off part of their cadence.
+ */
+static const int16_t tone_silence[MEDIA_MAX_FRAME];
+
+/*
+ * Render all of the call-progress tones.
+ * This must be called once, before any TU starts to stream a tone.
+ * The rendered buffers are made read-only.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int tones_init(void) {
+    static const int rates[TONE_RATES] = { MEDIA_NARROWBAND_RATE, MEDIA_WIDEBAND_RATE };
+
+    // Total up the space needed for all the bursts, so they can share a single mapping.
+    size_t total = 0;
+    for(int r = 0; r < TONE_RATES; r++) {
+        for(int t = 0; t < NUM_TONES; t++) {
+            total += (size_t)rates[r] / 1000 * tone_specs[t].on_msec;
+        }
+    }
+    tone_region_size = total * sizeof(int16_t);
+    tone_region = mmap(NULL, tone_region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(tone_region == MAP_FAILED) {
+        tone_region = NULL;
+        return -1;
+    }
+
+    // Render each burst.
+    int16_t *pcm = tone_region;
+    for(int r = 0; r < TONE_RATES; r++) {
+        for(int t = 0; t < NUM_TONES; t++) {
+            const TONE_SPEC *spec = &tone_specs[t];
+            TONE *tone = &tones[TONE_RATE_INDEX(rates[r])][t];
+            tone->pcm = pcm;
+            tone->on = (size_t)rates[r] / 1000 * spec->on_msec;
+            tone->period = (size_t)rates[r] / 1000 * (spec->on_msec + spec->off_msec);
+            for(size_t i = 0; i < tone->on; i++) {
+                double x = sin(2 * M_PI * spec->freq1 * i / rates[r])
+                         + sin(2 * M_PI * spec->freq2 * i / rates[r]);
+                pcm[i] = (int16_t)lrint(TONE_AMPLITUDE * x);
+            }
+            pcm += tone->on;
+        }
+    }
+
+    // From now on, the buffers are shared and must never change.
+    if(mprotect(tone_region, tone_region_size, PROT_READ) == -1) {
+        tones_fini();
+        return -1;
+    }
+    debug("Rendered call-progress tones (%zu bytes)", tone_region_size);
+    return 0;
+}
+
+/*
+ * Release the rendered tones.
+ */
+void tones_fini(void) {
+    if(tone_region) {
+        munmap(tone_region, tone_region_size);
+        tone_region = NULL;
+    }
+    memset(tones, 0, sizeof(tones));
+}
+
+/*
+ * Determine the tone heard by a TU in a given state.
+ *
+ * @param state  The state of the TU.
+ * @return the tone, or -1 if no tone is heard in that state.
+ */
+int tone_for_state(int state) {
+    switch(state) {
+    case TU_DIAL_TONE:
+        return TONE_DIAL;
+    case TU_RING_BACK:
+        return TONE_RINGBACK;
+    case TU_BUSY_SIGNAL:
+        return TONE_BUSY;
+    case TU_ERROR:
+        return TONE_ERROR;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Get the next samples of a tone, advancing a cursor into its cadence.
+ * No samples are copied: the result points into the shared buffer for the tone
+ * (or into shared silence) and must not be modified.  At most one frame of samples
+ * is returned, and fewer at the boundaries of the burst and of the cadence.
+ *
+ * @param tone  The tone.
+ * @param rate  The sample rate at which the tone is wanted.
+ * @param cursor  The position within the cadence, updated on return.
+ * @param len  Set to the number of samples available at the returned pointer.
+ * @return a pointer to the samples, or NULL if the tone or the rate is invalid.
+ */
+const int16_t *tone_frame(int tone, int rate, size_t *cursor, size_t *len) {
+    if(tone < 0 || tone >= NUM_TONES || (rate != MEDIA_NARROWBAND_RATE && rate != MEDIA_WIDEBAND_RATE)) {
+        *len = 0;
+        return NULL;
+    }
+    const TONE *t = &tones[TONE_RATE_INDEX(rate)][tone];
+    if(!t->pcm) {
+        *len = 0;
+        return NULL;
+    }
+    size_t frame = MEDIA_FRAME_SAMPLES(rate);
+    size_t pos = *cursor % t->period;
+    const int16_t *pcm;
+    size_t n;
+
+    // Within the burst.
+    if(pos < t->on) {
+        n = t->on - pos;
+        pcm = t->pcm + pos;
+    }
+    // Within the silence that follows it.
+    else {
+        n = t->period - pos;
+        pcm = tone_silence;
+    }
+    if(n > frame) {
+        n = frame;
+    }
+    *cursor = (pos + n) % t->period;
+    *len = n;
+    return pcm;
+}
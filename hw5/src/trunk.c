@@ -0,0 +1,126 @@
+/*
+ * Trunk: a connection carrying many virtual TUs, one per channel.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "trunk.h"
+#include "tu_ext.h"
+#include "csapp.h"
+
+/*
+ * Create the trunk of a connection, with only its channel 0.
+ *
+ * @param fd  The file descriptor of the connection, which is closed when the trunk is freed.
+ * @return the trunk, with one reference for the caller, or NULL if memory is short.
+ */
+TRUNK *trunk_create(int fd) {
+    TRUNK *trunk = malloc(sizeof(TRUNK));
+    if(!trunk) {
+        return NULL;
+    }
+    trunk->fd = fd;
+    Sem_init(&(trunk->write_mutex), 0, 1);
+    trunk->ref_count = 1;
+    trunk->closed = 0;
+    trunk->channels = NULL;
+    trunk->num_channels = 0;
+    exec_group_init(&(trunk->tasks));
+    return trunk;
+}
+
+void trunk_ref(TRUNK *trunk) {
+    __atomic_add_fetch(&(trunk->ref_count), 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Release a reference to a trunk.  Once the last TU of the trunk is gone, as well as
+ * the thread serving it, the connection is closed and the trunk freed.
+ */
+void trunk_unref(TRUNK *trunk) {
+    if(__atomic_sub_fetch(&(trunk->ref_count), 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    close(trunk->fd);
+    Sem_destroy(&(trunk->write_mutex));
+    exec_group_fini(&(trunk->tasks));
+    free(trunk->channels);
+    free(trunk);
+}
+
+/*
+ * Mark the connection of a trunk as ended, once the client has gone, so that the TUs
+ * still on the trunk no longer write to it.
+ */
+void trunk_close(TRUNK *trunk) {
+    P(&(trunk->write_mutex));
+    trunk->closed = 1;
+    V(&(trunk->write_mutex));
+}
+
+/*
+ * Get the state of a channel of a trunk, growing the table of channels as needed.
+ * Only the thread serving the trunk may call this, while the executor has none of its
+ * requests.
+ *
+ * @return the state of the channel, or NULL if the ID is out of range or memory is short.
+ */
+TRUNK_CHANNEL *trunk_channel(TRUNK *trunk, uint32_t channel) {
+    if(channel >= TRUNK_MAX_CHANNELS) {
+        return NULL;
+    }
+    if(channel >= trunk->num_channels) {
+        size_t num = trunk->num_channels ? trunk->num_channels : 16;
+        while(num <= channel) {
+            num *= 2;
+        }
+        TRUNK_CHANNEL *channels = realloc(trunk->channels, num * sizeof(TRUNK_CHANNEL));
+        if(!channels) {
+            return NULL;
+        }
+        memset(channels + trunk->num_channels, 0, (num - trunk->num_channels) * sizeof(TRUNK_CHANNEL));
+        for(size_t i = trunk->num_channels; i < num; i++) {
+            channels[i].actor.group = &(trunk->tasks);
+        }
+        trunk->channels = channels;
+        trunk->num_channels = num;
+    }
+    return &(trunk->channels[channel]);
+}
+
+/*
+ * Write a frame to a trunk on behalf of one of its channels.  The whole frame is written
+ * under the lock of the trunk, so that the frames of different channels do not mix.
+ *
+ * @param trunk  The trunk.
+ * @param channel  The channel ID.
+ * @param iov  The parts of the frame, of which the first is left free to be filled in
+ * with the channel ID.
+ * @param iovcnt  The number of parts, including the first.
+ * @return 0 if successful, -1 if the connection has ended or an error occurs.
+ */
+int trunk_send(TRUNK *trunk, uint32_t channel, struct iovec *iov, int iovcnt) {
+    uint32_t id = htonl(channel);
+    iov[0].iov_base = &id;
+    iov[0].iov_len = sizeof(id);
+    P(&(trunk->write_mutex));
+    int ret = trunk->closed ? -1 : tu_writev_all(trunk->fd, iov, iovcnt);
+    V(&(trunk->write_mutex));
+    return ret;
+}
+
+/*
+ * Write several whole frames, channel IDs included, to a trunk at once, as the client
+ * of a trunk does to have requests carried out without waiting for each answer.
+ *
+ * @return 0 if successful, -1 if the connection has ended or an error occurs.
+ */
+int trunk_send_frames(TRUNK *trunk, const void *frames, size_t len) {
+    struct iovec iov = { (void *)frames, len };
+    P(&(trunk->write_mutex));
+    int ret = trunk->closed ? -1 : tu_writev_all(trunk->fd, &iov, 1);
+    V(&(trunk->write_mutex));
+    return ret;
+}
@@ -2,14 +2,229 @@
  * TU: simulates a "telephone unit", which interfaces a client with the PBX.
  */
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <semaphore.h>
 
 #include "pbx.h"
 #include "debug.h"
 #include "pbx_registry.h"
+#include "tu_ext.h"
+#include "tone.h"
+#include "spool.h"
+#include "pickup.h"
+#include "proto.h"
+#include "trunk.h"
+#include "shm.h"
+#include "udp.h"
+#include "shard.h"
+#include "coro.h"
 #include "csapp.h"
 
+/*
+ * The request that the calling thread is carrying out on behalf of the client of a TU,
+ * if the client speaks the binary protocol.  Notifications to that client are sent as
+ * responses to the request; all others are sent as events.  A coroutine, which shares
+ * its thread with others (see coro.h), keeps its own.
+ */
+typedef struct tu_request {
+    TU *tu;
+    uint32_t id;
+} TU_REQUEST;
+
+_Static_assert(sizeof(TU_REQUEST) <= CORO_LOCAL_SIZE, "A request fits in a coroutine");
+
+static __thread TU_REQUEST thread_request;
+
+static TU_REQUEST *tu_request(void) {
+    TU_REQUEST *r = coro_local();
+    return r ? r : &thread_request;
+}
+
+/*
+ * Write all of the data described by an I/O vector, continuing after partial writes.
+ * The vector is consumed in the process.
+ *
+ * @return 0 if successful, -1 if an error occurs.
+ */
+int tu_writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while(iovcnt > 0) {
+        ssize_t n = coro_writev(fd, iov, iovcnt);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // Skip over the parts that were written completely, then trim the one written partially.
+        while(iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Write all of the data described by an I/O vector to the connection of a TU, to its
+ * shared-memory link if it has one, or to its UDP session.
+ *
+ * @return 0 if successful, -1 if an error occurs.
+ */
+static int tu_write(TU *tu, struct iovec *iov, int iovcnt) {
+    if(tu->udp) {
+        return udp_session_send(tu->udp, iov, iovcnt);
+    }
+    if(tu->shm) {
+        return shm_link_writev(tu->shm, iov, iovcnt);
+    }
+    return tu_writev_all(tu->fd, iov, iovcnt);
+}
+
+/*
+ * Send a line of output to the client of a TU, in the protocol of its connection.
+ * The line is given in its text protocol form.  For a client that speaks the binary
+ * protocol, it is sent instead as the payload of a single frame, leaving out a number
+ * of bytes at its start (such as a "chat " prefix) and at its end (such as the EOL).
+ * For a TU carried by a trunk, the frame goes on the channel of the TU.  A proxy for
+ * a party in another shard has no client: its changes of state go to that shard instead.
+ *
+ * @param tu  The TU.
+ * @param op  The kind of notification, for the frame header.
+ * @param flags  The flags, for the frame header.
+ * @param arg  The arg field, for the frame header.
+ * @param iov  The parts of the line.
+ * @param iovcnt  The number of parts.
+ * @param head  The number of bytes at the start of the line left out of the frame.
+ * @param tail  The number of bytes at the end of the line left out of the frame.
+ * @return 0 if successful, -1 if an error occurs.
+ */
+static int tu_send(TU *tu, int op, int flags, int32_t arg, struct iovec *iov, int iovcnt, size_t head, size_t tail) {
+    if(tu->leg) {
+        if(op == PROTO_OP_STATE) {
+            shard_leg_state(tu->leg, tu->state);
+        }
+        return 0;
+    }
+    if(__atomic_load_n(&(tu->proto), __ATOMIC_RELAXED) != PROTO_BINARY) {
+        return tu_write(tu, iov, iovcnt);
+    }
+    // Room is left in front of the header for the channel ID, on a trunk.
+    struct iovec frame[iovcnt + 2];
+    size_t len = 0;
+    for(int i = 0; i < iovcnt; i++) {
+        frame[i + 2] = iov[i];
+        len += iov[i].iov_len;
+    }
+    len -= head + tail;
+    for(int i = 2; i < iovcnt + 2 && head > 0; i++) {
+        size_t n = head < frame[i].iov_len ? head : frame[i].iov_len;
+        frame[i].iov_base = (char *)frame[i].iov_base + n;
+        frame[i].iov_len -= n;
+        head -= n;
+    }
+    for(int i = iovcnt + 1; i >= 2 && tail > 0; i--) {
+        size_t n = tail < frame[i].iov_len ? tail : frame[i].iov_len;
+        frame[i].iov_len -= n;
+        tail -= n;
+    }
+    PROTO_HEADER header;
+    TU_REQUEST *r = tu_request();
+    int response = tu == r->tu;
+    proto_header_pack(&header, response ? PROTO_RESPONSE : PROTO_EVENT, op, flags,
+                      response ? r->id : 0, arg, len);
+    frame[1].iov_base = &header;
+    frame[1].iov_len = sizeof(header);
+    if(tu->trunk) {
+        return trunk_send(tu->trunk, tu->channel, frame, iovcnt + 2);
+    }
+    return tu_write(tu, frame + 1, iovcnt + 1);
+}
+
+/*
+ * Send a notification, formatted as a line of the text protocol, to the client of a TU.
+ */
+static void tu_printf(TU *tu, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void tu_printf(TU *tu, const char *fmt, ...) {
+    char line[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if(n < 0) {
+        return;
+    }
+    struct iovec iov = { line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1 };
+    tu_send(tu, PROTO_OP_STATE, 0, 0, &iov, 1, 0, strlen(EOL));
+}
+
+/*
+ * Notify the client of a TU of its current state.  The TU must be locked.
+ */
+static void tu_notify(TU *tu) {
+    if(tu->state == TU_ON_HOOK) {
+        tu_printf(tu, "ON HOOK %d\r\n", tu->ext);
+    }
+    else if(tu->state == TU_CONNECTED) {
+        tu_printf(tu, "CONNECTED %d\r\n", tu->target->ext);
+    }
+    else if(tu->state == TU_ON_HOLD) {
+        tu_printf(tu, "ON HOLD %d\r\n", tu->target->ext);
+    }
+    else if(tu->state == TU_HELD) {
+        tu_printf(tu, "HELD %d\r\n", tu->target->ext);
+    }
+    else if(tu->state == TU_PARKED) {
+        tu_printf(tu, "PARKED %d\r\n", tu->park_slot);
+    }
+    else {
+        tu_printf(tu, "%s\r\n", tu_state_names[tu->state]);
+    }
+}
+
+/*
+ * Determine, without locking, whether a TU is in a call that is on hold.
+ * The state is read atomically; a stale answer only means that a chat or a frame
+ * is dropped, or goes through the normal path, just as it would had it come a moment
+ * earlier or later.
+ */
+static int tu_on_hold(TU *tu) {
+    int state = __atomic_load_n(&(tu->state), __ATOMIC_ACQUIRE);
+    return state == TU_ON_HOLD || state == TU_HELD;
+}
+
+/*
+ * Put a TU, which must be locked, in a new state.  The state is stored atomically, for
+ * tu_on_hold(), and the tone of a state that differs from the last starts its cadence
+ * from the beginning.  A voicemail being recorded while the TU rings back is kept if
+ * the call goes unanswered, and thrown away if it is answered.
+ */
+static void tu_set_state(TU *tu, int state) {
+    if(tu->state != state) {
+        tu->tone_cursor = 0;
+    }
+    if(tu->state == TU_RING_BACK && state != TU_RING_BACK) {
+        if(state == TU_CONNECTED) {
+            media_record_discard(&(tu->media));
+        }
+        else {
+            media_record_stop(&(tu->media));
+        }
+    }
+    __atomic_store_n(&(tu->state), state, __ATOMIC_RELEASE);
+}
+
 /*
  * Initialize a TU
  *
@@ -23,10 +238,26 @@ TU *tu_init(int fd) {
         return NULL;
     }
     tu->fd = fd;
+    tu->ext = fd;
+    tu->trunk = NULL;
+    tu->channel = 0;
+    tu->shm = NULL;
+    tu->udp = NULL;
+    tu->leg = NULL;
     tu->target = NULL;
+    tu->frame_open = 0;
+    tu->frame_peer = NULL;
     tu->state = TU_ON_HOOK;
     tu->ref_count = 1;
     Sem_init(&(tu->mutex), 0 , 1);
+    media_stream_init(&(tu->media), MEDIA_NARROWBAND_RATE);
+    tu->tone_cursor = 0;
+    tu->history = NULL;
+    tu->group = 0;
+    tu->ring_group = 0;
+    tu->ring_prev = tu->ring_next = NULL;
+    tu->park_slot = -1;
+    tu->proto = PROTO_TEXT;
     return tu;
 }
 
@@ -38,12 +269,11 @@ TU *tu_init(int fd) {
  * (for debugging purposes).
  */
 void tu_ref(TU *tu, char *reason) {
-    // Critical section.
-    P(&(tu->mutex));
-    (tu->ref_count)++;
+    // The count is not under the lock of the TU, so that a reference can be taken while
+    // other TUs are locked, without breaking the order in which TUs are locked.
+    __atomic_add_fetch(&(tu->ref_count), 1, __ATOMIC_RELAXED);
     //dprintf(tu->fd, "%s\r\n", reason);
     debug("%s", reason);
-    V(&(tu->mutex));
 }
 
 /*
@@ -54,21 +284,105 @@ void tu_ref(TU *tu, char *reason) {
  * (for debugging purposes).
  */
 void tu_unref(TU *tu, char *reason) {
-    // Critical section.
-    P(&(tu->mutex));
-    (tu->ref_count)--;
     //dprintf(tu->fd, "%s\r\n", reason);
     debug("%s", reason);
-    V(&(tu->mutex));
 
     // Reference count is 0, free.
-    if(tu->ref_count == 0) {
+    if(__atomic_sub_fetch(&(tu->ref_count), 1, __ATOMIC_ACQ_REL) == 0) {
+        media_record_stop(&(tu->media));
         Sem_destroy(&(tu->mutex));
-        close(tu->fd);
+        // The connection of a trunk is closed once all of its TUs are gone.
+        // A UDP session shares the socket of the transport, which stays open.
+        // A proxy has no connection, only its leg.
+        if(tu->trunk) {
+            trunk_unref(tu->trunk);
+        }
+        else if(tu->udp) {
+            udp_session_free(tu->udp);
+        }
+        else if(tu->leg) {
+            free(tu->leg);
+        }
+        else {
+            close(tu->fd);
+        }
+        if(tu->shm) {
+            shm_link_free(tu->shm);
+        }
         free(tu);
     }
 }
 
+/*
+ * Lock up to three TUs, in order of address.  Every thread that holds the locks of
+ * several TUs at once takes them in this order, so that no two threads can each wait
+ * for a TU that the other has locked.  Any of the TUs may be NULL, or the same as
+ * another.
+ */
+static void tu_lock_all(TU *a, TU *b, TU *c) {
+    TU *tus[3] = { a, b, c };
+    for(int i = 1; i < 3; i++) {
+        for(int j = i; j > 0 && tus[j] && (!tus[j - 1] || (uintptr_t)tus[j] < (uintptr_t)tus[j - 1]); j--) {
+            TU *t = tus[j];
+            tus[j] = tus[j - 1];
+            tus[j - 1] = t;
+        }
+    }
+    for(int i = 0; i < 3 && tus[i]; i++) {
+        if(i == 0 || tus[i] != tus[i - 1]) {
+            P(&(tus[i]->mutex));
+        }
+    }
+}
+
+/*
+ * Unlock the TUs locked by tu_lock_all().
+ */
+static void tu_unlock_all(TU *a, TU *b, TU *c) {
+    if(a) {
+        V(&(a->mutex));
+    }
+    if(b && b != a) {
+        V(&(b->mutex));
+    }
+    if(c && c != a && c != b) {
+        V(&(c->mutex));
+    }
+}
+
+/*
+ * Lock a TU, and the TU it is in a call with, if any.  If the peer comes first in the
+ * order in which TUs are locked, the TU is unlocked while the peer is locked, and the
+ * call may change meanwhile; it is then looked at again, so that the peer returned is
+ * always the current one.  The states of the TUs must only be looked at once this
+ * has returned.
+ *
+ * @param tu  The TU.
+ * @return the peer, locked as well, or NULL if the TU is in no call.
+ */
+static TU *tu_lock_call(TU *tu) {
+    P(&(tu->mutex));
+    TU *peer;
+    while((peer = tu->target) && (uintptr_t)peer < (uintptr_t)tu) {
+        // The reference keeps the peer while the TU is not locked, and its call may end.
+        tu_ref(peer, "Locking peer.");
+        V(&(tu->mutex));
+        P(&(peer->mutex));
+        P(&(tu->mutex));
+        if(tu->target == peer) {
+            // The call holds a reference too, so this is not the last.
+            __atomic_sub_fetch(&(peer->ref_count), 1, __ATOMIC_RELAXED);
+            return peer;
+        }
+        V(&(peer->mutex));
+        tu_unref(peer, "Peer changed while locking it.");
+    }
+    if(peer) {
+        P(&(peer->mutex));
+    }
+    return peer;
+}
+
 /*
  * Get the file descriptor for the network connection underlying a TU.
  * This file descriptor should only be used by a server to read input from
@@ -96,7 +410,10 @@ int tu_fileno(TU *tu) {
  * @return the extension number, if any, otherwise -1.
  */
 int tu_extension(TU *tu) {
-    return tu_fileno(tu);
+    if(!tu) {
+        return -1;
+    }
+    return tu->ext;
 }
 
 /*
@@ -112,7 +429,7 @@ int tu_set_extension(TU *tu, int ext) {
     }
     // Critical section.
     P(&(tu->mutex));
-    tu->fd = ext;
+    tu->ext = ext;
     V(&(tu->mutex));
     return 0;
 }
@@ -148,40 +465,43 @@ int tu_set_extension(TU *tu, int ext) {
  * TU transitioning to the TU_ERROR state. 
  */
 int tu_dial(TU *tu, TU *target) {
-    // Impose lock on originating telephone unit.
+    // Impose lock on originating telephone unit, and on the target, in order of address.
     if(!tu) {
         return -1;
     }
-    P(&(tu->mutex));
+    tu_lock_all(tu, target, NULL);
 
     // If caller does not know target.
     if(!target) {
         // If state is TU_DIAL_TONE, transition to TU_ERROR.
         if(tu->state == TU_DIAL_TONE) {
-            tu->state = TU_ERROR;
-            dprintf(tu->fd, "ERROR\r\n");
+            tu_set_state(tu, TU_ERROR);
+            tu_printf(tu, "ERROR\r\n");
             V(&(tu->mutex));
             return -1;
         }
         // Otherwise, no effect.
         else {
             if(tu->state == TU_ON_HOOK) {
-                dprintf(tu->fd, "ON HOOK %d\r\n", tu->fd);
+                tu_printf(tu, "ON HOOK %d\r\n", tu->ext);
             }
             else if(tu->state == TU_RINGING) {
-                dprintf(tu->fd, "RINGING\r\n");
+                tu_printf(tu, "RINGING\r\n");
             }
             else if(tu->state == TU_RING_BACK) {
-                dprintf(tu->fd, "RING BACK\r\n");
+                tu_printf(tu, "RING BACK\r\n");
             }
             else if(tu->state == TU_BUSY_SIGNAL) {
-                dprintf(tu->fd, "BUSY SIGNAL\r\n");
+                tu_printf(tu, "BUSY SIGNAL\r\n");
             }
             else if(tu->state == TU_CONNECTED) {
-                dprintf(tu->fd, "CONNECTED %d\r\n", tu->target->fd);
+                tu_printf(tu, "CONNECTED %d\r\n", tu->target->ext);
             }
             else if(tu->state == TU_ERROR) {
-                dprintf(tu->fd, "ERROR\r\n");
+                tu_printf(tu, "ERROR\r\n");
+            }
+            else {
+                tu_notify(tu);
             }
             V(&(tu->mutex));
             return 0;
@@ -189,34 +509,34 @@ int tu_dial(TU *tu, TU *target) {
     }
     // If originating telephone unit is the same as the target telephone unit.
     else if(tu == target) {
-        tu->state = TU_BUSY_SIGNAL;
-        dprintf(tu->fd, "BUSY SIGNAL\r\n");
+        tu_set_state(tu, TU_BUSY_SIGNAL);
+        tu_printf(tu, "BUSY SIGNAL\r\n");
         V(&(tu->mutex));
         return 0;
     }
 
-    // Impose lock on target telephone unit.
-    P(&(target->mutex));
-
     // If state is not TU_DIAL_TONE, no effect.
     if(tu->state != TU_DIAL_TONE) {
         if(tu->state == TU_ON_HOOK) {
-            dprintf(tu->fd, "ON HOOK %d\r\n", tu->fd);
+            tu_printf(tu, "ON HOOK %d\r\n", tu->ext);
         }
         else if(tu->state == TU_RINGING) {
-            dprintf(tu->fd, "RINGING\r\n");
+            tu_printf(tu, "RINGING\r\n");
         }
         else if(tu->state == TU_RING_BACK) {
-            dprintf(tu->fd, "RING BACK\r\n");
+            tu_printf(tu, "RING BACK\r\n");
         }
         else if(tu->state == TU_BUSY_SIGNAL) {
-            dprintf(tu->fd, "BUSY SIGNAL\r\n");
+            tu_printf(tu, "BUSY SIGNAL\r\n");
         }
         else if(tu->state == TU_CONNECTED) {
-            dprintf(tu->fd, "CONNECTED %d\r\n", tu->target->fd);
+            tu_printf(tu, "CONNECTED %d\r\n", tu->target->ext);
         }
         else if(tu->state == TU_ERROR) {
-            dprintf(tu->fd, "ERROR\r\n");
+            tu_printf(tu, "ERROR\r\n");
+        }
+        else {
+            tu_notify(tu);
         }
         V(&(tu->mutex));
         V(&(target->mutex));
@@ -224,8 +544,8 @@ int tu_dial(TU *tu, TU *target) {
     }
     // If the target telephone unit already has a peer or its state is not TU_ON_HOOK.
     else if(target->target || target->state != TU_ON_HOOK) {
-        tu->state = TU_BUSY_SIGNAL;
-        dprintf(tu->fd, "BUSY SIGNAL\r\n");
+        tu_set_state(tu, TU_BUSY_SIGNAL);
+        tu_printf(tu, "BUSY SIGNAL\r\n");
         V(&(tu->mutex));
         V(&(target->mutex));
         return 0;
@@ -234,14 +554,18 @@ int tu_dial(TU *tu, TU *target) {
     else {
         tu->target = target;
         target->target = tu;
-        tu->state = TU_RING_BACK;
-        target->state = TU_RINGING;
-        dprintf(tu->fd, "RING BACK\r\n");
-        dprintf(target->fd, "RINGING\r\n");
+        tu_set_state(tu, TU_RING_BACK);
+        tu_set_state(target, TU_RINGING);
+        pickup_lock();
+        pickup_ringing_add(target);
+        pickup_unlock();
+        tu_printf(tu, "RING BACK\r\n");
+        tu_printf(target, "RINGING\r\n");
+        // Each takes a reference to the other.
+        __atomic_add_fetch(&(tu->ref_count), 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&(target->ref_count), 1, __ATOMIC_RELAXED);
         V(&(tu->mutex));
-        tu_ref(tu, "Connected to peer.");
         V(&(target->mutex));
-        tu_ref(target, "Connected to peer.");
         return 0;
     }
     //Unexpected error.
@@ -268,52 +592,57 @@ int tu_dial(TU *tu, TU *target) {
  * TU transitioning to the TU_ERROR state. 
  */
 int tu_pickup(TU *tu) {
-    // Impose lock on originating telephone unit.
+    // Impose lock on originating telephone unit, and on its peer.
     if(!tu) {
         return -1;
     }
-    P(&(tu->mutex));
+    TU *peer = tu_lock_call(tu);
 
     // If telephone unit is not in TU_ON_HOOK nor TU_RINGING, no effect.
     if(tu->state != TU_ON_HOOK && tu->state != TU_RINGING) {
         if(tu->state == TU_DIAL_TONE) {
-            dprintf(tu->fd, "DIAL TONE\r\n");
+            tu_printf(tu, "DIAL TONE\r\n");
         }
         else if(tu->state == TU_RING_BACK) {
-            dprintf(tu->fd, "RING BACK\r\n");
+            tu_printf(tu, "RING BACK\r\n");
         }
         else if(tu->state == TU_BUSY_SIGNAL) {
-            dprintf(tu->fd, "BUSY SIGNAL\r\n");
+            tu_printf(tu, "BUSY SIGNAL\r\n");
         }
         else if(tu->state == TU_CONNECTED) {
-            dprintf(tu->fd, "CONNECTED %d\r\n", tu->target->fd);
+            tu_printf(tu, "CONNECTED %d\r\n", tu->target->ext);
         }
         else if(tu->state == TU_ERROR) {
-            dprintf(tu->fd, "ERROR\r\n");
+            tu_printf(tu, "ERROR\r\n");
         }
-        V(&(tu->mutex));
+        else {
+            tu_notify(tu);
+        }
+        tu_unlock_all(tu, peer, NULL);
         return 0;
     }
     // If telephone unit is in TU_ON_HOOK, then transition to TU_DIAL_TONE.
     else if(tu->state == TU_ON_HOOK) {
-        tu->state = TU_DIAL_TONE;
-        dprintf(tu->fd, "DIAL TONE\r\n");
-        V(&(tu->mutex));
+        tu_set_state(tu, TU_DIAL_TONE);
+        tu_printf(tu, "DIAL TONE\r\n");
+        tu_unlock_all(tu, peer, NULL);
         return 0;
     }
     // If telephone unit is in TU_RINGING, then transition to TU_CONNECTED for it and its target.
     else if(tu->state == TU_RINGING) {
-        P(&(tu->target->mutex));
-        tu->state = TU_CONNECTED;
-        tu->target->state = TU_CONNECTED;
-        dprintf(tu->fd, "CONNECTED %d\r\n", tu->target->fd);
-        dprintf(tu->target->fd, "CONNECTED %d\r\n", tu->fd);
-        V(&(tu->mutex));
-        V(&(tu->target->mutex));
+        tu_set_state(tu, TU_CONNECTED);
+        tu_set_state(tu->target, TU_CONNECTED);
+        tu->history = tu->target->history = chat_history_alloc();
+        pickup_lock();
+        pickup_ringing_remove(tu);
+        pickup_unlock();
+        tu_printf(tu, "CONNECTED %d\r\n", tu->target->ext);
+        tu_printf(tu->target, "CONNECTED %d\r\n", tu->ext);
+        tu_unlock_all(tu, peer, NULL);
         return 0;
     }
     // Unexpected error.
-    V(&(tu->mutex));
+    tu_unlock_all(tu, peer, NULL);
     return -1;
 }
 
@@ -339,50 +668,76 @@ int tu_pickup(TU *tu) {
  * TU transitioning to the TU_ERROR state. 
  */
 int tu_hangup(TU *tu) {
-    // Impose lock on originating telephone unit.
+    // Impose lock on originating telephone unit, and on its peer, if any.
     if(!tu) {
         return -1;
     }
-    P(&(tu->mutex));
+    tu_lock_call(tu);
 
-    // If telephone unit is in TU_CONNECTED or TU_RINGING, transition to TU_ON_HOOK and its target transitions to TU_DIAL_TONE.
-    if(tu->state == TU_CONNECTED || tu->state == TU_RINGING) {
-        // Lock target.
-        P(&(tu->target->mutex));
-        tu->state = TU_ON_HOOK;
-        tu->target->state = TU_DIAL_TONE;
+    // If telephone unit is in TU_CONNECTED or TU_RINGING, or the call is on hold, transition to TU_ON_HOOK
+    // and its target transitions to TU_DIAL_TONE.
+    if(tu->state == TU_CONNECTED || tu->state == TU_RINGING || tu->state == TU_ON_HOLD || tu->state == TU_HELD) {
+        pickup_lock();
+        pickup_ringing_remove(tu);
+        pickup_unlock();
+        tu_set_state(tu, TU_ON_HOOK);
+        tu_set_state(tu->target, TU_DIAL_TONE);
         tu->target->target = NULL;
-        dprintf(tu->fd, "ON HOOK %d\r\n", tu->fd);
-        dprintf(tu->target->fd, "DIAL TONE\r\n");
+        chat_history_free(tu->history);
+        tu->history = tu->target->history = NULL;
+        tu_printf(tu, "ON HOOK %d\r\n", tu->ext);
+        tu_printf(tu->target, "DIAL TONE\r\n");
         // Unlock target, set reference to NULL.
-        V(&(tu->target->mutex));
-        tu_unref(tu->target, "Peer hung up.");
+        TU *target = tu->target;
+        V(&(target->mutex));
         tu->target = NULL;
+        spool_kick(tu->ext);
         V(&(tu->mutex));
+        // The references are released once no TU is locked here, since either may be
+        // the last one, which frees its TU.
+        tu_unref(target, "Peer hung up.");
         tu_unref(tu, "Hung up from peer.");
         return 0;
     }
     // If telephone unit is in TU_RING_BACK, transition to TU_ON_HOOK and its target transitions to TU_ON_HOOK.
     else if(tu->state == TU_RING_BACK) {
-        //Lock target.
-        P(&(tu->target->mutex));
-        tu->state = TU_ON_HOOK;
-        tu->target->state = TU_ON_HOOK;
+        pickup_lock();
+        pickup_ringing_remove(tu->target);
+        pickup_unlock();
+        tu_set_state(tu, TU_ON_HOOK);
+        tu_set_state(tu->target, TU_ON_HOOK);
         tu->target->target = NULL;
-        dprintf(tu->fd, "ON HOOK %d\r\n", tu->fd);
-        dprintf(tu->target->fd, "ON HOOK %d\r\n", tu->target->fd);
+        tu_printf(tu, "ON HOOK %d\r\n", tu->ext);
+        tu_printf(tu->target, "ON HOOK %d\r\n", tu->target->ext);
         // Unlock target, set reference to NULL.
-        V(&(tu->target->mutex));
-        tu_unref(tu->target, "Stopped ringing.");
+        spool_kick(tu->target->ext);
+        TU *target = tu->target;
+        V(&(target->mutex));
         tu->target = NULL;
+        spool_kick(tu->ext);
         V(&(tu->mutex));
+        tu_unref(target, "Stopped ringing.");
         tu_unref(tu, "Stopped dialing.");
         return 0;
     }
     else if(tu->state == TU_DIAL_TONE || tu->state == TU_BUSY_SIGNAL || tu->state == TU_ERROR) {
-        tu->state = TU_ON_HOOK;
-        dprintf(tu->fd, "ON HOOK %d\r\n", tu->fd);
+        tu_set_state(tu, TU_ON_HOOK);
+        tu_printf(tu, "ON HOOK %d\r\n", tu->ext);
+        spool_kick(tu->ext);
+        V(&(tu->mutex));
+        return 0;
+    }
+    // If telephone unit is parked, leave the park slot and transition to TU_ON_HOOK.
+    else if(tu->state == TU_PARKED) {
+        pickup_lock();
+        park_clear(tu->park_slot, tu);
+        pickup_unlock();
+        tu->park_slot = -1;
+        tu_set_state(tu, TU_ON_HOOK);
+        tu_printf(tu, "ON HOOK %d\r\n", tu->ext);
+        spool_kick(tu->ext);
         V(&(tu->mutex));
+        tu_unref(tu, "Left park slot.");
         return 0;
     }
     else if(tu->state == TU_ON_HOOK) {
@@ -408,43 +763,1017 @@ int tu_hangup(TU *tu) {
  */
 
 int tu_chat(TU *tu, char *msg) {
-    // Impose lock on originating telephone unit.
+    if(!msg) {
+        return -1;
+    }
+    return tu_chatv(tu, msg, strlen(msg));
+}
+
+/*
+ * Write a chat, or one piece of a chat frame, to the peer of a TU.  If the TU is in a
+ * call, the chat is written to the peer's connection with a single scatter-gather write,
+ * straight from the buffer it is given in, and the sender is then notified of its
+ * (unchanged) state, unless more pieces of the chat are to come.  A whole chat is also
+ * recorded in the history of the call.  The pieces of a chat frame go only to the peer
+ * that the frame started with: once one is dropped, so are the rest.
+ *
+ * @param tu  The tu sending the chat.
+ * @param op  PROTO_OP_CHAT for a whole chat, PROTO_OP_CHATF for a piece of a frame.
+ * @param data  The bytes of the chat or of the piece.
+ * @param len  The number of bytes.
+ * @param more  The number of bytes of the chat that follow this piece.
+ * @return 0 if successful, -1 if there is no call in progress.
+ */
+static int tu_relay_chat(TU *tu, int op, const char *data, size_t len, size_t more) {
     if(!tu) {
         return -1;
     }
-    P(&(tu->mutex));
+    // A call on hold carries no chat, which is dropped without taking any lock.
+    // The pieces of a frame are counted under the lock, even so.
+    if(op == PROTO_OP_CHAT && tu_on_hold(tu)) {
+        return -1;
+    }
+    // Frame the chat: "chat <text>" EOL, or "chatf <n> <more>" EOL followed by the bytes.
+    char header[64];
+    struct iovec iov[3];
+    int iovcnt;
+    size_t head, tail;
+    if(op == PROTO_OP_CHAT) {
+        iov[0] = (struct iovec){ "chat ", strlen("chat ") };
+        iov[1] = (struct iovec){ (void *)data, len };
+        iov[2] = (struct iovec){ EOL, strlen(EOL) };
+        iovcnt = 3;
+        head = strlen("chat ");
+        tail = strlen(EOL);
+    }
+    else {
+        iov[0].iov_base = header;
+        iov[0].iov_len = snprintf(header, sizeof(header), "chatf %zu %zu%s", len, more, EOL);
+        iov[1] = (struct iovec){ (void *)data, len };
+        iovcnt = 2;
+        head = iov[0].iov_len;
+        tail = 0;
+    }
+
+    // Impose lock on originating telephone unit, and on its peer, if any.
+    TU *target = tu_lock_call(tu);
+    TU *peer = tu->state == TU_CONNECTED ? target : NULL;
+    if(op == PROTO_OP_CHATF) {
+        // A frame that started with another peer, or with none, must not go on to this
+        // one, which would get its pieces without its start.
+        if(!tu->frame_open) {
+            tu->frame_peer = peer;
+        }
+        if(tu->frame_peer != peer) {
+            tu->frame_peer = peer = NULL;
+        }
+        tu->frame_open = more > 0;
+    }
 
     // If not in TU_CONNECTED, no effect.
+    if(!peer) {
+        tu_unlock_all(tu, target, NULL);
+        return -1;
+    }
+    // If in TU_CONNECTED, send message to target.
+    if(op == PROTO_OP_CHAT && tu->history) {
+        chat_history_add(tu->history, tu->ext, data, len);
+    }
+    if(tu->target->leg) {
+        shard_leg_chat(tu->target->leg, op, data, len, more);
+    }
+    else {
+        tu_send(tu->target, op, more ? PROTO_FLAG_MORE : 0, proto_more_arg(more), iov, iovcnt, head, tail);
+    }
+    if(more == 0) {
+        tu_printf(tu, "CONNECTED %d\r\n", tu->target->ext);
+    }
+    V(&(tu->mutex));
+    V(&(tu->target->mutex));
+    return 0;
+}
+
+/*
+ * Send a chat message of a given length from a TU to its peer.
+ * This behaves like tu_chat(), except that the message need not be null-terminated.
+ * The message is not copied: it is written to the peer's connection with a single
+ * scatter-gather write, together with the prefix and the EOL that frame it.
+ *
+ * @param tu  The tu sending the chat.
+ * @param msg  The message to be sent.
+ * @param len  The length of the message.
+ * @return 0  If the chat was successfully sent, -1 if there is no call in progress
+ * or some other error occurs.
+ */
+int tu_chatv(TU *tu, const char *msg, size_t len) {
+    return tu_relay_chat(tu, PROTO_OP_CHAT, msg, len, 0);
+}
+
+/*
+ * Send one piece of a length-prefixed chat frame from a TU to its peer.
+ * The peer receives "chatf <n> <more>" followed by the n bytes of the piece, where
+ * more is the number of bytes of the chat still to come in later pieces.  The pieces
+ * of one chat arrive in order, but other notifications may arrive between them.
+ * The sender is notified of its state once the last piece has been sent.  If the call
+ * ends, or is put on hold, while a frame is being sent, the rest of the frame is
+ * dropped, even if the TU is connected again by the time it arrives; the peer learns
+ * from its own notifications that the frame will not be completed.
+ *
+ * @param tu  The tu sending the chat.
+ * @param data  The bytes of the piece, which may include anything, EOLs included.
+ * @param len  The number of bytes in the piece.
+ * @param more  The number of bytes of the chat that follow this piece.
+ * @return 0  If the piece was successfully sent, -1 if there is no call in progress
+ * or some other error occurs.
+ */
+int tu_chat_frame(TU *tu, const char *data, size_t len, size_t more) {
+    return tu_relay_chat(tu, PROTO_OP_CHATF, data, len, more);
+}
+
+/*
+ * Put the call of a TU on hold.
+ * If the TU is in the TU_CONNECTED state, it goes to the TU_ON_HOLD state and its peer
+ * simultaneously goes to the TU_HELD state, both of them keeping their reference to
+ * each other.  Otherwise, there is no effect.  Only the two TUs are locked: the PBX
+ * registry is not involved.
+ *
+ * In all cases, a notification of the resulting state of the TU is sent to its client,
+ * and if the peer has changed state, its client is also notified.
+ *
+ * @param tu  The TU putting its call on hold.
+ * @return 0 if successful, -1 if the TU is not in a call that can be put on hold.
+ */
+int tu_hold(TU *tu) {
+    if(!tu) {
+        return -1;
+    }
+    TU *peer = tu_lock_call(tu);
     if(tu->state != TU_CONNECTED) {
+        tu_notify(tu);
+        tu_unlock_all(tu, peer, NULL);
+        return -1;
+    }
+    tu_set_state(tu, TU_ON_HOLD);
+    tu_set_state(tu->target, TU_HELD);
+    tu_notify(tu);
+    tu_notify(tu->target);
+    V(&(tu->mutex));
+    V(&(tu->target->mutex));
+    return 0;
+}
+
+/*
+ * Take the call of a TU off hold.
+ * If the TU is in the TU_ON_HOLD state, it and its peer both return to the
+ * TU_CONNECTED state.  Otherwise, there is no effect; in particular, only the TU that
+ * put the call on hold can resume it.
+ *
+ * In all cases, a notification of the resulting state of the TU is sent to its client,
+ * and if the peer has changed state, its client is also notified.
+ *
+ * @param tu  The TU resuming its call.
+ * @return 0 if successful, -1 if the TU has not put a call on hold.
+ */
+int tu_resume(TU *tu) {
+    if(!tu) {
+        return -1;
+    }
+    TU *peer = tu_lock_call(tu);
+    if(tu->state != TU_ON_HOLD) {
+        tu_notify(tu);
+        tu_unlock_all(tu, peer, NULL);
+        return -1;
+    }
+    tu_set_state(tu, TU_CONNECTED);
+    tu_set_state(tu->target, TU_CONNECTED);
+    tu_notify(tu);
+    tu_notify(tu->target);
+    V(&(tu->mutex));
+    V(&(tu->target->mutex));
+    return 0;
+}
+
+/*
+ * Put a TU in a pickup group, or take it out of its group if the group is 0.
+ * A notification of the (unchanged) state of the TU is sent to its client.
+ *
+ * @param tu  The TU.
+ * @param group  The pickup group, from 0 to PICKUP_GROUPS - 1.
+ * @return 0 if successful, -1 if the group is invalid.
+ */
+int tu_set_group(TU *tu, int group) {
+    if(!tu) {
+        return -1;
+    }
+    P(&(tu->mutex));
+    if(group < 0 || group >= PICKUP_GROUPS) {
+        tu_notify(tu);
         V(&(tu->mutex));
         return -1;
     }
-    // If in TU_CONNECTED, send message to target.
-    P(&(tu->target->mutex));
-    dprintf(tu->target->fd, "chat %s\r\n", msg);
-    if(tu->state == TU_ON_HOOK) {
-        dprintf(tu->fd, "ON HOOK %d\r\n", tu->fd);
+    pickup_lock();
+    pickup_ringing_remove(tu);
+    tu->group = group;
+    if(tu->state == TU_RINGING) {
+        pickup_ringing_add(tu);
     }
-    else if(tu->state == TU_RINGING) {
-        dprintf(tu->fd, "RINGING\r\n");
+    pickup_unlock();
+    tu_notify(tu);
+    V(&(tu->mutex));
+    return 0;
+}
+
+/*
+ * Determine whether a TU is free to answer a call ringing elsewhere, or retrieve
+ * a parked call.  The TU must be locked.
+ */
+static int tu_can_answer(TU *tu) {
+    return tu->state == TU_ON_HOOK || tu->state == TU_DIAL_TONE;
+}
+
+/*
+ * Answer, on behalf of one TU, a call that is ringing on another.  The caller is
+ * re-pointed at the answering TU, with which it is now connected, and the ringing TU
+ * goes back on hook.  All three TUs, and the pickup lists, must be locked, so that
+ * none of them can hang up in the meantime.  The reference that the call held on the
+ * ringing TU now belongs to the answering TU; the caller of this function must release
+ * it once the ringing TU is unlocked.
+ */
+static void tu_take_call(TU *tu, TU *ringing) {
+    TU *caller = ringing->target;
+    pickup_ringing_remove(ringing);
+    tu_set_state(ringing, TU_ON_HOOK);
+    ringing->target = NULL;
+    tu_set_state(tu, TU_CONNECTED);
+    tu_set_state(caller, TU_CONNECTED);
+    tu->target = caller;
+    caller->target = tu;
+    __atomic_add_fetch(&(tu->ref_count), 1, __ATOMIC_RELAXED);
+    tu->history = caller->history = chat_history_alloc();
+    tu_notify(ringing);
+    tu_notify(tu);
+    tu_notify(caller);
+    spool_kick(ringing->ext);
+}
+
+/*
+ * Get the caller of a TU that is ringing, holding a reference to it, so that the
+ * caller can then be locked together with the ringing TU, and the TU answering, in
+ * order of address.  Nothing else may be locked.
+ *
+ * @param ringing  The TU that may be ringing, which must not go away meanwhile.
+ * @return the caller, or NULL if the TU is not ringing.
+ */
+static TU *tu_ringing_caller(TU *ringing) {
+    P(&(ringing->mutex));
+    TU *caller = ringing->state == TU_RINGING ? ringing->target : NULL;
+    if(caller) {
+        tu_ref(caller, "Picking up call.");
     }
-    else if(tu->state == TU_DIAL_TONE) {
-        dprintf(tu->fd, "DIAL TONE\r\n");
+    V(&(ringing->mutex));
+    return caller;
+}
+
+/*
+ * Answer the call that has been ringing the longest on any TU of the pickup group
+ * of a TU.  The TU must be on hook or hearing dial tone.  If no TU of the group is
+ * ringing, there is no effect.
+ *
+ * The ringing TU is found with only the answering TU locked, and then the three TUs are
+ * locked in order of address, waiting for any that is busy.  If the call has changed
+ * meanwhile, for example because the caller hung up, the attempt is started over, so
+ * that the call is never taken from under a hangup.
+ *
+ * In all cases, a notification of the resulting state of the TU is sent to its client,
+ * and the clients of the other TUs that changed state are notified as well.
+ *
+ * @param tu  The TU answering the call.
+ * @return 0 if a call was answered, otherwise -1.
+ */
+int tu_group_pickup(TU *tu) {
+    if(!tu) {
+        return -1;
     }
-    else if(tu->state == TU_RING_BACK) {
-        dprintf(tu->fd, "RING BACK\r\n");
+    while(1) {
+        P(&(tu->mutex));
+        pickup_lock();
+        TU *ringing = pickup_ringing_first(tu->group);
+        if(!tu_can_answer(tu) || !ringing) {
+            pickup_unlock();
+            tu_notify(tu);
+            V(&(tu->mutex));
+            return -1;
+        }
+        // A TU on the list of its group is not released before it leaves the list.
+        tu_ref(ringing, "Picking up call.");
+        pickup_unlock();
+        V(&(tu->mutex));
+        TU *caller = tu_ringing_caller(ringing);
+        tu_lock_all(tu, ringing, caller);
+        int ok = caller && tu_can_answer(tu) && ringing->state == TU_RINGING &&
+                 ringing->target == caller && ringing->ring_group == tu->group;
+        if(ok) {
+            pickup_lock();
+            tu_take_call(tu, ringing);
+            pickup_unlock();
+        }
+        tu_unlock_all(tu, ringing, caller);
+        if(caller) {
+            tu_unref(caller, "Done picking up call.");
+        }
+        tu_unref(ringing, "Done picking up call.");
+        if(ok) {
+            tu_unref(ringing, "Call picked up elsewhere.");
+            return 0;
+        }
+    }
+}
+
+/*
+ * Answer the call ringing on a particular TU.  The answering TU must be on hook or
+ * hearing dial tone.  If the other TU is not ringing, there is no effect.  Locking is
+ * done as for tu_group_pickup().
+ *
+ * @param tu  The TU answering the call.
+ * @param ringing  The TU on which the call is ringing, or NULL if the caller of this
+ * function could not identify it.
+ * @return 0 if the call was answered, otherwise -1.
+ */
+int tu_directed_pickup(TU *tu, TU *ringing) {
+    if(!tu) {
+        return -1;
     }
-    else if(tu->state == TU_BUSY_SIGNAL) {
-        dprintf(tu->fd, "BUSY SIGNAL\r\n");
+    if(ringing == tu) {
+        ringing = NULL;
     }
-    else if(tu->state == TU_CONNECTED) {
-        dprintf(tu->fd, "CONNECTED %d\r\n", tu->target->fd);
+    while(1) {
+        TU *caller = ringing ? tu_ringing_caller(ringing) : NULL;
+        tu_lock_all(tu, ringing, caller);
+        if(!tu_can_answer(tu) || !caller) {
+            tu_notify(tu);
+            tu_unlock_all(tu, ringing, caller);
+            if(caller) {
+                tu_unref(caller, "Done picking up call.");
+            }
+            return -1;
+        }
+        int ok = ringing->state == TU_RINGING && ringing->target == caller;
+        if(ok) {
+            pickup_lock();
+            tu_take_call(tu, ringing);
+            pickup_unlock();
+        }
+        tu_unlock_all(tu, ringing, caller);
+        tu_unref(caller, "Done picking up call.");
+        if(ok) {
+            tu_unref(ringing, "Call picked up elsewhere.");
+            return 0;
+        }
+    }
+}
+
+/*
+ * Park the peer of a TU on a park slot.
+ * If the TU is in the TU_CONNECTED state and the slot is free, the peer goes to the
+ * TU_PARKED state, waiting on the slot, and the TU goes to the TU_DIAL_TONE state,
+ * free to make another call.  Otherwise, there is no effect.
+ *
+ * In all cases, a notification of the resulting state of the TU is sent to its client,
+ * and if the peer has changed state, its client is also notified.
+ *
+ * @param tu  The TU parking its call.
+ * @param slot  The park slot.
+ * @return 0 if successful, otherwise -1.
+ */
+int tu_park(TU *tu, int slot) {
+    if(!tu) {
+        return -1;
+    }
+    TU *peer = tu_lock_call(tu);
+    if(tu->state != TU_CONNECTED) {
+        tu_notify(tu);
+        tu_unlock_all(tu, peer, NULL);
+        return -1;
+    }
+    pickup_lock();
+    int ret = park_put(slot, peer);
+    pickup_unlock();
+    if(ret == -1) {
+        tu_notify(tu);
+        V(&(tu->mutex));
+        V(&(peer->mutex));
+        return -1;
+    }
+    // The reference the call held on the peer now belongs to the park slot.
+    tu_set_state(peer, TU_PARKED);
+    peer->park_slot = slot;
+    peer->target = NULL;
+    tu_set_state(tu, TU_DIAL_TONE);
+    tu->target = NULL;
+    chat_history_free(tu->history);
+    tu->history = peer->history = NULL;
+    tu_notify(tu);
+    tu_notify(peer);
+    V(&(tu->mutex));
+    V(&(peer->mutex));
+    tu_unref(tu, "Parked call.");
+    return 0;
+}
+
+/*
+ * Retrieve the call parked on a park slot.
+ * If the TU is on hook or hearing dial tone and a call is parked on the slot, the TU
+ * and the parked party are connected.  Otherwise, there is no effect.  The parked TU
+ * is found with only the retrieving TU locked, and the two are then locked in order of
+ * address; if the call has left the slot meanwhile, for example because the parked
+ * party hung up, the attempt is started over.
+ *
+ * In all cases, a notification of the resulting state of the TU is sent to its client,
+ * and if the parked party has changed state, its client is also notified.
+ *
+ * @param tu  The TU retrieving the call.
+ * @param slot  The park slot.
+ * @return 0 if successful, otherwise -1.
+ */
+int tu_unpark(TU *tu, int slot) {
+    if(!tu) {
+        return -1;
+    }
+    while(1) {
+        P(&(tu->mutex));
+        pickup_lock();
+        TU *parked = park_peek(slot);
+        if(!tu_can_answer(tu) || !parked) {
+            pickup_unlock();
+            tu_notify(tu);
+            V(&(tu->mutex));
+            return -1;
+        }
+        // The park slot holds a reference to the TU until it leaves the slot.
+        tu_ref(parked, "Retrieving parked call.");
+        pickup_unlock();
+        V(&(tu->mutex));
+        tu_lock_all(tu, parked, NULL);
+        pickup_lock();
+        int ok = tu_can_answer(tu) && park_peek(slot) == parked;
+        if(ok) {
+            park_clear(slot, parked);
+        }
+        pickup_unlock();
+        if(ok) {
+            parked->park_slot = -1;
+            tu_set_state(parked, TU_CONNECTED);
+            tu_set_state(tu, TU_CONNECTED);
+            parked->target = tu;
+            tu->target = parked;
+            __atomic_add_fetch(&(tu->ref_count), 1, __ATOMIC_RELAXED);
+            tu->history = parked->history = chat_history_alloc();
+            tu_notify(tu);
+            tu_notify(parked);
+        }
+        tu_unlock_all(tu, parked, NULL);
+        tu_unref(parked, "Done retrieving parked call.");
+        if(ok) {
+            return 0;
+        }
+    }
+}
+
+/*
+ * Set the request that the calling thread is carrying out on behalf of the client of
+ * a TU.  Until the next call, notifications sent to that client by the calling thread
+ * are responses to the request, if the client speaks the binary protocol.
+ *
+ * @param tu  The TU, or NULL if the thread is not carrying out a request.
+ * @param id  The ID of the request.
+ */
+void tu_set_request(TU *tu, uint32_t id) {
+    TU_REQUEST *r = tu_request();
+    r->tu = tu;
+    r->id = id;
+}
+
+/*
+ * Switch the connection of a TU to another version of the protocol.
+ * A notification of the (unchanged) state of the TU follows, in the new protocol.
+ *
+ * @param tu  The TU.
+ * @param version  PROTO_TEXT or PROTO_BINARY.
+ * @return 0 if successful, -1 if the version is not supported.
+ */
+int tu_set_protocol(TU *tu, int version) {
+    if(!tu) {
+        return -1;
+    }
+    P(&(tu->mutex));
+    if(version != PROTO_TEXT && version != PROTO_BINARY) {
+        tu_notify(tu);
+        V(&(tu->mutex));
+        return -1;
+    }
+    __atomic_store_n(&(tu->proto), version, __ATOMIC_RELAXED);
+    tu_notify(tu);
+    V(&(tu->mutex));
+    return 0;
+}
+
+/*
+ * Put a TU on a channel of a trunk, so that its output goes to the trunk in frames of
+ * the binary protocol tagged with the channel.  This is done before the TU is registered,
+ * except for channel 0, which is the TU of the trunk connection itself.
+ *
+ * @param tu  The TU, which must be using the connection of the trunk.
+ * @param trunk  The trunk, which gains a reference held by the TU.
+ * @param channel  The channel.
+ */
+void tu_join_trunk(TU *tu, TRUNK *trunk, uint32_t channel) {
+    trunk_ref(trunk);
+    P(&(tu->mutex));
+    tu->trunk = trunk;
+    tu->channel = channel;
+    __atomic_store_n(&(tu->proto), PROTO_BINARY, __ATOMIC_RELAXED);
+    V(&(tu->mutex));
+}
+
+/*
+ * Move the output of a TU to a shared-memory link.  The client is first sent the line
+ * "SHM <ring-size>" on the connection, with the memory file of the link attached, and
+ * then a notification of the state of the TU, through the link.
+ *
+ * @param tu  The TU, whose connection must be a Unix-domain socket.
+ * @param link  The server side of the link, which the TU takes over if successful.
+ * @param memfd  The memory file of the link.
+ * @return 0 if successful, -1 if the memory file could not be passed to the client.
+ */
+int tu_attach_shm(TU *tu, SHM_LINK *link, int memfd) {
+    char line[32];
+    struct iovec iov = { line, snprintf(line, sizeof(line), "SHM %d%s", SHM_RING_SIZE, EOL) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    P(&(tu->mutex));
+    if(tu->trunk || tu->shm || sendmsg(tu->fd, &msg, MSG_NOSIGNAL) != iov.iov_len) {
+        V(&(tu->mutex));
+        return -1;
+    }
+    tu->shm = link;
+    tu_notify(tu);
+    V(&(tu->mutex));
+    return 0;
+}
+
+/*
+ * Send the output of a TU, which must not yet be registered, to the phone of a UDP session.
+ *
+ * @param tu  The TU, which takes over the session.
+ * @param s  The session.
+ */
+void tu_attach_udp(TU *tu, UDP_SESSION *s) {
+    P(&(tu->mutex));
+    tu->udp = s;
+    V(&(tu->mutex));
+}
+
+/*
+ * Send the client of a TU a notification of its current state.
+ *
+ * @param tu  The TU.
+ */
+void tu_notify_state(TU *tu) {
+    P(&(tu->mutex));
+    tu_notify(tu);
+    V(&(tu->mutex));
+}
+
+/*
+ * Tell the client of a TU that the request it just made was rejected without being
+ * carried out.  Only a client that speaks the binary protocol is told, by an error
+ * response; the text protocol has no such notification.
+ *
+ * @param tu  The TU.
+ * @param op  The command of the request.
+ */
+void tu_reject(TU *tu, int op) {
+    if(!tu) {
+        return;
+    }
+    P(&(tu->mutex));
+    if(tu->proto == PROTO_BINARY) {
+        tu_send(tu, op, PROTO_FLAG_ERROR, 0, NULL, 0, 0, 0);
+    }
+    V(&(tu->mutex));
+}
+
+/*
+ * Send again the chat messages of the current call that a TU may have missed.
+ * Each retained message with a sequence number greater than the given one is sent,
+ * oldest first, as "replay <seq> <from> <text>", where from is the extension of the
+ * party that sent it.  Messages from either party are included.  A notification of
+ * the (unchanged) state of the TU follows.
+ *
+ * @param tu  The tu requesting the replay.
+ * @param after  The sequence number of the last message already seen, or 0 for all.
+ * @return 0 if successful, -1 if there is no call in progress.
+ */
+int tu_replay(TU *tu, uint32_t after) {
+    if(!tu) {
+        return -1;
+    }
+    // The history is shared with the peer, so the peer is locked too.
+    TU *peer = tu_lock_call(tu);
+    if(tu->state != TU_CONNECTED) {
+        tu_notify(tu);
+        tu_unlock_all(tu, peer, NULL);
+        return -1;
     }
-    else if(tu->state == TU_ERROR) {
-        dprintf(tu->fd, "ERROR\r\n");
+    CHAT_RECORD rec;
+    struct iovec iov[4];
+    char header[64];
+    int parts;
+    while(tu->history && (parts = chat_history_find(tu->history, after, &rec, &iov[1])) != -1) {
+        iov[0].iov_base = header;
+        iov[0].iov_len = snprintf(header, sizeof(header), "replay %u %d ", rec.seq, rec.from);
+        iov[parts + 1].iov_base = EOL;
+        iov[parts + 1].iov_len = strlen(EOL);
+        if(tu_send(tu, PROTO_OP_REPLAY, 0, 0, iov, parts + 2, 0, strlen(EOL)) == -1) {
+            break;
+        }
+        after = rec.seq;
     }
+    tu_notify(tu);
     V(&(tu->mutex));
     V(&(tu->target->mutex));
     return 0;
 }
 
+/*
+ * Leave a message for an extension.  The message is stored in the spool of the
+ * extension and delivered to it once a TU is registered there and on hook, which may be
+ * right away.  A notification of the (unchanged) state of the sending TU follows.
+ *
+ * @param tu  The tu sending the message.
+ * @param ext  The extension to which the message is addressed.
+ * @param msg  The text of the message.
+ * @param len  The length of the text.
+ * @return 0 if the message was stored, -1 if it could not be.
+ */
+int tu_msg(TU *tu, int ext, const char *msg, size_t len) {
+    if(!tu) {
+        return -1;
+    }
+    // A message for an extension of another shard is spooled there.
+    int ret;
+    if(shard_remote(ext)) {
+        ret = shard_spool(tu_extension(tu), ext, msg, len);
+    }
+    else if((ret = spool_append(ext, tu_extension(tu), msg, len)) == 0) {
+        spool_kick(ext);
+    }
+    P(&(tu->mutex));
+    tu_notify(tu);
+    V(&(tu->mutex));
+    return ret;
+}
+
+/*
+ * Send a batch of spooled messages to the client of a TU.  The TU is locked for one
+ * message at a time, so that a client slow to take them holds up no more than that.
+ *
+ * @return the number of messages sent.
+ */
+static int tu_spool_send(void *arg, struct iovec *iov, int iovcnt) {
+    TU *tu = arg;
+    int sent = 0;
+    for(int i = 0; i < iovcnt; i += SPOOL_MSG_PARTS) {
+        P(&(tu->mutex));
+        // In the binary protocol, each message goes in a frame of its own.
+        int ret = tu->proto == PROTO_TEXT ? tu_write(tu, iov + i, SPOOL_MSG_PARTS) :
+                  tu_send(tu, PROTO_OP_MSG, 0, 0, iov + i, SPOOL_MSG_PARTS, 0, strlen(EOL));
+        V(&(tu->mutex));
+        if(ret == -1) {
+            break;
+        }
+        sent++;
+    }
+    return sent;
+}
+
+/*
+ * Deliver the messages spooled for a TU, if it is on hook or hearing dial tone (a TU
+ * that goes on hook and straight off hook again must not miss its delivery).
+ * The TU is only locked while each message is written, so it can go on serving its
+ * client while a long backlog is delivered.
+ *
+ * @param tu  The TU.
+ * @return the number of messages delivered, or -1 if an error occurs.
+ */
+int tu_deliver_spool(TU *tu) {
+    P(&(tu->mutex));
+    int idle = tu->state == TU_ON_HOOK || tu->state == TU_DIAL_TONE;
+    V(&(tu->mutex));
+    if(!idle) {
+        return 0;
+    }
+    return spool_deliver(tu_extension(tu), tu_spool_send, tu);
+}
+
+/*
+ * Get the next frame of the tone for the state of a TU, with the lock on the TU held.
+ */
+static const int16_t *tu_next_tone(TU *tu, size_t *len) {
+    int tone = tone_for_state(tu->state);
+    if(tone == -1) {
+        *len = 0;
+        return NULL;
+    }
+    return tone_frame(tone, tu->media.rate, &(tu->tone_cursor), len);
+}
+
+/*
+ * Get the next frame of the call-progress tone that a TU should be hearing in its
+ * current state.  The samples come from the buffer for the tone that is shared by
+ * all TUs, and the TU only keeps its position within the cadence, which tu_set_state()
+ * puts back at the beginning whenever the TU enters a new state.
+ *
+ * @param tu  The TU.
+ * @param len  Set to the number of samples available at the returned pointer.
+ * @return a pointer to the samples, which must not be modified, or NULL if no tone
+ * is heard in the current state.
+ */
+const int16_t *tu_tone_frame(TU *tu, size_t *len) {
+    *len = 0;
+    if(!tu) {
+        return NULL;
+    }
+    P(&(tu->mutex));
+    const int16_t *pcm = tu_next_tone(tu, len);
+    V(&(tu->mutex));
+    return pcm;
+}
+
+/*
+ * Send the client of a TU the next frame of the call-progress tone for its state.
+ * A phone streams audio for as long as it is off hook, so each frame it sends is
+ * answered with one frame of tone, and the tone keeps the pace of the phone.
+ * The caller must hold the lock on the TU.
+ *
+ * @param tu  The TU.
+ * @return 0 if a tone is heard in the current state, otherwise -1.
+ */
+static int tu_send_tone(TU *tu) {
+    if(tone_for_state(tu->state) == -1) {
+        return -1;
+    }
+    if(tu->leg || tu->proto != PROTO_BINARY) {
+        return 0;
+    }
+    size_t len;
+    const int16_t *pcm = tu_next_tone(tu, &len);
+    if(!pcm) {
+        return 0;
+    }
+    int16_t out[MEDIA_MAX_FRAME];
+    for(size_t i = 0; i < len; i++) {
+        out[i] = htons(pcm[i]);
+    }
+    struct iovec iov = { out, len * sizeof(int16_t) };
+    tu_send(tu, PROTO_OP_AUDIO, 0, 0, &iov, 1, 0, 0);
+    return 0;
+}
+
+/*
+ * Carry one frame of audio sent by the client of a TU.  In a call, the frame is relayed
+ * to the peer, if it speaks the binary protocol; while the TU rings back, it is recorded
+ * as voicemail for the extension being called, if there is a spool directory to keep it
+ * in.  In any state with a call-progress tone, the client is sent a frame of the tone
+ * in return.  Audio in a call on hold is dropped without taking any lock.
+ *
+ * @param tu  The TU whose client sent the frame.
+ * @param data  One frame of 16-bit samples in network byte order, at the rate of the TU.
+ * @param len  The length of the frame in bytes, or 0 if it was lost.
+ * @return 0 if the frame was carried or answered with a tone, -1 if it is the wrong
+ * length or there is nothing to do with it.
+ */
+int tu_audio(TU *tu, const char *data, size_t len) {
+    if(!tu || tu_on_hold(tu)) {
+        return -1;
+    }
+    size_t n = MEDIA_FRAME_SAMPLES(tu->media.rate);
+    if(len != 0 && len != n * sizeof(int16_t)) {
+        return -1;
+    }
+    int16_t frame[MEDIA_MAX_FRAME], out[MEDIA_MAX_FRAME];
+    memcpy(frame, data, len);
+    for(size_t i = 0; i < len / sizeof(int16_t); i++) {
+        frame[i] = ntohs(frame[i]);
+    }
+
+    TU *peer = tu_lock_call(tu);
+    if(tu->state == TU_RING_BACK) {
+        // The recording starts with the first frame sent, and is stopped by tu_set_state().
+        char path[PATH_MAX];
+        if(!tu->media.rec && spool_voicemail_path(tu->target->ext, tu->ext, path) == 0) {
+            media_record_start(&(tu->media), path, RECORDING_IMA_ADPCM);
+        }
+        if(tu->media.rec) {
+            media_receive(&(tu->media), len ? frame : NULL, out);
+        }
+        tu_send_tone(tu);
+        tu_unlock_all(tu, peer, NULL);
+        return 0;
+    }
+    if(tu->state != TU_CONNECTED) {
+        // A lost frame still marks the passing of one frame time.
+        int ret = tu_send_tone(tu);
+        tu_unlock_all(tu, peer, NULL);
+        return ret;
+    }
+    n = media_relay(&(tu->media), &(peer->media), len ? frame : NULL, out);
+    if(!peer->leg && peer->proto == PROTO_BINARY) {
+        for(size_t i = 0; i < n; i++) {
+            out[i] = htons(out[i]);
+        }
+        struct iovec iov = { out, n * sizeof(int16_t) };
+        tu_send(peer, PROTO_OP_AUDIO, 0, 0, &iov, 1, 0, 0);
+    }
+    V(&(tu->mutex));
+    V(&(peer->mutex));
+    return 0;
+}
+
+/*
+ * Take a snapshot of the state of a TU, for a hot restart.
+ *
+ * @param tu  The TU.
+ * @param snap  Set to the state of the TU.
+ * @param history  Set to the chat history of the call of the TU, if it has one with
+ * any messages in it, unless NULL.
+ * @return 1 if the history was set, otherwise 0.
+ */
+int tu_snapshot(TU *tu, TU_SNAPSHOT *snap, CHAT_HISTORY *history) {
+    int ret = 0;
+    P(&(tu->mutex));
+    snap->ext = tu->ext;
+    snap->state = tu->state;
+    snap->peer = tu->target ? tu->target->ext : -1;
+    snap->group = tu->group;
+    snap->park_slot = tu->park_slot;
+    snap->proto = tu->proto;
+    if(history && tu->history && tu->history->last_seq > 0) {
+        *history = *(tu->history);
+        ret = 1;
+    }
+    V(&(tu->mutex));
+    return ret;
+}
+
+/*
+ * Give a new TU, not yet registered, the state of a TU handed over on a hot restart,
+ * except for its call, which is restored by tu_restore_call() or tu_restore_lost_peer().
+ * No notification is sent, since the client already knows the state.
+ *
+ * @param tu  The TU.
+ * @param snap  The state handed over.
+ * @return 0 if successful, -1 if the state is not valid.
+ */
+int tu_restore(TU *tu, const TU_SNAPSHOT *snap) {
+    if(snap->state < TU_ON_HOOK || snap->state > TU_PARKED ||
+       (snap->proto != PROTO_TEXT && snap->proto != PROTO_BINARY)) {
+        return -1;
+    }
+    P(&(tu->mutex));
+    tu->ext = snap->ext;
+    tu_set_state(tu, snap->state);
+    tu->group = snap->group;
+    tu->proto = snap->proto;
+    if(tu->state == TU_PARKED) {
+        // As when the call was parked, the park slot holds a reference to the TU.
+        pickup_lock();
+        int ret = park_put(snap->park_slot, tu);
+        pickup_unlock();
+        if(ret == -1) {
+            V(&(tu->mutex));
+            return -1;
+        }
+        tu->park_slot = snap->park_slot;
+        __atomic_add_fetch(&(tu->ref_count), 1, __ATOMIC_RELAXED);
+    }
+    V(&(tu->mutex));
+    return 0;
+}
+
+/*
+ * Link two TUs restored on a hot restart as the parties of a call, each holding a
+ * reference to the other as on a dial.  A ringing TU goes back on the list of its
+ * pickup group, and a call in progress gets back its chat history.
+ *
+ * @param tu  One party.
+ * @param peer  The other party.
+ * @param history  The chat history of the call, or NULL if it had no messages.
+ */
+void tu_restore_call(TU *tu, TU *peer, const CHAT_HISTORY *history) {
+    tu_lock_all(tu, peer, NULL);
+    tu->target = peer;
+    peer->target = tu;
+    __atomic_add_fetch(&(tu->ref_count), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(peer->ref_count), 1, __ATOMIC_RELAXED);
+    if(tu->state == TU_RINGING || peer->state == TU_RINGING) {
+        pickup_lock();
+        pickup_ringing_add(tu->state == TU_RINGING ? tu : peer);
+        pickup_unlock();
+    }
+    else if(tu->state != TU_RING_BACK && (tu->history = peer->history = chat_history_alloc()) && history) {
+        *(tu->history) = *history;
+        tu->history->next = NULL;
+    }
+    V(&(peer->mutex));
+    V(&(tu->mutex));
+}
+
+/*
+ * Put a TU restored on a hot restart without its peer, which was not handed over, in
+ * the state it would have been left in had the peer hung up, and notify its client.
+ * A TU that was not in a call is left as it is.
+ *
+ * @param tu  The TU.
+ */
+void tu_restore_lost_peer(TU *tu) {
+    P(&(tu->mutex));
+    if(tu->state == TU_RINGING) {
+        tu_set_state(tu, TU_ON_HOOK);
+    }
+    else if(tu->state == TU_CONNECTED || tu->state == TU_RING_BACK ||
+            tu->state == TU_ON_HOLD || tu->state == TU_HELD) {
+        tu_set_state(tu, TU_DIAL_TONE);
+    }
+    else {
+        V(&(tu->mutex));
+        return;
+    }
+    tu_notify(tu);
+    V(&(tu->mutex));
+}
+
+/*
+ * Make a new TU, not yet in any call, the proxy for a party in another shard (see
+ * shard.h).  It has no client, and is never registered.
+ *
+ * @param tu  The TU, at the extension of the remote party.
+ * @param leg  The leg of the call, which goes with the TU.
+ */
+void tu_attach_leg(TU *tu, SHARD_LEG *leg) {
+    P(&(tu->mutex));
+    tu->leg = leg;
+    V(&(tu->mutex));
+}
+
+/*
+ * Turn away the call ringing on a TU, the caller going to a given state, as it would
+ * have on dialing had the call not been able to ring.  This is how a call to a party
+ * in another shard turns out to be busy.  If the TU is not ringing, there is no effect.
+ *
+ * In all cases, a notification of the resulting state of the TU is sent to its client,
+ * and the client of the caller, if any, is notified of its new state.
+ *
+ * @param tu  The ringing TU.
+ * @param state  The state of the caller: TU_ERROR, or otherwise TU_BUSY_SIGNAL.
+ * @return 0 if successful, -1 if the TU is not ringing.
+ */
+int tu_refuse(TU *tu, int state) {
+    if(!tu) {
+        return -1;
+    }
+    TU *caller = tu_lock_call(tu);
+    if(tu->state != TU_RINGING) {
+        tu_notify(tu);
+        tu_unlock_all(tu, caller, NULL);
+        return -1;
+    }
+    pickup_lock();
+    pickup_ringing_remove(tu);
+    pickup_unlock();
+    tu_set_state(tu, TU_ON_HOOK);
+    tu->target = NULL;
+    tu_set_state(caller, state == TU_ERROR ? TU_ERROR : TU_BUSY_SIGNAL);
+    caller->target = NULL;
+    tu_notify(tu);
+    tu_notify(caller);
+    spool_kick(tu->ext);
+    V(&(caller->mutex));
+    V(&(tu->mutex));
+    tu_unref(caller, "Call turned away.");
+    tu_unref(tu, "Turned call away.");
+    return 0;
+}
@@ -0,0 +1,795 @@
+/*
+ * UDP signaling transport: the sessions of phones registered over UDP, all served by
+ * one thread.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+
+#include "udp.h"
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "server_ext.h"
+#include "tu_ext.h"
+#include "handoff.h"
+#include "mirror.h"
+#include "admission.h"
+#include "metrics.h"
+#include "debug.h"
+#include "csapp.h"
+
+_Static_assert(MIRROR_SLOTS == UDP_MAX_SESSIONS, "A mirror slot for every session slot");
+
+/*
+ * Nanoseconds per millisecond, for the times kept by rate_clock().
+ */
+#define UDP_NSEC_PER_MS 1000000ULL
+
+/*
+ * The socket of the transport.
+ */
+static int udp_fd = -1;
+
+/*
+ * The sessions, indexed by the low 16 bits of their tokens, and a circular list of them.
+ * Only the serving thread uses these.
+ */
+static UDP_SESSION *udp_sessions[UDP_MAX_SESSIONS];
+static UDP_SESSION *udp_list;
+static int udp_num_sessions;
+static uint32_t udp_next_slot;
+
+/*
+ * Sessions that have datagrams to be sent at the end of the current batch, linked
+ * through their flush_next fields.
+ */
+static UDP_SESSION *udp_touched;
+
+/*
+ * Set on the serving thread, whose writes to a session are sent all at once at the end
+ * of each batch.
+ */
+static __thread int udp_serving;
+
+/*
+ * Key of the cookies that phones must echo to register, drawn when the thread starts.
+ */
+static uint64_t udp_cookie_key[2];
+
+/*
+ * Datagrams to be sent by the next sendmmsg() call.
+ */
+static struct mmsghdr udp_out_msgs[UDP_BATCH];
+static struct iovec udp_out_iov[UDP_BATCH][2];
+static UDP_HEADER udp_out_headers[UDP_BATCH];
+static int udp_out_count;
+
+static void udp_header_pack(UDP_HEADER *h, uint32_t token, uint32_t seq, uint32_t ack) {
+    h->token = htonl(token);
+    h->seq = htonl(seq);
+    h->ack = htonl(ack);
+}
+
+/*
+ * Put a session on the list of sessions to be flushed at the end of the current batch.
+ */
+static void udp_touch(UDP_SESSION *s) {
+    if(!s->touched) {
+        s->touched = 1;
+        s->flush_next = udp_touched;
+        udp_touched = s;
+    }
+}
+
+/*
+ * Send the datagrams gathered for sending.  A datagram that cannot be sent is dropped,
+ * and left to be sent again like any other lost datagram.
+ */
+static void udp_send_batch(void) {
+    int sent = 0;
+    while(sent < udp_out_count) {
+        int n = sendmmsg(udp_fd, udp_out_msgs + sent, udp_out_count - sent, MSG_DONTWAIT);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        sent += n > 0 ? n : 1;
+    }
+    udp_out_count = 0;
+}
+
+/*
+ * Gather a datagram to an address for sending.  The address and the payload must stay
+ * put until it has been sent.
+ */
+static void udp_out_to(struct sockaddr_storage *addr, socklen_t addrlen, uint32_t token,
+                       uint32_t seq, uint32_t ack, void *data, size_t len) {
+    if(udp_out_count == UDP_BATCH) {
+        udp_send_batch();
+    }
+    int i = udp_out_count++;
+    udp_header_pack(&udp_out_headers[i], token, seq, ack);
+    udp_out_iov[i][0].iov_base = &udp_out_headers[i];
+    udp_out_iov[i][0].iov_len = sizeof(UDP_HEADER);
+    udp_out_iov[i][1].iov_base = data;
+    udp_out_iov[i][1].iov_len = len;
+    struct msghdr *msg = &(udp_out_msgs[i].msg_hdr);
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = addr;
+    msg->msg_namelen = addrlen;
+    msg->msg_iov = udp_out_iov[i];
+    msg->msg_iovlen = 2;
+}
+
+/*
+ * Gather a datagram to a session for sending.  The payload must stay put until it
+ * has been sent.
+ */
+static void udp_out(UDP_SESSION *s, uint32_t seq, void *data, size_t len) {
+    udp_out_to(&(s->addr), s->addrlen, s->token, seq, s->received, data, len);
+}
+
+#define UDP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define UDP_SIPROUND(v0, v1, v2, v3) do {                                    \
+        v0 += v1; v1 = UDP_ROTL(v1, 13); v1 ^= v0; v0 = UDP_ROTL(v0, 32);    \
+        v2 += v3; v3 = UDP_ROTL(v3, 16); v3 ^= v2;                           \
+        v0 += v3; v3 = UDP_ROTL(v3, 21); v3 ^= v0;                           \
+        v2 += v1; v1 = UDP_ROTL(v1, 17); v1 ^= v2; v2 = UDP_ROTL(v2, 32);    \
+    } while(0)
+
+/*
+ * Hash bytes with a key, by SipHash-2-4, so that the hash cannot be forged by whoever
+ * does not know the key.
+ */
+static uint64_t udp_siphash(const uint64_t key[2], const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL, v1 = key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL, v3 = key[1] ^ 0x7465646279746573ULL;
+    uint64_t m;
+    for(size_t i = 0; i + 8 <= len; i += 8) {
+        memcpy(&m, p + i, 8);
+        v3 ^= m;
+        UDP_SIPROUND(v0, v1, v2, v3);
+        UDP_SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    // The last bytes, with the length in the top byte.
+    m = (uint64_t)len << 56;
+    for(size_t i = len & ~(size_t)7; i < len; i++) {
+        m |= (uint64_t)p[i] << (8 * (i & 7));
+    }
+    v3 ^= m;
+    UDP_SIPROUND(v0, v1, v2, v3);
+    UDP_SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+    v2 ^= 0xff;
+    for(int i = 0; i < 4; i++) {
+        UDP_SIPROUND(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * Compute the cookie for an address in a period of UDP_COOKIE_MS, which is never 0.
+ */
+static uint32_t udp_cookie(struct sockaddr_storage *addr, socklen_t addrlen, uint64_t period) {
+    char buf[sizeof(period) + sizeof(struct sockaddr_storage)];
+    memcpy(buf, &period, sizeof(period));
+    memcpy(buf + sizeof(period), addr, addrlen);
+    uint32_t cookie = udp_siphash(udp_cookie_key, buf, sizeof(period) + addrlen);
+    return cookie ? cookie : 1;
+}
+
+/*
+ * Check the cookie echoed by a phone registering from an address, which may have been
+ * given out in this period or in the one before.  If it is not valid, the phone is
+ * sent the cookie to echo, in a datagram no larger than the one it sent, and nothing
+ * is kept of it.
+ *
+ * @return 1 if the cookie is valid, 0 otherwise.
+ */
+static int udp_check_cookie(struct sockaddr_storage *addr, socklen_t addrlen, uint32_t cookie,
+                            uint64_t now) {
+    uint64_t period = now / (UDP_COOKIE_MS * UDP_NSEC_PER_MS);
+    if(cookie != 0 && (cookie == udp_cookie(addr, addrlen, period) ||
+                       cookie == udp_cookie(addr, addrlen, period - 1))) {
+        return 1;
+    }
+    udp_out_to(addr, addrlen, 0, 0, udp_cookie(addr, addrlen, period), NULL, 0);
+    return 0;
+}
+
+/*
+ * Write a session to the mirror, if there is one.
+ */
+static void udp_mirror(UDP_SESSION *s) {
+    if(!mirror_enabled()) {
+        return;
+    }
+    // Changes made from here on mark the session to be written again.
+    P(&(s->mutex));
+    s->dirty = 0;
+    V(&(s->mutex));
+    MIRROR_SLOT m;
+    memset(&m, 0, sizeof(m));
+    tu_snapshot(s->tu, &(m.tu), NULL);
+    P(&(s->mutex));
+    m.next_seq = s->next_seq;
+    m.acked = s->acked;
+    V(&(s->mutex));
+    m.used = 1;
+    m.token = s->token;
+    m.received = s->received;
+    m.addrlen = s->addrlen;
+    memcpy(&(m.addr), &(s->addr), s->addrlen);
+    mirror_write(s->token, &m);
+}
+
+/*
+ * Send out the datagrams of the sessions touched in the current batch: those queued
+ * for sending, or else an ack, if one is owed.
+ */
+static void udp_flush(uint64_t now) {
+    while(udp_touched) {
+        UDP_SESSION *s = udp_touched;
+        udp_touched = s->flush_next;
+        s->touched = 0;
+        int sent = 0;
+        P(&(s->mutex));
+        for(uint32_t seq = s->acked + 1; s->queued > 0 && seq < s->next_seq; seq++) {
+            UDP_SEGMENT *seg = s->window[seq % UDP_WINDOW];
+            if(seg->queued) {
+                // Once no longer queued, the segment is not written to by other threads.
+                seg->queued = 0;
+                s->queued--;
+                seg->tries++;
+                seg->sent_at = now;
+                udp_out(s, seq, seg->data, seg->len);
+                sent = 1;
+            }
+        }
+        V(&(s->mutex));
+        if(!sent && s->ack_pending) {
+            udp_out(s, 0, NULL, 0);
+        }
+        s->ack_pending = 0;
+        udp_mirror(s);
+    }
+    udp_send_batch();
+}
+
+/*
+ * Write all of the data described by an I/O vector to the phone of a session.  The data
+ * is appended to the last datagram not yet sent, if there is one, and otherwise put in
+ * new datagrams.  On the serving thread, or behind datagrams still waiting for it, they
+ * wait to be sent at the end of the current batch; otherwise they are sent at once.
+ *
+ * @return 0 if successful, -1 if the session has ended, or has too many datagrams
+ * that the phone has not acked, in which case it is ended.
+ */
+int udp_session_send(UDP_SESSION *s, struct iovec *iov, int iovcnt) {
+    P(&(s->mutex));
+    if(s->closed) {
+        V(&(s->mutex));
+        return -1;
+    }
+    int defer = udp_serving || s->queued > 0;
+    UDP_SEGMENT *seg = s->next_seq - 1 > s->acked ? s->window[(s->next_seq - 1) % UDP_WINDOW] : NULL;
+    if(seg && !seg->queued) {
+        seg = NULL;
+    }
+    size_t done = 0;
+    for(int i = 0; i < iovcnt; ) {
+        if(!seg || seg->len == UDP_MAX_PAYLOAD) {
+            if(s->next_seq - 1 - s->acked >= UDP_WINDOW || !(seg = malloc(sizeof(UDP_SEGMENT)))) {
+                // The phone is not keeping up; the session ends at the next sweep.
+                s->closed = 1;
+                V(&(s->mutex));
+                return -1;
+            }
+            seg->seq = s->next_seq++;
+            seg->len = 0;
+            seg->queued = 1;
+            seg->tries = 0;
+            seg->sent_at = 0;
+            s->window[seg->seq % UDP_WINDOW] = seg;
+            s->queued++;
+        }
+        size_t n = iov[i].iov_len - done;
+        if(n > UDP_MAX_PAYLOAD - seg->len) {
+            n = UDP_MAX_PAYLOAD - seg->len;
+        }
+        memcpy(seg->data + seg->len, (char *)iov[i].iov_base + done, n);
+        seg->len += n;
+        done += n;
+        if(done == iov[i].iov_len) {
+            i++;
+            done = 0;
+        }
+    }
+    s->dirty = 1;
+    if(defer) {
+        if(udp_serving) {
+            udp_touch(s);
+        }
+        V(&(s->mutex));
+        return 0;
+    }
+
+    // Nothing was waiting, so the queued datagrams are all those just filled.
+    uint64_t now = rate_clock();
+    for(uint32_t seq = s->acked + 1; s->queued > 0 && seq < s->next_seq; seq++) {
+        seg = s->window[seq % UDP_WINDOW];
+        if(!seg->queued) {
+            continue;
+        }
+        UDP_HEADER h;
+        udp_header_pack(&h, s->token, seq, __atomic_load_n(&(s->received), __ATOMIC_RELAXED));
+        struct iovec out[2] = { { &h, sizeof(h) }, { seg->data, seg->len } };
+        struct msghdr msg = { 0 };
+        msg.msg_name = &(s->addr);
+        msg.msg_namelen = s->addrlen;
+        msg.msg_iov = out;
+        msg.msg_iovlen = 2;
+        sendmsg(udp_fd, &msg, MSG_DONTWAIT);
+        seg->queued = 0;
+        s->queued--;
+        seg->tries++;
+        seg->sent_at = now;
+    }
+    V(&(s->mutex));
+    return 0;
+}
+
+/*
+ * Free a session, once its TU is gone.
+ */
+void udp_session_free(UDP_SESSION *s) {
+    for(int i = 0; i < UDP_WINDOW; i++) {
+        free(s->window[i]);
+    }
+    Sem_destroy(&(s->mutex));
+    free(s);
+}
+
+/*
+ * Drop the datagrams of a session that the phone has acked.
+ */
+static void udp_ack(UDP_SESSION *s, uint32_t ack) {
+    P(&(s->mutex));
+    if(ack > s->acked && ack < s->next_seq) {
+        for(uint32_t seq = s->acked + 1; seq <= ack; seq++) {
+            UDP_SEGMENT *seg = s->window[seq % UDP_WINDOW];
+            if(seg->queued) {
+                s->queued--;
+            }
+            free(seg);
+            s->window[seq % UDP_WINDOW] = NULL;
+        }
+        s->acked = ack;
+        s->dirty = 1;
+    }
+    V(&(s->mutex));
+}
+
+/*
+ * Add a session to the table and the list of sessions.
+ */
+static void udp_link(UDP_SESSION *s) {
+    udp_sessions[s->token % UDP_MAX_SESSIONS] = s;
+    if(udp_list) {
+        s->next = udp_list;
+        s->prev = udp_list->prev;
+        s->prev->next = s;
+        udp_list->prev = s;
+    }
+    else {
+        udp_list = s->prev = s->next = s;
+    }
+    udp_num_sessions++;
+}
+
+/*
+ * Start a session for a phone, plugging a new virtual TU into the PBX for it.
+ *
+ * @return the session, or NULL if there is no room for it.
+ */
+static UDP_SESSION *udp_register(struct sockaddr_storage *addr, socklen_t addrlen, uint64_t now) {
+    // Under overload, the phone goes unanswered, and sends its first datagram again.
+    if(udp_num_sessions == UDP_MAX_SESSIONS || admission_admit()) {
+        return NULL;
+    }
+    uint32_t slot = udp_next_slot;
+    while(udp_sessions[slot]) {
+        slot = (slot + 1) % UDP_MAX_SESSIONS;
+    }
+    // The high bits of the token are random, so that it cannot be guessed from the slot.
+    uint16_t r;
+    if(getrandom(&r, sizeof(r), 0) != sizeof(r) || r == 0) {
+        r = 1;
+    }
+    UDP_SESSION *s = malloc(sizeof(UDP_SESSION));
+    if(!s) {
+        return NULL;
+    }
+    memset(s, 0, sizeof(UDP_SESSION));
+    s->token = (uint32_t)r << 16 | slot;
+    memcpy(&(s->addr), addr, addrlen);
+    s->addrlen = addrlen;
+    s->received = 1;
+    s->ack_pending = 1;
+    s->last_heard = now;
+    Sem_init(&(s->mutex), 0, 1);
+    s->next_seq = 1;
+    if(!(s->tu = tu_init(udp_fd))) {
+        Sem_destroy(&(s->mutex));
+        free(s);
+        return NULL;
+    }
+    tu_attach_udp(s->tu, s);
+    int ext = pbx_register_virtual(pbx, s->tu);
+    if(ext == -1) {
+        // The TU takes the session with it.
+        tu_unref(s->tu, "Virtual extensions exhausted.");
+        return NULL;
+    }
+    rate_limits_init(&(s->rl), ext);
+    udp_touch(s);
+    udp_link(s);
+    udp_next_slot = (slot + 1) % UDP_MAX_SESSIONS;
+    return s;
+}
+
+/*
+ * End a session, unplugging its TU from the PBX.  The session goes with the TU, which
+ * may still be in a call for a while, so it must not be used afterwards.
+ */
+static void udp_end(UDP_SESSION *s) {
+    udp_sessions[s->token % UDP_MAX_SESSIONS] = NULL;
+    if(mirror_enabled()) {
+        mirror_clear(s->token);
+    }
+    if(s->next == s) {
+        udp_list = NULL;
+    }
+    else {
+        s->prev->next = s->next;
+        s->next->prev = s->prev;
+        if(udp_list == s) {
+            udp_list = s->next;
+        }
+    }
+    udp_num_sessions--;
+    if(s->touched) {
+        UDP_SESSION **p = &udp_touched;
+        while(*p != s) {
+            p = &((*p)->flush_next);
+        }
+        *p = s->flush_next;
+    }
+    P(&(s->mutex));
+    s->closed = 1;
+    V(&(s->mutex));
+    pbx_unregister(pbx, s->tu);
+}
+
+/*
+ * Handle a datagram received from a phone.  Each complete line of its payload is
+ * carried out as a command, as if it had come from a connection.
+ *
+ * @param buf  The datagram, with room for one more byte after it.
+ */
+static void udp_receive(char *buf, size_t len, struct sockaddr_storage *addr, socklen_t addrlen,
+                        uint64_t now) {
+    UDP_HEADER h;
+    if(len < sizeof(h)) {
+        return;
+    }
+    memcpy(&h, buf, sizeof(h));
+    h.token = ntohl(h.token);
+    h.seq = ntohl(h.seq);
+    h.ack = ntohl(h.ack);
+
+    UDP_SESSION *s;
+    if(h.token == 0) {
+        if(h.seq != 1 || !udp_check_cookie(addr, addrlen, h.ack, now) ||
+           !(s = udp_register(addr, addrlen, now))) {
+            return;
+        }
+    }
+    else {
+        s = udp_sessions[h.token % UDP_MAX_SESSIONS];
+        if(!s || s->token != h.token || s->addrlen != addrlen || memcmp(&(s->addr), addr, addrlen)) {
+            return;
+        }
+        s->last_heard = now;
+        udp_ack(s, h.ack);
+        // Even a keepalive gets an answer, so that the phone knows the server is there.
+        s->ack_pending = 1;
+        udp_touch(s);
+        if(h.seq != s->received + 1 && !(s->resync && h.seq > s->received)) {
+            return;
+        }
+        s->resync = 0;
+        __atomic_store_n(&(s->received), h.seq, __ATOMIC_RELAXED);
+    }
+
+    char *line = buf + sizeof(h);
+    char *end = buf + len;
+    char *eol;
+    while(line < end && (eol = memchr(line, '\n', end - line))) {
+        char *next = eol + 1;
+        if(eol > line && eol[-1] == '\r') {
+            eol--;
+        }
+        *eol = '\0';
+        pbx_serve_line(s->tu, &(s->rl), line, eol - line);
+        line = next;
+    }
+}
+
+/*
+ * Resend the datagrams of each session that have not been acked in time, and end the
+ * sessions that have failed or from which nothing has been heard for too long.
+ */
+static void udp_sweep(uint64_t now) {
+    UDP_SESSION *s = udp_list;
+    for(int n = udp_num_sessions; n > 0; n--) {
+        UDP_SESSION *next = s->next;
+        int end = now - s->last_heard >= UDP_SESSION_TIMEOUT_MS * UDP_NSEC_PER_MS;
+        int resend = 0;
+        P(&(s->mutex));
+        end |= s->closed;
+        int dirty = s->dirty;
+        for(uint32_t seq = s->acked + 1; !end && seq < s->next_seq; seq++) {
+            UDP_SEGMENT *seg = s->window[seq % UDP_WINDOW];
+            if(seg->queued || now - seg->sent_at < UDP_RTO_MS * UDP_NSEC_PER_MS) {
+                continue;
+            }
+            if(seg->tries >= UDP_MAX_TRIES) {
+                end = 1;
+                break;
+            }
+            seg->queued = 1;
+            s->queued++;
+            resend++;
+        }
+        V(&(s->mutex));
+        if(end) {
+            metrics_add(METRIC_UDP_SESSIONS_EXPIRED, 1);
+            udp_end(s);
+        }
+        else if(resend) {
+            metrics_add(METRIC_UDP_RETRANSMITS, resend);
+            udp_touch(s);
+        }
+        else if(dirty) {
+            // Changed by another thread, whose datagrams did not wait for this one.
+            udp_mirror(s);
+        }
+        s = next;
+    }
+}
+
+/*
+ * Take up a session found in the mirror, plugging its TU back into the PBX at its
+ * extension.  Datagrams to the phone that it has not acked are lost, so they are
+ * replaced by ones with empty payloads, which keep the sequence unbroken.
+ *
+ * @return the session, or NULL if the slot is not valid or the session cannot be set up.
+ */
+static UDP_SESSION *udp_restore(uint32_t slot, const MIRROR_SLOT *m, uint64_t now) {
+    if(m->token % UDP_MAX_SESSIONS != slot || m->token == 0 || m->addrlen > sizeof(m->addr) ||
+       m->next_seq == 0 || m->acked >= m->next_seq || m->next_seq - 1 - m->acked >= UDP_WINDOW ||
+       m->tu.ext < PBX_VIRTUAL_BASE || m->tu.ext >= PBX_MAX_REGISTERED) {
+        return NULL;
+    }
+    UDP_SESSION *s = malloc(sizeof(UDP_SESSION));
+    if(!s) {
+        return NULL;
+    }
+    memset(s, 0, sizeof(UDP_SESSION));
+    s->token = m->token;
+    memcpy(&(s->addr), &(m->addr), m->addrlen);
+    s->addrlen = m->addrlen;
+    s->received = m->received;
+    s->resync = 1;
+    s->last_heard = now;
+    Sem_init(&(s->mutex), 0, 1);
+    s->next_seq = m->next_seq;
+    s->acked = m->acked;
+    s->dirty = 1;
+    for(uint32_t seq = s->acked + 1; seq < s->next_seq; seq++) {
+        UDP_SEGMENT *seg = calloc(1, sizeof(UDP_SEGMENT));
+        if(!seg) {
+            udp_session_free(s);
+            return NULL;
+        }
+        seg->seq = seq;
+        seg->queued = 1;
+        s->window[seq % UDP_WINDOW] = seg;
+        s->queued++;
+    }
+    if(!(s->tu = tu_init(udp_fd))) {
+        udp_session_free(s);
+        return NULL;
+    }
+    tu_attach_udp(s->tu, s);
+    if(tu_restore(s->tu, &(m->tu)) == -1 || pbx_restore(pbx, s->tu) == -1) {
+        // The TU takes the session with it.
+        tu_unref(s->tu, "Mirrored session not valid.");
+        return NULL;
+    }
+    rate_limits_init(&(s->rl), m->tu.ext);
+    udp_touch(s);
+    udp_link(s);
+    return s;
+}
+
+/*
+ * Take up the sessions left in the mirror by the server that ran before, and the calls
+ * between them.  A call with a party that is gone ends, as if it had hung up.  Every
+ * phone is then sent the state of its TU, since what was last sent to it may be lost.
+ */
+static void udp_recover(uint64_t now) {
+    static MIRROR_SLOT m;
+    UDP_SESSION **by_ext = calloc(PBX_MAX_REGISTERED - PBX_VIRTUAL_BASE, sizeof(UDP_SESSION *));
+    int32_t *peers = malloc(UDP_MAX_SESSIONS * sizeof(int32_t));
+    if(!by_ext || !peers) {
+        free(by_ext);
+        free(peers);
+        return;
+    }
+    int count = 0;
+    for(uint32_t slot = 0; slot < UDP_MAX_SESSIONS; slot++) {
+        int ret = mirror_read(slot, &m);
+        // A torn or stale slot may hold any extension, so it is checked before use.
+        int valid = ret == 1 && m.tu.ext >= PBX_VIRTUAL_BASE && m.tu.ext < PBX_MAX_REGISTERED;
+        UDP_SESSION *s = valid && !by_ext[m.tu.ext - PBX_VIRTUAL_BASE] ? udp_restore(slot, &m, now) : NULL;
+        if(s) {
+            by_ext[m.tu.ext - PBX_VIRTUAL_BASE] = s;
+            peers[slot] = m.tu.peer;
+            count++;
+        }
+        else if(ret != 0) {
+            mirror_clear(slot);
+        }
+    }
+    UDP_SESSION *s = udp_list;
+    for(int n = udp_num_sessions; n > 0; n--, s = s->next) {
+        int ext = tu_extension(s->tu);
+        int peer = peers[s->token % UDP_MAX_SESSIONS];
+        UDP_SESSION *p = peer >= PBX_VIRTUAL_BASE && peer < PBX_MAX_REGISTERED ? by_ext[peer - PBX_VIRTUAL_BASE] : NULL;
+        if(peer == -1) {
+            tu_notify_state(s->tu);
+        }
+        else if(p && peers[p->token % UDP_MAX_SESSIONS] == ext) {
+            // Each call is linked once, from the party with the lower extension.
+            if(ext < peer) {
+                tu_restore_call(s->tu, p->tu, NULL);
+                tu_notify_state(s->tu);
+                tu_notify_state(p->tu);
+            }
+        }
+        else {
+            tu_restore_lost_peer(s->tu);
+        }
+    }
+    free(by_ext);
+    free(peers);
+    metrics_add(METRIC_UDP_SESSIONS_RECOVERED, count);
+}
+
+/*
+ * Thread function for the thread that serves all of the sessions.  It runs until the
+ * socket is shut down, by pbx_shutdown(), and then ends all of the sessions.
+ */
+static void *udp_thread(void *arg) {
+    Pthread_detach(pthread_self());
+    udp_serving = 1;
+    if(getrandom(udp_cookie_key, sizeof(udp_cookie_key), 0) != sizeof(udp_cookie_key)) {
+        udp_cookie_key[0] = rate_clock();
+        udp_cookie_key[1] = (uint64_t)getpid() * 0x9e3779b97f4a7c15ULL;
+    }
+    if(mirror_enabled()) {
+        udp_recover(rate_clock());
+    }
+    static char bufs[UDP_BATCH][sizeof(UDP_HEADER) + UDP_MAX_PAYLOAD + 1];
+    static struct sockaddr_storage addrs[UDP_BATCH];
+    static struct mmsghdr msgs[UDP_BATCH];
+    static struct iovec iov[UDP_BATCH];
+    // On a hot restart, the thread stops where it waits, leaving the datagrams still to
+    // come to the next server.  The sessions themselves are not handed over.
+    HANDOFF_CONN conn = { 0 };
+    handoff_join(&conn);
+    uint64_t next_tick = rate_clock() + UDP_TICK_MS * UDP_NSEC_PER_MS;
+    while(1) {
+        uint64_t now = rate_clock();
+        int timeout = next_tick > now ? (next_tick - now + UDP_NSEC_PER_MS - 1) / UDP_NSEC_PER_MS : 0;
+        struct pollfd pfd = { udp_fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout);
+        if(ready == -1 && errno == EINTR) {
+            handoff_park(&conn);
+            continue;
+        }
+        if(ready > 0 && (pfd.revents & POLLHUP)) {
+            break;
+        }
+        if(ready > 0) {
+            // One byte is kept back in each buffer, to terminate the last line.
+            for(int i = 0; i < UDP_BATCH; i++) {
+                iov[i].iov_base = bufs[i];
+                iov[i].iov_len = sizeof(bufs[i]) - 1;
+                memset(&(msgs[i].msg_hdr), 0, sizeof(struct msghdr));
+                msgs[i].msg_hdr.msg_name = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int n = recvmmsg(udp_fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+            now = rate_clock();
+            for(int i = 0; i < n; i++) {
+                if(!(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+                    udp_receive(bufs[i], msgs[i].msg_len, &addrs[i], msgs[i].msg_hdr.msg_namelen, now);
+                }
+            }
+            udp_flush(now);
+        }
+        if(now >= next_tick) {
+            udp_sweep(now);
+            udp_flush(now);
+            next_tick = now + UDP_TICK_MS * UDP_NSEC_PER_MS;
+        }
+    }
+    handoff_leave(&conn);
+    while(udp_list) {
+        udp_end(udp_list);
+    }
+    return NULL;
+}
+
+/*
+ * Open the socket of the transport on a UDP port.
+ *
+ * @param port  The port.
+ * @return the socket, or -1 if the port cannot be bound.
+ */
+int udp_open(const char *port) {
+    struct addrinfo hints = { 0 };
+    struct addrinfo *list, *p;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if(getaddrinfo(NULL, port, &hints, &list) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for(p = list; p; p = p->ai_next) {
+        if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            continue;
+        }
+        if(bind(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+/*
+ * Start the thread that serves phones on the socket of the transport.
+ *
+ * @param fd  The socket, as opened by udp_open() here or in the server that ran before.
+ */
+void udp_start(int fd) {
+    udp_fd = fd;
+    pthread_t tid;
+    Pthread_create(&tid, NULL, udp_thread, NULL);
+}
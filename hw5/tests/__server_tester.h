@@ -0,0 +1,28 @@
+#ifndef SERVER_TESTER_H
+#define SERVER_TESTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "udp.h"
+
+/*
+ * Helpers for tests that run the server and talk to it over sockets (server_tester.c).
+ * Anything that goes wrong fails the test that called the helper.
+ */
+void kill_servers(void);
+int start_server(char *port, ...);
+void stop_server(int *pid);
+int connect_tu(int port);
+void read_fully(int fd, void *buf, size_t len);
+int try_read_line(int fd, char *line, size_t size);
+void read_line(int fd, char *line, size_t size);
+int expect(int fd, char *prefix);
+void call(int a, int b, int ext_b);
+int connect_udp(int port);
+void put_datagram(int fd, uint32_t token, uint32_t seq, uint32_t ack, const char *payload);
+int get_datagram(int fd, UDP_HEADER *h, char *payload);
+void register_udp(int fd, UDP_HEADER *h, char *payload);
+void expect_datagram(int fd, uint32_t seq, UDP_HEADER *h, char *payload);
+
+#endif /* SERVER_TESTER_H */
@@ -0,0 +1,78 @@
+/*
+ * Tests of admission control: a server that turns away new clients once it has as
+ * many as its limit, while the calls of those it has go on.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+#include "admission.h"
+
+static int server_pid;
+
+static void init() {
+    kill_servers();
+    server_pid = start_server(SERVER_PORT_STR, "-O", "2", NULL);
+}
+
+static void fini() {
+    stop_server(&server_pid);
+}
+
+Test(admission_suite, config_test) {
+    cr_assert_eq(admission_config("100"), 0);
+    cr_assert_eq(admission_config("100:64:50:512"), 0);
+    cr_assert_eq(admission_config("0:0:20"), 0);
+    cr_assert_eq(admission_config(""), -1);
+    cr_assert_eq(admission_config("100:"), -1);
+    cr_assert_eq(admission_config("-1"), -1);
+    cr_assert_eq(admission_config("1:2:3:4:5"), -1);
+}
+
+Test(admission_suite, overload_test, .init = init, .fini = fini, .timeout = 30) {
+    int a = connect_tu(SERVER_PORT);
+    expect(a, "ON HOOK ");
+    int b = connect_tu(SERVER_PORT);
+    int ext_b = expect(b, "ON HOOK ");
+    call(a, b, ext_b);
+
+    // At its limit, the server turns a new client away, with a time to try again.
+    usleep(3 * ADMISSION_INTERVAL_MS * 1000);
+    char line[256];
+    int c = connect_tu(SERVER_PORT);
+    read_line(c, line, sizeof(line));
+    cr_assert_eq(strncmp(line, "OVERLOAD ", 9), 0, "Expected 'OVERLOAD', got '%s'", line);
+    cr_assert_geq(atoi(line + 9), ADMISSION_HOLD_MS);
+    cr_assert_eq(read(c, line, 1), 0, "Connection was not closed");
+    close(c);
+
+    // The call in progress goes on, chat included.
+    dprintf(a, "chat still here\r\n");
+    expect(a, "CONNECTED ");
+    expect(b, "chat still here");
+    dprintf(a, "hangup\r\n");
+    expect(a, "ON HOOK ");
+    expect(b, "DIAL TONE");
+
+    // Once a client leaves, new ones are taken again.
+    close(b);
+    int admitted = 0;
+    for(int i = 0; i < 50 && !admitted; i++) {
+	c = connect_tu(SERVER_PORT);
+	admitted = try_read_line(c, line, sizeof(line)) == 0 && !strncmp(line, "ON HOOK ", 8);
+	close(c);
+	if(!admitted)
+	    usleep(100000);
+    }
+    cr_assert(admitted, "New clients were never taken again");
+    close(a);
+}
@@ -0,0 +1,441 @@
+/*
+ * Tests of chat relay between connected TUs, checking the text that is delivered,
+ * which the scripted tests do not look at.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+
+static int server_pid;
+
+static void init() {
+    kill_servers();
+    server_pid = start_server(SERVER_PORT_STR, NULL);
+}
+
+#define SHORT_LINE 1024
+static void init_short_lines() {
+    kill_servers();
+    server_pid = start_server(SERVER_PORT_STR, "-l", QUOTE(SHORT_LINE), NULL);
+}
+
+static void fini() {
+    stop_server(&server_pid);
+}
+
+/*
+ * Read one line from a TU connection through a stream, including the EOL.
+ */
+static char *read_message(FILE *in) {
+    char *line = NULL;
+    size_t size = 0;
+    cr_assert(getline(&line, &size, in) > 0, "Connection closed unexpectedly\n");
+    return line;
+}
+
+/*
+ * Skip notifications until one starting with the given prefix, returning its argument.
+ */
+static int skip_to(FILE *in, char *prefix) {
+    while(1) {
+	char *line = read_message(in);
+	if(!strncmp(line, prefix, strlen(prefix))) {
+	    int arg = atoi(line + strlen(prefix));
+	    free(line);
+	    return arg;
+	}
+	free(line);
+    }
+}
+
+/*
+ * Connect two TUs and set up a call between them.
+ */
+static void setup_call(int *a, int *b, FILE **ain, FILE **bin) {
+    *a = connect_tu(SERVER_PORT);
+    *b = connect_tu(SERVER_PORT);
+    *ain = fdopen(dup(*a), "r");
+    *bin = fdopen(dup(*b), "r");
+    skip_to(*ain, "ON HOOK");
+    int ext = skip_to(*bin, "ON HOOK");
+    dprintf(*a, "pickup\r\n");
+    skip_to(*ain, "DIAL TONE");
+    dprintf(*a, "dial %d\r\n", ext);
+    skip_to(*bin, "RINGING");
+    dprintf(*b, "pickup\r\n");
+    skip_to(*bin, "CONNECTED");
+    skip_to(*ain, "CONNECTED");
+}
+
+Test(chat_suite, large_chat_test, .init = init, .fini = fini, .timeout = 30) {
+    int a, b;
+    FILE *ain, *bin;
+    setup_call(&a, &b, &ain, &bin);
+
+    // A message much larger than any single read, sent in pieces.
+    size_t len = 300000;
+    char *msg = malloc(len + 1);
+    for(size_t i = 0; i < len; i++)
+	msg[i] = 'a' + (i * 7) % 26;
+    msg[len] = '\0';
+    msg[len / 2] = ' ';
+    dprintf(a, "chat ");
+    for(size_t off = 0; off < len; off += 65536) {
+	size_t n = len - off < 65536 ? len - off : 65536;
+	cr_assert_eq(write(a, msg + off, n), n);
+	usleep(1000);
+    }
+    dprintf(a, "\r\n");
+
+    char *line = read_message(bin);
+    cr_assert_eq(strlen(line), len + 7, "Chat of length %zu relayed as %zu bytes\n", len + 7, strlen(line));
+    cr_assert(!strncmp(line, "chat ", 5), "Chat prefix missing\n");
+    cr_assert(!memcmp(line + 5, msg, len), "Chat text was altered\n");
+    cr_assert(!strcmp(line + 5 + len, "\r\n"), "Chat EOL missing\n");
+    skip_to(ain, "CONNECTED");
+    free(line);
+    free(msg);
+}
+
+Test(chat_suite, pipelined_chat_test, .init = init, .fini = fini, .timeout = 30) {
+    int a, b;
+    FILE *ain, *bin;
+    setup_call(&a, &b, &ain, &bin);
+
+    // Several commands arriving in one segment are each relayed intact and in order.
+    dprintf(a, "chat one\r\nchat\r\nchat two three\r\nchat  four \r\n");
+    char *expected[] = { "chat one\r\n", "chat \r\n", "chat two three\r\n", "chat  four \r\n" };
+    for(int i = 0; i < 4; i++) {
+	char *line = read_message(bin);
+	cr_assert_str_eq(line, expected[i]);
+	free(line);
+    }
+}
+
+Test(chat_suite, chat_frame_test, .init = init_short_lines, .fini = fini, .timeout = 30) {
+    int a, b;
+    FILE *ain, *bin;
+    setup_call(&a, &b, &ain, &bin);
+
+    // A frame much longer than the line limit, with EOLs in it, arrives intact in pieces.
+    size_t len = 100 * SHORT_LINE;
+    char *msg = malloc(len);
+    for(size_t i = 0; i < len; i++)
+	msg[i] = i % 100 == 98 ? '\r' : i % 100 == 99 ? '\n' : 'a' + i % 26;
+    dprintf(a, "chatf %zu\r\n", len);
+    for(size_t off = 0; off < len; off += 10000) {
+	size_t n = len - off < 10000 ? len - off : 10000;
+	cr_assert_eq(write(a, msg + off, n), n);
+	usleep(1000);
+    }
+    dprintf(a, "chat after\r\n");
+
+    char *buf = malloc(len);
+    size_t got = 0, more;
+    do {
+	size_t n;
+	char *line = read_message(bin);
+	cr_assert_eq(sscanf(line, "chatf %zu %zu\r\n", &n, &more), 2, "Bad frame header: %s\n", line);
+	cr_assert_eq(got + n + more, len, "Frame pieces do not add up\n");
+	cr_assert_eq(fread(buf + got, 1, n, bin), n);
+	got += n;
+	free(line);
+    } while(more > 0);
+    cr_assert(!memcmp(buf, msg, len), "Chat frame was altered\n");
+
+    // Text commands following the frame are still understood.
+    char *line = read_message(bin);
+    cr_assert_str_eq(line, "chat after\r\n");
+    free(line);
+    free(buf);
+    free(msg);
+}
+
+Test(chat_suite, chat_frame_peer_test, .init = init, .fini = fini, .timeout = 30) {
+    int a, b;
+    FILE *ain, *bin;
+    setup_call(&a, &b, &ain, &bin);
+    int c = connect_tu(SERVER_PORT);
+    FILE *cin = fdopen(dup(c), "r");
+    skip_to(cin, "ON HOOK ");
+
+    // B parks A in the middle of a frame from A, and C takes the call.
+    dprintf(a, "chatf 10\r\nabcd");
+    char *line = read_message(bin);
+    cr_assert_str_eq(line, "chatf 4 6\r\n");
+    free(line);
+    char piece[4];
+    cr_assert_eq(fread(piece, 1, 4, bin), 4);
+    dprintf(b, "park 3\r\n");
+    skip_to(bin, "DIAL TONE");
+    dprintf(c, "unpark 3\r\n");
+    skip_to(cin, "CONNECTED ");
+
+    // The rest of the frame does not follow C's call, but a chat sent after it does.
+    dprintf(a, "efghij");
+    dprintf(a, "chat after\r\n");
+    line = read_message(cin);
+    cr_assert_str_eq(line, "chat after\r\n", "C got part of a frame: %s", line);
+    free(line);
+}
+
+Test(chat_suite, long_line_test, .init = init_short_lines, .fini = fini, .timeout = 30) {
+    int a, b;
+    FILE *ain, *bin;
+    setup_call(&a, &b, &ain, &bin);
+
+    // A line over the limit is dropped as a whole, and the connection carries on.
+    size_t len = 10 * SHORT_LINE;
+    char *msg = malloc(len + 1);
+    memset(msg, 'x', len);
+    msg[len] = '\0';
+    dprintf(a, "chat %s\r\nchat ok\r\n", msg);
+    char *line = read_message(bin);
+    cr_assert_str_eq(line, "chat ok\r\n");
+    free(line);
+    free(msg);
+}
+
+Test(chat_suite, replay_test, .init = init, .fini = fini, .timeout = 30) {
+    int a, b;
+    FILE *ain, *bin;
+    setup_call(&a, &b, &ain, &bin);
+
+    // Exchange some chat in both directions, then ask for everything after the first message.
+    dprintf(a, "chat one\r\n");
+    int ext_b = skip_to(ain, "CONNECTED ");
+    dprintf(b, "chat two\r\n");
+    int ext_a = skip_to(bin, "CONNECTED ");
+    dprintf(a, "chat three  four\r\n");
+    skip_to(ain, "CONNECTED");
+    skip_to(bin, "chat three");
+    dprintf(b, "replay 1\r\n");
+
+    char expected[2][64];
+    snprintf(expected[0], sizeof(expected[0]), "replay 2 %d two\r\n", ext_b);
+    snprintf(expected[1], sizeof(expected[1]), "replay 3 %d three  four\r\n", ext_a);
+    for(int i = 0; i < 2; i++) {
+	char *line = read_message(bin);
+	cr_assert_str_eq(line, expected[i]);
+	free(line);
+    }
+    cr_assert_eq(skip_to(bin, "CONNECTED "), ext_a);
+
+    // The history ends with the call.
+    dprintf(a, "hangup\r\n");
+    skip_to(bin, "DIAL TONE");
+    dprintf(b, "replay\r\n");
+    char *line = read_message(bin);
+    cr_assert_str_eq(line, "DIAL TONE\r\n");
+    free(line);
+}
+
+Test(chat_suite, msg_backlog_test, .init = init, .fini = fini, .timeout = 30) {
+    int a, b;
+    FILE *ain, *bin;
+    setup_call(&a, &b, &ain, &bin);
+    int c = connect_tu(SERVER_PORT);
+    FILE *cin = fdopen(dup(c), "r");
+    int ext_c = skip_to(cin, "ON HOOK ");
+    dprintf(a, "chat who\r\n");
+    int ext_b = skip_to(ain, "CONNECTED ");
+
+    // B is busy, so messages for it are held.
+    int count = 10000;
+    FILE *cout = fdopen(dup(c), "w");
+    for(int i = 0; i < count; i++)
+	fprintf(cout, "msg %d note %d\r\n", ext_b, i);
+    fflush(cout);
+    for(int i = 0; i < count; i++)
+	skip_to(cin, "ON HOOK");
+
+    // Going on hook releases them, while B can still be used.
+    dprintf(b, "hangup\r\npickup\r\n");
+    int got = 0, dial_tone = 0;
+    while(got < count || !dial_tone) {
+	char *line = read_message(bin);
+	char expected[64];
+	snprintf(expected, sizeof(expected), "msg %d note %d\r\n", ext_c, got);
+	if(!strcmp(line, "DIAL TONE\r\n"))
+	    dial_tone = 1;
+	else if(!strncmp(line, "msg ", 4)) {
+	    cr_assert_str_eq(line, expected);
+	    got++;
+	}
+	free(line);
+    }
+}
+
+Test(chat_suite, hold_test, .init = init, .fini = fini, .timeout = 30) {
+    int a, b;
+    FILE *ain, *bin;
+    setup_call(&a, &b, &ain, &bin);
+    dprintf(a, "chat hi\r\n");
+    int ext_b = skip_to(ain, "CONNECTED ");
+    dprintf(b, "chat hi\r\n");
+    int ext_a = skip_to(bin, "CONNECTED ");
+    char line_a[64], line_b[64];
+
+    // Holding puts both parties in their hold states, keeping track of each other.
+    dprintf(a, "hold\r\n");
+    cr_assert_eq(skip_to(ain, "ON HOLD "), ext_b);
+    cr_assert_eq(skip_to(bin, "HELD "), ext_a);
+
+    // Chat goes nowhere while the call is on hold, and the held party cannot resume.
+    dprintf(b, "chat lost\r\nresume\r\npickup\r\n");
+    cr_assert_eq(skip_to(bin, "HELD "), ext_a);
+    cr_assert_eq(skip_to(bin, "HELD "), ext_a);
+    dprintf(a, "resume\r\n");
+    cr_assert_eq(skip_to(ain, "CONNECTED "), ext_b);
+    cr_assert_eq(skip_to(bin, "CONNECTED "), ext_a);
+    dprintf(b, "chat back\r\n");
+    char *line = read_message(ain);
+    cr_assert_str_eq(line, "chat back\r\n", "Chat during hold was delivered");
+    free(line);
+
+    // Hanging up a held call ends it as usual.
+    dprintf(b, "hold\r\n");
+    skip_to(bin, "ON HOLD");
+    skip_to(ain, "HELD");
+    dprintf(a, "hangup\r\n");
+    snprintf(line_a, sizeof(line_a), "ON HOOK %d\r\n", ext_a);
+    snprintf(line_b, sizeof(line_b), "DIAL TONE\r\n");
+    line = read_message(ain);
+    cr_assert_str_eq(line, line_a);
+    free(line);
+    line = read_message(bin);
+    cr_assert_str_eq(line, line_b);
+    free(line);
+}
+
+Test(chat_suite, group_pickup_test, .init = init, .fini = fini, .timeout = 30) {
+    int a = connect_tu(SERVER_PORT), b = connect_tu(SERVER_PORT), c = connect_tu(SERVER_PORT);
+    FILE *ain = fdopen(dup(a), "r"), *bin = fdopen(dup(b), "r"), *cin = fdopen(dup(c), "r");
+    int ext_a = skip_to(ain, "ON HOOK ");
+    int ext_b = skip_to(bin, "ON HOOK ");
+    int ext_c = skip_to(cin, "ON HOOK ");
+    dprintf(b, "group 3\r\n");
+    skip_to(bin, "ON HOOK");
+    dprintf(c, "group 3\r\n");
+    skip_to(cin, "ON HOOK");
+
+    // With nothing ringing in the group, pickup has no effect.
+    dprintf(c, "gpickup\r\n");
+    cr_assert_eq(skip_to(cin, "ON HOOK "), ext_c);
+
+    // A call ringing on B is answered by C, and B stops ringing.
+    dprintf(a, "pickup\r\n");
+    skip_to(ain, "DIAL TONE");
+    dprintf(a, "dial %d\r\n", ext_b);
+    skip_to(bin, "RINGING");
+    dprintf(c, "gpickup\r\n");
+    cr_assert_eq(skip_to(cin, "CONNECTED "), ext_a);
+    cr_assert_eq(skip_to(ain, "CONNECTED "), ext_c);
+    cr_assert_eq(skip_to(bin, "ON HOOK "), ext_b);
+    dprintf(a, "chat hi\r\n");
+    char *line = read_message(cin);
+    cr_assert_str_eq(line, "chat hi\r\n", "Chat did not reach the TU that picked up");
+    free(line);
+
+    // Directed pickup answers a particular extension, whatever its group.
+    dprintf(c, "hangup\r\n");
+    skip_to(cin, "ON HOOK");
+    skip_to(ain, "DIAL TONE");
+    dprintf(a, "dial %d\r\n", ext_c);
+    skip_to(cin, "RINGING");
+    dprintf(b, "group 0\r\ndpickup %d\r\n", ext_c);
+    skip_to(bin, "ON HOOK");
+    cr_assert_eq(skip_to(bin, "CONNECTED "), ext_a);
+    cr_assert_eq(skip_to(ain, "CONNECTED "), ext_b);
+    cr_assert_eq(skip_to(cin, "ON HOOK "), ext_c);
+}
+
+Test(chat_suite, park_test, .init = init, .fini = fini, .timeout = 30) {
+    int a, b;
+    FILE *ain, *bin;
+    setup_call(&a, &b, &ain, &bin);
+    dprintf(a, "chat hi\r\n");
+    int ext_b = skip_to(ain, "CONNECTED ");
+    dprintf(b, "chat hi\r\n");
+    skip_to(bin, "CONNECTED");
+    int c = connect_tu(SERVER_PORT);
+    FILE *cin = fdopen(dup(c), "r");
+    int ext_c = skip_to(cin, "ON HOOK ");
+
+    // Parking B frees A, and B waits on the slot until C retrieves it.
+    dprintf(a, "park 5\r\n");
+    skip_to(ain, "DIAL TONE");
+    cr_assert_eq(skip_to(bin, "PARKED "), 5);
+    dprintf(c, "unpark 4\r\n");
+    cr_assert_eq(skip_to(cin, "ON HOOK "), ext_c);
+    dprintf(c, "unpark 5\r\n");
+    cr_assert_eq(skip_to(cin, "CONNECTED "), ext_b);
+    cr_assert_eq(skip_to(bin, "CONNECTED "), ext_c);
+    dprintf(b, "chat back\r\n");
+    char *line = read_message(cin);
+    cr_assert_str_eq(line, "chat back\r\n", "Chat did not reach the TU that unparked");
+    free(line);
+
+    // A parked party that hangs up leaves its slot.
+    dprintf(c, "park 5\r\n");
+    skip_to(cin, "DIAL TONE");
+    skip_to(bin, "PARKED");
+    dprintf(b, "hangup\r\n");
+    cr_assert_eq(skip_to(bin, "ON HOOK "), ext_b);
+    dprintf(a, "unpark 5\r\n");
+    skip_to(ain, "DIAL TONE");
+}
+
+Test(chat_suite, pickup_race_test, .init = init, .fini = fini, .timeout = 60) {
+    for(int i = 0; i < 50; i++) {
+	int a = connect_tu(SERVER_PORT), b = connect_tu(SERVER_PORT), c = connect_tu(SERVER_PORT);
+	FILE *ain = fdopen(a, "r"), *bin = fdopen(b, "r"), *cin = fdopen(c, "r");
+	skip_to(ain, "ON HOOK");
+	int ext_b = skip_to(bin, "ON HOOK ");
+	skip_to(cin, "ON HOOK");
+	dprintf(b, "group 4\r\n");
+	skip_to(bin, "ON HOOK");
+	dprintf(c, "group 4\r\n");
+	skip_to(cin, "ON HOOK");
+
+	// The caller hangs up while C picks up: whichever wins, both end on hook.
+	dprintf(a, "pickup\r\n");
+	skip_to(ain, "DIAL TONE");
+	dprintf(a, "dial %d\r\n", ext_b);
+	skip_to(bin, "RINGING");
+	dprintf(a, "hangup\r\n");
+	dprintf(c, "gpickup\r\n");
+	skip_to(ain, "ON HOOK");
+	skip_to(bin, "ON HOOK");
+	dprintf(c, "hangup\r\n");
+	skip_to(cin, "ON HOOK");
+
+	// Both parties to a call hang up at once.
+	dprintf(a, "pickup\r\n");
+	skip_to(ain, "DIAL TONE");
+	dprintf(a, "dial %d\r\n", ext_b);
+	skip_to(bin, "RINGING");
+	dprintf(b, "pickup\r\n");
+	skip_to(bin, "CONNECTED");
+	skip_to(ain, "CONNECTED");
+	dprintf(a, "hangup\r\n");
+	dprintf(b, "hangup\r\n");
+	skip_to(ain, "ON HOOK");
+	skip_to(bin, "ON HOOK");
+	fclose(ain);
+	fclose(bin);
+	fclose(cin);
+    }
+}
@@ -0,0 +1,194 @@
+/*
+ * Tests of coroutines: many clients served in calls on a few threads, and a client
+ * stuck writing to a peer that does not read not holding up the others on its loop.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+
+#define PAIRS 100
+#define MAX_THREADS 16
+#define FLOOD_CHAT (64 * 1024)
+#define FLOOD_MIN (1024 * 1024)
+#define FLOOD_TRIES 50
+#define MAX_PARKED_SWITCHES 200
+
+static int server_pid;
+
+static void start_loops(char *loops) {
+    kill_servers();
+    server_pid = start_server(SERVER_PORT_STR, "-E", loops, "-r", "0-131071:0", NULL);
+}
+
+static void init_two_loops() {
+    start_loops("2");
+}
+
+static void init_one_loop() {
+    start_loops("1");
+}
+
+static void fini() {
+    stop_server(&server_pid);
+}
+
+/*
+ * Count the threads of the server.
+ */
+static int server_threads() {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", server_pid);
+    FILE *f = fopen(path, "r");
+    cr_assert(f, "Cannot read the status of the server");
+    int threads = -1;
+    while(fgets(line, sizeof(line), f)) {
+	if(strncmp(line, "Threads:", 8) == 0)
+	    threads = atoi(line + 8);
+    }
+    fclose(f);
+    return threads;
+}
+
+/*
+ * Count the context switches of all the threads of the server so far.
+ */
+static long server_switches() {
+    char path[320], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/task", server_pid);
+    DIR *dir = opendir(path);
+    cr_assert(dir, "Cannot list the threads of the server");
+    long switches = 0;
+    struct dirent *d;
+    while((d = readdir(dir))) {
+	if(d->d_name[0] == '.')
+	    continue;
+	snprintf(path, sizeof(path), "/proc/%d/task/%s/status", server_pid, d->d_name);
+	FILE *f = fopen(path, "r");
+	while(f && fgets(line, sizeof(line), f)) {
+	    if(strncmp(line, "voluntary_ctxt_switches:", 24) == 0)
+		switches += atol(line + 24);
+	}
+	if(f)
+	    fclose(f);
+    }
+    closedir(dir);
+    return switches;
+}
+
+/*
+ * Flood chat from one TU to another that never reads it, until the coroutine of the
+ * first is stuck writing, holding the locks of both.
+ */
+static void flood(int a) {
+    static char chat[FLOOD_CHAT + 16];
+    size_t len = snprintf(chat, sizeof(chat), "chat ");
+    memset(chat + len, 'x', FLOOD_CHAT);
+    len += FLOOD_CHAT;
+    len += snprintf(chat + len, sizeof(chat) - len, "\r\n");
+    size_t sent = 0;
+    for(int tries = 0; tries < FLOOD_TRIES; ) {
+	ssize_t n = send(a, chat + sent % len, len - sent % len, MSG_DONTWAIT);
+	if(n > 0) {
+	    sent += n;
+	    tries = 0;
+	}
+	else {
+	    tries++;
+	    usleep(10000);
+	}
+    }
+    cr_assert_geq(sent, FLOOD_MIN, "Only %zu bytes of chat were taken", sent);
+}
+
+Test(coro_suite, many_clients_test, .init = init_two_loops, .fini = fini, .timeout = 60) {
+    static int fds[2 * PAIRS], exts[2 * PAIRS];
+    for(int i = 0; i < 2 * PAIRS; i++) {
+	fds[i] = connect_tu(SERVER_PORT);
+	exts[i] = expect(fds[i], "ON HOOK ");
+    }
+
+    // Every pair sets up a call and chats across it, on the threads of two loops.
+    for(int i = 0; i < PAIRS; i++)
+	call(fds[2 * i], fds[2 * i + 1], exts[2 * i + 1]);
+    for(int i = 0; i < PAIRS; i++)
+	dprintf(fds[2 * i], "chat pair %d\r\n", i);
+    for(int i = 0; i < PAIRS; i++) {
+	char line[256], want[64];
+	expect(fds[2 * i], "CONNECTED ");
+	read_line(fds[2 * i + 1], line, sizeof(line));
+	snprintf(want, sizeof(want), "chat pair %d\r\n", i);
+	cr_assert_str_eq(line, want);
+    }
+    int threads = server_threads();
+    cr_assert(threads > 0 && threads < MAX_THREADS, "%d clients are served by %d threads", 2 * PAIRS, threads);
+    for(int i = 0; i < 2 * PAIRS; i++)
+	close(fds[i]);
+}
+
+Test(coro_suite, stuck_writer_test, .init = init_one_loop, .fini = fini, .timeout = 30) {
+    int fds[4], exts[4];
+    for(int i = 0; i < 4; i++) {
+	fds[i] = connect_tu(SERVER_PORT);
+	exts[i] = expect(fds[i], "ON HOOK ");
+    }
+    int a = fds[0], b = fds[1], c = fds[2], d = fds[3];
+
+    // A floods chat to B, which never reads it, until the coroutine of A is stuck.
+    call(a, b, exts[1]);
+    flood(a);
+
+    // C and D, on the same loop, set up a call and chat all the same.
+    call(c, d, exts[3]);
+    dprintf(c, "chat still here\r\n");
+    expect(c, "CONNECTED ");
+    expect(d, "chat still here");
+    dprintf(d, "hangup\r\n");
+    expect(d, "ON HOOK ");
+    expect(c, "DIAL TONE");
+    for(int i = 0; i < 4; i++)
+	close(fds[i]);
+}
+
+Test(coro_suite, parked_waiter_test, .init = init_one_loop, .fini = fini, .timeout = 30) {
+    int fds[4], exts[4];
+    for(int i = 0; i < 4; i++) {
+	fds[i] = connect_tu(SERVER_PORT);
+	exts[i] = expect(fds[i], "ON HOOK ");
+    }
+    int a = fds[0], b = fds[1], c = fds[2], d = fds[3];
+    call(a, b, exts[1]);
+    flood(a);
+
+    // C dials B, whose lock A holds, and its coroutine parks rather than polling.
+    dprintf(c, "pickup\r\n");
+    expect(c, "DIAL TONE");
+    dprintf(c, "dial %d\r\n", exts[1]);
+    usleep(200000);
+    long before = server_switches();
+    sleep(1);
+    long switches = server_switches() - before;
+    cr_assert_lt(switches, MAX_PARKED_SWITCHES, "The server switched %ld times while C waited", switches);
+
+    // D, on the same loop, is served all the same.
+    dprintf(d, "pickup\r\n");
+    expect(d, "DIAL TONE");
+
+    // Once B goes, A lets go of the lock, and C is answered.
+    close(b);
+    char line[256];
+    read_line(c, line, sizeof(line));
+    for(int i = 0; i < 4; i++)
+	if(i != 1)
+	    close(fds[i]);
+}
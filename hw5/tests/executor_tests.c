@@ -0,0 +1,175 @@
+/*
+ * Tests of the executor: the requests on each channel of a trunk carried out in order
+ * by a pool of workers, and a channel stuck writing to its peer not holding up the
+ * others.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+#include "proto.h"
+
+#define CHANNELS 8
+#define REQUESTS 40
+#define FLOOD_CHATS 100
+#define FLOOD_SIZE (200 * 1024)
+
+static int server_pid;
+
+static void init() {
+    kill_servers();
+    server_pid = start_server(SERVER_PORT_STR, "-W", "4", "-r", "0-131071:0", NULL);
+}
+
+static void fini() {
+    stop_server(&server_pid);
+}
+
+/*
+ * Read the next frame from a trunk, returning its channel and its payload as a string.
+ */
+static uint32_t read_trunk_frame(int fd, PROTO_HEADER *h, char *payload, size_t size) {
+    uint32_t ch;
+    read_fully(fd, &ch, sizeof(ch));
+    read_fully(fd, h, sizeof(*h));
+    cr_assert_eq(h->magic, PROTO_MAGIC);
+    uint32_t len = ntohl(h->len);
+    cr_assert_lt(len, size);
+    read_fully(fd, payload, len);
+    payload[len] = '\0';
+    return ntohl(ch);
+}
+
+/*
+ * Read frames from a trunk until the response to a request, and return its payload.
+ */
+static void expect_trunk_response(int fd, uint32_t channel, uint32_t id, char *payload, size_t size) {
+    while(1) {
+	PROTO_HEADER h;
+	uint32_t ch = read_trunk_frame(fd, &h, payload, size);
+	if(ch == channel && h.type == PROTO_RESPONSE && ntohl(h.id) == id)
+	    return;
+    }
+}
+
+/*
+ * Append a request frame on a channel of a trunk to a buffer.
+ */
+static size_t put_trunk_request(char *buf, uint32_t channel, int op, uint32_t id, int32_t arg,
+				const char *text, size_t len) {
+    PROTO_HEADER h;
+    uint32_t ch = htonl(channel);
+    memcpy(buf, &ch, sizeof(ch));
+    proto_header_pack(&h, PROTO_REQUEST, op, 0, id, arg, len);
+    memcpy(buf + sizeof(ch), &h, sizeof(h));
+    if(text)
+	memcpy(buf + sizeof(ch) + sizeof(h), text, len);
+    return sizeof(ch) + sizeof(h) + len;
+}
+
+/*
+ * Connect a trunk and open channels 1 to n on it, returning their extensions.
+ */
+static int open_trunk(int n, int *exts) {
+    int fd = connect_tu(SERVER_PORT);
+    char line[256], payload[256], buf[1024];
+    read_line(fd, line, sizeof(line));
+    dprintf(fd, "proto 3\r\n");
+    expect_trunk_response(fd, 0, 0, payload, sizeof(payload));
+    size_t len = 0;
+    for(int i = 1; i <= n; i++)
+	len += put_trunk_request(buf + len, i, PROTO_OP_OPEN, i, 0, NULL, 0);
+    cr_assert_eq(write(fd, buf, len), len);
+    for(int i = 1; i <= n; i++) {
+	expect_trunk_response(fd, i, i, payload, sizeof(payload));
+	cr_assert_eq(strncmp(payload, "ON HOOK ", 8), 0, "Got '%s'", payload);
+	exts[i] = atoi(payload + 8);
+    }
+    return fd;
+}
+
+Test(executor_suite, channel_order_test, .init = init, .fini = fini, .timeout = 30) {
+    int exts[CHANNELS + 1];
+    int fd = open_trunk(CHANNELS, exts);
+
+    // Every channel picks up and hangs up over and over, all sent at once, interleaved.
+    static char buf[CHANNELS * REQUESTS * 32];
+    size_t len = 0;
+    for(int i = 0; i < REQUESTS; i++) {
+	for(int ch = 1; ch <= CHANNELS; ch++)
+	    len += put_trunk_request(buf + len, ch, i % 2 ? PROTO_OP_HANGUP : PROTO_OP_PICKUP,
+				     ch * 1000 + i, 0, NULL, 0);
+    }
+    cr_assert_eq(write(fd, buf, len), len);
+
+    // The answers on each channel come in the order its requests were sent.
+    int next[CHANNELS + 1] = { 0 };
+    for(int n = 0; n < CHANNELS * REQUESTS; n++) {
+	PROTO_HEADER h;
+	char payload[256];
+	uint32_t ch = read_trunk_frame(fd, &h, payload, sizeof(payload));
+	cr_assert(ch >= 1 && ch <= CHANNELS, "Wrong channel %u", ch);
+	cr_assert_eq(h.type, PROTO_RESPONSE);
+	cr_assert_eq(ntohl(h.id), ch * 1000 + next[ch], "Channel %u answered %u out of order",
+		     ch, ntohl(h.id));
+	if(next[ch] % 2)
+	    cr_assert_eq(strncmp(payload, "ON HOOK ", 8), 0, "Got '%s'", payload);
+	else
+	    cr_assert_str_eq(payload, "DIAL TONE");
+	next[ch]++;
+    }
+    close(fd);
+}
+
+Test(executor_suite, stuck_channel_test, .init = init, .fini = fini, .timeout = 30) {
+    int exts[4];
+    int fd = open_trunk(3, exts);
+    int s = connect_tu(SERVER_PORT);
+    char line[256], payload[256], buf[1024];
+    read_line(s, line, sizeof(line));
+    int ext_s = atoi(line + strlen("ON HOOK "));
+
+    // Channel 1 calls a client that will never read what it is sent.
+    size_t len = put_trunk_request(buf, 1, PROTO_OP_PICKUP, 10, 0, NULL, 0);
+    len += put_trunk_request(buf + len, 1, PROTO_OP_DIAL, 11, ext_s, NULL, 0);
+    cr_assert_eq(write(fd, buf, len), len);
+    expect_trunk_response(fd, 1, 11, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "RING BACK");
+    read_line(s, line, sizeof(line));
+    cr_assert_str_eq(line, "RINGING\r\n");
+    dprintf(s, "pickup\r\n");
+    read_line(s, line, sizeof(line));
+    cr_assert_eq(strncmp(line, "CONNECTED ", 10), 0);
+
+    // Channel 1 sends it more chat than the connection can hold, which gets stuck.
+    static char flood[FLOOD_CHATS * (FLOOD_SIZE + 64)];
+    static char chat[FLOOD_SIZE];
+    memset(chat, 'x', sizeof(chat));
+    len = 0;
+    for(int i = 0; i < FLOOD_CHATS; i++)
+	len += put_trunk_request(flood + len, 1, PROTO_OP_CHAT, 100 + i, 0, chat, sizeof(chat));
+    cr_assert_eq(write(fd, flood, len), len);
+
+    // Channels 2 and 3 set up a call all the same.
+    len = put_trunk_request(buf, 2, PROTO_OP_PICKUP, 300, 0, NULL, 0);
+    len += put_trunk_request(buf + len, 2, PROTO_OP_DIAL, 301, exts[3], NULL, 0);
+    cr_assert_eq(write(fd, buf, len), len);
+    expect_trunk_response(fd, 2, 301, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "RING BACK");
+    len = put_trunk_request(buf, 3, PROTO_OP_PICKUP, 302, 0, NULL, 0);
+    cr_assert_eq(write(fd, buf, len), len);
+    expect_trunk_response(fd, 3, 302, payload, sizeof(payload));
+    cr_assert_eq(strncmp(payload, "CONNECTED ", 10), 0, "Got '%s'", payload);
+    close(s);
+    close(fd);
+}
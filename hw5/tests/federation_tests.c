@@ -0,0 +1,152 @@
+/*
+ * Tests of federation: calls between two PBXs, one routing a prefix to the other,
+ * and the connection between them going away and coming back.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+
+#define REMOTE_PORT 9998
+#define REMOTE_PORT_STR "9998"
+#define ROUTE "7:localhost:" REMOTE_PORT_STR
+
+static int local_pid, remote_pid;
+
+static void init() {
+    kill_servers();
+    remote_pid = start_server(REMOTE_PORT_STR, NULL);
+    usleep(200000);
+    local_pid = start_server(SERVER_PORT_STR, "-F", ROUTE, NULL);
+}
+
+static void fini() {
+    stop_server(&local_pid);
+    stop_server(&remote_pid);
+}
+
+/*
+ * Call from a TU of the local PBX to a TU of the remote one, and have it answered.
+ */
+static void call_remote(int a, int b, int ext_b) {
+    dprintf(a, "pickup\r\n");
+    expect(a, "DIAL TONE");
+    dprintf(a, "dial 7%d\r\n", ext_b);
+    expect(a, "RING BACK");
+    expect(b, "RINGING");
+    dprintf(b, "pickup\r\n");
+    expect(b, "CONNECTED ");
+    // The remote party is known by the number dialed.
+    char number[32];
+    snprintf(number, sizeof(number), "7%d", ext_b);
+    cr_assert_eq(expect(a, "CONNECTED "), atoi(number));
+}
+
+Test(federation_suite, remote_call_test, .init = init, .fini = fini, .timeout = 30) {
+    int b = connect_tu(REMOTE_PORT);
+    int ext_b = expect(b, "ON HOOK ");
+    int a = connect_tu(SERVER_PORT);
+    expect(a, "ON HOOK ");
+    call_remote(a, b, ext_b);
+
+    // Chat goes both ways, and hold is seen from the other PBX.
+    dprintf(a, "chat to b\r\n");
+    expect(a, "CONNECTED ");
+    expect(b, "chat to b");
+    dprintf(b, "chat to a\r\n");
+    expect(b, "CONNECTED ");
+    expect(a, "chat to a");
+
+    // A chat frame is passed on to the other PBX a piece at a time, as it arrives.
+    char line[256], piece[6];
+    dprintf(a, "chatf 10\r\nabcd");
+    read_line(b, line, sizeof(line));
+    cr_assert_str_eq(line, "chatf 4 6\r\n");
+    read_fully(b, piece, 4);
+    cr_assert_eq(memcmp(piece, "abcd", 4), 0);
+    dprintf(a, "efghij");
+    expect(a, "CONNECTED ");
+    read_line(b, line, sizeof(line));
+    cr_assert_str_eq(line, "chatf 6 0\r\n");
+    read_fully(b, piece, 6);
+    cr_assert_eq(memcmp(piece, "efghij", 6), 0);
+    dprintf(b, "hold\r\n");
+    expect(b, "ON HOLD ");
+    expect(a, "HELD ");
+    dprintf(b, "resume\r\n");
+    expect(b, "CONNECTED ");
+    expect(a, "CONNECTED ");
+
+    // Either party can hang up.
+    dprintf(b, "hangup\r\n");
+    expect(b, "ON HOOK ");
+    expect(a, "DIAL TONE");
+    dprintf(a, "hangup\r\n");
+    expect(a, "ON HOOK ");
+    call_remote(a, b, ext_b);
+    dprintf(a, "hangup\r\n");
+    expect(a, "ON HOOK ");
+    expect(b, "DIAL TONE");
+
+    // Nobody is at an empty remote extension.
+    dprintf(a, "pickup\r\n");
+    expect(a, "DIAL TONE");
+    dprintf(a, "dial 7%d\r\n", ext_b + 1000);
+    expect(a, "RING BACK");
+    expect(a, "ERROR");
+    close(a);
+    close(b);
+}
+
+Test(federation_suite, remote_restart_test, .init = init, .fini = fini, .timeout = 30) {
+    int b = connect_tu(REMOTE_PORT);
+    int ext_b = expect(b, "ON HOOK ");
+    int a = connect_tu(SERVER_PORT);
+    expect(a, "ON HOOK ");
+    call_remote(a, b, ext_b);
+
+    // The remote PBX goes away, taking the call with it.
+    stop_server(&remote_pid);
+    close(b);
+    expect(a, "DIAL TONE");
+    dprintf(a, "dial 7%d\r\n", ext_b);
+    expect(a, "ERROR");
+    dprintf(a, "hangup\r\n");
+    expect(a, "ON HOOK ");
+
+    // Once it is back, and the connections to it have been opened again in the
+    // background, calls to it go through again; until then, they fail at once.
+    remote_pid = start_server(REMOTE_PORT_STR, NULL);
+    b = connect_tu(REMOTE_PORT);
+    ext_b = expect(b, "ON HOOK ");
+    char line[256];
+    int rang = 0;
+    for(int i = 0; i < 100 && !rang; i++) {
+	dprintf(a, "pickup\r\n");
+	expect(a, "DIAL TONE");
+	dprintf(a, "dial 7%d\r\n", ext_b);
+	read_line(a, line, sizeof(line));
+	if(!(rang = !strncmp(line, "RING BACK", 9))) {
+	    cr_assert_eq(strncmp(line, "ERROR", 5), 0, "Expected 'ERROR', got '%s'", line);
+	    dprintf(a, "hangup\r\n");
+	    expect(a, "ON HOOK ");
+	    usleep(100000);
+	}
+    }
+    cr_assert(rang, "Calls to the PBX did not go through again");
+    expect(b, "RINGING");
+    dprintf(b, "pickup\r\n");
+    expect(b, "CONNECTED ");
+    expect(a, "CONNECTED ");
+    close(a);
+    close(b);
+}
@@ -0,0 +1,147 @@
+/*
+ * Tests of gossip: three PBXs, each knowing only the one before it to begin with,
+ * learning of each other's extensions and calling them.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+
+#define NODE_2_PORT 9998
+#define NODE_3_PORT 9997
+#define NODE_3_MOVED_PORT 9996
+
+static int pids[3];
+
+static int start_node(char *port, char *node, char *seed) {
+    return start_server(port, "-G", node, seed ? "-P" : NULL, seed, NULL);
+}
+
+static void init() {
+    kill_servers();
+    pids[0] = start_node(SERVER_PORT_STR, "1:127.0.0.1:9991", NULL);
+    pids[1] = start_node("9998", "2:127.0.0.1:9992", "127.0.0.1:9991");
+    pids[2] = start_node("9997", "3:127.0.0.1:9993", "127.0.0.1:9992");
+}
+
+static void fini() {
+    for(int i = 0; i < 3; i++)
+	stop_server(&pids[i]);
+}
+
+/*
+ * Dial a number, and hang up again.
+ *
+ * @return nonzero if the call rang, zero if it failed at once.
+ */
+static int try_dial(int fd, int number) {
+    char line[256];
+    dprintf(fd, "pickup\r\n");
+    expect(fd, "DIAL TONE");
+    dprintf(fd, "dial %d\r\n", number);
+    read_line(fd, line, sizeof(line));
+    int rang = !strncmp(line, "RING BACK", 9);
+    if(!rang)
+	cr_assert_eq(strncmp(line, "ERROR", 5), 0, "Expected 'ERROR', got '%s'", line);
+    dprintf(fd, "hangup\r\n");
+    // A call that rang may yet fail, or be answered by the test.
+    do
+	read_line(fd, line, sizeof(line));
+    while(strncmp(line, "ON HOOK", 7));
+    return rang;
+}
+
+static int node_number(int node, int ext) {
+    char digits[32];
+    snprintf(digits, sizeof(digits), "%d%d", node, ext);
+    return atoi(digits);
+}
+
+Test(gossip_suite, directory_test, .init = init, .fini = fini, .timeout = 30) {
+    int c = connect_tu(NODE_3_PORT);
+    int ext_c = expect(c, "ON HOOK ");
+    int a = connect_tu(SERVER_PORT);
+    expect(a, "ON HOOK ");
+
+    // The first node, which never heard of the third, learns of it through the second.
+    int rang = 0;
+    for(int i = 0; i < 100 && !(rang = try_dial(a, node_number(3, ext_c))); i++)
+	usleep(100000);
+    cr_assert(rang, "Extension of the third node never became reachable");
+    expect(c, "RINGING");
+    expect(c, "ON HOOK ");
+
+    // A call to an extension that the directory does not have fails without ringing.
+    cr_assert_eq(try_dial(a, node_number(3, ext_c + 1000)), 0);
+
+    // Once the extension goes away, so does its entry.
+    close(c);
+    for(int i = 0; i < 100 && (rang = try_dial(a, node_number(3, ext_c))); i++)
+	usleep(100000);
+    cr_assert_eq(rang, 0, "Extension of the third node never went away");
+    close(a);
+}
+
+Test(gossip_suite, restart_test, .init = init, .fini = fini, .timeout = 30) {
+    int c = connect_tu(NODE_3_PORT);
+    int ext_c = expect(c, "ON HOOK ");
+    int a = connect_tu(SERVER_PORT);
+    expect(a, "ON HOOK ");
+    int rang = 0;
+    for(int i = 0; i < 100 && !(rang = try_dial(a, node_number(3, ext_c))); i++)
+	usleep(100000);
+    cr_assert(rang);
+    expect(c, "RINGING");
+    expect(c, "ON HOOK ");
+    close(c);
+
+    // The third node starts again: its new incarnation replaces the old entries.
+    stop_server(&pids[2]);
+    pids[2] = start_node("9997", "3:127.0.0.1:9993", "127.0.0.1:9992");
+    c = connect_tu(NODE_3_PORT);
+    ext_c = expect(c, "ON HOOK ");
+    for(int i = 0; i < 100 && !(rang = try_dial(a, node_number(3, ext_c))); i++)
+	usleep(100000);
+    cr_assert(rang, "Extension of the restarted node never became reachable");
+    expect(c, "RINGING");
+    expect(c, "ON HOOK ");
+    close(a);
+    close(c);
+}
+
+Test(gossip_suite, moved_test, .init = init, .fini = fini, .timeout = 30) {
+    int c = connect_tu(NODE_3_PORT);
+    int ext_c = expect(c, "ON HOOK ");
+    int a = connect_tu(SERVER_PORT);
+    expect(a, "ON HOOK ");
+    int rang = 0;
+    for(int i = 0; i < 100 && !(rang = try_dial(a, node_number(3, ext_c))); i++)
+	usleep(100000);
+    cr_assert(rang);
+    expect(c, "RINGING");
+    expect(c, "ON HOOK ");
+    close(c);
+
+    // The third node starts again serving clients on another port, and the route to it
+    // follows.
+    stop_server(&pids[2]);
+    pids[2] = start_node("9996", "3:127.0.0.1:9993", "127.0.0.1:9992");
+    c = connect_tu(NODE_3_MOVED_PORT);
+    ext_c = expect(c, "ON HOOK ");
+    for(int i = 0; i < 100 && !(rang = try_dial(a, node_number(3, ext_c))); i++)
+	usleep(100000);
+    cr_assert(rang, "Extension of the moved node never became reachable");
+    expect(c, "RINGING");
+    expect(c, "ON HOOK ");
+    close(a);
+    close(c);
+}
@@ -0,0 +1,86 @@
+/*
+ * Tests of hot restart, with a call in progress and a half-sent command going over
+ * from one server to the next.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+
+#define HANDOFF_PATH "/tmp/pbx_test.handoff"
+
+static int old_pid, new_pid;
+
+static int start_handoff() {
+    return start_server(SERVER_PORT_STR, "-H", HANDOFF_PATH, NULL);
+}
+
+static void init() {
+    kill_servers();
+    unlink(HANDOFF_PATH);
+    old_pid = start_handoff();
+}
+
+static void fini() {
+    stop_server(&old_pid);
+    stop_server(&new_pid);
+    unlink(HANDOFF_PATH);
+}
+
+Test(handoff_suite, hot_restart_test, .init = init, .fini = fini, .timeout = 30) {
+    // A call with some chat in it, and a client halfway through sending a command.
+    int a = connect_tu(SERVER_PORT);
+    int ext_a = expect(a, "ON HOOK ");
+    int b = connect_tu(SERVER_PORT);
+    int ext_b = expect(b, "ON HOOK ");
+    int c = connect_tu(SERVER_PORT);
+    expect(c, "ON HOOK ");
+    call(a, b, ext_b);
+    dprintf(a, "chat before\r\n");
+    expect(a, "CONNECTED ");
+    expect(b, "chat before");
+    dprintf(c, "pick");
+
+    // The new server takes over, and the old one exits.
+    new_pid = start_handoff();
+    int status;
+    cr_assert_eq(waitpid(old_pid, &status, 0), old_pid);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS, "Old server did not exit cleanly");
+    old_pid = 0;
+
+    // The call goes on, with its history, and the half-sent command is completed.
+    dprintf(b, "chat after\r\n");
+    expect(b, "CONNECTED ");
+    expect(a, "chat after");
+    dprintf(a, "replay\r\n");
+    char line[256], expected[256];
+    snprintf(expected, sizeof(expected), "replay 1 %d before\r\n", ext_a);
+    read_line(a, line, sizeof(line));
+    cr_assert_str_eq(line, expected);
+    snprintf(expected, sizeof(expected), "replay 2 %d after\r\n", ext_b);
+    read_line(a, line, sizeof(line));
+    cr_assert_str_eq(line, expected);
+    expect(a, "CONNECTED ");
+    dprintf(c, "up\r\n");
+    expect(c, "DIAL TONE");
+
+    // New clients are taken by the new server.
+    int d = connect_tu(SERVER_PORT);
+    expect(d, "ON HOOK ");
+    dprintf(a, "hangup\r\n");
+    expect(a, "ON HOOK ");
+    expect(b, "DIAL TONE");
+    close(a);
+    close(b);
+    close(c);
+    close(d);
+}
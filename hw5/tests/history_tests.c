@@ -0,0 +1,77 @@
+/*
+ * Tests of the ring of recent chat messages kept for each call.
+ */
+#include <string.h>
+
+#include <criterion/criterion.h>
+
+#include "history.h"
+
+/*
+ * Gather the text of a message found in a history into a buffer.
+ */
+static size_t gather(struct iovec *text, int parts, char *buf) {
+    size_t len = 0;
+    for(int i = 0; i < parts; i++) {
+	memcpy(buf + len, text[i].iov_base, text[i].iov_len);
+	len += text[i].iov_len;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+Test(history_suite, wrap_and_evict_test, .timeout = 5) {
+    CHAT_HISTORY *h = chat_history_alloc();
+    cr_assert_not_null(h);
+    char msg[1000], buf[CHAT_HISTORY_BYTES + 1];
+
+    // Add more text than fits, in messages whose text wraps around the end of the ring.
+    for(int i = 1; i <= 100; i++) {
+	memset(msg, 'a' + i % 26, sizeof(msg) - 1);
+	msg[sizeof(msg) - 1] = '\0';
+	cr_assert_eq(chat_history_add(h, i % 2 ? 4 : 5, msg, strlen(msg)), i);
+    }
+
+    // Only the newest messages that fit are retained, all intact and in order.
+    CHAT_RECORD rec;
+    struct iovec text[2];
+    uint32_t seq = 0;
+    int parts, count = 0, wrapped = 0;
+    while((parts = chat_history_find(h, seq, &rec, text)) != -1) {
+	cr_assert_eq(rec.seq, seq ? seq + 1 : rec.seq, "Gap in replay at %u", rec.seq);
+	cr_assert_eq(rec.from, rec.seq % 2 ? 4 : 5);
+	cr_assert_eq(gather(text, parts, buf), sizeof(msg) - 1);
+	for(size_t j = 0; j < sizeof(msg) - 1; j++)
+	    cr_assert_eq(buf[j], 'a' + rec.seq % 26, "Text of message %u altered", rec.seq);
+	wrapped += parts == 2;
+	seq = rec.seq;
+	count++;
+    }
+    cr_assert_eq(seq, 100, "Newest message missing");
+    cr_assert_eq(count, CHAT_HISTORY_BYTES / (sizeof(msg) - 1), "Retained %d messages", count);
+    cr_assert(wrapped > 0, "No message wrapped around the ring");
+
+    // A message too long to retain still takes a sequence number.
+    char big[CHAT_HISTORY_BYTES + 1];
+    memset(big, 'x', sizeof(big));
+    cr_assert_eq(chat_history_add(h, 4, big, sizeof(big)), 101);
+    cr_assert_eq(chat_history_find(h, 100, &rec, text), -1);
+    cr_assert_eq(chat_history_add(h, 5, "hi", 2), 102);
+    cr_assert_eq(chat_history_find(h, 100, &rec, text), 1);
+    cr_assert_eq(rec.seq, 102);
+    chat_history_free(h);
+}
+
+Test(history_suite, pool_reuse_test, .timeout = 5) {
+    // A history returned to the pool comes back empty.
+    CHAT_HISTORY *h = chat_history_alloc();
+    chat_history_add(h, 4, "hello", 5);
+    chat_history_free(h);
+    CHAT_HISTORY *h2 = chat_history_alloc();
+    cr_assert_eq(h2, h, "Pool did not reuse the history");
+    CHAT_RECORD rec;
+    struct iovec text[2];
+    cr_assert_eq(chat_history_find(h2, 0, &rec, text), -1, "Reused history not empty");
+    cr_assert_eq(chat_history_add(h2, 4, "again", 5), 1);
+    chat_history_free(h2);
+}
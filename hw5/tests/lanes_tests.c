@@ -0,0 +1,129 @@
+/*
+ * Tests of priority lanes: the order in which queued requests are taken, and a hangup
+ * going ahead of a flood of chat sent before it.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+#include "proto.h"
+#include "lanes.h"
+
+#define FLOOD_CHATS 200
+#define FLOOD_SIZE 200
+
+static int server_pid;
+
+static void init() {
+    kill_servers();
+    server_pid = start_server(SERVER_PORT_STR, NULL);
+}
+
+static void fini() {
+    stop_server(&server_pid);
+}
+
+/*
+ * Read frames from the server until the response to a request, and return its payload.
+ */
+static void expect_response(int fd, uint32_t id, char *payload, size_t size) {
+    while(1) {
+	PROTO_HEADER h;
+	read_fully(fd, &h, sizeof(h));
+	cr_assert_eq(h.magic, PROTO_MAGIC);
+	uint32_t len = ntohl(h.len);
+	cr_assert_lt(len, size);
+	read_fully(fd, payload, len);
+	payload[len] = '\0';
+	if(h.type == PROTO_RESPONSE && ntohl(h.id) == id)
+	    return;
+    }
+}
+
+static size_t put_request(char *buf, int op, uint32_t id, int32_t arg, const char *text, size_t len) {
+    PROTO_HEADER h;
+    proto_header_pack(&h, PROTO_REQUEST, op, 0, id, arg, len);
+    memcpy(buf, &h, sizeof(h));
+    if(text)
+	memcpy(buf + sizeof(h), text, len);
+    return sizeof(h) + len;
+}
+
+Test(lanes_suite, weights_test) {
+    LANES lanes;
+    LANE_ITEM items[30];
+    lanes_init(&lanes);
+    cr_assert_null(lanes_pop(&lanes));
+    // Items 0-9 are chat, 10-19 bulk, 20-29 control, queued in that order.
+    for(int i = 0; i < 10; i++)
+	lanes_push(&lanes, LANE_CHAT, &items[i]);
+    for(int i = 10; i < 20; i++)
+	lanes_push(&lanes, LANE_BULK, &items[i]);
+    for(int i = 20; i < 30; i++)
+	lanes_push(&lanes, LANE_CONTROL, &items[i]);
+
+    // Each round takes 8 control, 2 chat and 1 bulk, each lane in order.
+    int expected[] = { 20, 21, 22, 23, 24, 25, 26, 27, 0, 1, 10, 28, 29, 2, 3, 11 };
+    for(size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++)
+	cr_assert_eq(lanes_pop(&lanes), &items[expected[i]], "Wrong item at %zu", i);
+    int left = 0;
+    while(lanes_pop(&lanes))
+	left++;
+    cr_assert_eq(left, 30 - sizeof(expected) / sizeof(expected[0]));
+    cr_assert_eq(lane_of(PROTO_OP_HANGUP), LANE_CONTROL);
+    cr_assert_eq(lane_of(PROTO_OP_CHAT), LANE_CHAT);
+    cr_assert_eq(lane_of(PROTO_OP_MSG), LANE_BULK);
+}
+
+Test(lanes_suite, hangup_ahead_of_chat_test, .init = init, .fini = fini, .timeout = 30) {
+    int a = connect_tu(SERVER_PORT), b = connect_tu(SERVER_PORT);
+    char line[256], payload[256];
+    read_line(a, line, sizeof(line));
+    read_line(b, line, sizeof(line));
+    int ext_b = atoi(line + strlen("ON HOOK "));
+    static char buf[FLOOD_CHATS * (sizeof(PROTO_HEADER) + FLOOD_SIZE) + 1024];
+    size_t len = sprintf(buf, "proto 2\r\n");
+    len += put_request(buf + len, PROTO_OP_PICKUP, 1, 0, NULL, 0);
+    len += put_request(buf + len, PROTO_OP_DIAL, 2, ext_b, NULL, 0);
+    cr_assert_eq(write(a, buf, len), len);
+    expect_response(a, 2, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "RING BACK");
+    read_line(b, line, sizeof(line));
+    cr_assert_str_eq(line, "RINGING\r\n");
+    dprintf(b, "pickup\r\n");
+    read_line(b, line, sizeof(line));
+    cr_assert_eq(strncmp(line, "CONNECTED ", 10), 0);
+
+    // A flood of chat, then a hangup, all at once: the hangup does not wait for the chat.
+    char chat[FLOOD_SIZE];
+    memset(chat, 'x', sizeof(chat));
+    len = 0;
+    for(int i = 0; i < FLOOD_CHATS; i++)
+	len += put_request(buf + len, PROTO_OP_CHAT, 100 + i, 0, chat, sizeof(chat));
+    len += put_request(buf + len, PROTO_OP_HANGUP, 999, 0, NULL, 0);
+    cr_assert_eq(write(a, buf, len), len);
+    expect_response(a, 999, payload, sizeof(payload));
+    cr_assert_eq(strncmp(payload, "ON HOOK ", 8), 0, "Got '%s'", payload);
+    int chats = 0;
+    static char chat_line[FLOOD_SIZE + 16];
+    while(1) {
+	read_line(b, chat_line, sizeof(chat_line));
+	if(strncmp(chat_line, "chat ", 5))
+	    break;
+	chats++;
+    }
+    cr_assert_str_eq(chat_line, "DIAL TONE\r\n");
+    cr_assert_lt(chats, FLOOD_CHATS, "The hangup waited for all of the chat");
+    close(a);
+    close(b);
+}
@@ -0,0 +1,337 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <criterion/criterion.h>
+
+#include "resample.h"
+#include "media.h"
+#include "tone.h"
+#include "plc.h"
+#include "adpcm.h"
+#include "recorder.h"
+#include "tu.h"
+#include "tu_ext.h"
+
+#define SUITE media_suite
+
+#define TONE_AMPLITUDE 16000.0
+#define SETTLE 64
+
+/*
+ * Fill a buffer with a sine tone, delayed by a (possibly fractional) number of samples.
+ */
+static void tone(int16_t *buf, size_t n, double freq, int rate, double delay) {
+    for(size_t i = 0; i < n; i++) {
+        buf[i] = (int16_t)lrint(TONE_AMPLITUDE * sin(2 * M_PI * freq * (i - delay) / rate));
+    }
+}
+
+/*
+ * Signal-to-noise ratio (dB) of a signal against its reference, skipping the filter warm-up.
+ */
+static double snr(const int16_t *sig, const int16_t *ref, size_t n) {
+    double s = 0, e = 0;
+    for(size_t i = SETTLE; i < n; i++) {
+        s += (double)ref[i] * ref[i];
+        e += ((double)sig[i] - ref[i]) * ((double)sig[i] - ref[i]);
+    }
+    return 10 * log10(s / (e + 1));
+}
+
+/*
+ * Root-mean-square level of a signal, skipping the filter warm-up.
+ */
+static double rms(const int16_t *sig, size_t n) {
+    double s = 0;
+    for(size_t i = SETTLE; i < n; i++) {
+        s += (double)sig[i] * sig[i];
+    }
+    return sqrt(s / (n - SETTLE));
+}
+
+Test(SUITE, upsample_tone_test, .timeout = 5) {
+    RESAMPLER rs;
+    int16_t in[1600], out[3200], ref[3200];
+    cr_assert_eq(resampler_init(&rs, 8000, 16000), 0);
+    tone(in, 1600, 1000, 8000, 0);
+    size_t n = resampler_process(&rs, in, 1600, out);
+    cr_assert_eq(n, 3200, "expected %d samples, got %zu", 3200, n);
+    // The prototype filter delays the signal by 31 samples at 16 kHz.
+    tone(ref, 3200, 1000, 16000, 31);
+    double r = snr(out, ref, n);
+    cr_assert_gt(r, 40.0, "SNR too low: %f dB", r);
+}
+
+Test(SUITE, downsample_tone_test, .timeout = 5) {
+    RESAMPLER rs;
+    int16_t in[3200], out[1600], ref[1600];
+    cr_assert_eq(resampler_init(&rs, 16000, 8000), 0);
+    tone(in, 3200, 1000, 16000, 0);
+    size_t n = resampler_process(&rs, in, 3200, out);
+    cr_assert_eq(n, 1600, "expected %d samples, got %zu", 1600, n);
+    tone(ref, 1600, 1000, 8000, 15.5);
+    double r = snr(out, ref, n);
+    cr_assert_gt(r, 40.0, "SNR too low: %f dB", r);
+}
+
+Test(SUITE, downsample_alias_test, .timeout = 5) {
+    RESAMPLER rs;
+    int16_t in[3200], out[1600];
+    cr_assert_eq(resampler_init(&rs, 16000, 8000), 0);
+    // A 6 kHz tone cannot be represented at 8 kHz and must not alias down to 2 kHz.
+    tone(in, 3200, 6000, 16000, 0);
+    size_t n = resampler_process(&rs, in, 3200, out);
+    double level = 20 * log10(rms(out, n) / (TONE_AMPLITUDE / sqrt(2)) + 1e-9);
+    cr_assert_lt(level, -60.0, "alias only attenuated by %f dB", level);
+}
+
+Test(SUITE, streaming_matches_oneshot_test, .timeout = 5) {
+    int rates[2][2] = { { 8000, 16000 }, { 16000, 8000 } };
+    int16_t in[1000], whole[2000], parts[2000];
+    tone(in, 1000, 440, 8000, 0);
+    for(int r = 0; r < 2; r++) {
+        RESAMPLER a, b;
+        resampler_init(&a, rates[r][0], rates[r][1]);
+        resampler_init(&b, rates[r][0], rates[r][1]);
+        size_t n = resampler_process(&a, in, 1000, whole);
+        // Feed the same input in awkward, odd-sized pieces.
+        size_t m = 0, off = 0, step = 1;
+        while(off < 1000) {
+            size_t len = off + step > 1000 ? 1000 - off : step;
+            m += resampler_process(&b, in + off, len, parts + m);
+            off += len;
+            step = step * 3 % 301 + 1;
+        }
+        cr_assert_eq(n, m, "expected %zu samples, got %zu", n, m);
+        cr_assert_arr_eq(whole, parts, n * sizeof(int16_t));
+    }
+}
+
+Test(SUITE, unsupported_rate_test, .timeout = 5) {
+    RESAMPLER rs;
+    cr_assert_eq(resampler_init(&rs, 8000, 44100), -1);
+    cr_assert_eq(resampler_init(&rs, 32000, 64000), -1);
+    MEDIA_STREAM ms;
+    cr_assert_eq(media_stream_init(&ms, 11025), -1);
+}
+
+Test(SUITE, mixed_rate_conference_test, .timeout = 5) {
+    MEDIA_STREAM nb, wb;
+    media_stream_init(&nb, MEDIA_NARROWBAND_RATE);
+    media_stream_init(&wb, MEDIA_WIDEBAND_RATE);
+    MEDIA_STREAM *ms[2] = { &nb, &wb };
+    int16_t nb_in[MEDIA_FRAME_SAMPLES(8000)], nb_out[MEDIA_FRAME_SAMPLES(8000)];
+    int16_t wb_out[MEDIA_FRAME_SAMPLES(16000)];
+    int16_t *out[2] = { nb_out, wb_out };
+    double nb_level = 0, wb_level = 0;
+    // Only the narrowband party talks: the wideband party must hear it, and the
+    // narrowband party must not hear itself.
+    for(int f = 0; f < 10; f++) {
+        for(int i = 0; i < MEDIA_FRAME_SAMPLES(8000); i++) {
+            int t = f * MEDIA_FRAME_SAMPLES(8000) + i;
+            nb_in[i] = (int16_t)lrint(TONE_AMPLITUDE * sin(2 * M_PI * 500 * t / 8000));
+        }
+        const int16_t *in[2] = { nb_in, NULL };
+        cr_assert_eq(media_mix(ms, in, out, 2), 0);
+        if(f >= 2) {
+            nb_level += rms(nb_out, MEDIA_FRAME_SAMPLES(8000));
+            wb_level += rms(wb_out, MEDIA_FRAME_SAMPLES(16000));
+        }
+    }
+    cr_assert_lt(nb_level / 8, 1.0, "talker hears itself at rms %f", nb_level / 8);
+    cr_assert_gt(wb_level / 8, TONE_AMPLITUDE / 2, "listener rms only %f", wb_level / 8);
+}
+
+Test(SUITE, shared_tone_cursor_test, .timeout = 5) {
+    cr_assert_eq(tones_init(), 0);
+    size_t a = 0, b = 0, len_a, len_b;
+    // Two listeners at the same point in the cadence read the very same samples.
+    const int16_t *pa = tone_frame(TONE_RINGBACK, 8000, &a, &len_a);
+    const int16_t *pb = tone_frame(TONE_RINGBACK, 8000, &b, &len_b);
+    cr_assert_not_null(pa);
+    cr_assert_eq(pa, pb, "listeners do not share the tone buffer");
+    cr_assert_eq(len_a, MEDIA_FRAME_SAMPLES(8000));
+    cr_assert_eq(a, len_a);
+    // Ringback is 2 s on, 4 s off.
+    size_t c = 0, on = 0, off = 0, len;
+    for(int f = 0; f < 6000 / MEDIA_FRAME_MSEC; f++) {
+        const int16_t *p = tone_frame(TONE_RINGBACK, 16000, &c, &len);
+        cr_assert_eq(len, MEDIA_FRAME_SAMPLES(16000));
+        for(size_t i = 0; i < len; i++) {
+            if(p[i]) {
+                on++;
+            }
+            else {
+                off++;
+            }
+        }
+    }
+    cr_assert_gt(on, 16000 * 19 / 10, "burst too short: %zu samples", on);
+    cr_assert_gt(off, 16000 * 4 - 100, "silence too short: %zu samples", off);
+    cr_assert_eq(c, 0, "cadence did not wrap around");
+    cr_assert_eq(tone_for_state(TU_CONNECTED), -1);
+    cr_assert_eq(tone_for_state(TU_BUSY_SIGNAL), TONE_BUSY);
+    tones_fini();
+}
+
+Test(SUITE, tone_restart_test, .timeout = 5) {
+    cr_assert_eq(tones_init(), 0);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    TU *tu = tu_init(sv[0]);
+    size_t len;
+    cr_assert_eq(tu_pickup(tu), 0);
+    const int16_t *first = tu_tone_frame(tu, &len);
+    cr_assert_not_null(first);
+    for(int f = 0; f < 10; f++) {
+        tu_tone_frame(tu, &len);
+    }
+    // Back in the same state, without a frame read in between, the cadence starts over.
+    cr_assert_eq(tu_hangup(tu), 0);
+    cr_assert_eq(tu_pickup(tu), 0);
+    cr_assert_eq(tu_tone_frame(tu, &len), first, "dial tone resumed partway through its cadence");
+    tu_unref(tu, "Test done.");
+    close(sv[1]);
+    tones_fini();
+}
+
+Test(SUITE, tone_buffer_readonly_test, .timeout = 5, .signal = SIGSEGV) {
+    size_t cursor = 0, len;
+    tones_init();
+    int16_t *pcm = (int16_t *)tone_frame(TONE_DIAL, 8000, &cursor, &len);
+    pcm[1] = 0;
+}
+
+/*
+ * Voiced-speech-like test signal: a 125 Hz fundamental with two harmonics.
+ */
+static int16_t voiced(long t, int rate) {
+    double x = 0.6 * sin(2 * M_PI * 125 * t / rate) + 0.3 * sin(2 * M_PI * 250 * t / rate)
+             + 0.1 * sin(2 * M_PI * 375 * t / rate);
+    return (int16_t)lrint(TONE_AMPLITUDE * x);
+}
+
+Test(SUITE, plc_single_loss_test, .timeout = 5) {
+    int rates[2] = { 8000, 16000 };
+    for(int r = 0; r < 2; r++) {
+        PLC plc;
+        int n = MEDIA_FRAME_SAMPLES(rates[r]);
+        int16_t frame[MEDIA_MAX_FRAME], ref[MEDIA_MAX_FRAME];
+        cr_assert_eq(plc_init(&plc, rates[r]), 0);
+        long t = 0;
+        for(int f = 0; f < 5; f++, t += n) {
+            for(int i = 0; i < n; i++) {
+                frame[i] = voiced(t + i, rates[r]);
+            }
+            plc_good_frame(&plc, frame, n);
+        }
+        // A single lost frame of a periodic signal is replaced by a close copy of it.
+        plc_lost_frame(&plc, frame, n);
+        for(int i = 0; i < n; i++) {
+            ref[i] = voiced(t + i, rates[r]);
+        }
+        double e = 0, s = 0;
+        for(int i = 0; i < n; i++) {
+            s += (double)ref[i] * ref[i];
+            e += ((double)frame[i] - ref[i]) * ((double)frame[i] - ref[i]);
+        }
+        cr_assert_gt(10 * log10(s / (e + 1)), 15.0, "poor concealment at %d Hz", rates[r]);
+    }
+}
+
+Test(SUITE, plc_long_loss_test, .timeout = 5) {
+    PLC plc;
+    int n = MEDIA_FRAME_SAMPLES(8000);
+    int16_t frame[MEDIA_MAX_FRAME];
+    plc_init(&plc, 8000);
+    long t = 0;
+    for(int f = 0; f < 5; f++, t += n) {
+        for(int i = 0; i < n; i++) {
+            frame[i] = voiced(t + i, 8000);
+        }
+        plc_good_frame(&plc, frame, n);
+    }
+    // After 60 ms the concealment has faded to silence.
+    for(int f = 0; f < 4; f++, t += n) {
+        plc_lost_frame(&plc, frame, n);
+    }
+    for(int i = 0; i < n; i++) {
+        cr_assert_eq(frame[i], 0, "sample %d not silent: %d", i, frame[i]);
+    }
+    // When audio resumes, it fades in from the silence rather than starting with a click.
+    for(int i = 0; i < n; i++) {
+        frame[i] = voiced(t + i, 8000);
+    }
+    int16_t first = voiced(t, 8000);
+    plc_good_frame(&plc, frame, n);
+    cr_assert_lt(abs(frame[0]), abs(first) / 4 + 1, "no fade-in: %d", frame[0]);
+    cr_assert_eq(frame[n - 1], voiced(t + n - 1, 8000));
+}
+
+Test(SUITE, adpcm_round_trip_test, .timeout = 5) {
+    ADPCM_STATE enc, dec;
+    int16_t in[1601], out[1601];
+    uint8_t packed[801];
+    adpcm_init(&enc);
+    adpcm_init(&dec);
+    for(int i = 0; i < 1601; i++) {
+        in[i] = voiced(i, 8000);
+    }
+    size_t len = adpcm_encode(&enc, in, 1601, packed);
+    cr_assert_eq(len, 801);
+    cr_assert_eq(adpcm_decode(&dec, packed, 1601, out), 801);
+    cr_assert_eq(enc.predictor, dec.predictor, "decoder out of step with encoder");
+    cr_assert_eq(enc.index, dec.index, "decoder out of step with encoder");
+    double r = snr(out, in, 1601);
+    cr_assert_gt(r, 25.0, "SNR too low: %f dB", r);
+}
+
+Test(SUITE, recording_round_trip_test, .timeout = 5) {
+    char path[] = "/tmp/pbx_recording_XXXXXX";
+    close(mkstemp(path));
+    int codecs[2] = { RECORDING_IMA_ADPCM, RECORDING_PCM16 };
+    int16_t in[8000], out[8000];
+    for(int i = 0; i < 8000; i++) {
+        in[i] = voiced(i, 8000);
+    }
+    for(int c = 0; c < 2; c++) {
+        RECORDER rec;
+        PLAYER pl;
+        cr_assert_eq(recorder_open(&rec, path, codecs[c], 8000), 0);
+        // Feed the recorder in frames, as the media path does.
+        for(int i = 0; i < 8000; i += MEDIA_FRAME_SAMPLES(8000)) {
+            cr_assert_eq(recorder_write(&rec, in + i, MEDIA_FRAME_SAMPLES(8000)), 0);
+        }
+        cr_assert_eq(recorder_close(&rec), 0);
+
+        struct stat st;
+        stat(path, &st);
+        cr_assert_eq(player_open(&pl, path), 0);
+        cr_assert_eq(pl.header.codec, codecs[c]);
+        cr_assert_eq(pl.header.rate, 8000);
+        long n = 0, ret;
+        while((ret = player_read(&pl, out + n, 333)) > 0) {
+            n += ret;
+        }
+        player_close(&pl);
+        cr_assert_eq(n, 8000, "played back %ld samples", n);
+        if(codecs[c] == RECORDING_PCM16) {
+            cr_assert_arr_eq(in, out, sizeof(in));
+        }
+        else {
+            cr_assert_lt(st.st_size, sizeof(in) / 3, "poor compression: %ld bytes", (long)st.st_size);
+            cr_assert_gt(snr(out, in, 8000), 25.0);
+        }
+    }
+    FILE *f = fopen(path, "w");
+    fputs("not a recording", f);
+    fclose(f);
+    PLAYER pl;
+    cr_assert_eq(player_open(&pl, path), -1);
+    unlink(path);
+}
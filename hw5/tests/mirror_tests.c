@@ -0,0 +1,136 @@
+/*
+ * Tests of the registry mirror: slots on their own, and a UDP phone carrying on with
+ * its session after the server is killed and started again.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+#include "mirror.h"
+#include "udp.h"
+
+#define MIRROR_PATH "/tmp/pbx_test.mirror"
+
+static int server_pid;
+
+static void start_mirror() {
+    server_pid = start_server(SERVER_PORT_STR, "-d", SERVER_PORT_STR, "-M", MIRROR_PATH, NULL);
+}
+
+static void init() {
+    kill_servers();
+    unlink(MIRROR_PATH);
+    start_mirror();
+}
+
+static void fini() {
+    stop_server(&server_pid);
+    unlink(MIRROR_PATH);
+}
+
+Test(mirror_suite, slot_test, .timeout = 10) {
+    unlink(MIRROR_PATH);
+    cr_assert_eq(mirror_open(MIRROR_PATH), 0);
+    MIRROR_SLOT m, got;
+    memset(&m, 0, sizeof(m));
+    m.used = 1;
+    m.token = 0x12340007;
+    m.next_seq = 5;
+    m.tu.ext = 70000;
+    mirror_write(7, &m);
+    cr_assert_eq(mirror_read(7, &got), 1);
+    cr_assert_eq(got.token, m.token);
+    cr_assert_eq(got.next_seq, 5);
+    cr_assert_eq(got.tu.ext, 70000);
+    cr_assert_eq(got.seq % 2, 0);
+    cr_assert_eq(mirror_read(8, &got), 0);
+
+    // The slots stay in the file, and a slot left in the middle of a write is torn.
+    cr_assert_eq(mirror_open(MIRROR_PATH), 0);
+    cr_assert_eq(mirror_read(7, &got), 1);
+    int fd = open(MIRROR_PATH, O_RDWR);
+    struct stat st;
+    fstat(fd, &st);
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    cr_assert_neq(map, MAP_FAILED);
+    MIRROR_SLOT *slots = (MIRROR_SLOT *)(map + (st.st_size - MIRROR_SLOTS * sizeof(MIRROR_SLOT)));
+    slots[7].seq++;
+    cr_assert_eq(mirror_read(7, &got), -1);
+    mirror_clear(7);
+    cr_assert_eq(mirror_read(7, &got), 0);
+
+    // A file with another layout is cleared.
+    mirror_write(7, &m);
+    ((MIRROR_HEADER *)map)->version = MIRROR_VERSION + 1;
+    munmap(map, st.st_size);
+    close(fd);
+    cr_assert_eq(mirror_open(MIRROR_PATH), 0);
+    cr_assert_eq(mirror_read(7, &got), 0);
+    unlink(MIRROR_PATH);
+}
+
+Test(mirror_suite, foreign_slot_test, .fini = fini, .timeout = 30) {
+    kill_servers();
+    unlink(MIRROR_PATH);
+    cr_assert_eq(mirror_open(MIRROR_PATH), 0);
+    MIRROR_SLOT m;
+    memset(&m, 0, sizeof(m));
+    m.used = 1;
+    m.token = 0x12340009;
+    m.next_seq = 1;
+    m.tu.ext = 0x40000000;
+    mirror_write(9, &m);
+
+    // The server starts all the same, and clears the slot with an extension out of range.
+    start_mirror();
+    int fd = connect_tu(SERVER_PORT);
+    char line[64];
+    cr_assert_gt(read(fd, line, sizeof(line)), 0, "Server did not greet the client");
+    cr_assert_eq(kill(server_pid, 0), 0, "Server is gone");
+    cr_assert_eq(mirror_read(9, &m), 0);
+    close(fd);
+}
+
+Test(mirror_suite, crash_recovery_test, .init = init, .fini = fini, .timeout = 30) {
+    int fd = connect_udp(SERVER_PORT);
+
+    UDP_HEADER h;
+    char payload[UDP_MAX_PAYLOAD + 1];
+    register_udp(fd, &h, payload);
+    uint32_t token = h.token;
+    int ext = atoi(payload + 8);
+    put_datagram(fd, token, 2, 1, "pickup\r\n");
+    expect_datagram(fd, 2, &h, payload);
+    cr_assert_str_eq(payload, "DIAL TONE\r\n");
+    put_datagram(fd, token, 0, 2, "");
+
+    // The server crashes, and another takes up the session, with the state of its TU.
+    usleep(100000);
+    stop_server(&server_pid);
+    start_mirror();
+    expect_datagram(fd, 3, &h, payload);
+    cr_assert_eq(h.token, token);
+    cr_assert_str_eq(payload, "DIAL TONE\r\n");
+
+    // The phone carries on at its extension, even though its datagram 3 was lost.
+    put_datagram(fd, token, 4, 3, "hangup\r\n");
+    expect_datagram(fd, 4, &h, payload);
+    cr_assert_eq(h.ack, 4);
+    char expected[32];
+    snprintf(expected, sizeof(expected), "ON HOOK %d\r\n", ext);
+    cr_assert_str_eq(payload, expected);
+    close(fd);
+}
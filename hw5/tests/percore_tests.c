@@ -0,0 +1,190 @@
+/*
+ * Tests of one shard per core: shards pinned to their cores, connections steered to
+ * the shard on the core that took them in, and a shard that crashes being started again.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+#include "pbx_ext.h"
+#include "shard.h"
+
+#define CORES 2
+#define MAX_CLIENTS 32
+
+static int server_pid;
+
+static void init() {
+    kill_servers();
+    server_pid = start_server(SERVER_PORT_STR, "-C", QUOTE(CORES), NULL);
+}
+
+static void fini() {
+    stop_server(&server_pid);
+    kill_servers();
+}
+
+/*
+ * Connect clients until there is one on the first core and two on the second.
+ * The kernel chooses the core of each connection.
+ */
+static void connect_cores(int fds[3], int exts[3]) {
+    int span = PBX_VIRTUAL_BASE / CORES;
+    int spare[MAX_CLIENTS], nspare = 0;
+    fds[0] = fds[1] = fds[2] = -1;
+    while(fds[0] == -1 || fds[1] == -1 || fds[2] == -1) {
+	cr_assert(nspare < MAX_CLIENTS, "Connections did not reach both cores");
+	int fd = connect_tu(SERVER_PORT);
+	int ext = expect(fd, "ON HOOK ");
+	int i = ext < span ? 0 : fds[1] == -1 ? 1 : 2;
+	if(fds[i] == -1) {
+	    fds[i] = fd;
+	    exts[i] = ext;
+	}
+	else {
+	    spare[nspare++] = fd;
+	}
+    }
+    for(int i = 0; i < nspare; i++)
+	close(spare[i]);
+}
+
+/*
+ * Get the pids of the shards, in the order in which they were started.
+ */
+static void shard_pids(int pids[CORES]) {
+    char path[64], line[256] = "";
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", server_pid, server_pid);
+    FILE *f = fopen(path, "r");
+    cr_assert(f && fgets(line, sizeof(line), f), "Cannot list the shards");
+    fclose(f);
+    int n = 0;
+    for(char *p = strtok(line, " \n"); p && n < CORES; p = strtok(NULL, " \n"))
+	pids[n++] = atoi(p);
+    cr_assert_eq(n, CORES, "Expected %d shards, found %d", CORES, n);
+}
+
+Test(percore_suite, pinning_test, .init = init, .fini = fini, .timeout = 30) {
+    // Clients of both shards, so that each has threads serving them as well.
+    int fds[3], exts[3];
+    connect_cores(fds, exts);
+    int pids[CORES];
+    shard_pids(pids);
+
+    // Shard i, and every thread of it, runs on the i'th CPU open to the server only,
+    // going round the CPUs again if there are more shards.
+    cpu_set_t cpus;
+    cr_assert_eq(sched_getaffinity(0, sizeof(cpus), &cpus), 0);
+    for(int i = 0; i < CORES; i++) {
+	int k = i % CPU_COUNT(&cpus), cpu = -1;
+	while(k >= 0)
+	    if(CPU_ISSET(++cpu, &cpus))
+		k--;
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/task", pids[i]);
+	DIR *d = opendir(path);
+	cr_assert_not_null(d);
+	int threads = 0;
+	struct dirent *de;
+	while((de = readdir(d))) {
+	    if(de->d_name[0] == '.')
+		continue;
+	    cpu_set_t set;
+	    cr_assert_eq(sched_getaffinity(atoi(de->d_name), sizeof(set), &set), 0);
+	    cr_assert_eq(CPU_COUNT(&set), 1, "Thread %s of shard %d is not pinned", de->d_name, i);
+	    cr_assert(CPU_ISSET(cpu, &set), "Thread %s of shard %d is not on CPU %d", de->d_name, i, cpu);
+	    threads++;
+	}
+	closedir(d);
+	cr_assert_gt(threads, 1, "Shard %d has no threads of its own", i);
+    }
+    for(int i = 0; i < 3; i++)
+	close(fds[i]);
+}
+
+Test(percore_suite, steering_test, .timeout = 30) {
+    // Two sockets sharing a port, the first with the program that steers connections.
+    int l[2];
+    struct sockaddr_in sin = { 0 };
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sin);
+    for(int i = 0; i < 2; i++) {
+	int one = 1;
+	l[i] = socket(AF_INET, SOCK_STREAM, 0);
+	cr_assert_eq(setsockopt(l[i], SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)), 0);
+	cr_assert_eq(bind(l[i], (struct sockaddr *)&sin, sizeof(sin)), 0);
+	cr_assert_eq(getsockname(l[i], (struct sockaddr *)&sin, &len), 0);
+	cr_assert_eq(listen(l[i], 64), 0);
+	fcntl(l[i], F_SETFL, O_NONBLOCK);
+    }
+    cr_assert_eq(shard_steer(l[0], 2), 0);
+
+    // Connections made on CPU c all go to the socket c % 2, where the hash would
+    // spread them over both.
+    cpu_set_t cpus;
+    cr_assert_eq(sched_getaffinity(0, sizeof(cpus), &cpus), 0);
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if(!CPU_ISSET(cpu, &cpus))
+	    continue;
+	cpu_set_t one;
+	CPU_ZERO(&one);
+	CPU_SET(cpu, &one);
+	cr_assert_eq(sched_setaffinity(0, sizeof(one), &one), 0);
+	for(int i = 0; i < 16; i++) {
+	    int fd = socket(AF_INET, SOCK_STREAM, 0);
+	    cr_assert_eq(connect(fd, (struct sockaddr *)&sin, sizeof(sin)), 0);
+	    int other = accept(l[1 - cpu % 2], NULL, NULL);
+	    int got = accept(l[cpu % 2], NULL, NULL);
+	    cr_assert_eq(other, -1, "Connection from CPU %d went to socket %d", cpu, 1 - cpu % 2);
+	    cr_assert_neq(got, -1, "Connection from CPU %d was not taken", cpu);
+	    close(got);
+	    close(fd);
+	}
+    }
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+    close(l[0]);
+    close(l[1]);
+}
+
+Test(percore_suite, core_restart_test, .init = init, .fini = fini, .timeout = 30) {
+    int fds[3], exts[3];
+    connect_cores(fds, exts);
+    int a = fds[0], b = fds[1];
+    call(a, b, exts[1]);
+
+    // The shard of B crashes, taking the call with it, and is started again.
+    int pids[CORES];
+    shard_pids(pids);
+    kill(pids[1], SIGKILL);
+    expect(a, "DIAL TONE");
+    dprintf(a, "hangup\r\n");
+    expect(a, "ON HOOK ");
+    close(a);
+    close(b);
+    close(fds[2]);
+    connect_cores(fds, exts);
+    call(fds[0], fds[1], exts[1]);
+
+    // SIGHUP stops all the shards, and the server with them.
+    int status;
+    kill(server_pid, SIGHUP);
+    cr_assert_eq(waitpid(server_pid, &status, 0), server_pid);
+    server_pid = 0;
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS, "Server did not exit cleanly");
+    for(int i = 0; i < 3; i++)
+	close(fds[i]);
+}
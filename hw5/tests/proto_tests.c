@@ -0,0 +1,363 @@
+/*
+ * Tests of the binary protocol: switching to it, request IDs in responses,
+ * events, rejected requests, trunks, and audio.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+#include "proto.h"
+#include "media.h"
+
+static int server_pid;
+
+static void init() {
+    kill_servers();
+    server_pid = start_server(SERVER_PORT_STR, NULL);
+}
+
+static void fini() {
+    stop_server(&server_pid);
+}
+
+#define VOICEMAIL_DIR "/tmp/pbx_test.voicemail"
+
+static void init_voicemail() {
+    kill_servers();
+    system("rm -rf " VOICEMAIL_DIR);
+    server_pid = start_server(SERVER_PORT_STR, "-s", VOICEMAIL_DIR, NULL);
+}
+
+static void fini_voicemail() {
+    fini();
+    system("rm -rf " VOICEMAIL_DIR);
+}
+
+/*
+ * Read a frame from the server, checking its type, ID and kind, and return its payload
+ * as a string.
+ */
+static void expect_frame(int fd, int type, uint32_t id, int op, char *payload, size_t size) {
+    PROTO_HEADER h;
+    read_fully(fd, &h, sizeof(h));
+    cr_assert_eq(h.magic, PROTO_MAGIC);
+    cr_assert_eq(h.type, type, "Wrong frame type %d", h.type);
+    cr_assert_eq(ntohl(h.id), id, "Wrong request ID %u", ntohl(h.id));
+    cr_assert_eq(h.op, op, "Wrong op %d", h.op);
+    uint32_t len = ntohl(h.len);
+    cr_assert_lt(len, size);
+    read_fully(fd, payload, len);
+    payload[len] = '\0';
+}
+
+/*
+ * Append a request frame to a buffer.
+ */
+static size_t put_request(char *buf, int op, uint32_t id, int32_t arg, const char *text) {
+    PROTO_HEADER h;
+    size_t len = text ? strlen(text) : 0;
+    proto_header_pack(&h, PROTO_REQUEST, op, 0, id, arg, len);
+    memcpy(buf, &h, sizeof(h));
+    if(text)
+	memcpy(buf + sizeof(h), text, len);
+    return sizeof(h) + len;
+}
+
+Test(proto_suite, pipelined_requests_test, .init = init, .fini = fini, .timeout = 30) {
+    int a = connect_tu(SERVER_PORT), b = connect_tu(SERVER_PORT);
+    char line[256], payload[256], buf[1024];
+    read_line(a, line, sizeof(line));
+    int ext_a = atoi(line + strlen("ON HOOK "));
+    read_line(b, line, sizeof(line));
+    int ext_b = atoi(line + strlen("ON HOOK "));
+
+    // Switch to the binary protocol and send several requests without waiting.
+    size_t len = sprintf(buf, "proto 2\r\n");
+    len += put_request(buf + len, PROTO_OP_PICKUP, 7, 0, NULL);
+    len += put_request(buf + len, PROTO_OP_DIAL, 8, ext_b, NULL);
+    cr_assert_eq(write(a, buf, len), len);
+    expect_frame(a, PROTO_RESPONSE, 0, PROTO_OP_STATE, payload, sizeof(payload));
+    snprintf(line, sizeof(line), "ON HOOK %d", ext_a);
+    cr_assert_str_eq(payload, line);
+    expect_frame(a, PROTO_RESPONSE, 7, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "DIAL TONE");
+    expect_frame(a, PROTO_RESPONSE, 8, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "RING BACK");
+
+    // What the peer does arrives as events.
+    read_line(b, line, sizeof(line));
+    cr_assert_str_eq(line, "RINGING\r\n");
+    dprintf(b, "pickup\r\nchat hello there\r\n");
+    expect_frame(a, PROTO_EVENT, 0, PROTO_OP_STATE, payload, sizeof(payload));
+    snprintf(line, sizeof(line), "CONNECTED %d", ext_b);
+    cr_assert_str_eq(payload, line);
+    expect_frame(a, PROTO_EVENT, 0, PROTO_OP_CHAT, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "hello there");
+
+    // A chat is answered by a response, and reaches a text peer as a line.
+    len = put_request(buf, PROTO_OP_CHAT, 9, 0, "hi");
+    cr_assert_eq(write(a, buf, len), len);
+    expect_frame(a, PROTO_RESPONSE, 9, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_str_eq(payload, line);
+    do {
+	read_line(b, line, sizeof(line));
+    } while(strncmp(line, "chat", 4));
+    cr_assert_str_eq(line, "chat hi\r\n");
+}
+
+Test(proto_suite, reject_test, .init = init, .fini = fini, .timeout = 30) {
+    int a = connect_tu(SERVER_PORT);
+    char line[256], payload[256], buf[1024];
+    read_line(a, line, sizeof(line));
+    dprintf(a, "proto 2\r\n");
+    expect_frame(a, PROTO_RESPONSE, 0, PROTO_OP_STATE, payload, sizeof(payload));
+
+    // Requests with an unknown command are rejected, and their payload skipped.
+    size_t len = put_request(buf, PROTO_NUM_OPS, 5, 0, "ignored");
+    len += put_request(buf + len, PROTO_OP_STATE, 6, 0, NULL);
+    len += put_request(buf + len, PROTO_OP_PICKUP, 7, 0, NULL);
+    cr_assert_eq(write(a, buf, len), len);
+    PROTO_HEADER h;
+    for(uint32_t id = 5; id <= 6; id++) {
+	read_fully(a, &h, sizeof(h));
+	cr_assert_eq(h.type, PROTO_RESPONSE);
+	cr_assert_eq(ntohl(h.id), id);
+	cr_assert(h.flags & PROTO_FLAG_ERROR, "Request was not rejected");
+	cr_assert_eq(ntohl(h.len), 0);
+    }
+    expect_frame(a, PROTO_RESPONSE, 7, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "DIAL TONE");
+}
+
+/*
+ * Read a frame from a trunk, checking its channel, and return its payload as a string.
+ */
+static void expect_trunk_frame(int fd, uint32_t channel, int type, uint32_t id, int op,
+			       char *payload, size_t size) {
+    uint32_t ch;
+    read_fully(fd, &ch, sizeof(ch));
+    cr_assert_eq(ntohl(ch), channel, "Wrong channel %u", ntohl(ch));
+    expect_frame(fd, type, id, op, payload, size);
+}
+
+/*
+ * Append a request frame on a channel of a trunk to a buffer.
+ */
+static size_t put_trunk_request(char *buf, uint32_t channel, int op, uint32_t id, int32_t arg,
+				const char *text) {
+    uint32_t ch = htonl(channel);
+    memcpy(buf, &ch, sizeof(ch));
+    return sizeof(ch) + put_request(buf + sizeof(ch), op, id, arg, text);
+}
+
+/*
+ * Read one frame from each of two channels of a trunk, which may come in either order,
+ * and return the payload of each.
+ */
+static void expect_trunk_pair(int fd, uint32_t ch_1, char *payload_1, uint32_t ch_2,
+			      char *payload_2, size_t size) {
+    for(int i = 0; i < 2; i++) {
+	uint32_t ch;
+	PROTO_HEADER h;
+	read_fully(fd, &ch, sizeof(ch));
+	read_fully(fd, &h, sizeof(h));
+	ch = ntohl(ch);
+	cr_assert(ch == ch_1 || ch == ch_2, "Wrong channel %u", ch);
+	char *payload = ch == ch_1 ? payload_1 : payload_2;
+	uint32_t len = ntohl(h.len);
+	cr_assert_lt(len, size);
+	read_fully(fd, payload, len);
+	payload[len] = '\0';
+    }
+}
+
+Test(proto_suite, trunk_test, .init = init, .fini = fini, .timeout = 30) {
+    int a = connect_tu(SERVER_PORT);
+    char line[256], payload[256], buf[1024];
+    read_line(a, line, sizeof(line));
+    dprintf(a, "proto 3\r\n");
+    expect_trunk_frame(a, 0, PROTO_RESPONSE, 0, PROTO_OP_STATE, payload, sizeof(payload));
+    line[strlen(line) - 2] = '\0';
+    cr_assert_str_eq(payload, line);
+
+    // Open two channels, each with a virtual TU of its own.
+    size_t len = put_trunk_request(buf, 1, PROTO_OP_OPEN, 1, 0, NULL);
+    len += put_trunk_request(buf + len, 2, PROTO_OP_OPEN, 2, 0, NULL);
+    cr_assert_eq(write(a, buf, len), len);
+    expect_trunk_frame(a, 1, PROTO_RESPONSE, 1, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_eq(strncmp(payload, "ON HOOK ", 8), 0);
+    int ext_1 = atoi(payload + 8);
+    expect_trunk_frame(a, 2, PROTO_RESPONSE, 2, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_eq(strncmp(payload, "ON HOOK ", 8), 0);
+    int ext_2 = atoi(payload + 8);
+    cr_assert_neq(ext_1, ext_2);
+
+    // A channel that is already open cannot be opened again, nor can one that is not
+    // open be used.
+    len = put_trunk_request(buf, 1, PROTO_OP_OPEN, 3, 0, NULL);
+    len += put_trunk_request(buf + len, 3, PROTO_OP_PICKUP, 4, 0, NULL);
+    cr_assert_eq(write(a, buf, len), len);
+    PROTO_HEADER h;
+    for(uint32_t id = 3; id <= 4; id++) {
+	uint32_t ch;
+	read_fully(a, &ch, sizeof(ch));
+	read_fully(a, &h, sizeof(h));
+	cr_assert_eq(ntohl(h.id), id);
+	cr_assert(h.flags & PROTO_FLAG_ERROR, "Request was not rejected");
+    }
+
+    // One virtual TU calls the other.
+    len = put_trunk_request(buf, 1, PROTO_OP_PICKUP, 5, 0, NULL);
+    len += put_trunk_request(buf + len, 1, PROTO_OP_DIAL, 6, ext_2, NULL);
+    cr_assert_eq(write(a, buf, len), len);
+    expect_trunk_frame(a, 1, PROTO_RESPONSE, 5, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "DIAL TONE");
+    expect_trunk_pair(a, 1, payload, 2, line, sizeof(payload));
+    cr_assert_str_eq(payload, "RING BACK");
+    cr_assert_str_eq(line, "RINGING");
+
+    // Closing the called channel ends the call.
+    len = put_trunk_request(buf, 2, PROTO_OP_CLOSE, 7, 0, NULL);
+    cr_assert_eq(write(a, buf, len), len);
+    expect_trunk_pair(a, 1, payload, 2, line, sizeof(payload));
+    cr_assert_str_eq(payload, "DIAL TONE");
+    snprintf(buf, sizeof(buf), "ON HOOK %d", ext_2);
+    cr_assert_str_eq(line, buf);
+}
+
+/*
+ * Append an audio request to a buffer, holding a frame of narrowband audio, or nothing
+ * if the frame is to count as lost.
+ */
+static size_t put_audio(char *buf, uint32_t id, int lost) {
+    PROTO_HEADER h;
+    size_t len = lost ? 0 : MEDIA_FRAME_SAMPLES(MEDIA_NARROWBAND_RATE) * sizeof(int16_t);
+    proto_header_pack(&h, PROTO_REQUEST, PROTO_OP_AUDIO, 0, id, 0, len);
+    memcpy(buf, &h, sizeof(h));
+    int16_t *pcm = (int16_t *)(buf + sizeof(h));
+    for(size_t i = 0; i < len / sizeof(int16_t); i++)
+	pcm[i] = htons((i % 20) * 1000 - 10000);
+    return sizeof(h) + len;
+}
+
+/*
+ * Read a frame of call-progress tone sent in response to an audio request, checking
+ * that it is a frame of narrowband audio that is not silent.
+ */
+static void expect_tone(int fd, uint32_t id) {
+    PROTO_HEADER h;
+    int16_t pcm[MEDIA_MAX_FRAME];
+    size_t n = MEDIA_FRAME_SAMPLES(MEDIA_NARROWBAND_RATE);
+    read_fully(fd, &h, sizeof(h));
+    cr_assert_eq(h.type, PROTO_RESPONSE, "Wrong frame type %d", h.type);
+    cr_assert_eq(ntohl(h.id), id, "Wrong request ID %u", ntohl(h.id));
+    cr_assert_eq(h.op, PROTO_OP_AUDIO, "Wrong op %d", h.op);
+    cr_assert_eq(ntohl(h.len), n * sizeof(int16_t));
+    read_fully(fd, pcm, n * sizeof(int16_t));
+    int loud = 0;
+    for(size_t i = 0; i < n; i++)
+	loud |= pcm[i] != 0;
+    cr_assert(loud, "The tone is silent");
+}
+
+/*
+ * Count the voicemail recordings in the spool directory, returning the path of one.
+ */
+static int voicemails(char *path, size_t size) {
+    int count = 0;
+    DIR *d = opendir(VOICEMAIL_DIR);
+    cr_assert_not_null(d);
+    struct dirent *de;
+    while((de = readdir(d))) {
+	if(strstr(de->d_name, ".pbxr")) {
+	    snprintf(path, size, "%s/%s", VOICEMAIL_DIR, de->d_name);
+	    count++;
+	}
+    }
+    closedir(d);
+    return count;
+}
+
+Test(proto_suite, audio_test, .init = init_voicemail, .fini = fini_voicemail, .timeout = 30) {
+    int a = connect_tu(SERVER_PORT), b = connect_tu(SERVER_PORT);
+    char line[256], payload[1024], buf[4096], path[512];
+    read_line(a, line, sizeof(line));
+    int ext_a = atoi(line + strlen("ON HOOK "));
+    read_line(b, line, sizeof(line));
+    int ext_b = atoi(line + strlen("ON HOOK "));
+    dprintf(a, "proto 2\r\n");
+    expect_frame(a, PROTO_RESPONSE, 0, PROTO_OP_STATE, payload, sizeof(payload));
+    dprintf(b, "proto 2\r\n");
+    expect_frame(b, PROTO_RESPONSE, 0, PROTO_OP_STATE, payload, sizeof(payload));
+
+    // Audio sent while the call rings is kept as voicemail once the caller gives up.
+    size_t len = put_request(buf, PROTO_OP_PICKUP, 1, 0, NULL);
+    len += put_request(buf + len, PROTO_OP_DIAL, 2, ext_b, NULL);
+    len += put_audio(buf + len, 3, 0);
+    len += put_audio(buf + len, 4, 1);
+    len += put_audio(buf + len, 5, 0);
+    len += put_request(buf + len, PROTO_OP_HANGUP, 6, 0, NULL);
+    cr_assert_eq(write(a, buf, len), len);
+    expect_frame(a, PROTO_RESPONSE, 1, PROTO_OP_STATE, payload, sizeof(payload));
+    expect_frame(a, PROTO_RESPONSE, 2, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "RING BACK");
+    // Each frame sent, even one that was lost, is answered with a frame of ringback.
+    for(uint32_t id = 3; id <= 5; id++)
+	expect_tone(a, id);
+    expect_frame(a, PROTO_RESPONSE, 6, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_eq(strncmp(payload, "ON HOOK", 7), 0);
+    cr_assert_eq(voicemails(path, sizeof(path)), 1, "No voicemail was kept");
+    char name[64];
+    snprintf(name, sizeof(name), "/%d-%d-", ext_b, ext_a);
+    cr_assert_not_null(strstr(path, name), "Voicemail %s is not for the callee", path);
+    PLAYER pl;
+    cr_assert_eq(player_open(&pl, path), 0);
+    cr_assert_eq(pl.header.codec, RECORDING_IMA_ADPCM);
+    int16_t pcm[1024];
+    cr_assert_eq(player_read(&pl, pcm, 1024), 3 * MEDIA_FRAME_SAMPLES(MEDIA_NARROWBAND_RATE));
+    player_close(&pl);
+    unlink(path);
+    expect_frame(b, PROTO_EVENT, 0, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "RINGING");
+    expect_frame(b, PROTO_EVENT, 0, PROTO_OP_STATE, payload, sizeof(payload));
+
+    // Voicemail from a call that is answered is thrown away, and audio in the call
+    // reaches the peer.
+    len = put_request(buf, PROTO_OP_PICKUP, 7, 0, NULL);
+    len += put_audio(buf + len, 12, 0);
+    len += put_request(buf + len, PROTO_OP_DIAL, 8, ext_b, NULL);
+    len += put_audio(buf + len, 9, 0);
+    cr_assert_eq(write(a, buf, len), len);
+    expect_frame(a, PROTO_RESPONSE, 7, PROTO_OP_STATE, payload, sizeof(payload));
+    expect_tone(a, 12);
+    expect_frame(a, PROTO_RESPONSE, 8, PROTO_OP_STATE, payload, sizeof(payload));
+    expect_tone(a, 9);
+    expect_frame(b, PROTO_EVENT, 0, PROTO_OP_STATE, payload, sizeof(payload));
+    cr_assert_str_eq(payload, "RINGING");
+    len = put_request(buf, PROTO_OP_PICKUP, 10, 0, NULL);
+    cr_assert_eq(write(b, buf, len), len);
+    expect_frame(b, PROTO_RESPONSE, 10, PROTO_OP_STATE, payload, sizeof(payload));
+    expect_frame(a, PROTO_EVENT, 0, PROTO_OP_STATE, payload, sizeof(payload));
+    snprintf(line, sizeof(line), "CONNECTED %d", ext_b);
+    cr_assert_str_eq(payload, line);
+    cr_assert_eq(voicemails(path, sizeof(path)), 0, "Voicemail of an answered call was kept");
+    len = put_audio(buf, 11, 0);
+    cr_assert_eq(write(a, buf, len), len);
+    PROTO_HEADER h;
+    read_fully(b, &h, sizeof(h));
+    cr_assert_eq(h.type, PROTO_EVENT);
+    cr_assert_eq(h.op, PROTO_OP_AUDIO);
+    cr_assert_eq(ntohl(h.len), MEDIA_FRAME_SAMPLES(MEDIA_NARROWBAND_RATE) * sizeof(int16_t));
+}
@@ -0,0 +1,77 @@
+/*
+ * Tests of the token buckets used for rate limiting, driven by a simulated clock.
+ */
+#include <criterion/criterion.h>
+
+#include "ratelimit.h"
+#include "metrics.h"
+
+#define SEC 1000000000ULL
+
+Test(ratelimit_suite, bucket_take_test, .timeout = 5) {
+    TOKEN_BUCKET b;
+    bucket_init(&b, 10, 5, 0);
+
+    // A full bucket allows a burst, then nothing until it refills.
+    for(int i = 0; i < 5; i++)
+	cr_assert_eq(bucket_take(&b, 1, 0), 0, "Command %d of burst was refused", i);
+    cr_assert_eq(bucket_take(&b, 1, 0), -1, "Command beyond burst was allowed");
+    cr_assert_eq(bucket_take(&b, 1, SEC / 20), -1, "Half a token was enough");
+    cr_assert_eq(bucket_take(&b, 1, SEC / 10), 0, "Refilled token was refused");
+
+    // Refilling stops at the burst.
+    int taken = 0;
+    while(bucket_take(&b, 1, 100 * SEC) == 0)
+	taken++;
+    cr_assert_eq(taken, 5, "Expected a burst of 5 after idling, got %d", taken);
+}
+
+Test(ratelimit_suite, bucket_charge_test, .timeout = 5) {
+    TOKEN_BUCKET b;
+    bucket_init(&b, 1000, 1000, 0);
+
+    // Charges within the burst pass without waiting; a larger one waits off its debt.
+    cr_assert_eq(bucket_charge(&b, 600, 0), 0);
+    cr_assert_eq(bucket_charge(&b, 400, 0), 0);
+    uint64_t wait = bucket_charge(&b, 2000, 0);
+    cr_assert(wait >= 2 * SEC - 1000 && wait <= 2 * SEC, "Expected a wait of 2s, got %lu ns", wait);
+    cr_assert_eq(bucket_charge(&b, 0, 2 * SEC), 0, "Debt not repaid after waiting");
+
+    // A bucket without a rate never runs out.
+    bucket_init(&b, 0, 0, 0);
+    cr_assert_eq(bucket_charge(&b, 1e9, 0), 0);
+    cr_assert_eq(bucket_take(&b, 1e9, 0), 0);
+}
+
+Test(ratelimit_suite, rate_class_test, .timeout = 5) {
+    RATE_LIMITS rl;
+    cr_assert_eq(rate_class_add("10-19:2:5000"), 0);
+    cr_assert_eq(rate_class_add("20:0"), 0);
+    cr_assert_eq(rate_class_add("30-29:1"), -1, "Empty range was accepted");
+    cr_assert_eq(rate_class_add("40:x"), -1, "Bad rate was accepted");
+    cr_assert_eq(rate_class_add("40"), -1, "Missing rate was accepted");
+
+    rate_limits_init(&rl, 15);
+    cr_assert_eq(rl.commands.rate, 2);
+    cr_assert_eq(rl.chat.rate, 5000);
+    rate_limits_init(&rl, 20);
+    cr_assert_eq(rl.commands.rate, 0);
+    cr_assert_eq(rl.chat.rate, 0);
+    rate_limits_init(&rl, 25);
+    cr_assert_eq(rl.commands.rate, RATE_DEFAULT_COMMANDS);
+
+    // Commands over the limit are dropped and counted.
+    rate_limits_init(&rl, 10);
+    uint64_t before = metrics_get(METRIC_COMMANDS_THROTTLED);
+    int allowed = 0;
+    for(int i = 0; i < 10; i++)
+	allowed += rate_limit_command(&rl, 0) == 0;
+    cr_assert(allowed >= 2 && allowed <= 3, "Expected 2 commands to pass, got %d", allowed);
+    cr_assert_eq(metrics_get(METRIC_COMMANDS_THROTTLED) - before, 10 - allowed);
+
+    // Essential commands always pass, and hold back the others while in debt.
+    rate_limits_init(&rl, 10);
+    for(int i = 0; i < 10; i++)
+	cr_assert_eq(rate_limit_command(&rl, 1), 0, "Essential command %d dropped", i);
+    cr_assert_eq(rate_limit_command(&rl, 0), -1);
+}
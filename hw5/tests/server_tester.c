@@ -0,0 +1,224 @@
+/*
+ * Helpers for tests that run the server and talk to it over sockets: starting and
+ * stopping servers, connecting clients, and reading what the server sends them.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+
+#define MAX_SERVER_ARGS 16
+
+/*
+ * Kill any server left over from an earlier test.
+ */
+void kill_servers(void) {
+    system("killall -s KILL pbx > /dev/null 2>&1");
+}
+
+/*
+ * Start a server on a port, with further options given as strings up to a NULL.
+ * An option that is not wanted can be dropped by passing NULL in place of its flag,
+ * as long as it comes last.
+ *
+ * @return the pid of the server.
+ */
+int start_server(char *port, ...) {
+    char *argv[MAX_SERVER_ARGS] = { "pbx", "-p", port };
+    int argc = 3;
+    va_list ap;
+    va_start(ap, port);
+    while(argc < MAX_SERVER_ARGS - 1 && (argv[argc] = va_arg(ap, char *)))
+	argc++;
+    va_end(ap);
+    argv[argc] = NULL;
+    int pid;
+    if((pid = fork()) == 0) {
+	execv("bin/pbx", argv);
+	fprintf(stderr, "Failed to exec server\n");
+	abort();
+    }
+    return pid;
+}
+
+/*
+ * Kill a server, if it is still running, and wait for it.
+ */
+void stop_server(int *pid) {
+    if(*pid) {
+	kill(*pid, SIGKILL);
+	waitpid(*pid, NULL, 0);
+	*pid = 0;
+    }
+}
+
+/*
+ * Connect to the server on a port, trying again until it is up.
+ */
+int connect_tu(int port) {
+    struct sockaddr_in sin = { 0 };
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(int i = 0; i < 100; i++) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0)
+	    return fd;
+	close(fd);
+	usleep(50000);
+    }
+    cr_assert_fail("Could not connect to server on port %d", port);
+    return -1;
+}
+
+void read_fully(int fd, void *buf, size_t len) {
+    for(size_t off = 0; off < len; ) {
+	ssize_t n = read(fd, (char *)buf + off, len - off);
+	cr_assert(n > 0, "Connection closed unexpectedly\n");
+	off += n;
+    }
+}
+
+/*
+ * Read a text line from a socket, one byte at a time so that nothing that follows,
+ * such as a binary frame, is consumed.
+ *
+ * @return 0 if successful, -1 if the connection ended first.
+ */
+int try_read_line(int fd, char *line, size_t size) {
+    size_t n = 0;
+    while(n + 1 < size) {
+	if(read(fd, line + n, 1) != 1) {
+	    line[n] = '\0';
+	    return -1;
+	}
+	if(line[n++] == '\n')
+	    break;
+    }
+    line[n] = '\0';
+    return 0;
+}
+
+/*
+ * Read a text line from a socket, which must not end first.
+ */
+void read_line(int fd, char *line, size_t size) {
+    cr_assert_eq(try_read_line(fd, line, size), 0, "Connection closed unexpectedly\n");
+}
+
+/*
+ * Read a line, which must start with a given prefix, and return the number after it.
+ */
+int expect(int fd, char *prefix) {
+    char line[256];
+    read_line(fd, line, sizeof(line));
+    cr_assert_eq(strncmp(line, prefix, strlen(prefix)), 0, "Expected '%s', got '%s'", prefix, line);
+    return atoi(line + strlen(prefix));
+}
+
+/*
+ * Set up a call from one TU to another, both on hook.
+ */
+void call(int a, int b, int ext_b) {
+    dprintf(a, "pickup\r\n");
+    expect(a, "DIAL TONE");
+    dprintf(a, "dial %d\r\n", ext_b);
+    expect(a, "RING BACK");
+    expect(b, "RINGING");
+    dprintf(b, "pickup\r\n");
+    expect(b, "CONNECTED ");
+    expect(a, "CONNECTED ");
+}
+
+/*
+ * Open a datagram socket to the UDP phone port of the server, waiting at most a second
+ * for each datagram.
+ */
+int connect_udp(int port) {
+    struct sockaddr_in sin = { 0 };
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    cr_assert_eq(connect(fd, (struct sockaddr *)&sin, sizeof(sin)), 0);
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+/*
+ * Send a datagram to the server.
+ */
+void put_datagram(int fd, uint32_t token, uint32_t seq, uint32_t ack, const char *payload) {
+    char buf[sizeof(UDP_HEADER) + UDP_MAX_PAYLOAD];
+    UDP_HEADER h = { htonl(token), htonl(seq), htonl(ack) };
+    memcpy(buf, &h, sizeof(h));
+    size_t len = strlen(payload);
+    memcpy(buf + sizeof(h), payload, len);
+    cr_assert_eq(send(fd, buf, sizeof(h) + len, 0), sizeof(h) + len);
+}
+
+/*
+ * Receive a datagram from the server, with its payload as a string.
+ *
+ * @return 0 if successful, -1 if none came in time.
+ */
+int get_datagram(int fd, UDP_HEADER *h, char *payload) {
+    char buf[sizeof(UDP_HEADER) + UDP_MAX_PAYLOAD];
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if(n < (ssize_t)sizeof(*h)) {
+	return -1;
+    }
+    memcpy(h, buf, sizeof(*h));
+    h->token = ntohl(h->token);
+    h->seq = ntohl(h->seq);
+    h->ack = ntohl(h->ack);
+    memcpy(payload, buf + sizeof(*h), n - sizeof(*h));
+    payload[n - sizeof(*h)] = '\0';
+    return 0;
+}
+
+/*
+ * Register a phone with the server over UDP, trying again until the server is up:
+ * first for a cookie, then with it.  The answer to the registration, with the token
+ * of the session, is left in h and payload.
+ */
+void register_udp(int fd, UDP_HEADER *h, char *payload) {
+    uint32_t cookie = 0;
+    for(int i = 0; i < 100; i++) {
+	put_datagram(fd, 0, 1, cookie, "");
+	if(get_datagram(fd, h, payload) == -1) {
+	    usleep(50000);
+	    continue;
+	}
+	if(h->token != 0)
+	    return;
+	cr_assert_eq(h->seq, 0);
+	cr_assert_neq(h->ack, 0);
+	cookie = h->ack;
+    }
+    cr_assert_fail("Could not register with server");
+}
+
+/*
+ * Receive the next datagram from the server with a given seq, skipping any sent again
+ * from before it.
+ */
+void expect_datagram(int fd, uint32_t seq, UDP_HEADER *h, char *payload) {
+    do {
+	cr_assert_eq(get_datagram(fd, h, payload), 0, "No datagram from server");
+    } while(h->seq < seq);
+    cr_assert_eq(h->seq, seq);
+}
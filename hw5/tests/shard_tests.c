@@ -0,0 +1,129 @@
+/*
+ * Tests of shards: a call between clients of two shards, and the call going away
+ * with the shard of one of them.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+#include "pbx_ext.h"
+
+#define SHARD_PATH "/tmp/pbx_test.shard"
+#define MAX_CLIENTS 32
+
+static int shard_pids[2];
+
+static int start_shard(int index) {
+    char spec[64];
+    snprintf(spec, sizeof(spec), "%d/2:%s", index, SHARD_PATH);
+    return start_server(SERVER_PORT_STR, "-S", spec, NULL);
+}
+
+static void init() {
+    kill_servers();
+    unlink(SHARD_PATH);
+    shard_pids[0] = start_shard(0);
+    shard_pids[1] = start_shard(1);
+}
+
+static void fini() {
+    for(int i = 0; i < 2; i++)
+	stop_server(&shard_pids[i]);
+    unlink(SHARD_PATH);
+}
+
+/*
+ * Connect clients until there is one in each shard, plus a third in the second.
+ * The kernel chooses the shard of each connection.
+ */
+static void connect_shards(int fds[3], int exts[3]) {
+    int span = PBX_VIRTUAL_BASE / 2;
+    int spare[MAX_CLIENTS], nspare = 0;
+    fds[0] = fds[1] = fds[2] = -1;
+    while(fds[0] == -1 || fds[1] == -1 || fds[2] == -1) {
+	cr_assert(nspare < MAX_CLIENTS, "Connections did not reach both shards");
+	int fd = connect_tu(SERVER_PORT);
+	int ext = expect(fd, "ON HOOK ");
+	int i = ext < span ? 0 : fds[1] == -1 ? 1 : 2;
+	if(fds[i] == -1) {
+	    fds[i] = fd;
+	    exts[i] = ext;
+	}
+	else {
+	    spare[nspare++] = fd;
+	}
+    }
+    for(int i = 0; i < nspare; i++)
+	close(spare[i]);
+}
+
+Test(shard_suite, cross_shard_call_test, .init = init, .fini = fini, .timeout = 30) {
+    int fds[3], exts[3];
+    connect_shards(fds, exts);
+    int a = fds[0], b = fds[1], c = fds[2];
+
+    // A calls B in the other shard, and they chat both ways.
+    dprintf(a, "pickup\r\n");
+    expect(a, "DIAL TONE");
+    dprintf(a, "dial %d\r\n", exts[1]);
+    expect(a, "RING BACK");
+    expect(b, "RINGING");
+    dprintf(b, "pickup\r\n");
+    cr_assert_eq(expect(b, "CONNECTED "), exts[0]);
+    cr_assert_eq(expect(a, "CONNECTED "), exts[1]);
+    dprintf(a, "chat from a\r\n");
+    expect(a, "CONNECTED ");
+    expect(b, "chat from a");
+    dprintf(b, "chat from b\r\n");
+    expect(b, "CONNECTED ");
+    expect(a, "chat from b");
+
+    // C, in the same shard as B, finds A busy once the shard of A answers, and
+    // nobody at an empty extension.
+    dprintf(c, "pickup\r\n");
+    expect(c, "DIAL TONE");
+    dprintf(c, "dial %d\r\n", exts[0]);
+    expect(c, "RING BACK");
+    expect(c, "BUSY SIGNAL");
+    dprintf(c, "hangup\r\n");
+    expect(c, "ON HOOK ");
+    dprintf(c, "pickup\r\n");
+    expect(c, "DIAL TONE");
+    dprintf(c, "dial %d\r\n", exts[0] + 1000);
+    expect(c, "ERROR");
+
+    // Hanging up ends the call in both shards.
+    dprintf(b, "hangup\r\n");
+    expect(b, "ON HOOK ");
+    expect(a, "DIAL TONE");
+    dprintf(a, "hangup\r\n");
+    expect(a, "ON HOOK ");
+    close(a);
+    close(b);
+    close(c);
+}
+
+Test(shard_suite, shard_crash_test, .init = init, .fini = fini, .timeout = 30) {
+    int fds[3], exts[3];
+    connect_shards(fds, exts);
+    int a = fds[0], b = fds[1];
+    call(a, b, exts[1]);
+
+    // The shard of B goes away, taking the call with it.
+    stop_server(&shard_pids[1]);
+    expect(a, "DIAL TONE");
+    dprintf(a, "dial %d\r\n", exts[2]);
+    expect(a, "ERROR");
+    close(a);
+    close(b);
+    close(fds[2]);
+}
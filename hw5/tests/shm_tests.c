@@ -0,0 +1,195 @@
+/*
+ * Tests of the shared-memory transport: the rings on their own, and a client moving
+ * its connection to shared memory.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+#include "shm.h"
+
+#define SOCKET_PATH "/tmp/pbx_test.sock"
+
+static int server_pid;
+
+static void init() {
+    kill_servers();
+    server_pid = start_server(SERVER_PORT_STR, "-u", SOCKET_PATH, NULL);
+}
+
+static void fini() {
+    stop_server(&server_pid);
+    unlink(SOCKET_PATH);
+}
+
+/*
+ * Bytes sent through a ring by the writer thread of ring_test.
+ */
+#define RING_TEST_BYTES (16 * SHM_RING_SIZE + 123)
+
+static void *ring_writer(void *arg) {
+    SHM_LINK *link = arg;
+    static unsigned char buf[4099];
+    for(size_t sent = 0; sent < RING_TEST_BYTES; ) {
+	size_t n = RING_TEST_BYTES - sent < sizeof(buf) ? RING_TEST_BYTES - sent : sizeof(buf);
+	for(size_t i = 0; i < n; i++)
+	    buf[i] = (sent + i) % 251;
+	struct iovec iov[2] = { { buf, n / 2 }, { buf + n / 2, n - n / 2 } };
+	if(shm_link_writev(link, iov, 2) == -1)
+	    return NULL;
+	sent += n;
+    }
+    return NULL;
+}
+
+Test(shm_suite, ring_test, .timeout = 30) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    int memfd;
+    SHM_LINK *server = shm_link_create(sv[0], &memfd);
+    cr_assert_not_null(server);
+    SHM_LINK *client = shm_link_attach(sv[1], memfd);
+    cr_assert_not_null(client);
+    close(memfd);
+
+    // Many times the size of the ring goes through, in order, with the writer and
+    // the reader each waiting on the other in turn.
+    pthread_t tid;
+    pthread_create(&tid, NULL, ring_writer, server);
+    static unsigned char buf[1000];
+    for(size_t got = 0; got < RING_TEST_BYTES; ) {
+	ssize_t n = shm_link_read(client, buf, sizeof(buf));
+	cr_assert(n > 0, "Link closed early");
+	for(ssize_t i = 0; i < n; i++)
+	    cr_assert_eq(buf[i], (got + i) % 251, "Wrong byte at %zu", got + i);
+	got += n;
+	if(got % 7 == 0)
+	    usleep(100);
+    }
+    pthread_join(tid, NULL);
+
+    // Once the link is closed, the other side reads EOF and cannot write.
+    shm_link_close(server);
+    cr_assert_eq(shm_link_read(client, buf, sizeof(buf)), 0);
+    struct iovec iov = { buf, 1 };
+    cr_assert_eq(shm_link_writev(client, &iov, 1), -1);
+    shm_link_free(client);
+    shm_link_free(server);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+Test(shm_suite, bad_position_test, .timeout = 30) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    int memfd;
+    SHM_LINK *server = shm_link_create(sv[0], &memfd);
+    SHM_LINK *client = shm_link_attach(sv[1], memfd);
+    cr_assert(server && client);
+    close(memfd);
+
+    // A client that moves its tail past the end of the ring closes the link.
+    static unsigned char buf[1000];
+    __atomic_store_n(&(client->out->tail), 3 * SHM_RING_SIZE, __ATOMIC_SEQ_CST);
+    cr_assert_eq(shm_link_read(server, buf, sizeof(buf)), 0);
+    cr_assert(server->in->closed, "Link not closed");
+    shm_link_free(client);
+    shm_link_free(server);
+    close(sv[0]);
+    close(sv[1]);
+
+    // So does one that moves its head past the tail of the server.
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    server = shm_link_create(sv[0], &memfd);
+    client = shm_link_attach(sv[1], memfd);
+    cr_assert(server && client);
+    close(memfd);
+    __atomic_store_n(&(client->in->head), 100, __ATOMIC_SEQ_CST);
+    struct iovec iov = { buf, sizeof(buf) };
+    cr_assert_eq(shm_link_writev(server, &iov, 1), -1);
+    cr_assert(server->out->closed, "Link not closed");
+    shm_link_free(client);
+    shm_link_free(server);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Read a text line from a shared-memory link.
+ */
+static void read_link_line(SHM_LINK *link, char *line, size_t size) {
+    size_t n = 0;
+    while(n + 1 < size) {
+	cr_assert_eq(shm_link_read(link, line + n, 1), 1, "Link closed unexpectedly\n");
+	if(line[n++] == '\n')
+	    break;
+    }
+    line[n] = '\0';
+}
+
+Test(shm_suite, shm_transport_test, .init = init, .fini = fini, .timeout = 30) {
+    struct sockaddr_un sun = { 0 };
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, SOCKET_PATH);
+    int fd = -1;
+    for(int i = 0; i < 100; i++) {
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0)
+	    break;
+	close(fd);
+	fd = -1;
+	usleep(50000);
+    }
+    cr_assert_neq(fd, -1, "Could not connect to server");
+    char line[256], state[256];
+    read_line(fd, state, sizeof(state));
+    cr_assert_eq(strncmp(state, "ON HOOK ", 8), 0);
+
+    // The memory of the link comes with the answer to the shm command.
+    dprintf(fd, "shm\r\n");
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { line, sizeof(line) - 1 };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n = recvmsg(fd, &msg, 0);
+    cr_assert_gt(n, 0);
+    line[n] = '\0';
+    snprintf(state + 200, 56, "SHM %d\r\n", SHM_RING_SIZE);
+    cr_assert_str_eq(line, state + 200);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cr_assert(cmsg && cmsg->cmsg_type == SCM_RIGHTS, "No memory file passed");
+    int memfd;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+    SHM_LINK *link = shm_link_attach(fd, memfd);
+    cr_assert_not_null(link);
+    close(memfd);
+
+    // From then on, commands and notifications go through the rings.
+    read_link_line(link, line, sizeof(line));
+    cr_assert_str_eq(line, state);
+    struct iovec cmd = { "pickup\r\n", strlen("pickup\r\n") };
+    cr_assert_eq(shm_link_writev(link, &cmd, 1), 0);
+    read_link_line(link, line, sizeof(line));
+    cr_assert_str_eq(line, "DIAL TONE\r\n");
+
+    // When the client goes, the server sees it.
+    shm_link_close(link);
+    cr_assert_eq(read(fd, line, 1), 0, "Server did not close the connection");
+    shm_link_free(link);
+}
@@ -0,0 +1,120 @@
+/*
+ * Tests of the store-and-forward message spool, without a server.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <criterion/criterion.h>
+
+#include "spool.h"
+
+/*
+ * Collects delivered messages into a buffer.
+ */
+static char delivered[1 << 20];
+static size_t delivered_len;
+static int batches;
+
+static int collect(void *arg, struct iovec *iov, int iovcnt) {
+    for(int i = 0; i < iovcnt; i++) {
+	cr_assert(delivered_len + iov[i].iov_len <= sizeof(delivered), "Too much delivered");
+	memcpy(delivered + delivered_len, iov[i].iov_base, iov[i].iov_len);
+	delivered_len += iov[i].iov_len;
+    }
+    batches++;
+    return iovcnt / SPOOL_MSG_PARTS;
+}
+
+/*
+ * Sends the first three messages of a batch, appending another to the spool as it
+ * does, then fails.
+ */
+static int send_three(void *arg, struct iovec *iov, int iovcnt) {
+    cr_assert_eq(spool_append(*(int *)arg, 9, "late", 4), 0, "Append during delivery failed");
+    return collect(arg, iov, 3 * SPOOL_MSG_PARTS) == 3 ? 3 : 0;
+}
+
+static void ignore(int ext) {
+}
+
+Test(spool_suite, backlog_test, .timeout = 10) {
+    cr_assert_eq(spool_init(NULL, ignore), 0);
+    cr_assert(!spool_pending(7));
+    cr_assert_eq(spool_deliver(7, collect, NULL), 0, "Delivered from a spool never written");
+
+    // A backlog large enough to make the file grow several times.
+    int count = 10000;
+    for(int i = 0; i < count; i++) {
+	char msg[32];
+	int len = snprintf(msg, sizeof(msg), "message %d", i);
+	cr_assert_eq(spool_append(7, 3 + i % 2, msg, len), 0, "Append %d failed", i);
+    }
+    cr_assert(spool_pending(7));
+    cr_assert_eq(spool_deliver(7, collect, NULL), count);
+    cr_assert_eq(batches, (count + SPOOL_BATCH - 1) / SPOOL_BATCH);
+    cr_assert(!spool_pending(7));
+
+    // Messages arrive intact and in order.
+    char *p = delivered;
+    for(int i = 0; i < count; i++) {
+	char expected[64];
+	int len = snprintf(expected, sizeof(expected), "msg %d message %d\r\n", 3 + i % 2, i);
+	cr_assert(!strncmp(p, expected, len), "Message %d wrong: %.*s", i, len, p);
+	p += len;
+    }
+    cr_assert_eq(p, delivered + delivered_len);
+
+    // Once delivered, messages are gone and the spool is usable again.
+    cr_assert_eq(spool_deliver(7, collect, NULL), 0);
+    cr_assert_eq(spool_append(7, 3, "again", 5), 0);
+    cr_assert_eq(spool_deliver(7, collect, NULL), 1);
+    spool_fini();
+}
+
+Test(spool_suite, partial_send_test, .timeout = 10) {
+    cr_assert_eq(spool_init(NULL, ignore), 0);
+    int ext = 4;
+    for(int i = 0; i < 5; i++) {
+	char msg[32];
+	int len = snprintf(msg, sizeof(msg), "message %d", i);
+	cr_assert_eq(spool_append(ext, 2, msg, len), 0);
+    }
+
+    // The messages not sent are kept, after those appended while sending.
+    delivered_len = 0;
+    cr_assert_eq(spool_deliver(ext, send_three, &ext), -1);
+    cr_assert(spool_pending(ext));
+    cr_assert_eq(spool_deliver(ext, collect, NULL), 3);
+    const char *expected = "msg 2 message 0\r\nmsg 2 message 1\r\nmsg 2 message 2\r\n"
+	"msg 2 message 3\r\nmsg 2 message 4\r\nmsg 9 late\r\n";
+    cr_assert_eq(delivered_len, strlen(expected));
+    cr_assert(!memcmp(delivered, expected, delivered_len), "Delivered %.*s", (int)delivered_len, delivered);
+    spool_fini();
+}
+
+Test(spool_suite, persistence_test, .timeout = 10) {
+    char dir[] = "/tmp/pbx-spool-test-XXXXXX";
+    cr_assert_not_null(mkdtemp(dir));
+    cr_assert_eq(spool_init(dir, ignore), 0);
+    cr_assert_eq(spool_append(12, 5, "kept", 4), 0);
+    cr_assert_eq(spool_append(12, 6, "", 0), 0);
+    cr_assert_eq(spool_append(-1, 6, "bad", 3), -1, "Invalid extension accepted");
+    spool_fini();
+
+    // Messages not yet delivered survive a restart.
+    cr_assert_eq(spool_init(dir, ignore), 0);
+    cr_assert(spool_pending(12), "Spooled messages forgotten");
+    delivered_len = 0;
+    cr_assert_eq(spool_deliver(12, collect, NULL), 2);
+    cr_assert_eq(delivered_len, strlen("msg 5 kept\r\nmsg 6 \r\n"));
+    cr_assert(!memcmp(delivered, "msg 5 kept\r\nmsg 6 \r\n", delivered_len));
+    spool_fini();
+
+    char path[64];
+    snprintf(path, sizeof(path), "%s/12.spool", dir);
+    unlink(path);
+    rmdir(dir);
+}
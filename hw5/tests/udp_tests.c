@@ -0,0 +1,140 @@
+/*
+ * Tests of the UDP signaling transport, with a phone registering over UDP and a client
+ * connected over TCP.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "__server_tester.h"
+#include "udp.h"
+
+static int server_pid;
+
+static void init() {
+    kill_servers();
+    server_pid = start_server(SERVER_PORT_STR, "-d", SERVER_PORT_STR, NULL);
+}
+
+static void fini() {
+    stop_server(&server_pid);
+}
+
+Test(udp_suite, udp_phone_test, .init = init, .fini = fini, .timeout = 30) {
+    int fd = connect_udp(SERVER_PORT);
+
+    // Register, trying again until the server is up.
+    UDP_HEADER h;
+    char payload[UDP_MAX_PAYLOAD + 1];
+    register_udp(fd, &h, payload);
+    uint32_t token = h.token;
+    cr_assert_neq(token, 0);
+    cr_assert_eq(h.seq, 1);
+    cr_assert_eq(h.ack, 1);
+    cr_assert_eq(strncmp(payload, "ON HOOK ", 8), 0);
+    int ext = atoi(payload + 8);
+
+    // Commands go in order, and are answered as on a connection.
+    put_datagram(fd, token, 2, 1, "pickup\r\n");
+    expect_datagram(fd, 2, &h, payload);
+    cr_assert_eq(h.ack, 2);
+    cr_assert_str_eq(payload, "DIAL TONE\r\n");
+
+    // A datagram after a gap is dropped, and only acked.
+    put_datagram(fd, token, 4, 2, "hangup\r\n");
+    cr_assert_eq(get_datagram(fd, &h, payload), 0);
+    cr_assert_eq(h.seq, 0);
+    cr_assert_eq(h.ack, 2);
+
+    // Until the phone acks it, an answer keeps being sent again.
+    put_datagram(fd, token, 3, 2, "hangup\r\n");
+    expect_datagram(fd, 3, &h, payload);
+    cr_assert_eq(strncmp(payload, "ON HOOK ", 8), 0);
+    char first[UDP_MAX_PAYLOAD + 1];
+    strcpy(first, payload);
+    expect_datagram(fd, 3, &h, payload);
+    cr_assert_str_eq(payload, first);
+    put_datagram(fd, token, 0, 3, "");
+
+    // A client on TCP reaches the phone at its extension.
+    int tcp = connect_tu(SERVER_PORT);
+    char line[256];
+    read_line(tcp, line, sizeof(line));
+    dprintf(tcp, "pickup\r\n");
+    read_line(tcp, line, sizeof(line));
+    cr_assert_str_eq(line, "DIAL TONE\r\n");
+    dprintf(tcp, "dial %d\r\n", ext);
+    read_line(tcp, line, sizeof(line));
+    cr_assert_str_eq(line, "RING BACK\r\n");
+    expect_datagram(fd, 4, &h, payload);
+    cr_assert_str_eq(payload, "RINGING\r\n");
+
+    // Datagrams from another address, or with another token, are ignored.
+    int other = connect_udp(SERVER_PORT);
+    put_datagram(other, token, 4, 4, "pickup\r\n");
+    put_datagram(fd, token ^ 0x10000, 4, 4, "pickup\r\n");
+    put_datagram(fd, token, 4, 4, "pickup\r\n");
+    expect_datagram(fd, 5, &h, payload);
+    cr_assert_eq(strncmp(payload, "CONNECTED ", 10), 0);
+    read_line(tcp, line, sizeof(line));
+    cr_assert_eq(strncmp(line, "CONNECTED ", 10), 0);
+    close(other);
+    close(tcp);
+    close(fd);
+}
+
+Test(udp_suite, udp_cookie_test, .init = init, .fini = fini, .timeout = 30) {
+    // A registration without a cookie only gets one, no larger than itself, and nothing
+    // is sent again to its address.
+    int phone = connect_udp(SERVER_PORT);
+    UDP_HEADER h;
+    char payload[UDP_MAX_PAYLOAD + 1];
+    int answered = 0;
+    for(int i = 0; i < 100 && !answered; i++) {
+	put_datagram(phone, 0, 1, 0, "pickup\r\n");
+	if(!(answered = get_datagram(phone, &h, payload) == 0))
+	    usleep(50000);
+    }
+    cr_assert(answered, "No cookie from server");
+    cr_assert_eq(h.token, 0);
+    cr_assert_eq(h.seq, 0);
+    cr_assert_str_eq(payload, "");
+    uint32_t cookie = h.ack;
+    cr_assert_neq(cookie, 0);
+    cr_assert_eq(get_datagram(phone, &h, payload), -1, "Server sent again to an unregistered phone");
+
+    // Nor does one with a wrong cookie, or with the cookie of another address, register.
+    // (The cookie given out again is that of the period now, which may have changed.)
+    put_datagram(phone, 0, 1, cookie ^ 1, "");
+    cr_assert_eq(get_datagram(phone, &h, payload), 0);
+    cr_assert_eq(h.token, 0);
+    cr_assert_neq(h.ack, cookie ^ 1);
+    int other = connect_udp(SERVER_PORT);
+    put_datagram(other, 0, 1, cookie, "");
+    cr_assert_eq(get_datagram(other, &h, payload), 0);
+    cr_assert_eq(h.token, 0);
+    cr_assert_neq(h.ack, cookie);
+
+    // With its cookie, the phone registers, and its commands are carried out.
+    put_datagram(phone, 0, 1, cookie, "pickup\r\n");
+    expect_datagram(phone, 1, &h, payload);
+    cr_assert_neq(h.token, 0);
+    cr_assert_eq(strncmp(payload, "ON HOOK ", 8), 0);
+    char *rest = strstr(payload, "\r\n");
+    if(rest[2] == '\0')
+	expect_datagram(phone, 2, &h, payload);
+    else
+	memmove(payload, rest + 2, strlen(rest + 2) + 1);
+    cr_assert_str_eq(payload, "DIAL TONE\r\n");
+    close(other);
+    close(phone);
+}